@@ -24,6 +24,8 @@
 
 #include "main.h"
 
+#include <string.h>
+
 #ifdef _WIN32
 #include <Windows.h>
 #include <WinSock2.h>
@@ -160,14 +162,31 @@ if (verbose) {
 	ftl_handle_t handle;
 	ftl_ingest_params_t params;
 
+	/*fields added later default to off*/
+	memset(&params, 0, sizeof(params));
+
 	params.log_func = log_test;
+	params.log_callback = NULL;
+	params.log_callback_data = NULL;
+	params.async_logging = 0;
 	params.stream_key = stream_key;
 	params.video_codec = FTL_VIDEO_H264;
 	params.audio_codec = FTL_AUDIO_OPUS;
 	params.ingest_hostname = ingest_location;
 	params.status_callback = NULL;
+	params.status_callback_data = NULL;
+	params.status_callback_batch = 0;
 	params.video_frame_rate = (float)input_framerate;
 	params.video_kbps = target_bw_kbps;
+	params.socket_send_buf = 0;
+	params.socket_recv_buf = 0;
+	params.kernel_pacing = 0;
+	params.io_uring = 0;
+	params.thread_params = NULL;
+	params.context = NULL;
+	params.allocator = NULL;
+	params.clock = NULL;
+	params.clock_data = NULL;
 
 	struct timeval proc_start_tv, proc_end_tv, proc_delta_tv;
 	struct timeval profile_start, profile_stop, profile_delta;
@@ -0,0 +1,221 @@
+/**
+ * impair.c - Link impairment (loss, bursts, bandwidth, delay, jitter, reordering) for the ingest simulators
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ **/
+
+#include <stdlib.h>
+#include <string.h>
+#include "impair.h"
+
+#define NS_PER_MS 1000000LL
+
+static int _before(impair_packet_t *a, impair_packet_t *b) {
+	return a->due < b->due || (a->due == b->due && a->order < b->order);
+}
+
+static void _heap_push(impair_t *link, impair_packet_t *pkt) {
+	int i = link->count++, parent;
+
+	while (i > 0 && _before(pkt, link->heap[parent = (i - 1) / 2])) {
+		link->heap[i] = link->heap[parent];
+		i = parent;
+	}
+
+	link->heap[i] = pkt;
+}
+
+static impair_packet_t *_heap_pop(impair_t *link) {
+	impair_packet_t *top = link->heap[0];
+	impair_packet_t *last = link->heap[--link->count];
+	int i = 0, child;
+
+	while ((child = 2 * i + 1) < link->count) {
+		if (child + 1 < link->count && _before(link->heap[child + 1], link->heap[child])) {
+			child++;
+		}
+
+		if (!_before(link->heap[child], last)) {
+			break;
+		}
+
+		link->heap[i] = link->heap[child];
+		i = child;
+	}
+
+	if (link->count > 0) {
+		link->heap[i] = last;
+	}
+
+	return top;
+}
+
+double impair_random(uint64_t *state) {
+	uint64_t x = *state;
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+
+	return (double)((x * 0x2545F4914F6CDD1DULL) >> 11) / (double)(1ULL << 53);
+}
+
+int impair_init(impair_t *link, const impair_params_t *params) {
+	memset(link, 0, sizeof(*link));
+	link->params = *params;
+	link->rng = params->seed != 0 ? params->seed : 0x9E3779B97F4A7C15ULL;
+
+	if ((link->heap = (impair_packet_t **)calloc(IMPAIR_MAX_QUEUED, sizeof(impair_packet_t *))) == NULL) {
+		return -1;
+	}
+
+	if ((link->free_list = (impair_packet_t **)calloc(IMPAIR_MAX_QUEUED, sizeof(impair_packet_t *))) == NULL) {
+		free(link->heap);
+		return -1;
+	}
+
+	return 0;
+}
+
+void impair_destroy(impair_t *link) {
+	int i;
+
+	for (i = 0; i < link->count; i++) {
+		free(link->heap[i]);
+	}
+
+	for (i = 0; i < link->free_count; i++) {
+		free(link->free_list[i]);
+	}
+
+	free(link->heap);
+	free(link->free_list);
+	link->heap = link->free_list = NULL;
+	link->count = link->free_count = 0;
+}
+
+void impair_submit(impair_t *link, const uint8_t *data, int len, const struct sockaddr_storage *from, socklen_t fromlen, int64_t now) {
+	impair_params_t *p = &link->params;
+	impair_packet_t *pkt;
+	int64_t delay, start = now;
+
+	link->stats.packets++;
+
+	/*always draw the same number of randoms per packet so one setting doesn't shift the others*/
+	double state = impair_random(&link->rng);
+	double drop = impair_random(&link->rng);
+	double jitter = impair_random(&link->rng);
+	double reorder = impair_random(&link->rng);
+
+	if (link->bad ? state < p->burst_r : state < p->burst_p) {
+		link->bad = !link->bad;
+		link->stats.bursts += link->bad;
+	}
+
+	if (p->bandwidth_kbps > 0) {
+		if (link->link_free > start) {
+			start = link->link_free;
+		}
+
+		if (start - now > p->queue_ms * NS_PER_MS) {
+			link->stats.overflowed++;
+			return;
+		}
+
+		/*a packet lost further along still took its turn on the bottleneck*/
+		link->link_free = start + (int64_t)len * 8 * 1000000 / p->bandwidth_kbps;
+		start = link->link_free;
+	}
+
+	if (drop < (link->bad ? p->burst_loss : p->loss)) {
+		link->stats.dropped++;
+		link->stats.burst_dropped += link->bad;
+		return;
+	}
+
+	if (len > IMPAIR_MAX_PACKET || link->count == IMPAIR_MAX_QUEUED) {
+		link->stats.overflowed++;
+		return;
+	}
+
+	if (link->free_count > 0) {
+		pkt = link->free_list[--link->free_count];
+	}
+	else if ((pkt = (impair_packet_t *)malloc(sizeof(impair_packet_t))) == NULL) {
+		link->stats.overflowed++;
+		return;
+	}
+
+	delay = p->delay_ms * NS_PER_MS + (int64_t)(jitter * p->jitter_ms * NS_PER_MS);
+
+	pkt->due = start + delay;
+
+	if (reorder < p->reorder) {
+		pkt->due += p->reorder_ms * NS_PER_MS;
+		link->stats.reordered++;
+	}
+	else {
+		/*jitter alone queues packets up like a link would rather than swapping them*/
+		if (pkt->due < link->last_due) {
+			pkt->due = link->last_due;
+		}
+
+		link->last_due = pkt->due;
+	}
+	pkt->order = link->next_order++;
+	pkt->len = len;
+	pkt->arrived = now;
+	memcpy(pkt->data, data, len);
+	memcpy(&pkt->from, from, fromlen);
+	pkt->fromlen = fromlen;
+
+	_heap_push(link, pkt);
+}
+
+impair_packet_t *impair_next(impair_t *link, int64_t now) {
+	impair_packet_t *pkt;
+
+	if (link->count == 0 || link->heap[0]->due > now) {
+		return NULL;
+	}
+
+	pkt = _heap_pop(link);
+	link->stats.delivered++;
+	link->stats.delay_ns_total += now - pkt->arrived;
+
+	return pkt;
+}
+
+void impair_release(impair_t *link, impair_packet_t *pkt) {
+	if (link->free_count < IMPAIR_MAX_QUEUED) {
+		link->free_list[link->free_count++] = pkt;
+	}
+	else {
+		free(pkt);
+	}
+}
+
+int64_t impair_next_due(impair_t *link, int64_t now) {
+	if (link->count == 0) {
+		return -1;
+	}
+
+	return link->heap[0]->due > now ? link->heap[0]->due - now : 0;
+}
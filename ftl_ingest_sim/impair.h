@@ -0,0 +1,103 @@
+/**
+ * impair.h - Link impairment (loss, bursts, bandwidth, delay, jitter, reordering) for the ingest simulators
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ **/
+
+#ifndef __IMPAIR_H
+#define __IMPAIR_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+#define IMPAIR_MAX_PACKET 2048
+#define IMPAIR_MAX_QUEUED 16384 /*packets held back at once, more are dropped as if the link queue overflowed*/
+
+/*
+ * Loss follows a two state Gilbert-Elliott model: each packet the link moves from good to bad with chance
+ * burst_p and back with burst_r, and drops with chance loss while good and burst_loss while bad. burst_p 0
+ * leaves plain independent loss. A bandwidth limit turns the link into a bottleneck with queue_ms of
+ * buffering in front of it, packets that would wait longer are tail dropped.
+ */
+typedef struct {
+	double loss; /*0 to 1, per packet while the link is good*/
+	double burst_p; /*0 to 1, chance per packet of a loss burst starting*/
+	double burst_r; /*0 to 1, chance per packet of a burst ending*/
+	double burst_loss; /*0 to 1, per packet during a burst*/
+	int bandwidth_kbps; /*0 for unlimited*/
+	int queue_ms;
+	int delay_ms; /*one way, added to every packet*/
+	int jitter_ms; /*each packet gets a further 0 to jitter_ms, without overtaking the one before*/
+	double reorder; /*0 to 1, chance a packet is held back reorder_ms so the next few overtake it*/
+	int reorder_ms;
+	uint64_t seed; /*same seed, same drops and delays*/
+} impair_params_t;
+
+typedef struct {
+	uint64_t packets;
+	uint64_t dropped;
+	uint64_t burst_dropped; /*of dropped, while the link was bad*/
+	uint64_t bursts;
+	uint64_t overflowed; /*tail dropped at the bottleneck or beyond IMPAIR_MAX_QUEUED*/
+	uint64_t reordered;
+	int64_t delay_ns_total; /*over the packets delivered*/
+	uint64_t delivered;
+} impair_stats_t;
+
+typedef struct {
+	int64_t due; /*ns*/
+	uint64_t order; /*arrival order, keeps equal due times first in first out*/
+	int len;
+	struct sockaddr_storage from;
+	socklen_t fromlen;
+	int64_t arrived;
+	uint8_t data[IMPAIR_MAX_PACKET];
+} impair_packet_t;
+
+typedef struct {
+	impair_params_t params;
+	impair_stats_t stats;
+	uint64_t rng;
+	uint64_t next_order;
+	int64_t last_due; /*of the packets kept in order*/
+	int64_t link_free; /*when the bottleneck has sent everything queued on it*/
+	int bad; /*in a loss burst*/
+	impair_packet_t **heap; /*min heap on (due, order)*/
+	impair_packet_t **free_list;
+	int count;
+	int free_count;
+} impair_t;
+
+int impair_init(impair_t *link, const impair_params_t *params);
+void impair_destroy(impair_t *link);
+
+/*decides the packet's fate, a copy is kept until impair_next hands it back*/
+void impair_submit(impair_t *link, const uint8_t *data, int len, const struct sockaddr_storage *from, socklen_t fromlen, int64_t now);
+
+/*the next packet due by now or NULL, give it back with impair_release once handled*/
+impair_packet_t *impair_next(impair_t *link, int64_t now);
+void impair_release(impair_t *link, impair_packet_t *pkt);
+
+/*ns until the next packet is due, -1 if none is queued*/
+int64_t impair_next_due(impair_t *link, int64_t now);
+
+/*uniform in [0, 1), xorshift64* so runs are repeatable from the seed*/
+double impair_random(uint64_t *state);
+
+#endif // __IMPAIR_H
@@ -0,0 +1,643 @@
+/**
+ * main.c - FTL ingest simulator: accepts a libftl stream and degrades its media path on purpose
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ **/
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include "hmac/hmac.h"
+#include "impair.h"
+#include "receiver.h"
+
+#define MAX_CLIENTS 16
+#define MAX_COMMAND_LEN 4096
+#define NONCE_LEN 64
+#define HMAC_HEX_LEN 128
+#define UDP_BATCH 64
+
+typedef struct {
+	int sock;
+	char buf[MAX_COMMAND_LEN];
+	int len;
+	unsigned char nonce[NONCE_LEN];
+	int have_nonce;
+	int connected;
+	int channel_id;
+	int64_t connect_time;
+} client_t;
+
+typedef struct {
+	int tcp_port;
+	int udp_port;
+	int report_ms;
+	int verbose;
+	int channel_id; /*-1 accepts any channel*/
+	const char *key; /*NULL accepts any hmac*/
+
+	int listen_sock;
+	int udp_sock;
+	client_t clients[MAX_CLIENTS];
+
+	struct sockaddr_storage peer;
+	socklen_t peer_len;
+	int have_peer;
+
+	impair_t link;
+	receiver_t rx;
+	uint64_t nonce_rng;
+
+	uint64_t prev_bytes[RECEIVER_MAX_STREAMS];
+	int64_t prev_report;
+	int streaming;
+} sim_t;
+
+static volatile sig_atomic_t shutdown_flag = 0;
+
+static void _shutdown(int sig) {
+	shutdown_flag = 1;
+}
+
+static int64_t _now_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (int64_t)ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+static void usage(void) {
+	printf("Usage: ftl_ingest_sim [options]\n");
+	printf("Accepts one FTL stream at a time, impairs its media on the way in and nacks what goes missing\n");
+	printf("\t-t port\t\tcontrol (tcp) port, default 8084\n");
+	printf("\t-u port\t\tmedia (udp) port, default 8082\n");
+	printf("\t-k key\t\tonly accept this stream key (channel-key), default accepts any\n");
+	printf("\t-l pct\t\tpacket loss, default 0\n");
+	printf("\t-g p,r,loss\tloss bursts, pct chance per packet of a burst starting, ending and of loss during one\n");
+	printf("\t-b kbps\t\tlink bandwidth, default unlimited\n");
+	printf("\t-q ms\t\tbuffering in front of a limited link, default 100\n");
+	printf("\t-d ms\t\tone way delay, default 0\n");
+	printf("\t-j ms\t\tjitter added on top of the delay, default 0\n");
+	printf("\t-r pct\t\tpackets held back so later ones overtake them, default 0\n");
+	printf("\t-R ms\t\thow long reordered packets are held back, default 10\n");
+	printf("\t-S seed\t\tseed for loss and delay, default 1\n");
+	printf("\t-n\t\tdon't send nacks\n");
+	printf("\t-N ms\t\twait before nacking a hole, default 5\n");
+	printf("\t-T ms\t\tbetween nacks for the same packet, default 50\n");
+	printf("\t-c count\tnacks per packet before it is counted lost, default 3\n");
+	printf("\t-i ms\t\treport interval, default 1000\n");
+	printf("\t-v\t\tverbose, print control commands\n");
+	printf("\t-?\t\tthis help message\n");
+	exit(0);
+}
+
+static void _send_rtcp(void *user_data, const uint8_t *pkt, int len) {
+	sim_t *sim = (sim_t *)user_data;
+
+	if (sim->have_peer) {
+		sendto(sim->udp_sock, pkt, len, 0, (struct sockaddr *)&sim->peer, sim->peer_len);
+	}
+}
+
+static const char *_stream_name(receiver_stream_t *st) {
+	return st->payload_type == VIDEO_PTYPE ? "video" : st->payload_type == AUDIO_PTYPE ? "audio" : "other";
+}
+
+static void _print_latency(const char *name, receiver_latency_t *lat) {
+	if (lat->count == 0) {
+		return;
+	}
+
+	printf("\t\t%s ms: avg %.1f p50 %.1f p90 %.1f p99 %.1f max %.1f\n", name,
+		lat->total_ns / (double)lat->count / NS_PER_MS,
+		receiver_latency_percentile(lat, 50), receiver_latency_percentile(lat, 90),
+		receiver_latency_percentile(lat, 99), lat->max_ns / (double)NS_PER_MS);
+}
+
+static void _print_stats(sim_t *sim, int64_t now, int summary) {
+	impair_stats_t *ls = &sim->link.stats;
+	double interval = (now - sim->prev_report) / (double)NS_PER_SEC;
+	receiver_stream_t *st;
+	receiver_stats_t *s;
+	int i;
+
+	if (summary) {
+		printf("summary:\n");
+	}
+
+	printf("\tlink: in %llu dropped %llu (%llu in %llu bursts) reordered %llu overflowed %llu avg delay %.1f ms, mtu probes %llu\n",
+		(unsigned long long)ls->packets, (unsigned long long)ls->dropped, (unsigned long long)ls->burst_dropped,
+		(unsigned long long)ls->bursts, (unsigned long long)ls->reordered,
+		(unsigned long long)ls->overflowed, ls->delivered ? ls->delay_ns_total / (double)ls->delivered / NS_PER_MS : 0,
+		(unsigned long long)sim->rx.probes);
+
+	for (i = 0; i < RECEIVER_MAX_STREAMS; i++) {
+		if ((st = sim->rx.streams[i]) == NULL) {
+			continue;
+		}
+
+		s = &st->stats;
+
+		printf("\t%s %u: %llu pkts %.0f kbps, holes %llu nacked %llu recovered %llu lost %llu late %llu dup %llu, jitter %.1f ms\n",
+			_stream_name(st), st->ssrc, (unsigned long long)s->packets,
+			summary || interval <= 0 ? 0 : (s->bytes - sim->prev_bytes[i]) * 8 / interval / 1000,
+			(unsigned long long)s->holes, (unsigned long long)s->nacked, (unsigned long long)s->recovered,
+			(unsigned long long)s->lost, (unsigned long long)s->late, (unsigned long long)s->duplicates,
+			st->jitter * 1000 / st->clock_rate);
+
+		if (st->payload_type == VIDEO_PTYPE) {
+			printf("\t\tframes complete %llu incomplete %llu\n", (unsigned long long)s->frames_complete, (unsigned long long)s->frames_incomplete);
+		}
+
+		if (summary) {
+			_print_latency("recovery", &s->recovery);
+			_print_latency("assembly", &s->assembly);
+		}
+
+		sim->prev_bytes[i] = s->bytes;
+	}
+
+	sim->prev_report = now;
+	fflush(stdout);
+}
+
+/*a new stream starts counting from zero*/
+static void _stream_start(sim_t *sim, int64_t now) {
+	impair_params_t params = sim->link.params;
+
+	receiver_reset(&sim->rx);
+	impair_destroy(&sim->link);
+	impair_init(&sim->link, &params);
+
+	memset(sim->prev_bytes, 0, sizeof(sim->prev_bytes));
+	sim->prev_report = now;
+	sim->have_peer = 0;
+	sim->streaming = 1;
+}
+
+static void _stream_stop(sim_t *sim, int64_t now) {
+	if (sim->streaming) {
+		_print_stats(sim, now, 1);
+		sim->streaming = 0;
+	}
+}
+
+static void _reply(client_t *c, const char *fmt, ...) {
+	char buf[512];
+	va_list args;
+	int len;
+
+	va_start(args, fmt);
+	len = vsnprintf(buf, sizeof(buf), fmt, args);
+	va_end(args);
+
+	send(c->sock, buf, len, MSG_NOSIGNAL);
+}
+
+/*CONNECT <channel id> $<hex hmac of our nonce keyed with the stream key>*/
+static int _check_connect(sim_t *sim, client_t *c, const char *cmd) {
+	char hmac[HMAC_HEX_LEN + 1], expected[HMAC_HEX_LEN + 1];
+	int channel_id;
+
+	if (sscanf(cmd, "CONNECT %d $%128s", &channel_id, hmac) != 2 || !c->have_nonce) {
+		return 400;
+	}
+
+	c->channel_id = channel_id;
+
+	if (sim->channel_id >= 0 && channel_id != sim->channel_id) {
+		return 405;
+	}
+
+	if (sim->key != NULL) {
+		hmacsha512(sim->key, c->nonce, NONCE_LEN, expected);
+
+		if (strcasecmp(hmac, expected) != 0) {
+			return 401;
+		}
+	}
+
+	return 200;
+}
+
+static void _handle_command(sim_t *sim, client_t *c, const char *cmd, int64_t now) {
+	char hex[NONCE_LEN * 2 + 1];
+	int code, i;
+
+	if (sim->verbose) {
+		printf("control %d: %s\n", c->sock, cmd);
+	}
+
+	if (strcmp(cmd, "HMAC") == 0) {
+		for (i = 0; i < NONCE_LEN; i++) {
+			c->nonce[i] = (unsigned char)(impair_random(&sim->nonce_rng) * 256);
+			sprintf(hex + i * 2, "%02x", c->nonce[i]);
+		}
+
+		c->have_nonce = 1;
+		_reply(c, "200 %s\n", hex);
+	}
+	else if (strncmp(cmd, "CONNECT ", 8) == 0) {
+		if ((code = _check_connect(sim, c, cmd)) == 200) {
+			c->connected = 1;
+		}
+		else {
+			printf("control %d: rejected channel %d with %d\n", c->sock, c->channel_id, code);
+		}
+
+		_reply(c, "%d\n", code);
+	}
+	else if (strcmp(cmd, ".") == 0) {
+		if (!c->connected) {
+			_reply(c, "401\n");
+			return;
+		}
+
+		_stream_stop(sim, now);
+		_stream_start(sim, now);
+		c->connect_time = now;
+		printf("control %d: channel %d streaming to udp port %d\n", c->sock, c->channel_id, sim->udp_port);
+		_reply(c, "200 hi. Use UDP port %d\n", sim->udp_port);
+	}
+	else if (strncmp(cmd, "PING", 4) == 0) {
+		_reply(c, "201\n");
+	}
+	else if (strncmp(cmd, "DISCONNECT", 10) == 0) {
+		c->connected = 0;
+		_stream_stop(sim, now);
+		_reply(c, "200\n");
+	}
+	else if (strncmp(cmd, "DISCOVER", 8) == 0) {
+		/*not part of the control protocol libftl speaks, there is no reply format to imitate*/
+		_reply(c, "400\n");
+	}
+	else if (c->connected && strchr(cmd, ':') != NULL) {
+		/*stream metadata, ingest doesn't answer these*/
+	}
+	else {
+		_reply(c, "400\n");
+	}
+}
+
+static void _client_close(sim_t *sim, client_t *c, int64_t now) {
+	printf("control %d: closed\n", c->sock);
+
+	if (c->connected) {
+		_stream_stop(sim, now);
+	}
+
+	close(c->sock);
+	memset(c, 0, sizeof(*c));
+	c->sock = -1;
+}
+
+static void _client_read(sim_t *sim, client_t *c, int64_t now) {
+	char *end;
+	int ret;
+
+	if ((ret = recv(c->sock, c->buf + c->len, sizeof(c->buf) - 1 - c->len, 0)) <= 0) {
+		_client_close(sim, c, now);
+		return;
+	}
+
+	c->len += ret;
+	c->buf[c->len] = '\0';
+
+	while ((end = strstr(c->buf, "\r\n\r\n")) != NULL) {
+		*end = '\0';
+		_handle_command(sim, c, c->buf, now);
+
+		c->len -= (int)(end + 4 - c->buf);
+		memmove(c->buf, end + 4, c->len + 1);
+	}
+
+	if (c->len == sizeof(c->buf) - 1) {
+		printf("control %d: command too long\n", c->sock);
+		_client_close(sim, c, now);
+	}
+}
+
+static void _accept(sim_t *sim) {
+	int sock, i, one = 1;
+
+	if ((sock = accept(sim->listen_sock, NULL, NULL)) < 0) {
+		return;
+	}
+
+	for (i = 0; i < MAX_CLIENTS; i++) {
+		if (sim->clients[i].sock < 0) {
+			setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+			sim->clients[i].sock = sock;
+			printf("control %d: connected\n", sock);
+			return;
+		}
+	}
+
+	close(sock);
+}
+
+static void _udp_read(sim_t *sim, int64_t now) {
+	uint8_t buf[IMPAIR_MAX_PACKET];
+	struct sockaddr_storage from;
+	socklen_t from_len;
+	int i, len;
+
+	for (i = 0; i < UDP_BATCH; i++) {
+		from_len = sizeof(from);
+
+		if ((len = recvfrom(sim->udp_sock, buf, sizeof(buf), MSG_DONTWAIT, (struct sockaddr *)&from, &from_len)) < 0) {
+			return;
+		}
+
+		/*nacks and reports go back to wherever media last came from*/
+		memcpy(&sim->peer, &from, from_len);
+		sim->peer_len = from_len;
+		sim->have_peer = 1;
+
+		impair_submit(&sim->link, buf, len, &from, from_len, now);
+	}
+}
+
+/*dual stack, v4 clients show up as mapped addresses*/
+static int _open_socket(int type, int port) {
+	struct sockaddr_in6 addr;
+	int sock, off = 0, one = 1;
+
+	if ((sock = socket(AF_INET6, type, 0)) < 0) {
+		return -1;
+	}
+
+	setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin6_family = AF_INET6;
+	addr.sin6_addr = in6addr_any;
+	addr.sin6_port = htons(port);
+
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0 || (type == SOCK_STREAM && listen(sock, MAX_CLIENTS) != 0)) {
+		close(sock);
+		return -1;
+	}
+
+	return sock;
+}
+
+static int _timeout_ms(int64_t ns) {
+	if (ns <= 0) {
+		return 0;
+	}
+
+	return (int)((ns + NS_PER_MS - 1) / NS_PER_MS);
+}
+
+int main(int argc, char **argv) {
+	static sim_t sim;
+	impair_params_t link_params;
+	receiver_params_t rx_params;
+	struct pollfd fds[2 + MAX_CLIENTS];
+	client_t *owners[2 + MAX_CLIENTS];
+	impair_packet_t *pkt;
+	int64_t now, next, next_report, due;
+	char *sep;
+	int c, i, nfds;
+
+	memset(&link_params, 0, sizeof(link_params));
+	link_params.reorder_ms = 10;
+	link_params.queue_ms = 100;
+	link_params.seed = 1;
+
+	memset(&rx_params, 0, sizeof(rx_params));
+	rx_params.nack_enabled = 1;
+	rx_params.nack_delay_ms = 5;
+	rx_params.nack_retry_ms = 50;
+	rx_params.nack_retries = 3;
+	rx_params.frame_timeout_ms = 1000;
+
+	sim.tcp_port = 8084;
+	sim.udp_port = 8082;
+	sim.report_ms = 1000;
+	sim.channel_id = -1;
+
+	while ((c = getopt(argc, argv, "t:u:k:l:g:b:q:d:j:r:R:S:nN:T:c:i:v?")) != -1) {
+		switch (c) {
+		case 't':
+			sim.tcp_port = atoi(optarg);
+			break;
+		case 'u':
+			sim.udp_port = atoi(optarg);
+			break;
+		case 'k':
+			/*same channel-key split libftl does*/
+			if ((sep = strpbrk(optarg, "-,")) == NULL) {
+				usage();
+			}
+			*sep = '\0';
+			sim.channel_id = atoi(optarg);
+			sim.key = sep + 1;
+			break;
+		case 'l':
+			link_params.loss = atof(optarg) / 100;
+			break;
+		case 'g':
+			if (sscanf(optarg, "%lf,%lf,%lf", &link_params.burst_p, &link_params.burst_r, &link_params.burst_loss) != 3) {
+				usage();
+			}
+			link_params.burst_p /= 100;
+			link_params.burst_r /= 100;
+			link_params.burst_loss /= 100;
+			break;
+		case 'b':
+			link_params.bandwidth_kbps = atoi(optarg);
+			break;
+		case 'q':
+			link_params.queue_ms = atoi(optarg);
+			break;
+		case 'd':
+			link_params.delay_ms = atoi(optarg);
+			break;
+		case 'j':
+			link_params.jitter_ms = atoi(optarg);
+			break;
+		case 'r':
+			link_params.reorder = atof(optarg) / 100;
+			break;
+		case 'R':
+			link_params.reorder_ms = atoi(optarg);
+			break;
+		case 'S':
+			link_params.seed = strtoull(optarg, NULL, 0);
+			break;
+		case 'n':
+			rx_params.nack_enabled = 0;
+			break;
+		case 'N':
+			rx_params.nack_delay_ms = atoi(optarg);
+			break;
+		case 'T':
+			rx_params.nack_retry_ms = atoi(optarg);
+			break;
+		case 'c':
+			rx_params.nack_retries = atoi(optarg);
+			break;
+		case 'i':
+			sim.report_ms = atoi(optarg);
+			break;
+		case 'v':
+			sim.verbose = 1;
+			break;
+		default:
+			usage();
+			break;
+		}
+	}
+
+	if (sim.report_ms <= 0) {
+		usage();
+	}
+
+	signal(SIGINT, _shutdown);
+	signal(SIGTERM, _shutdown);
+
+	if ((sim.listen_sock = _open_socket(SOCK_STREAM, sim.tcp_port)) < 0) {
+		fprintf(stderr, "failed to listen on tcp port %d: %s\n", sim.tcp_port, strerror(errno));
+		return 1;
+	}
+
+	if ((sim.udp_sock = _open_socket(SOCK_DGRAM, sim.udp_port)) < 0) {
+		fprintf(stderr, "failed to bind udp port %d: %s\n", sim.udp_port, strerror(errno));
+		return 1;
+	}
+
+	if (impair_init(&sim.link, &link_params) != 0) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+
+	receiver_init(&sim.rx, &rx_params, _send_rtcp, &sim);
+
+	/*nonces don't need to repeat between runs*/
+	sim.nonce_rng = (uint64_t)_now_ns() | 1;
+
+	for (i = 0; i < MAX_CLIENTS; i++) {
+		sim.clients[i].sock = -1;
+	}
+
+	printf("ingest sim listening on tcp %d udp %d: loss %.2f%% delay %d ms jitter %d ms reorder %.2f%% (%d ms) nacks %s\n",
+		sim.tcp_port, sim.udp_port, link_params.loss * 100, link_params.delay_ms, link_params.jitter_ms,
+		link_params.reorder * 100, link_params.reorder_ms, rx_params.nack_enabled ? "on" : "off");
+	fflush(stdout);
+
+	now = _now_ns();
+	next_report = now + sim.report_ms * NS_PER_MS;
+	sim.prev_report = now;
+
+	while (!shutdown_flag) {
+		now = _now_ns();
+
+		while ((pkt = impair_next(&sim.link, now)) != NULL) {
+			receiver_packet(&sim.rx, pkt->data, pkt->len, now);
+			impair_release(&sim.link, pkt);
+		}
+
+		next = now + receiver_run_timers(&sim.rx, now);
+
+		if (now >= next_report) {
+			if (sim.streaming) {
+				receiver_send_report(&sim.rx);
+				_print_stats(&sim, now, 0);
+			}
+
+			next_report += sim.report_ms * NS_PER_MS;
+
+			if (next_report <= now) {
+				next_report = now + sim.report_ms * NS_PER_MS;
+			}
+		}
+
+		if (next_report < next) {
+			next = next_report;
+		}
+
+		if ((due = impair_next_due(&sim.link, now)) >= 0 && now + due < next) {
+			next = now + due;
+		}
+
+		fds[0].fd = sim.listen_sock;
+		fds[0].events = POLLIN;
+		fds[1].fd = sim.udp_sock;
+		fds[1].events = POLLIN;
+		nfds = 2;
+
+		for (i = 0; i < MAX_CLIENTS; i++) {
+			if (sim.clients[i].sock >= 0) {
+				fds[nfds].fd = sim.clients[i].sock;
+				fds[nfds].events = POLLIN;
+				owners[nfds++] = &sim.clients[i];
+			}
+		}
+
+		if (poll(fds, nfds, _timeout_ms(next - now)) <= 0) {
+			continue;
+		}
+
+		now = _now_ns();
+
+		if (fds[1].revents & POLLIN) {
+			_udp_read(&sim, now);
+		}
+
+		if (fds[0].revents & POLLIN) {
+			_accept(&sim);
+		}
+
+		for (i = 2; i < nfds; i++) {
+			if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+				_client_read(&sim, owners[i], now);
+			}
+		}
+	}
+
+	now = _now_ns();
+	_stream_stop(&sim, now);
+
+	for (i = 0; i < MAX_CLIENTS; i++) {
+		if (sim.clients[i].sock >= 0) {
+			close(sim.clients[i].sock);
+		}
+	}
+
+	close(sim.udp_sock);
+	close(sim.listen_sock);
+	receiver_destroy(&sim.rx);
+	impair_destroy(&sim.link);
+
+	return 0;
+}
@@ -0,0 +1,654 @@
+/**
+ * receiver.c - RTP receive side of the ingest simulator: loss detection, nacks, frame assembly
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ **/
+
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include "receiver.h"
+
+#define SEEN_NONE 0
+#define SEEN_RECEIVED 1
+#define SEEN_MISSING 2
+#define SEEN_GAVE_UP 3
+
+#define MAX_SEQ_JUMP 3000 /*a bigger jump forward is taken as the sender restarting its sequence*/
+#define MAX_FRAME_PACKETS 4096
+#define MAX_TIMER_NS (100 * NS_PER_MS)
+
+static void _frame_check(receiver_t *rx, receiver_stream_t *st, receiver_frame_t *f, int64_t now);
+
+void receiver_latency_add(receiver_latency_t *lat, int64_t ns) {
+	unsigned long v, e, bucket;
+	int64_t us = ns / 1000;
+
+	if (us < 0) {
+		us = 0;
+	}
+	else if (us > 0x7FFFFFFF) {
+		us = 0x7FFFFFFF;
+	}
+
+	v = (unsigned long)us;
+
+	if (v < (1 << RECEIVER_HISTOGRAM_SUB_BITS)) {
+		bucket = v;
+	}
+	else {
+		e = 31 - __builtin_clz((unsigned int)v);
+		bucket = ((e - RECEIVER_HISTOGRAM_SUB_BITS + 1) << RECEIVER_HISTOGRAM_SUB_BITS) + ((v >> (e - RECEIVER_HISTOGRAM_SUB_BITS)) & ((1 << RECEIVER_HISTOGRAM_SUB_BITS) - 1));
+	}
+
+	lat->buckets[bucket]++;
+	lat->count++;
+	lat->total_ns += ns;
+
+	if (ns > lat->max_ns) {
+		lat->max_ns = ns;
+	}
+}
+
+static int64_t _bucket_value(int bucket) {
+	int group = bucket >> RECEIVER_HISTOGRAM_SUB_BITS;
+	int64_t lower;
+
+	if (group == 0) {
+		return bucket;
+	}
+
+	lower = (int64_t)((1 << RECEIVER_HISTOGRAM_SUB_BITS) + (bucket & ((1 << RECEIVER_HISTOGRAM_SUB_BITS) - 1))) << (group - 1);
+
+	return lower + ((int64_t)1 << (group - 1)) - 1;
+}
+
+double receiver_latency_percentile(const receiver_latency_t *lat, double pct) {
+	uint64_t seen = 0, want;
+	int bucket;
+
+	if (lat->count == 0) {
+		return 0;
+	}
+
+	want = (uint64_t)(lat->count * pct / 100.0 + 0.5);
+
+	if (want == 0) {
+		want = 1;
+	}
+
+	for (bucket = 0; bucket < RECEIVER_HISTOGRAM_BUCKETS; bucket++) {
+		if ((seen += lat->buckets[bucket]) >= want) {
+			/*the bucket's upper edge can be past the largest value actually seen*/
+			return _bucket_value(bucket) * 1000 < lat->max_ns ? _bucket_value(bucket) / 1000.0 : lat->max_ns / (double)NS_PER_MS;
+		}
+	}
+
+	return lat->max_ns / (double)NS_PER_MS;
+}
+
+void receiver_init(receiver_t *rx, const receiver_params_t *params, receiver_send_t send, void *send_data) {
+	memset(rx, 0, sizeof(*rx));
+	rx->params = *params;
+	rx->send = send;
+	rx->send_data = send_data;
+}
+
+void receiver_reset(receiver_t *rx) {
+	int i;
+
+	for (i = 0; i < RECEIVER_MAX_STREAMS; i++) {
+		free(rx->streams[i]);
+		rx->streams[i] = NULL;
+	}
+
+	rx->probes = 0;
+	rx->unknown = 0;
+}
+
+void receiver_destroy(receiver_t *rx) {
+	receiver_reset(rx);
+}
+
+void receiver_set_frame_callback(receiver_t *rx, receiver_frame_done_t frame_done, void *frame_data) {
+	rx->frame_done = frame_done;
+	rx->frame_data = frame_data;
+}
+
+static receiver_stream_t *_stream_lookup(receiver_t *rx, uint32_t ssrc, int payload_type, uint16_t sn) {
+	receiver_stream_t *st;
+	int i, free_slot = -1;
+
+	for (i = 0; i < RECEIVER_MAX_STREAMS; i++) {
+		if (rx->streams[i] == NULL) {
+			if (free_slot < 0) {
+				free_slot = i;
+			}
+		}
+		else if (rx->streams[i]->ssrc == ssrc) {
+			return rx->streams[i];
+		}
+	}
+
+	if (free_slot < 0 || (st = (receiver_stream_t *)calloc(1, sizeof(receiver_stream_t))) == NULL) {
+		return NULL;
+	}
+
+	st->ssrc = ssrc;
+	st->payload_type = payload_type;
+	st->clock_rate = payload_type == VIDEO_PTYPE ? 90000 : 48000;
+	st->highest_sn = sn - 1;
+	st->base_sn = sn;
+	st->active = 1;
+
+	rx->streams[free_slot] = st;
+
+	return st;
+}
+
+static void _hole_remove(receiver_stream_t *st, int i) {
+	st->holes[i] = st->holes[--st->hole_count];
+}
+
+static int _hole_find(receiver_stream_t *st, uint16_t sn) {
+	int i;
+
+	for (i = 0; i < st->hole_count; i++) {
+		if (st->holes[i].sn == sn) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+static void _hole_give_up(receiver_stream_t *st, int i) {
+	st->seen[st->holes[i].sn] = SEEN_GAVE_UP;
+	st->stats.lost++;
+	_hole_remove(st, i);
+}
+
+static void _hole_add(receiver_t *rx, receiver_stream_t *st, uint16_t sn, int64_t now) {
+	receiver_hole_t *hole;
+	int i, oldest = 0;
+
+	if (st->hole_count == RECEIVER_MAX_MISSING) {
+		for (i = 1; i < st->hole_count; i++) {
+			if (st->holes[i].first_seen < st->holes[oldest].first_seen) {
+				oldest = i;
+			}
+		}
+
+		_hole_give_up(st, oldest);
+	}
+
+	hole = &st->holes[st->hole_count++];
+	hole->sn = sn;
+	hole->tries = 0;
+	hole->first_seen = now;
+	hole->next_nack = now + rx->params.nack_delay_ms * NS_PER_MS;
+
+	st->seen[sn] = SEEN_MISSING;
+	st->stats.holes++;
+}
+
+/*moves the highest sequence number up, everything skipped over is a hole*/
+static void _advance(receiver_t *rx, receiver_stream_t *st, uint16_t sn, int64_t now) {
+	uint16_t s = st->highest_sn;
+
+	while (s != sn) {
+		s++;
+
+		/*keep the half of the sequence space behind us, forget the half ahead*/
+		st->seen[(uint16_t)(s + 32768)] = SEEN_NONE;
+
+		if (s == 0) {
+			st->cycles += 1 << 16;
+		}
+
+		if (s != sn) {
+			_hole_add(rx, st, s, now);
+		}
+	}
+
+	st->highest_sn = sn;
+}
+
+static void _update_jitter(receiver_stream_t *st, uint32_t timestamp, int64_t now) {
+	int64_t arrival = now / 1000 * st->clock_rate / 1000000;
+	int64_t transit = arrival - (int64_t)timestamp;
+	int64_t d;
+
+	if (st->have_transit) {
+		d = transit - st->last_transit;
+
+		if (d < 0) {
+			d = -d;
+		}
+
+		/*rtp timestamps wrap, a jump that large is the wrap and not jitter*/
+		if (d < (int64_t)1 << 31) {
+			st->jitter += ((double)d - st->jitter) / 16.0;
+		}
+	}
+
+	st->last_transit = transit;
+	st->have_transit = 1;
+}
+
+static int _ts_before(uint32_t a, uint32_t b) {
+	return (int32_t)(a - b) < 0;
+}
+
+static receiver_frame_t *_frame_find(receiver_stream_t *st, uint32_t timestamp) {
+	int i;
+
+	for (i = 0; i < RECEIVER_MAX_FRAMES; i++) {
+		if (st->frames[i].used && st->frames[i].timestamp == timestamp) {
+			return &st->frames[i];
+		}
+	}
+
+	return NULL;
+}
+
+static receiver_frame_t *_frame_create(receiver_stream_t *st, uint32_t timestamp, uint16_t sn, int64_t now) {
+	receiver_frame_t *f = NULL;
+	int i;
+
+	for (i = 0; i < RECEIVER_MAX_FRAMES; i++) {
+		if (!st->frames[i].used) {
+			f = &st->frames[i];
+			break;
+		}
+
+		if (f == NULL || st->frames[i].first_arrival < f->first_arrival) {
+			f = &st->frames[i];
+		}
+	}
+
+	if (f->used && !f->done) {
+		st->stats.frames_incomplete++;
+	}
+
+	memset(f, 0, sizeof(*f));
+	f->used = 1;
+	f->timestamp = timestamp;
+	f->min_sn = sn;
+	f->first_arrival = now;
+
+	return f;
+}
+
+/*the closest frame before f that has its last packet, or the closest frame after f*/
+static receiver_frame_t *_frame_neighbour(receiver_stream_t *st, receiver_frame_t *f, int after) {
+	receiver_frame_t *best = NULL, *c;
+	int i;
+
+	for (i = 0; i < RECEIVER_MAX_FRAMES; i++) {
+		c = &st->frames[i];
+
+		if (!c->used || c == f || _ts_before(c->timestamp, f->timestamp) == after) {
+			continue;
+		}
+
+		if (!after && !c->have_marker) {
+			continue;
+		}
+
+		if (best == NULL || _ts_before(c->timestamp, best->timestamp) == after) {
+			best = c;
+		}
+	}
+
+	return best;
+}
+
+/*
+ * A frame runs from the packet after the previous frame's marker to its own marker, and is complete once
+ * every sequence number in between has arrived. Without the previous frame (the first one, or one lost
+ * entirely) the lowest sequence number seen for the frame stands in for its start.
+ */
+static void _frame_check(receiver_t *rx, receiver_stream_t *st, receiver_frame_t *f, int64_t now) {
+	receiver_frame_t *prev;
+	uint16_t first, s;
+
+	if (f->done || !f->have_marker) {
+		return;
+	}
+
+	first = f->min_sn;
+
+	if ((prev = _frame_neighbour(st, f, 0)) != NULL) {
+		s = prev->marker_sn + 1;
+
+		if ((int16_t)(f->marker_sn - s) >= 0 && (uint16_t)(f->marker_sn - s) < MAX_FRAME_PACKETS) {
+			first = s;
+		}
+	}
+
+	for (s = first; s != (uint16_t)(f->marker_sn + 1); s++) {
+		if (st->seen[s] != SEEN_RECEIVED) {
+			return;
+		}
+	}
+
+	f->done = 1;
+	st->stats.frames_complete++;
+	receiver_latency_add(&st->stats.assembly, now - f->first_arrival);
+
+	if (rx->frame_done != NULL) {
+		rx->frame_done(rx->frame_data, st->ssrc, f->timestamp, now);
+	}
+}
+
+static void _frame_add(receiver_t *rx, receiver_stream_t *st, uint32_t timestamp, uint16_t sn, int marker, int fresh, int64_t now) {
+	receiver_frame_t *f, *next;
+
+	/*a late packet for a frame that already expired doesn't start it again*/
+	if ((f = _frame_find(st, timestamp)) == NULL) {
+		if (!fresh) {
+			return;
+		}
+
+		f = _frame_create(st, timestamp, sn, now);
+	}
+
+	if (f->done) {
+		return;
+	}
+
+	if ((int16_t)(sn - f->min_sn) < 0) {
+		f->min_sn = sn;
+	}
+
+	if (marker) {
+		f->have_marker = 1;
+		f->marker_sn = sn;
+
+		/*the next frame's start was waiting on this marker*/
+		if ((next = _frame_neighbour(st, f, 1)) != NULL) {
+			_frame_check(rx, st, next, now);
+		}
+	}
+
+	_frame_check(rx, st, f, now);
+}
+
+void receiver_packet(receiver_t *rx, const uint8_t *data, int len, int64_t now) {
+	receiver_stream_t *st;
+	uint16_t sn;
+	uint32_t timestamp, ssrc;
+	int payload_type, marker, diff, i;
+
+	if (len < 8 || (data[0] >> 6) != 2) {
+		rx->unknown++;
+		return;
+	}
+
+	/*rtcp packet types share the byte rtp uses for marker and payload type*/
+	if (data[1] >= 192 && data[1] <= 223) {
+		if (data[1] == 204 && len >= 12 && memcmp(data + 8, "FTLP", 4) == 0) {
+			rx->probes++;
+
+			/*the sender only trusts a probe size once it comes back at full length*/
+			if (rx->send != NULL) {
+				rx->send(rx->send_data, data, len);
+			}
+		}
+		else {
+			rx->unknown++;
+		}
+		return;
+	}
+
+	if (len < 12) {
+		rx->unknown++;
+		return;
+	}
+
+	marker = data[1] >> 7;
+	payload_type = data[1] & 0x7F;
+	sn = ntohs(*(uint16_t *)(data + 2));
+	timestamp = ntohl(*(uint32_t *)(data + 4));
+	ssrc = ntohl(*(uint32_t *)(data + 8));
+
+	if ((st = _stream_lookup(rx, ssrc, payload_type, sn)) == NULL) {
+		rx->unknown++;
+		return;
+	}
+
+	st->stats.packets++;
+	st->stats.bytes += len;
+
+	diff = (int16_t)(sn - st->highest_sn);
+
+	if (diff > MAX_SEQ_JUMP) {
+		memset(st->seen, 0, sizeof(st->seen));
+		st->hole_count = 0;
+		st->highest_sn = sn - 1;
+		diff = 1;
+	}
+
+	if (diff > 0) {
+		_advance(rx, st, sn, now);
+		_update_jitter(st, timestamp, now);
+	}
+	else {
+		switch (st->seen[sn]) {
+		case SEEN_RECEIVED:
+			st->stats.duplicates++;
+			return;
+		case SEEN_MISSING:
+			if ((i = _hole_find(st, sn)) >= 0) {
+				receiver_latency_add(&st->stats.recovery, now - st->holes[i].first_seen);
+				_hole_remove(st, i);
+			}
+			st->stats.recovered++;
+			break;
+		case SEEN_GAVE_UP:
+			st->stats.late++;
+			break;
+		}
+	}
+
+	st->seen[sn] = SEEN_RECEIVED;
+
+	if (payload_type == VIDEO_PTYPE) {
+		_frame_add(rx, st, timestamp, sn, marker, diff > 0, now);
+	}
+}
+
+static int _compare_distance(const void *a, const void *b) {
+	return *(const int *)a - *(const int *)b;
+}
+
+static void _flush_nacks(receiver_t *rx, receiver_stream_t *st, uint8_t *pkt, int n) {
+	uint32_t *hdr = (uint32_t *)pkt;
+
+	hdr[0] = htonl((2 << 30) | (1 << 24) | (205 << 16) | (2 + n));
+	hdr[1] = htonl(RECEIVER_SSRC);
+	hdr[2] = htonl(st->ssrc);
+
+	if (rx->send != NULL) {
+		rx->send(rx->send_data, pkt, 12 + n * 4);
+	}
+
+	st->stats.nacks_sent++;
+}
+
+/*generic nack (rfc 4585): each fci names one sequence number and a bitmask of the 16 after it*/
+static void _send_nacks(receiver_t *rx, receiver_stream_t *st, int *distance, int count) {
+	uint8_t pkt[12 + RECEIVER_MAX_NACK_FCI * 4];
+	uint16_t *fci = (uint16_t *)(pkt + 12);
+	uint16_t pid = 0, blp = 0, sn, d;
+	int i, n = 0, open = 0;
+
+	qsort(distance, count, sizeof(int), _compare_distance);
+
+	for (i = 0; i < count; i++) {
+		sn = (uint16_t)(st->highest_sn + distance[i]);
+		d = sn - pid;
+
+		if (open && d >= 1 && d <= 16) {
+			blp |= 1 << (d - 1);
+			continue;
+		}
+
+		if (open) {
+			fci[n * 2] = htons(pid);
+			fci[n * 2 + 1] = htons(blp);
+
+			if (++n == RECEIVER_MAX_NACK_FCI) {
+				_flush_nacks(rx, st, pkt, n);
+				n = 0;
+			}
+		}
+
+		pid = sn;
+		blp = 0;
+		open = 1;
+	}
+
+	if (open) {
+		fci[n * 2] = htons(pid);
+		fci[n * 2 + 1] = htons(blp);
+		_flush_nacks(rx, st, pkt, n + 1);
+	}
+}
+
+int64_t receiver_run_timers(receiver_t *rx, int64_t now) {
+	int distance[RECEIVER_MAX_MISSING];
+	int64_t next = now + MAX_TIMER_NS;
+	receiver_stream_t *st;
+	receiver_frame_t *f;
+	receiver_hole_t *hole;
+	int i, s, count;
+
+	for (s = 0; s < RECEIVER_MAX_STREAMS; s++) {
+		if ((st = rx->streams[s]) == NULL) {
+			continue;
+		}
+
+		count = 0;
+
+		for (i = 0; i < st->hole_count; i++) {
+			hole = &st->holes[i];
+
+			if (hole->next_nack > now) {
+				if (hole->next_nack < next) {
+					next = hole->next_nack;
+				}
+				continue;
+			}
+
+			if (hole->tries >= rx->params.nack_retries) {
+				_hole_give_up(st, i--);
+				continue;
+			}
+
+			if (rx->params.nack_enabled) {
+				distance[count++] = (int16_t)(hole->sn - st->highest_sn);
+				st->stats.nacked++;
+			}
+
+			hole->tries++;
+			hole->next_nack = now + rx->params.nack_retry_ms * NS_PER_MS;
+
+			if (hole->next_nack < next) {
+				next = hole->next_nack;
+			}
+		}
+
+		if (count > 0) {
+			_send_nacks(rx, st, distance, count);
+		}
+
+		for (i = 0; i < RECEIVER_MAX_FRAMES; i++) {
+			f = &st->frames[i];
+
+			if (!f->used) {
+				continue;
+			}
+
+			/*finished frames stay around a while as the previous frame of the ones after them*/
+			if (now - f->first_arrival >= rx->params.frame_timeout_ms * NS_PER_MS * (f->done ? 2 : 1)) {
+				if (!f->done) {
+					st->stats.frames_incomplete++;
+				}
+				f->used = 0;
+			}
+		}
+	}
+
+	return next - now;
+}
+
+void receiver_send_report(receiver_t *rx) {
+	uint8_t pkt[8 + RECEIVER_MAX_STREAMS * 24];
+	uint32_t *hdr = (uint32_t *)pkt, *block;
+	receiver_stream_t *st;
+	uint32_t extended, expected, expected_interval, lost_interval, fraction;
+	uint64_t received, received_interval;
+	int64_t lost;
+	int s, n = 0;
+
+	for (s = 0; s < RECEIVER_MAX_STREAMS; s++) {
+		if ((st = rx->streams[s]) == NULL) {
+			continue;
+		}
+
+		extended = st->cycles + st->highest_sn;
+		expected = extended - st->base_sn + 1;
+		received = st->stats.packets - st->stats.duplicates;
+		lost = (int64_t)expected - (int64_t)received;
+
+		expected_interval = expected - st->expected_prior;
+		received_interval = received - st->received_prior;
+		lost_interval = expected_interval > received_interval ? expected_interval - (uint32_t)received_interval : 0;
+		fraction = expected_interval > 0 ? (lost_interval << 8) / expected_interval : 0;
+		st->expected_prior = expected;
+		st->received_prior = received;
+
+		if (lost > 0x7FFFFF) {
+			lost = 0x7FFFFF;
+		}
+		else if (lost < -0x800000) {
+			lost = -0x800000;
+		}
+
+		block = (uint32_t *)(pkt + 8 + n * 24);
+		block[0] = htonl(st->ssrc);
+		block[1] = htonl((fraction << 24) | ((uint32_t)lost & 0xFFFFFF));
+		block[2] = htonl(extended);
+		block[3] = htonl((uint32_t)st->jitter);
+		block[4] = 0; /*no sender reports to refer to*/
+		block[5] = 0;
+		n++;
+	}
+
+	if (n == 0 || rx->send == NULL) {
+		return;
+	}
+
+	hdr[0] = htonl((2 << 30) | (n << 24) | (201 << 16) | (1 + n * 6));
+	hdr[1] = htonl(RECEIVER_SSRC);
+
+	rx->send(rx->send_data, pkt, 8 + n * 24);
+}
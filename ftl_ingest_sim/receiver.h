@@ -0,0 +1,152 @@
+/**
+ * receiver.h - RTP receive side of the ingest simulator: loss detection, nacks, frame assembly
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ **/
+
+#ifndef __RECEIVER_H
+#define __RECEIVER_H
+
+#include <stdint.h>
+
+#define NS_PER_MS 1000000LL
+#define NS_PER_SEC 1000000000LL
+
+#define RECEIVER_MAX_STREAMS 8
+#define RECEIVER_MAX_MISSING 4096 /*outstanding holes per stream, the oldest is given up on when full*/
+#define RECEIVER_MAX_FRAMES 128 /*frames being assembled per stream*/
+#define RECEIVER_MAX_NACK_FCI 64
+#define RECEIVER_HISTOGRAM_SUB_BITS 3 /*same log-linear layout as libftl's latency histograms, in microseconds*/
+#define RECEIVER_HISTOGRAM_BUCKETS ((32 - RECEIVER_HISTOGRAM_SUB_BITS + 1) << RECEIVER_HISTOGRAM_SUB_BITS)
+#define RECEIVER_SSRC 0x4654494E
+
+#define VIDEO_PTYPE 96
+#define AUDIO_PTYPE 97
+
+typedef struct {
+	int nack_delay_ms; /*how long a hole may stay open before it is nacked, gives reordered packets a chance*/
+	int nack_retry_ms; /*between nacks for the same packet*/
+	int nack_retries; /*nacks sent for a packet before it is given up as lost*/
+	int frame_timeout_ms; /*a video frame not complete by then counts as incomplete*/
+	int nack_enabled;
+} receiver_params_t;
+
+typedef struct {
+	uint64_t count;
+	int64_t total_ns;
+	int64_t max_ns;
+	uint64_t buckets[RECEIVER_HISTOGRAM_BUCKETS];
+} receiver_latency_t;
+
+typedef struct {
+	uint64_t packets;
+	uint64_t bytes;
+	uint64_t duplicates;
+	uint64_t holes; /*sequence numbers seen missing*/
+	uint64_t nacks_sent; /*nack packets*/
+	uint64_t nacked; /*sequence numbers requested, retries included*/
+	uint64_t recovered; /*missing packets that turned up later, by retransmit or reordering*/
+	uint64_t lost; /*given up on*/
+	uint64_t late; /*turned up after being given up on*/
+	uint64_t frames_complete;
+	uint64_t frames_incomplete;
+	receiver_latency_t recovery; /*hole first seen to the packet arriving*/
+	receiver_latency_t assembly; /*first packet of a frame to the frame being complete*/
+} receiver_stats_t;
+
+typedef struct {
+	uint16_t sn;
+	int tries;
+	int64_t first_seen;
+	int64_t next_nack;
+} receiver_hole_t;
+
+typedef struct {
+	uint32_t timestamp;
+	int used;
+	int done;
+	int have_marker;
+	uint16_t min_sn;
+	uint16_t marker_sn;
+	int64_t first_arrival;
+} receiver_frame_t;
+
+typedef struct {
+	uint32_t ssrc;
+	int payload_type;
+	int active;
+	int clock_rate;
+
+	uint16_t highest_sn;
+	uint32_t cycles;
+	uint32_t base_sn;
+	uint8_t seen[65536];
+
+	receiver_hole_t holes[RECEIVER_MAX_MISSING];
+	int hole_count;
+
+	receiver_frame_t frames[RECEIVER_MAX_FRAMES];
+
+	/*rfc 3550 interarrival jitter and the counts receiver reports are built from*/
+	double jitter;
+	int64_t last_transit;
+	int have_transit;
+	uint32_t expected_prior;
+	uint64_t received_prior;
+
+	receiver_stats_t stats;
+} receiver_stream_t;
+
+/*sends an rtcp packet back to whoever sent the stream*/
+typedef void (*receiver_send_t)(void *user_data, const uint8_t *pkt, int len);
+
+/*a video frame has every one of its packets*/
+typedef void (*receiver_frame_done_t)(void *user_data, uint32_t ssrc, uint32_t timestamp, int64_t now);
+
+typedef struct {
+	receiver_params_t params;
+	receiver_stream_t *streams[RECEIVER_MAX_STREAMS];
+	uint64_t probes; /*path mtu probes from the sender*/
+	uint64_t unknown;
+	receiver_send_t send;
+	void *send_data;
+	receiver_frame_done_t frame_done;
+	void *frame_data;
+} receiver_t;
+
+void receiver_init(receiver_t *rx, const receiver_params_t *params, receiver_send_t send, void *send_data);
+void receiver_destroy(receiver_t *rx);
+void receiver_set_frame_callback(receiver_t *rx, receiver_frame_done_t frame_done, void *frame_data);
+
+/*forgets every stream, for a new connection*/
+void receiver_reset(receiver_t *rx);
+
+void receiver_packet(receiver_t *rx, const uint8_t *data, int len, int64_t now);
+
+/*sends the nacks that are due, expires holes and frames, returns ns until something else is due*/
+int64_t receiver_run_timers(receiver_t *rx, int64_t now);
+
+/*one rtcp receiver report covering every stream*/
+void receiver_send_report(receiver_t *rx);
+
+void receiver_latency_add(receiver_latency_t *lat, int64_t ns);
+/*percentile from the histogram, in ms and within 12.5% of the recorded value*/
+double receiver_latency_percentile(const receiver_latency_t *lat, double pct);
+
+#endif // __RECEIVER_H
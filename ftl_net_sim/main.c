@@ -0,0 +1,710 @@
+/**
+ * main.c - FTL network simulation: streams through a simulated link on a virtual clock
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ **/
+
+/*
+ * A whole stream runs on one thread against a virtual clock, so a run is repeatable from its seed and takes
+ * as long as the work does rather than as long as the stream. The sender is a real libftl handle with
+ * media.c built into this file and its socket calls redirected onto the simulated uplink. The ingest end is
+ * the ingest simulator's receiver, whose nacks come back over a second simulated link. Time only moves
+ * when nothing is left to do at the current instant, it then jumps to whatever is due next.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "impair.h"
+#include "receiver.h"
+
+static int netsim_send(int sock, const void *buf, size_t len, int flags);
+
+/*media.c's sockets, everything it sends goes onto the uplink and rtcp comes off the downlink*/
+#define send(sock, buf, len, flags) netsim_send((sock), (buf), (len), (flags))
+#define ftl_send_batch netsim_send_batch
+#define ftl_send_batch_txtime netsim_send_batch_txtime
+#define ftl_recv_batch netsim_recv_batch
+
+#include "media.c"
+
+#undef send
+#undef ftl_send_batch
+#undef ftl_send_batch_txtime
+#undef ftl_recv_batch
+
+#define FRAME_HISTORY 1024 /*video frames remembered for their latency*/
+#define AUDIO_INTERVAL_MS 20
+#define AUDIO_PACKET_LEN 160
+#define DRAIN_MS 2000 /*after the last frame, for retransmits and the links to settle*/
+#define KEY_FRAME_RATIO 5 /*key frames are this many times the size of the others*/
+
+typedef struct {
+	uint32_t timestamp;
+	int64_t submitted;
+} frame_record_t;
+
+typedef struct {
+	uint64_t received; /*media packets at the ingest, duplicates aside*/
+	uint64_t recovered;
+	uint64_t lost;
+	double lost_pct;
+	double resent_pct; /*retransmits per packet sent*/
+	double overhead_pct; /*bytes on the uplink beyond the media itself*/
+} netsim_result_t;
+
+typedef struct {
+	int duration_s;
+	int video_kbps;
+	int pace_kbps;
+	int fps;
+	int gop;
+	int audio;
+	double max_lost;
+	double max_latency; /*p99 frame latency in ms*/
+	int json;
+
+	int64_t now;
+	uint64_t rng;
+	impair_t up, down;
+	receiver_t rx;
+	struct sockaddr_storage peer; /*the links keep a source address, nothing here reads it*/
+
+	ftl_handle_t handle;
+	ftl_stream_configuration_private_t *ftl;
+	uint8_t *frame_buf;
+	int frame_buf_len;
+
+	int64_t pacer_wake; /*-1 while the pacer waits for packets*/
+	int64_t next_audio;
+	uint64_t frames;
+	frame_record_t history[FRAME_HISTORY];
+	receiver_latency_t frame_latency; /*handed to libftl to complete at the ingest*/
+
+	uint64_t up_bytes; /*everything handed to the uplink, retransmits included*/
+} netsim_t;
+
+/*the socket calls have no user data, there is one simulation per process*/
+static netsim_t sim;
+
+static void usage(void) {
+	printf("Usage: ftl_net_sim [options]\n");
+	printf("Streams through a simulated link on a virtual clock and reports how loss recovery and pacing held up\n");
+	printf("\t-t secs\t\tstream length, default 30\n");
+	printf("\t-S seed\t\tseed for the link and the frame sizes, default 1\n");
+	printf("\t-v kbps\t\tvideo bitrate, default 4000\n");
+	printf("\t-p kbps\t\tpacer rate, default the video bitrate, 0 sends unpaced\n");
+	printf("\t-f fps\t\tframe rate, default 30\n");
+	printf("\t-k frames\tkey frame interval, default 60\n");
+	printf("\t-A\t\tno audio\n");
+	printf("\t-b kbps\t\tlink bandwidth, default unlimited\n");
+	printf("\t-q ms\t\tbuffering in front of a limited link, default 100\n");
+	printf("\t-d ms\t\tone way delay, default 20\n");
+	printf("\t-j ms\t\tjitter added on top of the delay, default 0\n");
+	printf("\t-l pct\t\tpacket loss, default 0\n");
+	printf("\t-g p,r,loss\tloss bursts, pct chance per packet of a burst starting, ending and of loss during one\n");
+	printf("\t-r pct\t\tpackets held back so later ones overtake them, default 0\n");
+	printf("\t-R ms\t\thow long reordered packets are held back, default 10\n");
+	printf("\t-x pct\t\tloss on the return (rtcp) path, default 0\n");
+	printf("\t-n\t\tdon't send nacks\n");
+	printf("\t-N ms\t\twait before nacking a hole, default 5\n");
+	printf("\t-T ms\t\tbetween nacks for the same packet, default 50\n");
+	printf("\t-c count\tnacks per packet before it is counted lost, default 3\n");
+	printf("\t-L pct\t\texit with status 2 if more than pct of the media packets are lost\n");
+	printf("\t-P ms\t\texit with status 2 if the p99 frame latency is above ms\n");
+	printf("\t-J\t\tprint the results as one json object\n");
+	printf("\t-V\t\tlibftl logs to stderr\n");
+	printf("\t-?\t\tthis help message\n");
+	exit(0);
+}
+
+static void _uplink(const uint8_t *buf, int len) {
+	sim.up_bytes += len;
+	impair_submit(&sim.up, buf, len, &sim.peer, sizeof(sim.peer), sim.now);
+}
+
+static int netsim_send(int sock, const void *buf, size_t len, int flags) {
+	_uplink((const uint8_t *)buf, (int)len);
+
+	return (int)len;
+}
+
+int netsim_send_batch(SOCKET socket, uint8_t **bufs, int *lens, int count) {
+	int i;
+
+	for (i = 0; i < count; i++) {
+		_uplink(bufs[i], lens[i]);
+	}
+
+	return count;
+}
+
+/*kernel pacing is never turned on here, the departure times would be on the os clock anyway*/
+int netsim_send_batch_txtime(SOCKET socket, uint8_t **bufs, int *lens, int64_t *txtimes, int count) {
+	return netsim_send_batch(socket, bufs, lens, count);
+}
+
+int netsim_recv_batch(SOCKET socket, uint8_t **bufs, int *lens, int count) {
+	impair_packet_t *pkt;
+	int n = 0;
+
+	while (n < count && (pkt = impair_next(&sim.down, sim.now)) != NULL) {
+		if (pkt->len <= lens[n]) {
+			memcpy(bufs[n], pkt->data, pkt->len);
+			lens[n++] = pkt->len;
+		}
+		impair_release(&sim.down, pkt);
+	}
+
+	if (n == 0) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	return n;
+}
+
+static int64_t _clock(void *user_data) {
+	return ((netsim_t *)user_data)->now;
+}
+
+static void _log(ftl_log_severity_t log_level, const char *msg) {
+	fprintf(stderr, "[%.3f] %s", sim.now / (double)NS_PER_SEC, msg);
+}
+
+static void _log_nothing(ftl_log_severity_t log_level, const char *msg) {
+}
+
+static void _send_rtcp(void *user_data, const uint8_t *pkt, int len) {
+	netsim_t *s = (netsim_t *)user_data;
+
+	impair_submit(&s->down, pkt, len, &s->peer, sizeof(s->peer), s->now);
+}
+
+static void _frame_done(void *user_data, uint32_t ssrc, uint32_t timestamp, int64_t now) {
+	netsim_t *s = (netsim_t *)user_data;
+	uint64_t i;
+	frame_record_t *f;
+
+	if (ssrc != s->ftl->video.media_component.ssrc) {
+		return;
+	}
+
+	/*newest first, frames usually complete in order*/
+	for (i = s->frames; i > 0 && s->frames - i < FRAME_HISTORY; i--) {
+		f = &s->history[(i - 1) % FRAME_HISTORY];
+
+		if (f->timestamp == timestamp) {
+			receiver_latency_add(&s->frame_latency, now - f->submitted);
+			return;
+		}
+	}
+}
+
+/*
+ * What media_init sets up, minus the socket and the send thread: the links stand in for the one and the
+ * main loop runs the pacer in place of the other.
+ */
+static int _stream_init(netsim_t *s, int verbose) {
+	ftl_ingest_params_t params;
+	ftl_stream_configuration_private_t *ftl;
+	ftl_media_config_t *media;
+
+	memset(&params, 0, sizeof(params));
+	params.stream_key = "1-netsim";
+	params.ingest_hostname = "127.0.0.1";
+	params.video_codec = FTL_VIDEO_H264;
+	params.audio_codec = FTL_AUDIO_OPUS;
+	params.video_frame_rate = (float)s->fps;
+	params.video_kbps = s->pace_kbps;
+	params.log_func = verbose ? _log : _log_nothing;
+	params.clock = _clock;
+	params.clock_data = s;
+
+	if (ftl_ingest_create(&s->handle, &params) != FTL_SUCCESS) {
+		return -1;
+	}
+
+	ftl = s->ftl = (ftl_stream_configuration_private_t *)s->handle.priv;
+	media = &ftl->media;
+
+	ftl_ingest_set_log_level(&s->handle, verbose ? FTL_LOG_INFO : FTL_LOG_ERROR);
+
+	media->media_socket = INVALID_SOCKET;
+	media->uring = NULL;
+
+	if (pthread_mutex_init(&media->mutex, &ftl_default_mutexattr) != 0 ||
+		_nack_init(ftl, &ftl->video.media_component) != FTL_SUCCESS ||
+		_nack_init(ftl, &ftl->audio.media_component) != FTL_SUCCESS ||
+		sem_init(&ftl->video.media_component.pkt_ready, 0, 0) != 0) {
+		return -1;
+	}
+
+	/*nothing on a simulated link ever fails with EMSGSIZE, probing would only walk the mtu up*/
+	media->max_mtu = MAX_MTU;
+	media->pmtud_enabled = FALSE;
+	media->kernel_pacing = FALSE;
+	media->next_stats = s->now + STATS_SAMPLE_MS * NS_PER_MS;
+
+	stats_reset(ftl);
+
+	ftl->video.media_component.timestamp = 0;
+	ftl->video.media_component.timestamp_step = (uint32_t)(90000.f / ftl->video.frame_rate);
+	ftl->video.wait_for_idr_frame = TRUE;
+	ftl->audio.media_component.timestamp = 0;
+	ftl->audio.media_component.timestamp_step = 48000 / 50;
+
+	_media_pacer_init(ftl);
+
+	return 0;
+}
+
+static void _stream_destroy(netsim_t *s) {
+	ftl_stream_configuration_private_t *ftl = s->ftl;
+
+	if (ftl == NULL) {
+		return;
+	}
+
+	_nack_destroy(ftl, &ftl->video.media_component);
+	_nack_destroy(ftl, &ftl->audio.media_component);
+	sem_destroy(&ftl->video.media_component.pkt_ready);
+	pthread_mutex_destroy(&ftl->media.mutex);
+	ftl_ingest_destroy(&s->handle);
+	s->ftl = NULL;
+}
+
+static void _send_nalu(netsim_t *s, uint8_t header, int len, int end_of_frame) {
+	ftl_status_t drop_reason;
+
+	s->frame_buf[0] = header;
+	media_send_video(s->ftl, s->frame_buf, len, end_of_frame, 0, &drop_reason);
+}
+
+/*
+ * Frame sizes average out to the video bitrate over a key frame interval, with each frame within 25% of
+ * its share so the pacer sees some variation.
+ */
+static void _submit_video(netsim_t *s) {
+	ftl_media_component_common_t *mc = &s->ftl->video.media_component;
+	frame_record_t *f = &s->history[s->frames % FRAME_HISTORY];
+	int64_t average = (int64_t)s->video_kbps * 1000 / 8 / s->fps;
+	int64_t delta = average * s->gop / (s->gop + KEY_FRAME_RATIO - 1);
+	int len;
+
+	f->timestamp = mc->timestamp;
+	f->submitted = s->now;
+
+	if (s->frames % s->gop == 0) {
+		len = (int)(delta * KEY_FRAME_RATIO);
+		_send_nalu(s, 0x67, 16, FALSE); /*sps*/
+		_send_nalu(s, 0x68, 4, FALSE); /*pps*/
+		_send_nalu(s, 0x65, len, TRUE); /*idr slice*/
+	}
+	else {
+		len = (int)(delta * (0.75 + 0.5 * impair_random(&s->rng)));
+		_send_nalu(s, 0x41, len > 1 ? len : 1, TRUE);
+	}
+
+	s->frames++;
+}
+
+static void _submit_audio(netsim_t *s) {
+	uint8_t packet[AUDIO_PACKET_LEN];
+	ftl_status_t drop_reason;
+
+	memset(packet, 0, sizeof(packet));
+	media_send_audio(s->ftl, packet, sizeof(packet), &drop_reason);
+}
+
+/*a send thread step: once it sleeps new packets wait for it to wake, once the queue is empty they wake it*/
+static void _pace(netsim_t *s) {
+	int wait_ms;
+
+	while ((wait_ms = media_pace(s->ftl, s->now)) == 0) {
+	}
+
+	s->pacer_wake = wait_ms > 0 ? s->now + wait_ms * NS_PER_MS : -1;
+}
+
+static void _next(int64_t *next, int64_t t) {
+	if (t >= 0 && t < *next) {
+		*next = t;
+	}
+}
+
+static uint64_t _counter(ftl_media_component_common_t *mc, int stat) {
+	return (uint64_t)ftl_atomic_load(&mc->stats.counters[stat]);
+}
+
+static uint64_t _sent(netsim_t *s, int stat) {
+	return _counter(&s->ftl->video.media_component, stat) + _counter(&s->ftl->audio.media_component, stat);
+}
+
+static receiver_stream_t *_rx_stream(netsim_t *s, int payload_type) {
+	int i;
+
+	for (i = 0; i < RECEIVER_MAX_STREAMS; i++) {
+		if (s->rx.streams[i] != NULL && s->rx.streams[i]->payload_type == payload_type) {
+			return s->rx.streams[i];
+		}
+	}
+
+	return NULL;
+}
+
+static void _print_latency(const char *name, const receiver_latency_t *lat) {
+	if (lat->count == 0) {
+		printf("\t%s: none\n", name);
+		return;
+	}
+
+	printf("\t%s: avg %.1f p50 %.1f p90 %.1f p99 %.1f max %.1f ms\n", name,
+		lat->total_ns / (double)lat->count / NS_PER_MS, receiver_latency_percentile(lat, 50),
+		receiver_latency_percentile(lat, 90), receiver_latency_percentile(lat, 99), lat->max_ns / (double)NS_PER_MS);
+}
+
+static void _print_results(netsim_t *s, const netsim_result_t *res) {
+	ftl_media_component_common_t *video = &s->ftl->video.media_component;
+	impair_stats_t *up = &s->up.stats, *down = &s->down.stats;
+	receiver_stream_t *st;
+	int i;
+
+	printf("sender: frames %llu queued %llu dropped %llu, packets sent %llu resent %llu (%.2f%%) nacked %llu too late %llu, overhead %.2f%%\n",
+		(unsigned long long)s->frames, (unsigned long long)_counter(video, MEDIA_STAT_FRAMES_QUEUED),
+		(unsigned long long)_counter(video, MEDIA_STAT_FRAMES_DROPPED), (unsigned long long)_sent(s, MEDIA_STAT_PACKETS_SENT),
+		(unsigned long long)_sent(s, MEDIA_STAT_PACKETS_RESENT), res->resent_pct, (unsigned long long)_sent(s, MEDIA_STAT_PACKETS_NACKED),
+		(unsigned long long)_sent(s, MEDIA_STAT_PACKETS_LATE), res->overhead_pct);
+	printf("uplink: in %llu dropped %llu (%llu in %llu bursts) overflowed %llu reordered %llu avg delay %.1f ms\n",
+		(unsigned long long)up->packets, (unsigned long long)up->dropped, (unsigned long long)up->burst_dropped,
+		(unsigned long long)up->bursts, (unsigned long long)up->overflowed, (unsigned long long)up->reordered,
+		up->delivered ? up->delay_ns_total / (double)up->delivered / NS_PER_MS : 0);
+	printf("downlink: in %llu dropped %llu\n", (unsigned long long)down->packets, (unsigned long long)down->dropped);
+
+	for (i = 0; i < RECEIVER_MAX_STREAMS; i++) {
+		if ((st = s->rx.streams[i]) == NULL) {
+			continue;
+		}
+
+		printf("ingest %s: packets %llu holes %llu recovered %llu lost %llu late %llu duplicates %llu, nacks %llu",
+			st->payload_type == VIDEO_PTYPE ? "video" : "audio", (unsigned long long)st->stats.packets,
+			(unsigned long long)st->stats.holes, (unsigned long long)st->stats.recovered, (unsigned long long)st->stats.lost,
+			(unsigned long long)st->stats.late, (unsigned long long)st->stats.duplicates, (unsigned long long)st->stats.nacks_sent);
+
+		if (st->payload_type == VIDEO_PTYPE) {
+			printf(", frames complete %llu incomplete %llu", (unsigned long long)st->stats.frames_complete,
+				(unsigned long long)st->stats.frames_incomplete);
+		}
+
+		printf("\n");
+		_print_latency("recovery", &st->stats.recovery);
+	}
+
+	printf("recovered %llu, lost %llu of %llu media packets (%.3f%%)\n", (unsigned long long)res->recovered, (unsigned long long)res->lost,
+		(unsigned long long)(res->received + res->lost), res->lost_pct);
+	_print_latency("frame latency", &s->frame_latency);
+}
+
+static void _print_json(netsim_t *s, const netsim_result_t *res) {
+	receiver_stream_t *video = _rx_stream(s, VIDEO_PTYPE);
+	receiver_latency_t none;
+	const receiver_latency_t *recovery = &none, *lat = &s->frame_latency;
+
+	memset(&none, 0, sizeof(none));
+
+	if (video != NULL) {
+		recovery = &video->stats.recovery;
+	}
+
+	printf("{\"frames\":%llu,\"frames_dropped\":%llu,\"frames_complete\":%llu,\"frames_incomplete\":%llu,"
+		"\"packets_sent\":%llu,\"packets_resent\":%llu,\"resent_pct\":%.3f,\"overhead_pct\":%.3f,"
+		"\"link_dropped\":%llu,\"link_overflowed\":%llu,\"recovered\":%llu,\"lost\":%llu,\"received\":%llu,\"lost_pct\":%.4f,"
+		"\"recovery_p50_ms\":%.2f,\"recovery_p99_ms\":%.2f,"
+		"\"frame_latency_p50_ms\":%.2f,\"frame_latency_p90_ms\":%.2f,\"frame_latency_p99_ms\":%.2f,\"frame_latency_max_ms\":%.2f}\n",
+		(unsigned long long)s->frames, (unsigned long long)_counter(&s->ftl->video.media_component, MEDIA_STAT_FRAMES_DROPPED),
+		(unsigned long long)(video != NULL ? video->stats.frames_complete : 0),
+		(unsigned long long)(video != NULL ? video->stats.frames_incomplete : 0),
+		(unsigned long long)_sent(s, MEDIA_STAT_PACKETS_SENT), (unsigned long long)_sent(s, MEDIA_STAT_PACKETS_RESENT),
+		res->resent_pct, res->overhead_pct, (unsigned long long)s->up.stats.dropped, (unsigned long long)s->up.stats.overflowed,
+		(unsigned long long)res->recovered, (unsigned long long)res->lost, (unsigned long long)res->received, res->lost_pct,
+		receiver_latency_percentile(recovery, 50), receiver_latency_percentile(recovery, 99),
+		receiver_latency_percentile(lat, 50), receiver_latency_percentile(lat, 90), receiver_latency_percentile(lat, 99),
+		lat->max_ns / (double)NS_PER_MS);
+}
+
+int main(int argc, char **argv) {
+	impair_params_t up_params, down_params;
+	receiver_params_t rx_params;
+	impair_packet_t *pkt;
+	ftl_status_msg_t status;
+	receiver_stream_t *st;
+	int64_t end, stop, next, next_video, rx_due, timers_due;
+	netsim_result_t res;
+	uint64_t sent_bytes, sent_packets;
+	int c, i, verbose = 0;
+
+	memset(&up_params, 0, sizeof(up_params));
+	memset(&down_params, 0, sizeof(down_params));
+	up_params.delay_ms = 20;
+	up_params.reorder_ms = 10;
+	up_params.queue_ms = 100;
+	up_params.seed = 1;
+
+	memset(&rx_params, 0, sizeof(rx_params));
+	rx_params.nack_enabled = 1;
+	rx_params.nack_delay_ms = 5;
+	rx_params.nack_retry_ms = 50;
+	rx_params.nack_retries = 3;
+	rx_params.frame_timeout_ms = 1000;
+
+	sim.duration_s = 30;
+	sim.video_kbps = 4000;
+	sim.pace_kbps = -1;
+	sim.fps = 30;
+	sim.gop = 60;
+	sim.audio = 1;
+	sim.max_lost = -1;
+	sim.max_latency = -1;
+
+	while ((c = getopt(argc, argv, "t:S:v:p:f:k:Ab:q:d:j:l:g:r:R:x:nN:T:c:L:P:JV?")) != -1) {
+		switch (c) {
+		case 't':
+			sim.duration_s = atoi(optarg);
+			break;
+		case 'S':
+			up_params.seed = strtoull(optarg, NULL, 0);
+			break;
+		case 'v':
+			sim.video_kbps = atoi(optarg);
+			break;
+		case 'p':
+			sim.pace_kbps = atoi(optarg);
+			break;
+		case 'f':
+			sim.fps = atoi(optarg);
+			break;
+		case 'k':
+			sim.gop = atoi(optarg);
+			break;
+		case 'A':
+			sim.audio = 0;
+			break;
+		case 'b':
+			up_params.bandwidth_kbps = atoi(optarg);
+			break;
+		case 'q':
+			up_params.queue_ms = atoi(optarg);
+			break;
+		case 'd':
+			up_params.delay_ms = atoi(optarg);
+			break;
+		case 'j':
+			up_params.jitter_ms = atoi(optarg);
+			break;
+		case 'l':
+			up_params.loss = atof(optarg) / 100;
+			break;
+		case 'g':
+			if (sscanf(optarg, "%lf,%lf,%lf", &up_params.burst_p, &up_params.burst_r, &up_params.burst_loss) != 3) {
+				usage();
+			}
+			up_params.burst_p /= 100;
+			up_params.burst_r /= 100;
+			up_params.burst_loss /= 100;
+			break;
+		case 'r':
+			up_params.reorder = atof(optarg) / 100;
+			break;
+		case 'R':
+			up_params.reorder_ms = atoi(optarg);
+			break;
+		case 'x':
+			down_params.loss = atof(optarg) / 100;
+			break;
+		case 'n':
+			rx_params.nack_enabled = 0;
+			break;
+		case 'N':
+			rx_params.nack_delay_ms = atoi(optarg);
+			break;
+		case 'T':
+			rx_params.nack_retry_ms = atoi(optarg);
+			break;
+		case 'c':
+			rx_params.nack_retries = atoi(optarg);
+			break;
+		case 'L':
+			sim.max_lost = atof(optarg);
+			break;
+		case 'P':
+			sim.max_latency = atof(optarg);
+			break;
+		case 'J':
+			sim.json = 1;
+			break;
+		case 'V':
+			verbose = 1;
+			break;
+		default:
+			usage();
+			break;
+		}
+	}
+
+	if (sim.duration_s <= 0 || sim.video_kbps <= 0 || sim.fps <= 0 || sim.gop <= 0) {
+		usage();
+	}
+
+	if (sim.pace_kbps < 0) {
+		sim.pace_kbps = sim.video_kbps;
+	}
+
+	/*the return path shares the uplink's delay, rtcp is too little traffic for the rest to matter*/
+	down_params.delay_ms = up_params.delay_ms;
+	down_params.jitter_ms = up_params.jitter_ms;
+	down_params.seed = up_params.seed * 0x9E3779B97F4A7C15ULL + 1;
+	sim.rng = up_params.seed * 0xBF58476D1CE4E5B9ULL + 2;
+
+	sim.frame_buf_len = (int)((int64_t)sim.video_kbps * 1000 / 8 / sim.fps * KEY_FRAME_RATIO) + 16;
+
+	if ((sim.frame_buf = (uint8_t *)calloc(1, sim.frame_buf_len)) == NULL ||
+		impair_init(&sim.up, &up_params) != 0 || impair_init(&sim.down, &down_params) != 0) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+
+	receiver_init(&sim.rx, &rx_params, _send_rtcp, &sim);
+	receiver_set_frame_callback(&sim.rx, _frame_done, &sim);
+
+	ftl_init();
+
+	if (_stream_init(&sim, verbose) != 0) {
+		fprintf(stderr, "failed to set up the stream\n");
+		_stream_destroy(&sim);
+		return 1;
+	}
+
+	sim.pacer_wake = -1;
+	sim.next_audio = 0;
+	end = (int64_t)sim.duration_s * NS_PER_SEC;
+	stop = end + DRAIN_MS * NS_PER_MS;
+
+	while (sim.now < stop) {
+		/*everything due at this instant, in the order a real stream would see it*/
+		if (impair_next_due(&sim.down, sim.now) == 0) {
+			media_recv(sim.ftl);
+		}
+
+		while ((pkt = impair_next(&sim.up, sim.now)) != NULL) {
+			receiver_packet(&sim.rx, pkt->data, pkt->len, sim.now);
+			impair_release(&sim.up, pkt);
+		}
+
+		rx_due = sim.now + receiver_run_timers(&sim.rx, sim.now);
+
+		next_video = (int64_t)(sim.frames * NS_PER_SEC / sim.fps);
+
+		if (sim.now < end && sim.now >= next_video) {
+			_submit_video(&sim);
+			next_video = (int64_t)(sim.frames * NS_PER_SEC / sim.fps);
+		}
+
+		if (sim.audio && sim.now < end && sim.now >= sim.next_audio) {
+			_submit_audio(&sim);
+			sim.next_audio += AUDIO_INTERVAL_MS * NS_PER_MS;
+		}
+
+		if (sim.pacer_wake <= sim.now) {
+			_pace(&sim);
+		}
+
+		timers_due = sim.now + media_run_timers(sim.ftl, sim.now) * NS_PER_MS;
+
+		/*nobody reads the stats messages, keep the queue from filling up*/
+		while (ftl_ingest_get_status(&sim.handle, &status, 0) == FTL_SUCCESS) {
+		}
+
+		next = stop;
+
+		if (sim.now < end) {
+			_next(&next, next_video);
+
+			if (sim.audio) {
+				_next(&next, sim.next_audio);
+			}
+		}
+
+		_next(&next, sim.pacer_wake);
+		_next(&next, rx_due);
+		_next(&next, timers_due);
+
+		if (impair_next_due(&sim.up, sim.now) >= 0) {
+			_next(&next, sim.now + impair_next_due(&sim.up, sim.now));
+		}
+
+		if (impair_next_due(&sim.down, sim.now) >= 0) {
+			_next(&next, sim.now + impair_next_due(&sim.down, sim.now));
+		}
+
+		/*something still due now was handled above, never stand still*/
+		sim.now = next > sim.now ? next : sim.now + 1;
+	}
+
+	memset(&res, 0, sizeof(res));
+
+	for (i = 0; i < RECEIVER_MAX_STREAMS; i++) {
+		if ((st = sim.rx.streams[i]) != NULL) {
+			res.received += st->stats.packets - st->stats.duplicates;
+			res.recovered += st->stats.recovered;
+			res.lost += st->stats.lost;
+		}
+	}
+
+	sent_bytes = _sent(&sim, MEDIA_STAT_BYTES_SENT);
+	sent_packets = _sent(&sim, MEDIA_STAT_PACKETS_SENT);
+	res.lost_pct = res.received + res.lost > 0 ? 100.0 * res.lost / (res.received + res.lost) : 0;
+	res.resent_pct = sent_packets > 0 ? 100.0 * _sent(&sim, MEDIA_STAT_PACKETS_RESENT) / sent_packets : 0;
+	res.overhead_pct = sent_bytes > 0 ? 100.0 * (sim.up_bytes - sent_bytes) / sent_bytes : 0;
+
+	if (sim.json) {
+		_print_json(&sim, &res);
+	}
+	else {
+		_print_results(&sim, &res);
+	}
+
+	_stream_destroy(&sim);
+	receiver_destroy(&sim.rx);
+	impair_destroy(&sim.up);
+	impair_destroy(&sim.down);
+	free(sim.frame_buf);
+
+	if (sim.max_lost >= 0 && res.lost_pct > sim.max_lost) {
+		return 2;
+	}
+
+	if (sim.max_latency >= 0 && receiver_latency_percentile(&sim.frame_latency, 99) > sim.max_latency) {
+		return 2;
+	}
+
+	return 0;
+}
@@ -0,0 +1,619 @@
+/**
+ * context.c - Worker pool shared by many streams
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ **/
+
+#define __FTL_INTERNAL
+#include "ftl.h"
+#include "ftl_private.h"
+
+/*
+ * Streams created with a context don't get threads of their own. Each is owned by exactly one worker,
+ * which watches its sockets, runs its media timers and paces its video from a timer wheel. Ownership
+ * only changes under the context mutex: new streams go to the worker with the fewest streams, and a
+ * worker that stays busier than CONTEXT_OVERLOAD_PERCENT hands one of its streams to the least loaded
+ * worker.
+ */
+
+#ifdef _WIN32
+#define LOCK_MUTEX(mutex) WaitForSingleObject((mutex), INFINITE)
+#define UNLOCK_MUTEX(mutex) ReleaseMutex(mutex)
+static DWORD WINAPI context_worker_thread(LPVOID data);
+#else
+#define LOCK_MUTEX(mutex) pthread_mutex_lock(&(mutex))
+#define UNLOCK_MUTEX(mutex) pthread_mutex_unlock(&(mutex))
+static void *context_worker_thread(void *data);
+#endif
+
+static int64_t _context_now_ms(ftl_context_private_t *ctx);
+static void _worker_adopt(ftl_context_worker_t *worker, ftl_stream_configuration_private_t *ftl);
+static void _worker_release(ftl_context_worker_t *worker, ftl_stream_configuration_private_t *ftl);
+static void _worker_drop(ftl_context_worker_t *worker, ftl_stream_configuration_private_t *ftl);
+static void _worker_let_go(ftl_context_worker_t *worker, ftl_stream_configuration_private_t *ftl);
+static void _worker_service(ftl_context_worker_t *worker, ftl_stream_configuration_private_t *ftl, int64_t now_ms);
+static void _context_post_detached(ftl_stream_configuration_private_t *ftl);
+static void _worker_rebalance(ftl_context_worker_t *worker);
+static void _timer_arm(ftl_context_worker_t *worker, ftl_stream_configuration_private_t *ftl, int64_t due);
+static void _timer_cancel(ftl_context_worker_t *worker, ftl_stream_configuration_private_t *ftl);
+static int _timer_next_timeout(ftl_context_worker_t *worker, int64_t now_ms);
+
+FTL_API ftl_status_t ftl_context_create(ftl_context_t *context, ftl_context_params_t *params) {
+	ftl_context_private_t *ctx;
+	ftl_context_worker_t *worker;
+	ftl_allocator_t allocator;
+	int i, slot;
+
+	ftl_allocator_init(&allocator, params->allocator);
+
+	if ((ctx = (ftl_context_private_t *)ftl_alloc(&allocator, sizeof(ftl_context_private_t))) == NULL) {
+		return FTL_MALLOC_FAILURE;
+	}
+
+	ctx->allocator = allocator;
+	ftl_clock_init(&ctx->clock, params->clock, params->clock_data);
+
+	if (ftl_logger_init(&ctx->log, NULL, params->log_callback, params->log_callback_data, &allocator, FALSE, NULL) != FTL_SUCCESS) {
+		ftl_free(&allocator, ctx);
+		return FTL_MALLOC_FAILURE;
+	}
+
+	ctx->worker_count = params->worker_threads > 0 ? params->worker_threads : ftl_get_cpu_count();
+
+	if (params->thread_params != NULL) {
+		ctx->thread_params = *params->thread_params;
+	}
+	else {
+		memset(&ctx->thread_params, 0, sizeof(ctx->thread_params));
+	}
+
+	if ((ctx->workers = (ftl_context_worker_t *)ftl_calloc(&allocator, ctx->worker_count, sizeof(ftl_context_worker_t))) == NULL) {
+		ftl_logger_destroy(&ctx->log);
+		ftl_free(&allocator, ctx);
+		return FTL_MALLOC_FAILURE;
+	}
+
+#ifdef _WIN32
+	if ((ctx->mutex = CreateMutex(NULL, FALSE, NULL)) == NULL) {
+#else
+	if (pthread_mutex_init(&ctx->mutex, &ftl_default_mutexattr) != 0) {
+#endif
+		ftl_free(&allocator, ctx->workers);
+		ftl_logger_destroy(&ctx->log);
+		ftl_free(&allocator, ctx);
+		return FTL_MALLOC_FAILURE;
+	}
+
+	ctx->running = TRUE;
+
+	for (i = 0; i < ctx->worker_count; i++) {
+		worker = &ctx->workers[i];
+		worker->context = ctx;
+		worker->index = i;
+		worker->wheel_ms = _context_now_ms(ctx);
+		worker->load_window_start = ftl_monotonic_ns();
+
+		for (slot = 0; slot < TIMER_WHEEL_SLOTS; slot++) {
+			worker->wheel[slot] = NULL;
+		}
+
+		if ((worker->poller = ftl_poller_create(&ctx->allocator)) == NULL) {
+			FTL_LOG(ctx, FTL_LOG_ERROR, "Failed to create poller for context worker %d: %s\n", i, ftl_get_socket_error());
+			break;
+		}
+
+#ifdef _WIN32
+		if ((worker->thread_handle = CreateThread(NULL, 0, context_worker_thread, worker, 0, &worker->thread_id)) == NULL) {
+#else
+		if ((pthread_create(&worker->thread, NULL, context_worker_thread, worker)) != 0) {
+#endif
+			ftl_poller_destroy(worker->poller);
+			break;
+		}
+	}
+
+	context->priv = ctx;
+
+	if (i < ctx->worker_count) {
+		ctx->worker_count = i;
+		ftl_context_destroy(context);
+		return FTL_MALLOC_FAILURE;
+	}
+
+	FTL_LOG(ctx, FTL_LOG_INFO, "Created context with %d workers\n", ctx->worker_count);
+
+	return FTL_SUCCESS;
+}
+
+FTL_API ftl_status_t ftl_context_destroy(ftl_context_t *context) {
+	ftl_context_private_t *ctx = (ftl_context_private_t *)context->priv;
+	int i;
+
+	if (ctx == NULL) {
+		return FTL_SUCCESS;
+	}
+
+	ctx->running = FALSE;
+
+	for (i = 0; i < ctx->worker_count; i++) {
+		if (ctx->workers[i].handle_count > 0) {
+			FTL_LOG(ctx, FTL_LOG_ERROR, "Context worker %d still has %d streams, disconnect them before destroying the context\n", i, ctx->workers[i].handle_count);
+		}
+
+		ftl_poller_wake(ctx->workers[i].poller);
+	}
+
+	for (i = 0; i < ctx->worker_count; i++) {
+#ifdef _WIN32
+		WaitForSingleObject(ctx->workers[i].thread_handle, INFINITE);
+		CloseHandle(ctx->workers[i].thread_handle);
+#else
+		pthread_join(ctx->workers[i].thread, NULL);
+#endif
+		ftl_poller_destroy(ctx->workers[i].poller);
+	}
+
+#ifdef _WIN32
+	CloseHandle(ctx->mutex);
+#else
+	pthread_mutex_destroy(&ctx->mutex);
+#endif
+
+	ftl_logger_destroy(&ctx->log);
+	ftl_free(&ctx->allocator, ctx->workers);
+	ftl_free(&ctx->allocator, ctx);
+	context->priv = NULL;
+
+	return FTL_SUCCESS;
+}
+
+/*hands a connected stream to the worker with the fewest streams*/
+ftl_status_t context_attach(ftl_stream_configuration_private_t *ftl) {
+	ftl_context_private_t *ctx = ftl->context;
+	ftl_event_loop_t *loop = &ftl->event_loop;
+	ftl_context_worker_t *worker;
+	int i;
+
+#ifdef _WIN32
+	if ((loop->detached = CreateSemaphore(NULL, 0, 1, NULL)) == NULL) {
+#else
+	if (sem_init(&loop->detached, 0 /* pshared */, 0 /* value */)) {
+#endif
+		return FTL_MALLOC_FAILURE;
+	}
+
+	loop->kicked = FALSE;
+	loop->detach_pending = FALSE;
+	loop->timer_due = -1;
+
+	LOCK_MUTEX(ctx->mutex);
+
+	worker = &ctx->workers[0];
+	for (i = 1; i < ctx->worker_count; i++) {
+		if (ctx->workers[i].handle_count < worker->handle_count) {
+			worker = &ctx->workers[i];
+		}
+	}
+
+	loop->worker = worker;
+	loop->next_handle = worker->inbox;
+	worker->inbox = ftl;
+	worker->handle_count++;
+	loop->started = TRUE;
+
+	UNLOCK_MUTEX(ctx->mutex);
+
+	ftl_poller_wake(worker->poller);
+
+	return FTL_SUCCESS;
+}
+
+/*waits until the owning worker has let go of the stream, returns straight away if it already has*/
+void context_detach(ftl_stream_configuration_private_t *ftl) {
+	ftl_context_private_t *ctx = ftl->context;
+	ftl_event_loop_t *loop = &ftl->event_loop;
+	ftl_context_worker_t *worker;
+
+	if (!loop->started) {
+		return;
+	}
+
+	LOCK_MUTEX(ctx->mutex);
+
+	loop->detach_pending = TRUE;
+	worker = loop->worker;
+
+	UNLOCK_MUTEX(ctx->mutex);
+
+	if (worker != NULL) {
+		ftl_poller_wake(worker->poller);
+#ifdef _WIN32
+		WaitForSingleObject(loop->detached, INFINITE);
+#else
+		sem_wait(&loop->detached);
+#endif
+	}
+
+#ifdef _WIN32
+	CloseHandle(loop->detached);
+#else
+	sem_destroy(&loop->detached);
+#endif
+
+	loop->started = FALSE;
+}
+
+/*called by the producer after queuing video so the owning worker starts pacing it*/
+void context_kick(ftl_stream_configuration_private_t *ftl) {
+	ftl_context_private_t *ctx = ftl->context;
+	ftl_context_worker_t *worker;
+
+	LOCK_MUTEX(ctx->mutex);
+
+	ftl->event_loop.kicked = TRUE;
+	worker = ftl->event_loop.worker;
+
+	UNLOCK_MUTEX(ctx->mutex);
+
+	if (worker != NULL) {
+		ftl_poller_wake(worker->poller);
+	}
+}
+
+static int64_t _context_now_ms(ftl_context_private_t *ctx) {
+	return ftl_clock_now(&ctx->clock) / NS_PER_MS;
+}
+
+/*takes ownership of a stream from the inbox, called with the context mutex held*/
+static void _worker_adopt(ftl_context_worker_t *worker, ftl_stream_configuration_private_t *ftl) {
+	ftl_event_loop_t *loop = &ftl->event_loop;
+
+	loop->poller = worker->poller;
+	loop->running = TRUE;
+
+	if (ftl_poller_add(worker->poller, loop->control_watch.sock, &loop->control_watch) != 0 ||
+		ftl_poller_add(worker->poller, loop->media_watch.sock, &loop->media_watch) != 0) {
+		FTL_LOG(ftl, FTL_LOG_ERROR, "Failed to add stream sockets to context worker %d: %s\n", worker->index, ftl_get_socket_error());
+	}
+
+	loop->prev_handle = NULL;
+	loop->next_handle = worker->handles;
+	if (worker->handles != NULL) {
+		worker->handles->event_loop.prev_handle = ftl;
+	}
+	worker->handles = ftl;
+
+	/*service it on this pass, it may have media queued from before the hand over*/
+	loop->kicked = TRUE;
+}
+
+/*stops watching a stream, called with the context mutex held*/
+static void _worker_release(ftl_context_worker_t *worker, ftl_stream_configuration_private_t *ftl) {
+	ftl_event_loop_t *loop = &ftl->event_loop;
+
+	if (loop->running) {
+		ftl_poller_remove(worker->poller, loop->control_watch.sock);
+		ftl_poller_remove(worker->poller, loop->media_watch.sock);
+	}
+
+	_timer_cancel(worker, ftl);
+
+	if (loop->prev_handle != NULL) {
+		loop->prev_handle->event_loop.next_handle = loop->next_handle;
+	}
+	else {
+		worker->handles = loop->next_handle;
+	}
+
+	if (loop->next_handle != NULL) {
+		loop->next_handle->event_loop.prev_handle = loop->prev_handle;
+	}
+
+	loop->running = FALSE;
+	worker->handle_count--;
+}
+
+/*the connection is gone, tear the stream down here since nobody else is watching it*/
+static void _worker_drop(ftl_context_worker_t *worker, ftl_stream_configuration_private_t *ftl) {
+	LOCK_MUTEX(worker->context->mutex);
+	_worker_release(worker, ftl);
+	UNLOCK_MUTEX(worker->context->mutex);
+
+	if (ftl->connected) {
+		event_loop_connection_lost(ftl);
+	}
+
+	/*the disconnect has to go out before the stream is let go*/
+	deliver_status_msgs(ftl);
+}
+
+/*after this the stream may be freed by a disconnect waiting in context_detach*/
+static void _worker_let_go(ftl_context_worker_t *worker, ftl_stream_configuration_private_t *ftl) {
+	LOCK_MUTEX(worker->context->mutex);
+
+	ftl->event_loop.worker = NULL;
+	if (ftl->event_loop.detach_pending) {
+		_context_post_detached(ftl);
+	}
+
+	UNLOCK_MUTEX(worker->context->mutex);
+}
+
+static void _context_post_detached(ftl_stream_configuration_private_t *ftl) {
+#ifdef _WIN32
+	ReleaseSemaphore(ftl->event_loop.detached, 1, NULL);
+#else
+	sem_post(&ftl->event_loop.detached);
+#endif
+}
+
+static void _worker_service(ftl_context_worker_t *worker, ftl_stream_configuration_private_t *ftl, int64_t now_ms) {
+	int64_t now;
+	int next_ms, pace_ms;
+
+	if (!ftl->event_loop.running) {
+		return;
+	}
+
+	now = ftl_clock_now(&ftl->clock);
+
+	next_ms = media_run_timers(ftl, now);
+
+	if ((pace_ms = media_pace(ftl, now)) >= 0 && pace_ms < next_ms) {
+		next_ms = pace_ms;
+	}
+
+	deliver_status_msgs(ftl);
+
+	/*never the slot being expired, the wheel has already moved past it*/
+	_timer_arm(worker, ftl, now_ms + (next_ms > 0 ? next_ms : 1));
+}
+
+/*
+ * Every CONTEXT_REBALANCE_INTERVAL_MS each worker publishes how busy it was. One that stays overloaded
+ * while another has less than half its load moves a stream over; that worker picks it up from its inbox
+ * on the next wake up. Load is real work, so it is timed on the os clock even when the context has a
+ * virtual one.
+ */
+static void _worker_rebalance(ftl_context_worker_t *worker) {
+	ftl_context_private_t *ctx = worker->context;
+	ftl_context_worker_t *target;
+	ftl_stream_configuration_private_t *ftl;
+	int64_t now = ftl_monotonic_ns();
+	int64_t elapsed_ms = (now - worker->load_window_start) / NS_PER_MS;
+	int i;
+
+	if (elapsed_ms < CONTEXT_REBALANCE_INTERVAL_MS) {
+		return;
+	}
+
+	/*other workers read load under the mutex when they look for a target*/
+	LOCK_MUTEX(ctx->mutex);
+
+	worker->load = (int)(worker->busy_ns / 10000 / elapsed_ms);
+	worker->busy_ns = 0;
+	worker->load_window_start = now;
+
+	if (worker->load < CONTEXT_OVERLOAD_PERCENT || ctx->worker_count < 2) {
+		UNLOCK_MUTEX(ctx->mutex);
+		return;
+	}
+
+	target = worker;
+	for (i = 0; i < ctx->worker_count; i++) {
+		if (ctx->workers[i].load < target->load) {
+			target = &ctx->workers[i];
+		}
+	}
+
+	for (ftl = worker->handles; ftl != NULL && ftl->event_loop.detach_pending; ftl = ftl->event_loop.next_handle);
+
+	if (target != worker && target->load * 2 < worker->load && ftl != NULL && ftl->event_loop.next_handle != NULL) {
+		_worker_release(worker, ftl);
+
+		ftl->event_loop.worker = target;
+		ftl->event_loop.next_handle = target->inbox;
+		target->inbox = ftl;
+		target->handle_count++;
+
+		FTL_LOG(worker->context, FTL_LOG_INFO, "Context worker %d is %d%% busy, moved a stream to worker %d (%d%% busy)\n", worker->index, worker->load, target->index, target->load);
+
+		ftl_poller_wake(target->poller);
+	}
+
+	UNLOCK_MUTEX(ctx->mutex);
+}
+
+#ifdef _WIN32
+static DWORD WINAPI context_worker_thread(LPVOID data)
+#else
+static void *context_worker_thread(void *data)
+#endif
+{
+	ftl_context_worker_t *worker = (ftl_context_worker_t *)data;
+	ftl_context_private_t *ctx = worker->context;
+	ftl_stream_configuration_private_t *ftl, *next;
+	ftl_stream_configuration_private_t *dead[MAX_POLL_EVENTS];
+	ftl_io_watch_t *watch;
+	void *ready[MAX_POLL_EVENTS];
+	int64_t now_ms, work_start;
+	int count, dead_count, i, timeout;
+	char name[16];
+
+	snprintf(name, sizeof(name), "ftl-worker-%d", worker->index);
+	ftl_thread_setup(&ctx->log, name, &ctx->thread_params, TRUE);
+
+	while (ctx->running) {
+		work_start = ftl_monotonic_ns();
+		now_ms = _context_now_ms(ctx);
+
+		/*new streams, detach requests and freshly queued media*/
+		LOCK_MUTEX(ctx->mutex);
+
+		while ((ftl = worker->inbox) != NULL) {
+			worker->inbox = ftl->event_loop.next_handle;
+			_worker_adopt(worker, ftl);
+		}
+
+		for (ftl = worker->handles; ftl != NULL; ftl = next) {
+			next = ftl->event_loop.next_handle;
+
+			if (ftl->event_loop.detach_pending) {
+				_worker_release(worker, ftl);
+				ftl->event_loop.worker = NULL;
+				_context_post_detached(ftl);
+			}
+			else if (ftl->event_loop.kicked || ftl->media.ingest_unreachable || ftl_atomic_load(&ftl->migration.state) == MIGRATION_SWITCHED) {
+				ftl->event_loop.kicked = FALSE;
+				_timer_arm(worker, ftl, now_ms);
+			}
+		}
+
+		UNLOCK_MUTEX(ctx->mutex);
+
+		/*run the timer wheel up to now*/
+		while (worker->wheel_ms <= now_ms) {
+			int slot = (int)(worker->wheel_ms % TIMER_WHEEL_SLOTS);
+
+			for (ftl = worker->wheel[slot]; ftl != NULL; ftl = next) {
+				next = ftl->event_loop.next_timer;
+
+				if (ftl->event_loop.timer_due <= now_ms) {
+					_timer_cancel(worker, ftl);
+					_worker_service(worker, ftl, now_ms);
+
+					if (ftl->media.ingest_unreachable) {
+						_worker_drop(worker, ftl);
+						_worker_let_go(worker, ftl);
+					}
+				}
+			}
+
+			/*after a long stall every slot has been visited once, no need to go round again*/
+			worker->wheel_ms = now_ms - worker->wheel_ms >= TIMER_WHEEL_SLOTS ? now_ms - TIMER_WHEEL_SLOTS + 1 : worker->wheel_ms + 1;
+		}
+
+		worker->busy_ns += ftl_monotonic_ns() - work_start;
+
+		_worker_rebalance(worker);
+
+		timeout = _timer_next_timeout(worker, _context_now_ms(ctx));
+
+		if ((count = ftl_poller_wait(worker->poller, ready, MAX_POLL_EVENTS, timeout)) < 0) {
+			FTL_LOG(ctx, FTL_LOG_ERROR, "Context worker %d wait failed: %s\n", worker->index, ftl_get_socket_error());
+			sleep_ms(10);
+			continue;
+		}
+
+		work_start = ftl_monotonic_ns();
+		dead_count = 0;
+
+		for (i = 0; i < count; i++) {
+			watch = (ftl_io_watch_t *)ready[i];
+			ftl = watch->ftl;
+
+			/*an earlier event in this batch may have torn the stream down*/
+			if (!ftl->event_loop.running) {
+				continue;
+			}
+
+			if (!watch->ready(ftl) || ftl->media.ingest_unreachable) {
+				_worker_drop(worker, ftl);
+				dead[dead_count++] = ftl;
+			}
+		}
+
+		/*only let go once the batch is done, a later event may still point at the stream*/
+		for (i = 0; i < dead_count; i++) {
+			_worker_let_go(worker, dead[i]);
+		}
+
+		worker->busy_ns += ftl_monotonic_ns() - work_start;
+	}
+
+	FTL_LOG(ctx, FTL_LOG_INFO, "Exited context worker %d\n", worker->index);
+
+	return 0;
+}
+
+/*
+ * Hashed timer wheel with 1ms slots, each stream is on it at most once. Streams due more than
+ * TIMER_WHEEL_SLOTS ms out share a slot with nearer ones and are skipped until their time comes round.
+ */
+static void _timer_arm(ftl_context_worker_t *worker, ftl_stream_configuration_private_t *ftl, int64_t due) {
+	ftl_event_loop_t *loop = &ftl->event_loop;
+	int slot;
+
+	if (loop->timer_due >= 0) {
+		if (loop->timer_due <= due) {
+			return;
+		}
+
+		_timer_cancel(worker, ftl);
+	}
+
+	/*anything already due goes in the slot the wheel will visit next*/
+	if (due < worker->wheel_ms) {
+		due = worker->wheel_ms;
+	}
+
+	slot = (int)(due % TIMER_WHEEL_SLOTS);
+
+	loop->timer_due = due;
+	loop->prev_timer = NULL;
+	loop->next_timer = worker->wheel[slot];
+	if (worker->wheel[slot] != NULL) {
+		worker->wheel[slot]->event_loop.prev_timer = ftl;
+	}
+	worker->wheel[slot] = ftl;
+}
+
+static void _timer_cancel(ftl_context_worker_t *worker, ftl_stream_configuration_private_t *ftl) {
+	ftl_event_loop_t *loop = &ftl->event_loop;
+
+	if (loop->timer_due < 0) {
+		return;
+	}
+
+	if (loop->prev_timer != NULL) {
+		loop->prev_timer->event_loop.next_timer = loop->next_timer;
+	}
+	else {
+		worker->wheel[loop->timer_due % TIMER_WHEEL_SLOTS] = loop->next_timer;
+	}
+
+	if (loop->next_timer != NULL) {
+		loop->next_timer->event_loop.prev_timer = loop->prev_timer;
+	}
+
+	loop->timer_due = -1;
+}
+
+/*ms until the first occupied slot, a full turn of the wheel if there is none*/
+static int _timer_next_timeout(ftl_context_worker_t *worker, int64_t now_ms) {
+	int64_t ms;
+
+	for (ms = worker->wheel_ms; ms < worker->wheel_ms + TIMER_WHEEL_SLOTS; ms++) {
+		if (worker->wheel[ms % TIMER_WHEEL_SLOTS] != NULL) {
+			return ms > now_ms ? (int)(ms - now_ms) : 0;
+		}
+	}
+
+	return TIMER_WHEEL_SLOTS;
+}
@@ -0,0 +1,214 @@
+/**
+ * event_loop.c - Per stream I/O loop
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ **/
+
+#define __FTL_INTERNAL
+#include "ftl.h"
+#include "ftl_private.h"
+
+#ifdef _WIN32
+static DWORD WINAPI event_loop_thread(LPVOID data);
+#else
+static void *event_loop_thread(void *data);
+#endif
+
+/*
+ * One thread per stream waits on both the control connection and the media socket (epoll on linux) and
+ * runs the media timers in between, so a closed control connection or an icmp unreachable is acted on
+ * as soon as the kernel reports it.
+ */
+ftl_status_t event_loop_start(ftl_stream_configuration_private_t *ftl) {
+	ftl_event_loop_t *loop = &ftl->event_loop;
+
+	loop->control_watch.sock = ftl->ingest_socket;
+	loop->control_watch.ready = _ingest_control_ready;
+	loop->control_watch.ftl = ftl;
+	loop->media_watch.sock = media_get_recv_socket(ftl);
+	loop->media_watch.ready = media_recv;
+	loop->media_watch.ftl = ftl;
+
+	if (ftl->context != NULL) {
+		return context_attach(ftl);
+	}
+
+	if ((loop->poller = ftl_poller_create(&ftl->allocator)) == NULL) {
+		FTL_LOG(ftl, FTL_LOG_ERROR, "Failed to create event loop poller: %s\n", ftl_get_socket_error());
+		return FTL_MALLOC_FAILURE;
+	}
+
+	if (ftl_poller_add(loop->poller, loop->control_watch.sock, &loop->control_watch) != 0 ||
+		ftl_poller_add(loop->poller, loop->media_watch.sock, &loop->media_watch) != 0) {
+		FTL_LOG(ftl, FTL_LOG_ERROR, "Failed to add sockets to the event loop: %s\n", ftl_get_socket_error());
+		ftl_poller_destroy(loop->poller);
+		return FTL_INTERNAL_ERROR;
+	}
+
+	loop->running = TRUE;
+#ifdef _WIN32
+	if ((loop->thread_handle = CreateThread(NULL, 0, event_loop_thread, ftl, 0, &loop->thread_id)) == NULL) {
+#else
+	if ((pthread_create(&loop->thread, NULL, event_loop_thread, ftl)) != 0) {
+#endif
+		loop->running = FALSE;
+		ftl_poller_destroy(loop->poller);
+		return FTL_MALLOC_FAILURE;
+	}
+
+	loop->started = TRUE;
+
+	return FTL_SUCCESS;
+}
+
+/*must not be called from the event loop itself*/
+void event_loop_stop(ftl_stream_configuration_private_t *ftl) {
+	ftl_event_loop_t *loop = &ftl->event_loop;
+
+	if (ftl->context != NULL) {
+		context_detach(ftl);
+		return;
+	}
+
+	if (!loop->started) {
+		return;
+	}
+
+	loop->running = FALSE;
+	ftl_poller_wake(loop->poller);
+
+#ifdef _WIN32
+	WaitForSingleObject(loop->thread_handle, INFINITE);
+	CloseHandle(loop->thread_handle);
+#else
+	pthread_join(loop->thread, NULL);
+#endif
+
+	ftl_poller_destroy(loop->poller);
+	loop->started = FALSE;
+}
+
+void event_loop_wake(ftl_stream_configuration_private_t *ftl) {
+	if (ftl->event_loop.running) {
+		ftl_poller_wake(ftl->event_loop.poller);
+	}
+}
+
+/*something was queued for the status callback, have the loop deliver it*/
+void event_loop_notify(ftl_stream_configuration_private_t *ftl) {
+	if (ftl->context != NULL) {
+		context_kick(ftl);
+	}
+	else {
+		event_loop_wake(ftl);
+	}
+}
+
+/*a migration moved the stream, called on the loop's own thread or once it has stopped*/
+void event_loop_replace_sockets(ftl_stream_configuration_private_t *ftl, SOCKET control_sock, SOCKET media_sock) {
+	ftl_event_loop_t *loop = &ftl->event_loop;
+
+	if (loop->running) {
+		ftl_poller_remove(loop->poller, loop->control_watch.sock);
+		ftl_poller_remove(loop->poller, loop->media_watch.sock);
+	}
+
+	loop->control_watch.sock = control_sock;
+	loop->media_watch.sock = media_sock;
+
+	if (loop->running && (ftl_poller_add(loop->poller, control_sock, &loop->control_watch) != 0 ||
+		ftl_poller_add(loop->poller, media_sock, &loop->media_watch) != 0)) {
+		FTL_LOG(ftl, FTL_LOG_ERROR, "Failed to add sockets to the event loop: %s\n", ftl_get_socket_error());
+	}
+}
+
+void event_loop_connection_lost(ftl_stream_configuration_private_t *ftl) {
+	ftl_status_event_reasons_t reason = ftl->media.ingest_unreachable ? FTL_STATUS_EVENT_REASON_MEDIA_UNREACHABLE : FTL_STATUS_EVENT_REASON_UNKNOWN;
+	ftl_status_t status_code;
+	ftl_status_msg_t status;
+
+	ftl->connected = 0;
+	ftl->ready_for_media = 0;
+
+	/*a migration that switched has the live session, one that didn't dies with the stream*/
+	_ingest_migration_settle(ftl);
+
+	ftl_poller_remove(ftl->event_loop.poller, ftl->event_loop.control_watch.sock);
+	ftl_poller_remove(ftl->event_loop.poller, ftl->event_loop.media_watch.sock);
+
+	if ((status_code = _ingest_disconnect(ftl)) != FTL_SUCCESS) {
+		FTL_LOG(ftl, FTL_LOG_ERROR, "Disconnect failed with error %d\n", status_code);
+	}
+
+	/*ingests come back quickly, leave media as it is for ftl_ingest_connect to resume or ftl_ingest_disconnect to free*/
+	ftl->media.suspended = TRUE;
+
+	status.type = FTL_STATUS_EVENT;
+	status.msg.event.reason = reason;
+	status.msg.event.type = FTL_STATUS_EVENT_TYPE_DISCONNECTED;
+
+	enqueue_status_msg(ftl, &status);
+}
+
+#ifdef _WIN32
+static DWORD WINAPI event_loop_thread(LPVOID data)
+#else
+static void *event_loop_thread(void *data)
+#endif
+{
+	ftl_stream_configuration_private_t *ftl = (ftl_stream_configuration_private_t *)data;
+	ftl_event_loop_t *loop = &ftl->event_loop;
+	void *ready[MAX_POLL_EVENTS];
+	ftl_io_watch_t *watch;
+	int ms_timeout, count, i;
+	BOOL alive = TRUE;
+
+	ftl_thread_setup(&ftl->log, "ftl-event-loop", &ftl->thread_params, TRUE);
+
+	while (loop->running && alive) {
+		ms_timeout = media_run_timers(ftl, ftl_clock_now(&ftl->clock));
+		deliver_status_msgs(ftl);
+
+		if ((count = ftl_poller_wait(loop->poller, ready, MAX_POLL_EVENTS, ms_timeout)) < 0) {
+			FTL_LOG(ftl, FTL_LOG_ERROR, "Event loop wait failed: %s\n", ftl_get_socket_error());
+			sleep_ms(10);
+			continue;
+		}
+
+		for (i = 0; i < count && alive; i++) {
+			watch = (ftl_io_watch_t *)ready[i];
+			alive = watch->ready(watch->ftl);
+		}
+
+		/*the send thread reports an unreachable ingest by waking us*/
+		alive = alive && !ftl->media.ingest_unreachable;
+	}
+
+	if (!alive && loop->running && ftl->connected) {
+		event_loop_connection_lost(ftl);
+	}
+
+	deliver_status_msgs(ftl);
+
+	loop->running = FALSE;
+
+	FTL_LOG(ftl, FTL_LOG_INFO, "Exited Event Loop\n");
+
+	return 0;
+}
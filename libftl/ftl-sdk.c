@@ -4,10 +4,13 @@
 #include "ftl_private.h"
 
 static BOOL _get_chan_id_and_key(const char *stream_key, uint32_t *chan_id, char *key);
-static int _lookup_ingest_ip(const char *ingest_location, char *ingest_ip);
-void ftl_register_log_handler(ftl_logging_function_t log_func);
+static int _lookup_ingest_ip(ftl_stream_configuration_private_t *ftl, const char *ingest_location);
+static void _prefer_ingest_ip(ftl_stream_configuration_private_t *ftl, struct sockaddr_storage *addr, socklen_t addrlen);
+
+#ifndef _WIN32
+pthread_mutexattr_t ftl_default_mutexattr;
+#endif
 
-char error_message[1000];
 FTL_API const int FTL_VERSION_MAJOR = 0;
 FTL_API const int FTL_VERSION_MINOR = 2;
 FTL_API const int FTL_VERSION_MAINTENANCE = 3;
@@ -15,7 +18,6 @@ FTL_API const int FTL_VERSION_MAINTENANCE = 3;
 // Initializes all sublibraries used by FTL
 FTL_API ftl_status_t ftl_init() {
   ftl_init_sockets();
-  ftl_logging_init();
 #ifndef _WIN32
   pthread_mutexattr_init(&ftl_default_mutexattr);
   // Set pthread mutexes to recursive to mirror Windows mutex behavior
@@ -27,18 +29,61 @@ FTL_API ftl_status_t ftl_init() {
 FTL_API ftl_status_t ftl_ingest_create(ftl_handle_t *ftl_handle, ftl_ingest_params_t *params){
   ftl_status_t ret_status = FTL_SUCCESS;
 	ftl_stream_configuration_private_t *ftl = NULL;
+  ftl_allocator_t allocator;
+
+  ftl_allocator_init(&allocator, params->allocator);
 
-  if( (ftl = (ftl_stream_configuration_private_t *)malloc(sizeof(ftl_stream_configuration_private_t))) == NULL){
+  if( (ftl = (ftl_stream_configuration_private_t *)ftl_alloc(&allocator, sizeof(ftl_stream_configuration_private_t))) == NULL){
     ret_status = FTL_MALLOC_FAILURE;
 		goto fail;
   }
 
+  ftl->allocator = allocator;
+
+  if (ftl_logger_init(&ftl->log, params->log_func, params->log_callback, params->log_callback_data, &allocator, params->async_logging ? TRUE : FALSE, params->thread_params) != FTL_SUCCESS) {
+    ftl_free(&allocator, ftl);
+    ftl = NULL;
+    ret_status = FTL_MALLOC_FAILURE;
+    goto fail;
+  }
+
   ftl->connected = 0;
   ftl->ready_for_media = 0;
+  ftl->ingest_socket = INVALID_SOCKET;
+  ftl->event_loop.started = FALSE;
+  ftl->event_loop.running = FALSE;
+  ftl->media.ingest_unreachable = FALSE;
+  ftl->media.suspended = FALSE;
+  ftl->migration.state = MIGRATION_NONE;
+  ftl->migration.session.sock = INVALID_SOCKET;
+  ftl->migration.media_socket = INVALID_SOCKET;
+  ftl->migration.uring = NULL;
   ftl->video_kbps = params->video_kbps;
+  ftl->socket_send_buf = params->socket_send_buf;
+  ftl->socket_recv_buf = params->socket_recv_buf;
+  ftl->kernel_pacing = params->kernel_pacing ? TRUE : FALSE;
+  ftl->io_uring = params->io_uring ? TRUE : FALSE;
+  ftl->stats_seq = 0;
+  memset(&ftl->stats_snapshot, 0, sizeof(ftl->stats_snapshot));
+
+  if (params->thread_params != NULL) {
+    ftl->thread_params = *params->thread_params;
+  }
+  else {
+    memset(&ftl->thread_params, 0, sizeof(ftl->thread_params));
+  }
+  ftl->context = params->context != NULL ? (ftl_context_private_t *)params->context->priv : NULL;
+
+  /*a worker services all of its streams off one clock*/
+  if (ftl->context != NULL) {
+    ftl->clock = ftl->context->clock;
+  }
+  else {
+    ftl_clock_init(&ftl->clock, params->clock, params->clock_data);
+  }
 
   ftl->key = NULL;
-  if( (ftl->key = (char*)malloc(sizeof(char)*MAX_KEY_LEN)) == NULL){
+  if( (ftl->key = (char*)ftl_alloc(&ftl->allocator, sizeof(char)*MAX_KEY_LEN)) == NULL){
     ret_status = FTL_MALLOC_FAILURE;
 		goto fail;
   }
@@ -49,7 +94,7 @@ FTL_API ftl_status_t ftl_ingest_create(ftl_handle_t *ftl_handle, ftl_ingest_para
   }
 
 /*because some of our ingests are behind revolving dns' we need to store the ip to ensure it doesnt change for handshake and media*/
-  if ( _lookup_ingest_ip(params->ingest_hostname, ftl->ingest_ip) == FALSE) {
+  if ( _lookup_ingest_ip(ftl, params->ingest_hostname) == FALSE) {
     ret_status = FTL_DNS_FAILURE;
 		goto fail;
   }
@@ -65,31 +110,37 @@ FTL_API ftl_status_t ftl_ingest_create(ftl_handle_t *ftl_handle, ftl_ingest_para
   ftl->video.media_component.ssrc = ftl->channel_id + 1;
 
   ftl->video.frame_rate = params->video_frame_rate;
+  ftl->video.sps_len = 0;
+  ftl->video.pps_len = 0;
+  ftl->video.resend_param_sets = FALSE;
   ftl->video.width = 1280;
   ftl->video.height = 720;
 
+  ftl->status_callback = params->status_callback;
+  ftl->status_callback_data = params->status_callback_data;
+  ftl->status_callback_batch = params->status_callback_batch;
+  if (ftl->status_callback_batch < 1) {
+    ftl->status_callback_batch = 1;
+  }
+  else if (ftl->status_callback_batch > STATUS_QUEUE_SIZE) {
+    ftl->status_callback_batch = STATUS_QUEUE_SIZE;
+  }
 
-  ftl_register_log_handler(params->log_func);
-
-  ftl->status_q.count = 0;
-  ftl->status_q.head = NULL;
-
-#ifdef _WIN32
-  if ((ftl->status_q.mutex = CreateMutex(NULL, FALSE, NULL)) == NULL) {
-#else
-  if (pthread_mutex_init(&ftl->status_q.mutex, &ftl_default_mutexattr) != 0) {
-#endif
-	  FTL_LOG(FTL_LOG_ERROR, "Failed to create status queue mutex\n");
-	  return FTL_MALLOC_FAILURE;
+  if (status_queue_init(&ftl->status_q, ftl->status_callback != NULL) != FTL_SUCCESS) {
+	  FTL_LOG(ftl, FTL_LOG_ERROR, "Failed to allocate create status queue semaphore\n");
+	  ret_status = FTL_MALLOC_FAILURE;
+	  goto fail;
   }
 
 #ifdef _WIN32
-  if ((ftl->status_q.sem = CreateSemaphore(NULL, 0, MAX_STATUS_MESSAGE_QUEUED, NULL)) == NULL) {
+  if ((ftl->migration.retired = CreateSemaphore(NULL, 0, 1000000, NULL)) == NULL) {
 #else
-  if (sem_init(&ftl->status_q.sem, 0 /* pshared */, 0 /* value */)) {
+  if (sem_init(&ftl->migration.retired, 0 /* pshared */, 0 /* value */)) {
 #endif
-	  FTL_LOG(FTL_LOG_ERROR, "Failed to allocate create status queue semaphore\n");
-	  return FTL_MALLOC_FAILURE;
+	  FTL_LOG(ftl, FTL_LOG_ERROR, "Failed to create the migration semaphore\n");
+	  status_queue_destroy(&ftl->status_q);
+	  ret_status = FTL_MALLOC_FAILURE;
+	  goto fail;
   }
 
   ftl_handle->priv = ftl;
@@ -99,10 +150,11 @@ fail:
 
 	if(ftl != NULL) {
 		if (ftl->key != NULL) {
-			free(ftl->key);
+			ftl_free(&ftl->allocator, ftl->key);
 		}
 
-		free(ftl);
+		ftl_logger_destroy(&ftl->log);
+		ftl_free(&ftl->allocator, ftl);
 	}
 
 	return ret_status;	
@@ -110,13 +162,45 @@ fail:
 
 FTL_API ftl_status_t ftl_ingest_connect(ftl_handle_t *ftl_handle){
 	ftl_stream_configuration_private_t *ftl = (ftl_stream_configuration_private_t *)ftl_handle->priv;
+  ftl_connect_stats_t *timings = &ftl->connect_stats;
   ftl_status_t status = FTL_SUCCESS;
+  BOOL resumed = FALSE;
+  int64_t start, media_start;
+
+  /*real time even with a virtual clock, this waits on the network*/
+  start = ftl_monotonic_ns();
+
+  /*the loop that saw the connection go has finished, let go of it before starting another*/
+  if (ftl->media.suspended) {
+	  event_loop_stop(ftl);
+	  _ingest_migration_settle(ftl);
+  }
 
   if ((status = _ingest_connect(ftl)) != FTL_SUCCESS) {
 	  return status;
   }
 
-  if ((status = media_init(ftl)) != FTL_SUCCESS) {
+  media_start = ftl_monotonic_ns();
+
+  if (ftl->media.suspended) {
+	  if ((resumed = (media_resume(ftl) == FTL_SUCCESS)) == FALSE) {
+		  FTL_LOG(ftl, FTL_LOG_INFO, "Could not resume media, setting it up again\n");
+		  media_destroy(ftl);
+	  }
+  }
+
+  if (!resumed && (status = media_init(ftl)) != FTL_SUCCESS) {
+	  return status;
+  }
+
+  timings->media_setup_us = (int)((ftl_monotonic_ns() - media_start) / NS_PER_US);
+  timings->total_us = (int)((ftl_monotonic_ns() - start) / NS_PER_US);
+  stats_connected(ftl);
+
+  FTL_LOG(ftl, FTL_LOG_INFO, "%s in %d us (tcp %d, hmac %d, auth %d, metadata %d, media %d)\n", resumed ? "Resumed" : "Connected", timings->total_us,
+    timings->tcp_connect_us, timings->hmac_us, timings->auth_us, timings->metadata_us, timings->media_setup_us);
+
+  if ((status = event_loop_start(ftl)) != FTL_SUCCESS) {
 	  return status;
   }
 
@@ -132,35 +216,151 @@ FTL_API ftl_status_t ftl_ingest_get_status(ftl_handle_t *ftl_handle, ftl_status_
 	return dequeue_status_msg(ftl, msg, ms_timeout);
 }
 
-FTL_API ftl_status_t ftl_ingest_update_hostname(ftl_handle_t *ftl_handle, const char *ingest_hostname) {
+FTL_API ftl_status_t ftl_ingest_get_stats(ftl_handle_t *ftl_handle, ftl_stats_t *stats) {
+	ftl_stream_configuration_private_t *ftl = (ftl_stream_configuration_private_t *)ftl_handle->priv;
+
+	stats_get_snapshot(ftl, stats);
 
 	return FTL_SUCCESS;
 }
 
-FTL_API ftl_status_t ftl_ingest_update_stream_key(ftl_handle_t *ftl_handle, const char *stream_key) {
+FTL_API ftl_status_t ftl_ingest_set_log_level(ftl_handle_t *ftl_handle, ftl_log_severity_t level) {
+	ftl_stream_configuration_private_t *ftl = (ftl_stream_configuration_private_t *)ftl_handle->priv;
+
+	ftl_atomic_store(&ftl->log.level, level);
+
 	return FTL_SUCCESS;
 }
 
+FTL_API ftl_status_t ftl_ingest_select(ftl_handle_t *ftl_handle, const char **ingest_hostnames, int count, int *selected) {
+	ftl_stream_configuration_private_t *ftl = (ftl_stream_configuration_private_t *)ftl_handle->priv;
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	ftl_status_t status;
+	int best;
+
+	if (ftl->connected) {
+		return FTL_ALREADY_CONNECTED;
+	}
+
+	if (ingest_hostnames == NULL || count < 1 || count > MAX_INGEST_PROBES) {
+		return FTL_CONFIG_ERROR;
+	}
+
+	status = _ingest_probe(ftl, ingest_hostnames, count, &best, &addr, &addrlen);
+
+	/*the event loop isn't running, nobody else will deliver them*/
+	deliver_status_msgs(ftl);
+
+	if (status != FTL_SUCCESS) {
+		return status;
+	}
+
+	if (_lookup_ingest_ip(ftl, ingest_hostnames[best]) == FALSE) {
+		return FTL_DNS_FAILURE;
+	}
+
+	/*connect to the node that was measured, even if the name is behind revolving dns*/
+	_prefer_ingest_ip(ftl, &addr, addrlen);
+
+	if (selected != NULL) {
+		*selected = best;
+	}
+
+	return FTL_SUCCESS;
+}
+
+FTL_API ftl_status_t ftl_ingest_update_hostname(ftl_handle_t *ftl_handle, const char *ingest_hostname) {
+	ftl_stream_configuration_private_t *ftl = (ftl_stream_configuration_private_t *)ftl_handle->priv;
+	struct sockaddr_storage candidates[MAX_INGEST_CANDIDATES];
+	socklen_t candidate_lens[MAX_INGEST_CANDIDATES];
+	int64_t candidate_failed[MAX_INGEST_CANDIDATES];
+	int candidate_count = ftl->ingest_candidate_count;
+	char ingest_ip[INET6_ADDRSTRLEN];
+	ftl_status_t status;
+
+	if (!ftl->connected) {
+		return _lookup_ingest_ip(ftl, ingest_hostname) ? FTL_SUCCESS : FTL_DNS_FAILURE;
+	}
+
+	/*the stream stays on the old ingest if the new one can't be reached*/
+	memcpy(candidates, ftl->ingest_candidates, sizeof(candidates));
+	memcpy(candidate_lens, ftl->ingest_candidate_lens, sizeof(candidate_lens));
+	memcpy(candidate_failed, ftl->ingest_candidate_failed, sizeof(candidate_failed));
+	strcpy(ingest_ip, ftl->ingest_ip);
+
+	if (_lookup_ingest_ip(ftl, ingest_hostname) == FALSE) {
+		status = FTL_DNS_FAILURE;
+	}
+	else {
+		strcpy(ftl->ingest_ip, ingest_ip);
+		status = _ingest_migrate(ftl, ftl->channel_id, ftl->key);
+	}
+
+	if (status != FTL_SUCCESS) {
+		memcpy(ftl->ingest_candidates, candidates, sizeof(candidates));
+		memcpy(ftl->ingest_candidate_lens, candidate_lens, sizeof(candidate_lens));
+		memcpy(ftl->ingest_candidate_failed, candidate_failed, sizeof(candidate_failed));
+		ftl->ingest_candidate_count = candidate_count;
+		strcpy(ftl->ingest_ip, ingest_ip);
+	}
+
+	return status;
+}
+
+FTL_API ftl_status_t ftl_ingest_update_stream_key(ftl_handle_t *ftl_handle, const char *stream_key) {
+	ftl_stream_configuration_private_t *ftl = (ftl_stream_configuration_private_t *)ftl_handle->priv;
+	char key[MAX_KEY_LEN];
+	uint32_t channel_id;
+
+	if (strlen(stream_key) >= MAX_KEY_LEN || _get_chan_id_and_key(stream_key, &channel_id, key) == FALSE) {
+		return FTL_BAD_OR_INVALID_STREAM_KEY;
+	}
+
+	if (!ftl->connected) {
+		ftl->channel_id = channel_id;
+		strcpy(ftl->key, key);
+		return FTL_SUCCESS;
+	}
+
+	/*the new key only replaces the old one once media has switched to the session it opened*/
+	return _ingest_migrate(ftl, channel_id, key);
+}
+
 FTL_API int ftl_ingest_send_media(ftl_handle_t *ftl_handle, ftl_media_type_t media_type, uint8_t *data, int32_t len, int end_of_frame) {
+	ftl_media_send_result_t result;
+
+	ftl_ingest_send_media_ex(ftl_handle, media_type, data, len, end_of_frame, 0, &result);
+
+	return result.bytes_queued;
+}
+
+FTL_API ftl_status_t ftl_ingest_send_media_ex(ftl_handle_t *ftl_handle, ftl_media_type_t media_type, uint8_t *data, int32_t len, int end_of_frame, int ms_timeout, ftl_media_send_result_t *result) {
 
 	ftl_stream_configuration_private_t *ftl = (ftl_stream_configuration_private_t *)ftl_handle->priv;
+	ftl_status_t drop_reason = FTL_SUCCESS;
 	int bytes_sent = 0;
 
 	if (!ftl->ready_for_media) {
-		return bytes_sent;
+		drop_reason = FTL_NOT_ACTIVE_STREAM;
 	}
-
-	if (media_type == FTL_AUDIO_DATA) {
-		bytes_sent = media_send_audio(ftl, data, len);
+	else if (media_type == FTL_AUDIO_DATA) {
+		bytes_sent = media_send_audio(ftl, data, len, &drop_reason);
 	}
 	else if (media_type == FTL_VIDEO_DATA) {
-		bytes_sent = media_send_video(ftl, data, len, end_of_frame);
+		bytes_sent = media_send_video(ftl, data, len, end_of_frame, ms_timeout, &drop_reason);
 	}
 	else {
-		return bytes_sent;
+		drop_reason = FTL_UNSUPPORTED_MEDIA_TYPE;
+	}
+
+	if (result != NULL) {
+		result->bytes_queued = bytes_sent;
+		result->drop_reason = drop_reason;
+		result->queue_depth_ms = ftl->ready_for_media ? media_get_queue_depth_ms(ftl) : 0;
 	}
 
-	return bytes_sent;
+	return drop_reason;
 }
 
 FTL_API ftl_status_t ftl_ingest_disconnect(ftl_handle_t *ftl_handle) {
@@ -169,12 +369,24 @@ FTL_API ftl_status_t ftl_ingest_disconnect(ftl_handle_t *ftl_handle) {
 
 	ftl->ready_for_media = 0;
 
-	if ((status_code = _ingest_disconnect(ftl)) != FTL_SUCCESS) {
-		FTL_LOG(FTL_LOG_ERROR, "Disconnect failed with error %d\n", status_code);
-	}
+	/*with the event loop stopped nothing else can tear the stream down, if it already has there is nothing left to clean up*/
+	event_loop_stop(ftl);
 
-	if ((status_code = media_destroy(ftl)) != FTL_SUCCESS) {
-		FTL_LOG(FTL_LOG_ERROR, "failed to clean up media channel with error %d\n", status_code);
+	if (ftl->connected) {
+		_ingest_migration_settle(ftl);
+
+		if ((status_code = _ingest_disconnect(ftl)) != FTL_SUCCESS) {
+			FTL_LOG(ftl, FTL_LOG_ERROR, "Disconnect failed with error %d\n", status_code);
+		}
+
+		if ((status_code = media_destroy(ftl)) != FTL_SUCCESS) {
+			FTL_LOG(ftl, FTL_LOG_ERROR, "failed to clean up media channel with error %d\n", status_code);
+		}
+	}
+	else if (ftl->media.suspended) {
+		/*the connection was lost earlier and never resumed*/
+		_ingest_migration_settle(ftl);
+		media_destroy(ftl);
 	}
 
 	ftl_status_msg_t status;
@@ -185,6 +397,9 @@ FTL_API ftl_status_t ftl_ingest_disconnect(ftl_handle_t *ftl_handle) {
 
 	enqueue_status_msg(ftl, &status);
 
+	/*the event loop is gone, nobody else will deliver it*/
+	deliver_status_msgs(ftl);
+
 	return FTL_SUCCESS;
 }
 
@@ -194,38 +409,26 @@ FTL_API ftl_status_t ftl_ingest_destroy(ftl_handle_t *ftl_handle){
 
 	if (ftl != NULL) {
 
-#ifdef _WIN32
-		WaitForSingleObject(ftl->status_q.mutex, INFINITE);
-#else
-		pthread_mutex_lock(&ftl->status_q.mutex);
-#endif
-
-		status_queue_elmt_t *elmt;
-
-		while (ftl->status_q.head != NULL) {
-			elmt = ftl->status_q.head;
-			ftl->status_q.head = elmt->next;
-			free(elmt);
-			ftl->status_q.count--;
+		/*lost the connection and was never disconnected*/
+		if (ftl->media.suspended) {
+			event_loop_stop(ftl);
+			_ingest_migration_settle(ftl);
+			media_destroy(ftl);
 		}
 
-		ftl->status_q.head = NULL;
-
+		status_queue_destroy(&ftl->status_q);
 #ifdef _WIN32
-		ReleaseMutex(ftl->status_q.mutex);
-		CloseHandle(ftl->status_q.mutex);
-		CloseHandle(ftl->status_q.sem);
+		CloseHandle(ftl->migration.retired);
 #else
-		pthread_mutex_unlock(&ftl->status_q.mutex);
-		pthread_mutex_destroy(&ftl->status_q.mutex);
-		sem_destroy(&ftl->status_q.sem);
+		sem_destroy(&ftl->migration.retired);
 #endif
 
 		if (ftl->key != NULL) {
-			free(ftl->key);
+			ftl_free(&ftl->allocator, ftl->key);
 		}
 
-		free(ftl);
+		ftl_logger_destroy(&ftl->log);
+		ftl_free(&ftl->allocator, ftl);
 	}
 
 	return status;
@@ -241,11 +444,8 @@ BOOL _get_chan_id_and_key(const char *stream_key, uint32_t *chan_id, char *key)
 			/* stream key gets copied */
 			strcpy(key, stream_key+i+1);
 
-			/* Now get the channel id */
-			char * copy_of_key = strdup(stream_key);
-			copy_of_key[i] = '\0';
-			*chan_id = atol(copy_of_key);
-			free(copy_of_key);
+			/* Now get the channel id, atol stops at the divider so no copy is needed */
+			*chan_id = atol(stream_key);
 
 			return TRUE;
 		}
@@ -254,31 +454,94 @@ BOOL _get_chan_id_and_key(const char *stream_key, uint32_t *chan_id, char *key)
 		return FALSE;
 }
 
-static int _lookup_ingest_ip(const char *ingest_location, char *ingest_ip) {
-	struct hostent *remoteHost;
-	struct in_addr addr;
-	BOOL success = FALSE;
-	ingest_ip[0] = '\0';
-
-	remoteHost = gethostbyname(ingest_location);
-
-	if (remoteHost) {
-		int i = 0;
-		if (remoteHost->h_addrtype == AF_INET)
-		{
-			while (remoteHost->h_addr_list[i] != 0) {
-				addr.s_addr = *(u_long *)remoteHost->h_addr_list[i++];
-				FTL_LOG(FTL_LOG_DEBUG, "IP Address #%d of ingest is: %s\n", i, inet_ntoa(addr));
-
-				//revolving dns ensures this will change automatically so just use first ip found
-				if (!success) {
-					strcpy(ingest_ip, inet_ntoa(addr));
-					success = TRUE;
-          //break;
-				}
-			}
+/*
+ * Keeps every address in resolver (rfc 6724) order with the families interleaved, starting with the
+ * family of the first address (rfc 8305), so the connect can race them and a dead node costs one
+ * HAPPY_EYEBALLS_DELAY_MS instead of a connect timeout.
+ */
+static int _lookup_ingest_ip(ftl_stream_configuration_private_t *ftl, const char *ingest_location) {
+	struct addrinfo hints;
+	struct addrinfo *resolved_names = NULL, *p;
+	struct addrinfo *by_family[2][MAX_INGEST_CANDIDATES];
+	char addr_str[INET6_ADDRSTRLEN];
+	int counts[2] = { 0, 0 }, next[2] = { 0, 0 };
+	int err, i = 0, family, first_family = -1;
+
+	ftl->ingest_ip[0] = '\0';
+	ftl->ingest_candidate_count = 0;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	if ((err = getaddrinfo(ingest_location, NULL, &hints, &resolved_names)) != 0) {
+		FTL_LOG(ftl, FTL_LOG_ERROR, "getaddrinfo failed to look up ingest address %s: %s\n", ingest_location, gai_strerror(err));
+		return FALSE;
+	}
+
+	for (p = resolved_names; p != NULL; p = p->ai_next) {
+		FTL_LOG(ftl, FTL_LOG_DEBUG, "IP Address #%d of ingest is: %s\n", ++i, ftl_sockaddr_to_string((struct sockaddr_storage *)p->ai_addr, (socklen_t)p->ai_addrlen, addr_str, sizeof(addr_str)));
+
+		if (p->ai_family != AF_INET && p->ai_family != AF_INET6) {
+			continue;
+		}
+
+		family = p->ai_family == AF_INET6;
+
+		if (first_family < 0) {
+			first_family = family;
+		}
+
+		if (counts[family] < MAX_INGEST_CANDIDATES) {
+			by_family[family][counts[family]++] = p;
 		}
 	}
 
-	return success;
+	for (family = first_family; ftl->ingest_candidate_count < MAX_INGEST_CANDIDATES && (next[0] < counts[0] || next[1] < counts[1]); family = !family) {
+		if (next[family] >= counts[family]) {
+			continue;
+		}
+
+		p = by_family[family][next[family]++];
+		memcpy(&ftl->ingest_candidates[ftl->ingest_candidate_count], p->ai_addr, p->ai_addrlen);
+		ftl->ingest_candidate_lens[ftl->ingest_candidate_count] = (socklen_t)p->ai_addrlen;
+		ftl->ingest_candidate_failed[ftl->ingest_candidate_count] = 0;
+		ftl->ingest_candidate_count++;
+	}
+
+	freeaddrinfo(resolved_names);
+
+	return ftl->ingest_candidate_count > 0;
+}
+
+/*moves addr to the front of the candidates, adding it if the lookup didn't return it*/
+static void _prefer_ingest_ip(ftl_stream_configuration_private_t *ftl, struct sockaddr_storage *addr, socklen_t addrlen) {
+	char want[INET6_ADDRSTRLEN], have[INET6_ADDRSTRLEN];
+	int i;
+
+	ftl_sockaddr_to_string(addr, addrlen, want, sizeof(want));
+
+	for (i = 0; i < ftl->ingest_candidate_count; i++) {
+		if (strcmp(want, ftl_sockaddr_to_string(&ftl->ingest_candidates[i], ftl->ingest_candidate_lens[i], have, sizeof(have))) == 0) {
+			break;
+		}
+	}
+
+	/*a missing address pushes the last one out if the list is full*/
+	if (i == ftl->ingest_candidate_count) {
+		if (i < MAX_INGEST_CANDIDATES) {
+			ftl->ingest_candidate_count++;
+		}
+		else {
+			i--;
+		}
+	}
+
+	memmove(&ftl->ingest_candidates[1], &ftl->ingest_candidates[0], i * sizeof(ftl->ingest_candidates[0]));
+	memmove(&ftl->ingest_candidate_lens[1], &ftl->ingest_candidate_lens[0], i * sizeof(ftl->ingest_candidate_lens[0]));
+	memmove(&ftl->ingest_candidate_failed[1], &ftl->ingest_candidate_failed[0], i * sizeof(ftl->ingest_candidate_failed[0]));
+
+	memcpy(&ftl->ingest_candidates[0], addr, sizeof(ftl->ingest_candidates[0]));
+	ftl->ingest_candidate_lens[0] = addrlen;
+	ftl->ingest_candidate_failed[0] = 0;
 }
@@ -25,6 +25,7 @@
 #ifndef __FTL_H
 #define __FTL_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 #ifdef _WIN32
@@ -119,8 +120,90 @@ typedef enum {
  */
 
  typedef void (*ftl_logging_function_t)(ftl_log_severity_t log_level, const char * log_message);
+
+ /*! \brief Logging callback with user data
+ * \ingroup ftl_public
+ *
+ * Only ever called with the messages of the handle (or context) it was given
+ * to. Calls for one handle never overlap; with async_logging they all come
+ * from that handle's log thread.
+ */
+ typedef void (*ftl_log_callback_t)(void *user_data, ftl_log_severity_t log_level, const char *log_message);
   typedef void (*ftl_status_function_t)(ftl_connection_status_t status);
 
+ struct _ftl_status_msg_t;
+
+ /*! \brief Push mode status delivery
+ * \ingroup ftl_public
+ *
+ * Called with count (1 to status_callback_batch) messages, oldest first. It
+ * runs on the stream's event loop thread (a worker thread for streams on a
+ * context), so it must return quickly and must not call back into libftl for
+ * the same handle except ftl_ingest_send_media(_ex). The final disconnect
+ * event of ftl_ingest_disconnect is delivered from the calling thread before
+ * that call returns. msgs is only valid during the call.
+ */
+ typedef void (*ftl_status_callback_t)(void *user_data, const struct _ftl_status_msg_t *msgs, int count);
+
+ typedef enum {
+   FTL_THREAD_SCHED_DEFAULT, //leave the os scheduler alone (windows raises pacer threads to time critical as it always has)
+   FTL_THREAD_SCHED_FIFO,
+   FTL_THREAD_SCHED_RR
+ } ftl_thread_sched_policy_t;
+
+ /*! \brief Where and how the threads libftl starts are scheduled
+ * \ingroup ftl_public
+ *
+ * Applies to every thread of a handle (event loop and send thread) or of a
+ * context (its workers). The async log thread only takes the cpu affinity,
+ * it never runs real-time. Real-time policies need CAP_SYS_NICE (or an rtprio
+ * limit) on linux; without it libftl logs a warning and keeps the default
+ * policy. On windows FIFO and RR both map to THREAD_PRIORITY_TIME_CRITICAL.
+ */
+ typedef struct {
+   uint64_t cpu_affinity; //bit n allows cpu n, 0 to let the os place threads
+   ftl_thread_sched_policy_t sched_policy;
+   int sched_priority; //1 (lowest) to 99, only used with FIFO and RR
+ } ftl_thread_params_t;
+
+ /*! \brief Memory used by a handle or context
+ * \ingroup ftl_public
+ *
+ * Everything a handle or context allocates for itself, including its nack
+ * buffers and log ring, comes from alloc and goes back through free. Both are
+ * called from the application's thread and from the handle's own threads.
+ */
+ typedef struct {
+   void *(*alloc)(void *user_data, size_t size);
+   void (*free)(void *user_data, void *ptr);
+   void *user_data;
+ } ftl_allocator_t;
+
+ /*! \brief Time source of a handle or context
+ * \ingroup ftl_public
+ *
+ * Returns nanoseconds on a clock that never goes backwards; only differences
+ * are used, so the origin doesn't matter. libftl uses the os monotonic clock
+ * by default. Tests and simulations can pass a virtual clock instead to drive
+ * the pacer, nack and stats timing; sleeps and timeouts are still real time,
+ * and kernel pacing always stamps packets with the os clock.
+ */
+ typedef int64_t (*ftl_clock_function_t)(void *user_data);
+
+ typedef struct {
+	 void* priv;
+ } ftl_context_t;
+
+ typedef struct {
+   int worker_threads; //0 for one worker per cpu
+   ftl_thread_params_t *thread_params; //NULL for os defaults
+   ftl_log_callback_t log_callback; //messages about the context itself, NULL to write them to stderr
+   void *log_callback_data; //passed back to log_callback
+   ftl_allocator_t *allocator; //NULL for malloc and free
+   ftl_clock_function_t clock; //NULL for the os monotonic clock, streams on the context use it too
+   void *clock_data; //passed back to clock
+ } ftl_context_params_t;
+
  typedef struct {
    char *ingest_hostname;
    char *stream_key;
@@ -128,8 +211,22 @@ typedef enum {
    int video_kbps; //used for the leaky bucket to smooth out packet flow rate, set to 0 to bypass
    float video_frame_rate; //TODO: add runtime detection mode of frame rate to simplify sdk
    ftl_audio_codec_t audio_codec;
-   void *status_callback;
+   ftl_status_callback_t status_callback; //NULL to poll with ftl_ingest_get_status instead
+   void *status_callback_data; //passed back to status_callback
+   int status_callback_batch; //most messages per callback, 0 for one at a time
    ftl_logging_function_t log_func;
+   ftl_log_callback_t log_callback; //used instead of log_func when set
+   void *log_callback_data; //passed back to log_callback
+   int async_logging; //format log messages into a ring drained by a background thread that calls log_func, repeats from one place are rate limited
+   int socket_send_buf; //media socket SO_SNDBUF in bytes, 0 to size it from video_kbps and the maximum burst
+   int socket_recv_buf; //media socket SO_RCVBUF in bytes, 0 to size it from video_kbps
+   int kernel_pacing; //linux only: let the fq qdisc pace media using SO_TXTIME departure times, falls back to software pacing if unavailable
+   int io_uring; //linux only: send media and receive rtcp through io_uring, needs libftl built with FTL_IO_URING, falls back to sendmmsg if unavailable
+   ftl_thread_params_t *thread_params; //NULL for os defaults, ignored when the stream runs on a context
+   ftl_context_t *context; //run the stream on a shared worker pool created with ftl_context_create, NULL for threads of its own
+   ftl_allocator_t *allocator; //NULL for malloc and free
+   ftl_clock_function_t clock; //NULL for the os monotonic clock, ignored when the stream runs on a context
+   void *clock_data; //passed back to clock
  } ftl_ingest_params_t;
 
  typedef struct {
@@ -142,13 +239,16 @@ typedef enum {
 	 FTL_STATUS_VIDEO_PACKETS,
 	 FTL_STATUS_AUDIO_PACKETS,
 	 FTL_STATUS_VIDEO,
-	 FTL_STATUS_AUDIO
+	 FTL_STATUS_AUDIO,
+	 FTL_STATUS_NETWORK,
+	 FTL_STATUS_INGEST_PROBE
  } ftl_status_types_t;
 
  typedef enum {
 	 FTL_STATUS_EVENT_TYPE_UNKNOWN,
 	 FTL_STATUS_EVENT_TYPE_CONNECTED,
-	 FTL_STATUS_EVENT_TYPE_DISCONNECTED
+	 FTL_STATUS_EVENT_TYPE_DISCONNECTED,
+	 FTL_STATUS_EVENT_TYPE_MIGRATED /**< the stream now goes to the ingest given to ftl_ingest_update_hostname or ftl_ingest_update_stream_key */
  } ftl_status_event_types_t;
 
  typedef enum {
@@ -156,6 +256,7 @@ typedef enum {
 	 FTL_STATUS_EVENT_REASON_NO_MEDIA,
 	 FTL_STATUS_EVENT_REASON_API_REQUEST,
 	 FTL_STATUS_EVENT_REASON_UNKNOWN,
+	 FTL_STATUS_EVENT_REASON_MEDIA_UNREACHABLE, /**< ICMP reported the ingest media port unreachable */
  } ftl_status_event_reasons_t;
 
  typedef struct {
@@ -163,11 +264,12 @@ typedef enum {
 	 ftl_status_event_reasons_t reason;
  }ftl_status_event_msg_t;
 
+ /*stats messages cover the STATS_INTERVAL (5 seconds) since the previous message of the same type*/
  typedef struct {
-	 int received;
-	 int lost;
-	 int recovered;
-	 int late;
+	 int received; //packets sent that the ingest did not report lost
+	 int lost; //packets the ingest reported lost with a nack
+	 int recovered; //lost packets that were retransmitted
+	 int late; //lost packets no longer buffered when the nack arrived
 	 int average_pps;//average packets per second
  }ftl_packet_stats_msg_t;
 
@@ -175,19 +277,108 @@ typedef enum {
 	 int frames_sent;
 	 int bytes_sent;
 	 int average_fps;
-	 int max_frame_size;
+	 int max_frame_size; //largest frame queued, in bytes
  }ftl_video_frame_stats_msg_t;
 
- /*status messages*/
  typedef struct {
+	 int mtu; //largest rtp packet that currently reaches the ingest without fragmentation
+ }ftl_network_msg_t;
+
+ /*one per hostname passed to ftl_ingest_select, in the order they were passed*/
+ typedef struct {
+	 int index; //position in the list of hostnames
+	 ftl_status_t status; //FTL_SUCCESS if the ingest answered, otherwise why it was passed over
+	 int connect_us; //tcp connect to the control port
+	 int rtt_us; //fastest round trip to the ingest
+	 int jitter_us; //slowest round trip less the fastest
+	 int selected; //1 for the ingest the stream will connect to
+ }ftl_ingest_probe_msg_t;
+
+ /*status messages*/
+ typedef struct _ftl_status_msg_t {
 	 ftl_status_types_t type;
 	 union {
 		 ftl_status_event_msg_t event;
 		 ftl_packet_stats_msg_t pkt_stats;
 		 ftl_video_frame_stats_msg_t video_stats;
+		 ftl_network_msg_t network;
+		 ftl_ingest_probe_msg_t ingest_probe;
 	 } msg;
  }ftl_status_msg_t;
 
+/*! \brief Outcome of a call to ftl_ingest_send_media_ex
+ *  \ingroup ftl_public
+ */
+
+ typedef struct {
+	 int bytes_queued; /**< RTP bytes accepted into the send queue by this call */
+	 ftl_status_t drop_reason; /**< FTL_SUCCESS if nothing was dropped, otherwise why data was discarded */
+	 int queue_depth_ms; /**< time needed to drain the video send queue at the configured bitrate */
+ }ftl_media_send_result_t;
+
+/*! \brief Counters for one media component since the stream connected, see ftl_ingest_get_stats
+ *  \ingroup ftl_public
+ */
+
+ typedef struct {
+	 uint64_t frames_queued; /**< frames accepted by ftl_ingest_send_media */
+	 uint64_t frames_dropped; /**< frames discarded, waiting for a key frame or because the queue was full */
+	 uint64_t frames_sent;
+	 uint64_t packets_sent;
+	 uint64_t bytes_sent;
+	 uint64_t packets_nacked; /**< packets the ingest reported lost */
+	 uint64_t packets_resent; /**< lost packets that were retransmitted */
+	 uint64_t packets_late; /**< lost packets no longer buffered when the nack arrived */
+	 float frame_rate; /**< frames sent per second over the last window_ms */
+	 float packet_rate; /**< packets sent per second over the last window_ms */
+	 int kbps; /**< bitrate sent over the last window_ms */
+	 int max_frame_size; /**< largest frame queued over the last window_ms, in bytes */
+ }ftl_component_stats_t;
+
+/*! \brief Latency percentiles since the stream connected, in microseconds
+ *  \ingroup ftl_public
+ *
+ *  Percentiles are accurate to within 12.5%, max is exact.
+ */
+
+ typedef struct {
+	 uint64_t count; /**< number of samples */
+	 int p50_us;
+	 int p90_us;
+	 int p99_us;
+	 int max_us;
+ }ftl_latency_stats_t;
+
+/*! \brief How long each step of the last ftl_ingest_connect (or migration) took, in microseconds
+ *  \ingroup ftl_public
+ */
+
+ typedef struct {
+	 int tcp_connect_us; /**< until a control connection to one of the ingest's addresses was up */
+	 int hmac_us; /**< asking for the nonce and signing it */
+	 int auth_us; /**< CONNECT until the ingest accepted the stream key */
+	 int metadata_us; /**< stream metadata until the ingest assigned the media port */
+	 int media_setup_us; /**< media socket and threads */
+	 int total_us; /**< the whole call */
+ }ftl_connect_stats_t;
+
+/*! \brief Snapshot returned by ftl_ingest_get_stats
+ *  \ingroup ftl_public
+ */
+
+ typedef struct {
+	 int window_ms; /**< time the rates were measured over, 0 until the first sample */
+	 int queue_depth_ms; /**< time needed to drain the video send queue */
+	 int mtu; /**< largest rtp packet currently sent */
+	 ftl_component_stats_t video;
+	 ftl_component_stats_t audio;
+	 ftl_latency_stats_t queue_delay; /**< video packet queued until handed to the kernel */
+	 ftl_latency_stats_t pacer_overshoot; /**< how late the pacer woke up compared to when it asked to */
+	 ftl_latency_stats_t nack_response; /**< nack received until the retransmit was handed to the kernel */
+	 ftl_latency_stats_t frame_spread; /**< first until last packet of a video frame handed to the kernel */
+	 ftl_connect_stats_t connect;
+ }ftl_stats_t;
+
 /*!
  * \ingroup ftl_public
  * \brief FTL Initialization
@@ -206,18 +397,148 @@ typedef enum {
  */
 FTL_API ftl_status_t ftl_init();
 
+/*!
+ * \ingroup ftl_public
+ * \brief Creates a pool of worker threads that streams can share
+ *
+ * Without a context every stream runs an event loop and a send thread of its
+ * own. Streams created with ftl_ingest_params_t.context set are instead spread
+ * over the context's workers, which pace their video and watch their sockets,
+ * so a process sending many streams needs only worker_threads threads.
+ * Workers that stay busy hand streams over to idle ones.
+ *
+ * Every stream using the context must be disconnected before it is destroyed.
+ */
+FTL_API ftl_status_t ftl_context_create(ftl_context_t *context, ftl_context_params_t *params);
+
+FTL_API ftl_status_t ftl_context_destroy(ftl_context_t *context);
+
 FTL_API ftl_status_t ftl_ingest_create(ftl_handle_t *ftl_handle, ftl_ingest_params_t *params);
 
+/*!
+ * \ingroup ftl_public
+ * \brief Connects to the ingest, or reconnects after the connection was lost
+ *
+ * When the ingest drops the stream (a disconnected status event that wasn't
+ * asked for) the media side is kept as it is: buffers, threads, sequence
+ * numbers and timestamps. Calling this again then only redoes the handshake
+ * and media carries on where it left off, with the last sps and pps sent
+ * again ahead of the next frame. Ask the encoder for a key frame at that point
+ * if the ingest may have restarted. ftl_ingest_disconnect frees what was kept
+ * if the stream is given up instead.
+ */
 FTL_API ftl_status_t ftl_ingest_connect(ftl_handle_t *ftl_handle);
 
+/*!
+ * \ingroup ftl_public
+ * \brief Waits for the next status message
+ *
+ * Waits up to ms_timeout milliseconds, or forever if ms_timeout is negative.
+ * Events are queued in order. If the app falls behind, stats messages of the
+ * same type are merged and only the newest is kept, so an event is never
+ * pushed out by stats. Only one thread may call this at a time.
+ *
+ * The wait is the same whether or not the stream is connected, the disconnect
+ * event is the last message of a session.
+ *
+ * @returns FTL_SUCCESS with the message in msg, FTL_STATUS_TIMEOUT if nothing
+ * arrived in time, or FTL_CONFIG_ERROR if the handle was created with a
+ * status_callback.
+ */
 FTL_API ftl_status_t ftl_ingest_get_status(ftl_handle_t *ftl_handle, ftl_status_msg_t *msg, int ms_timeout);
 
+/*!
+ * \ingroup ftl_public
+ * \brief Copies the latest stats snapshot
+ *
+ * The snapshot is refreshed about once a second by the thread running the
+ * stream's timers. Reading it never blocks the media threads, all fields come
+ * from the same refresh. Can be called from any thread, also after the stream
+ * disconnected, in which case the last snapshot taken is returned.
+ */
+FTL_API ftl_status_t ftl_ingest_get_stats(ftl_handle_t *ftl_handle, ftl_stats_t *stats);
+
+/*!
+ * \ingroup ftl_public
+ * \brief Sets the most verbose level passed to the handle's log_func
+ *
+ * Messages above level are discarded before they are formatted. Defaults to
+ * FTL_LOG_DEBUG. Can be changed at any time from any thread.
+ */
+FTL_API ftl_status_t ftl_ingest_set_log_level(ftl_handle_t *ftl_handle, ftl_log_severity_t level);
+
+/*!
+ * \ingroup ftl_public
+ * \brief Picks the nearest healthy ingest out of several
+ *
+ * Probes every hostname in parallel, each over a control connection of its
+ * own: the tcp connect, a nonce request and a few pings give its round trip
+ * and how much that varies. The handle is then pointed at the ingest with the
+ * lowest round trip plus jitter, and the next ftl_ingest_connect uses it. An
+ * FTL_STATUS_INGEST_PROBE status message is queued for every hostname, with
+ * selected set on the one chosen. Only call it while not connected; it blocks
+ * for up to a couple of seconds.
+ *
+ * @returns FTL_SUCCESS with the chosen position in *selected (which may be
+ * NULL), FTL_CONNECT_ERROR if no ingest answered, FTL_CONFIG_ERROR if count is
+ * out of range or FTL_ALREADY_CONNECTED.
+ */
+FTL_API ftl_status_t ftl_ingest_select(ftl_handle_t *ftl_handle, const char **ingest_hostnames, int count, int *selected);
+
+/*!
+ * \ingroup ftl_public
+ * \brief Moves the stream to another ingest without a gap
+ *
+ * While not connected this only changes where the next ftl_ingest_connect
+ * goes. A live stream is migrated: a new control connection and media socket
+ * are set up on the calling thread, which blocks for the handshake while media
+ * keeps flowing to the old ingest. Media switches over in front of the next
+ * key frame the encoder sends (an sps), after which the old session is closed
+ * and an FTL_STATUS_EVENT_TYPE_MIGRATED event is queued. Sequence numbers,
+ * timestamps, the send queue, pacing and stats all carry on. If the old ingest
+ * goes away first, media switches right away. Calling this again before the
+ * switch replaces the pending migration.
+ *
+ * @returns FTL_SUCCESS once the new session is ready to take over,
+ * FTL_DNS_FAILURE, or the error the connection failed with, in which case
+ * the stream stays where it was.
+ */
 FTL_API ftl_status_t ftl_ingest_update_hostname(ftl_handle_t *ftl_handle, const char *ingest_hostname);
+
+/*!
+ * \ingroup ftl_public
+ * \brief Continues the stream under another stream key
+ *
+ * Like ftl_ingest_update_hostname, but a live stream is migrated to a new
+ * session on the current ingest authenticated with the new key. The SSRCs stay
+ * those of the key the handle was created with.
+ *
+ * @returns FTL_SUCCESS, FTL_BAD_OR_INVALID_STREAM_KEY, or the error the
+ * connection failed with, in which case the old key stays in use.
+ */
 FTL_API ftl_status_t ftl_ingest_update_stream_key(ftl_handle_t *ftl_handle, const char *stream_key);
 
 FTL_API ftl_status_t ftl_ingest_get_status(ftl_handle_t *ftl_handle, ftl_status_msg_t *msg, int ms_timeout);
 
-FTL_API int ftl_ingest_send_media(ftl_handle_t *ftl_handle, ftl_media_type_t media_type, uint8_t *data, int32_t len, int end_of_frame);		
+FTL_API int ftl_ingest_send_media(ftl_handle_t *ftl_handle, ftl_media_type_t media_type, uint8_t *data, int32_t len, int end_of_frame);
+
+/*!
+ * \ingroup ftl_public
+ * \brief Sends media and reports what happened to it
+ *
+ * Behaves like ftl_ingest_send_media but tells the caller whether the data was
+ * queued, dropped because the send queue is full (FTL_STATUS_MEDIA_QUEUE_FULL)
+ * or dropped because libftl is waiting for the next key frame
+ * (FTL_STATUS_WAITING_FOR_KEY_FRAME). queue_depth_ms can be used by encoder
+ * rate control to back off before the queue overflows.
+ *
+ * If ms_timeout is 0 the call never blocks. Otherwise it waits up to
+ * ms_timeout milliseconds for room in the video queue before dropping.
+ *
+ * @returns the drop reason, which is also stored in result->drop_reason.
+ * result may be NULL.
+ */
+FTL_API ftl_status_t ftl_ingest_send_media_ex(ftl_handle_t *ftl_handle, ftl_media_type_t media_type, uint8_t *data, int32_t len, int end_of_frame, int ms_timeout, ftl_media_send_result_t *result);
 
 FTL_API ftl_status_t ftl_ingest_disconnect(ftl_handle_t *ftl_handle);
 
@@ -86,7 +86,7 @@ unsigned char decode_hex_char(char c) {
     return 0;
 }
 
-int recv_all(SOCKET sock, char * buf, int buflen, const char line_terminator) {
+int recv_all(ftl_logger_t *log, SOCKET sock, char * buf, int buflen, const char line_terminator) {
     int pos = 0;
     int n;
     int bytes_recd = 0;
@@ -96,7 +96,7 @@ int recv_all(SOCKET sock, char * buf, int buflen, const char line_terminator) {
         if (n < 0) {
             //this will abort in the event of an error or in the buffer is filled before the terminiator is reached
             const char * error = ftl_get_socket_error();
-            FTL_LOG(FTL_LOG_ERROR, "socket error while receiving: %s", error);
+            FTL_LOG_TO(log, FTL_LOG_ERROR, "socket error while receiving: %s", error);
             return n;
         }
 		else if (n == 0) {
@@ -113,35 +113,46 @@ int recv_all(SOCKET sock, char * buf, int buflen, const char line_terminator) {
     return bytes_recd;
 }
 
-int ftl_get_hmac(SOCKET sock, char * auth_key, char * dst) {
+int ftl_get_hmac(ftl_logger_t *log, SOCKET sock, char * auth_key, char * dst) {
     char buf[2048];
     int string_len;
-    int response_code;
 
     send(sock, "HMAC\r\n\r\n", 8, 0);
-    string_len = recv_all(sock, buf, 2048, '\n');
-    if (string_len < 4 || string_len == 2048) {
-        FTL_LOG(FTL_LOG_ERROR, "ingest returned invalid response with length %d", string_len);
+    string_len = recv_all(log, sock, buf, 2048, '\n');
+    if (string_len == 2048) {
+        FTL_LOG_TO(log, FTL_LOG_ERROR, "ingest returned invalid response with length %d", string_len);
+        return 0;
+    }
+
+    return ftl_sign_nonce(log, buf, string_len, auth_key, dst);
+}
+
+/*signs the nonce in an HMAC response ("200 <hex>\n", nul terminated) with the stream key*/
+int ftl_sign_nonce(ftl_logger_t *log, const char *buf, int string_len, char * auth_key, char * dst) {
+    int response_code;
+
+    if (string_len < 4) {
+        FTL_LOG_TO(log, FTL_LOG_ERROR, "ingest returned invalid response with length %d", string_len);
         return 0;
     }
 
     response_code = ftl_read_response_code(buf);
     if (response_code != FTL_INGEST_RESP_OK) {
-        FTL_LOG(FTL_LOG_ERROR, "ingest did not give us an HMAC nonce");
+        FTL_LOG_TO(log, FTL_LOG_ERROR, "ingest did not give us an HMAC nonce");
         return 0;
     }
 
     int len = string_len - 5; // Strip "200 " and "\n"
     if (len % 2) {
-        FTL_LOG(FTL_LOG_ERROR, "ingest did not give us a well-formed hex string");
+        FTL_LOG_TO(log, FTL_LOG_ERROR, "ingest did not give us a well-formed hex string");
         return 0;
     }
 
     int messageLen = len / 2;
     unsigned char *msg;
 
-    if( (msg = (unsigned char*)malloc(messageLen * sizeof(*msg))) == NULL){
-        FTL_LOG(FTL_LOG_ERROR, "Unable to allocate %d bytes of memory", messageLen * sizeof(*msg));
+    if( (msg = (unsigned char*)ftl_alloc(&log->allocator, messageLen * sizeof(*msg))) == NULL){
+        FTL_LOG_TO(log, FTL_LOG_ERROR, "Unable to allocate %d bytes of memory", messageLen * sizeof(*msg));
         return 0;        
     }
 
@@ -153,7 +164,7 @@ int ftl_get_hmac(SOCKET sock, char * auth_key, char * dst) {
     }
 
     hmacsha512(auth_key, msg, messageLen, dst);
-    free(msg);
+    ftl_free(&log->allocator, msg);
     return 1;
 }
 
@@ -179,94 +190,252 @@ const char * ftl_video_codec_to_string(ftl_video_codec_t codec) {
   return "";
 }
 
-int enqueue_status_msg(ftl_stream_configuration_private_t *ftl, ftl_status_msg_t *stats_msg) {
-	status_queue_elmt_t *elmt;
-#ifdef _WIN32
-	WaitForSingleObject(ftl->status_q.mutex, INFINITE);
-#else
-	pthread_mutex_lock(&ftl->status_q.mutex);
-#endif
+const char * ftl_sockaddr_to_string(struct sockaddr_storage *addr, socklen_t addrlen, char *buf, int buflen) {
+  if (getnameinfo((struct sockaddr *)addr, addrlen, buf, buflen, NULL, 0, NI_NUMERICHOST) != 0) {
+    snprintf(buf, buflen, "<unknown>");
+  }
 
-	if ( (elmt = (status_queue_elmt_t*)malloc(sizeof(status_queue_elmt_t))) == NULL) {
-		FTL_LOG(FTL_LOG_ERROR, "Unable to allocate status msg");
-	}
+  return buf;
+}
+
+void ftl_sockaddr_set_port(struct sockaddr_storage *addr, int port) {
+  if (addr->ss_family == AF_INET6) {
+    ((struct sockaddr_in6 *)addr)->sin6_port = htons(port);
+  }
+  else {
+    ((struct sockaddr_in *)addr)->sin_port = htons(port);
+  }
+}
 
-	memcpy(&elmt->stats_msg, stats_msg, sizeof(status_queue_elmt_t));
-	elmt->next = NULL;
+ftl_status_t status_queue_init(status_queue_t *q, BOOL push_mode) {
+	int i;
 
-	if (ftl->status_q.head == NULL) {
-		ftl->status_q.head = elmt;
+	for (i = 0; i < STATUS_QUEUE_SIZE; i++) {
+		q->cells[i].seq = i;
 	}
-	else {
-		status_queue_elmt_t *tail = ftl->status_q.head;
 
-		do {
-			if (tail->next == NULL) {
-				tail->next = elmt;
-				break;
-			}
-			tail = tail->next;
-		} while (tail != NULL);
+	for (i = 0; i < STATUS_COALESCED_TYPES; i++) {
+		q->coalesced_state[i] = STATUS_SLOT_EMPTY;
+		q->coalesced_pos[i] = 0;
 	}
 
-	/*if queue is full remove head*/
-	if (ftl->status_q.count >= MAX_STATUS_MESSAGE_QUEUED) {
-		elmt = ftl->status_q.head;
-		ftl->status_q.head = elmt->next;
-		free(elmt);
-		FTL_LOG(FTL_LOG_ERROR, "Status queue was full with %d msgs, removed head", ftl->status_q.count);
+	q->enqueue_pos = 0;
+	q->dequeue_pos = 0;
+	q->dropped = 0;
+	q->push_mode = push_mode;
+
+#ifdef _WIN32
+	if ((q->sem = CreateSemaphore(NULL, 0, STATUS_QUEUE_SIZE + STATUS_COALESCED_TYPES, NULL)) == NULL) {
+#else
+	if (sem_init(&q->sem, 0 /* pshared */, 0 /* value */)) {
+#endif
+		return FTL_MALLOC_FAILURE;
 	}
-	else {
-		ftl->status_q.count++;
+
+	return FTL_SUCCESS;
+}
+
+void status_queue_destroy(status_queue_t *q) {
 #ifdef _WIN32
-		ReleaseSemaphore(ftl->status_q.sem, 1, NULL);
+	CloseHandle(q->sem);
 #else
-		sem_post(&ftl->status_q.sem);
+	sem_destroy(&q->sem);
 #endif
+}
+
+static void _status_queue_signal(status_queue_t *q) {
+	if (q->push_mode) {
+		return;
 	}
 
 #ifdef _WIN32
-	ReleaseMutex(ftl->status_q.mutex);
+	ReleaseSemaphore(q->sem, 1, NULL);
 #else
-	pthread_mutex_unlock(&ftl->status_q.mutex);
+	sem_post(&q->sem);
 #endif
+}
+
+/*the queue is close to full: keep only the newest stats message of each type*/
+static int _status_queue_coalesce(status_queue_t *q, ftl_status_msg_t *msg, unsigned long pos) {
+	ftl_atomic_t *state = &q->coalesced_state[msg->type];
+
+	if (ftl_atomic_cas(state, STATUS_SLOT_EMPTY, STATUS_SLOT_WRITING)) {
+		q->coalesced[msg->type] = *msg;
+		ftl_atomic_store(&q->coalesced_pos[msg->type], (long)pos);
+		ftl_atomic_store(state, STATUS_SLOT_READY);
+		_status_queue_signal(q);
+		return 1;
+	}
+
+	/*already signalled for, the consumer just gets the newer numbers where the older ones were queued*/
+	if (ftl_atomic_cas(state, STATUS_SLOT_READY, STATUS_SLOT_WRITING)) {
+		q->coalesced[msg->type] = *msg;
+		ftl_atomic_store(state, STATUS_SLOT_READY);
+		return 0;
+	}
+
+	/*another producer or the consumer is on the slot right now, this sample is lost*/
+	ftl_atomic_add(&q->dropped, 1);
+	return -1;
+}
+
+/*never blocks or allocates, safe to call from the media threads*/
+int enqueue_status_msg(ftl_stream_configuration_private_t *ftl, ftl_status_msg_t *stats_msg) {
+	status_queue_t *q = &ftl->status_q;
+	status_queue_cell_t *cell;
+	BOOL is_event = stats_msg->type == FTL_STATUS_EVENT;
+	unsigned long pos, used;
+	long diff;
+
+	pos = (unsigned long)ftl_atomic_load(&q->enqueue_pos);
+
+	for (;;) {
+		used = pos - (unsigned long)ftl_atomic_load(&q->dequeue_pos);
+
+		/*while older numbers of this type wait in their slot, the ring must not get newer ones behind them*/
+		if (!is_event && stats_msg->type < STATUS_COALESCED_TYPES &&
+			(used >= STATUS_QUEUE_SIZE - STATUS_QUEUE_EVENT_RESERVE || ftl_atomic_load(&q->coalesced_state[stats_msg->type]) == STATUS_SLOT_READY)) {
+			if (_status_queue_coalesce(q, stats_msg, pos) < 0) {
+				return -1;
+			}
+
+			if (q->push_mode) {
+				event_loop_notify(ftl);
+			}
+
+			return 0;
+		}
+
+		cell = &q->cells[pos & (STATUS_QUEUE_SIZE - 1)];
+		diff = (long)((unsigned long)ftl_atomic_load(&cell->seq) - pos);
+
+		if (diff == 0) {
+			if (ftl_atomic_cas(&q->enqueue_pos, (long)pos, (long)(pos + 1))) {
+				break;
+			}
+			pos = (unsigned long)ftl_atomic_load(&q->enqueue_pos);
+		}
+		else if (diff < 0) {
+			ftl_atomic_add(&q->dropped, 1);
+			FTL_LOG(ftl, FTL_LOG_ERROR, "Status queue is full, dropped a message of type %d\n", stats_msg->type);
+			return -1;
+		}
+		else {
+			pos = (unsigned long)ftl_atomic_load(&q->enqueue_pos);
+		}
+	}
+
+	cell->msg = *stats_msg;
+	ftl_atomic_store(&cell->seq, (long)(pos + 1));
+	_status_queue_signal(q);
+
+	if (q->push_mode) {
+		event_loop_notify(ftl);
+	}
+
 	return 0;
 }
 
+/*
+ * Single consumer, takes messages in the order they were queued: a coalesced slot goes out ahead of the
+ * ring cells claimed after it was filled, so stats can't trail a disconnect event queued behind them.
+ * A slot filled later than the oldest cell waits for that cell, which its producer is about to fill.
+ */
+static BOOL _status_queue_take(status_queue_t *q, ftl_status_msg_t *msg) {
+	unsigned long pos = (unsigned long)q->dequeue_pos;
+	status_queue_cell_t *cell = &q->cells[pos & (STATUS_QUEUE_SIZE - 1)];
+	int type;
+
+	for (type = 0; type < STATUS_COALESCED_TYPES; type++) {
+		/*the position only changes while the slot is empty, so it can be read before claiming the slot*/
+		if (ftl_atomic_load(&q->coalesced_state[type]) == STATUS_SLOT_READY &&
+			(long)(pos - (unsigned long)ftl_atomic_load(&q->coalesced_pos[type])) >= 0 &&
+			ftl_atomic_cas(&q->coalesced_state[type], STATUS_SLOT_READY, STATUS_SLOT_READING)) {
+			*msg = q->coalesced[type];
+			ftl_atomic_store(&q->coalesced_state[type], STATUS_SLOT_EMPTY);
+			return TRUE;
+		}
+	}
+
+	if ((long)((unsigned long)ftl_atomic_load(&cell->seq) - (pos + 1)) == 0) {
+		*msg = cell->msg;
+		ftl_atomic_store(&cell->seq, (long)(pos + STATUS_QUEUE_SIZE));
+		ftl_atomic_store(&q->dequeue_pos, (long)(pos + 1));
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+/*
+ * Waits up to ms_timeout (forever if negative) for a message, whether or not the stream is connected, as
+ * a reconnect on another thread can queue more. Only one thread may call this at a time.
+ */
 int dequeue_status_msg(ftl_stream_configuration_private_t *ftl, ftl_status_msg_t *stats_msg, int ms_timeout) {
-	status_queue_elmt_t *elmt;
-	int retval = -1;
+	status_queue_t *q = &ftl->status_q;
 
-	if (!ftl->connected) {
-		return retval;
+	if (q->push_mode) {
+		return FTL_CONFIG_ERROR;
 	}
+
+#ifndef _WIN32
+	struct timespec deadline;
+	struct timeval now;
+	int ret;
+#endif
+
 #ifdef _WIN32
-	HANDLE handles[] = { ftl->status_q.mutex, ftl->status_q.sem };
-	WaitForMultipleObjects(sizeof(handles) / sizeof(handles[0]), handles, TRUE, INFINITE);
+	if (WaitForSingleObject(q->sem, ms_timeout < 0 ? INFINITE : (DWORD)ms_timeout) != WAIT_OBJECT_0) {
+		return FTL_STATUS_TIMEOUT;
+	}
 #else
-	sem_wait(&ftl->status_q.sem);
-	pthread_mutex_lock(&ftl->status_q.mutex);
+	if (sem_trywait(&q->sem) != 0) {
+		if (ms_timeout < 0) {
+			while ((ret = sem_wait(&q->sem)) != 0 && errno == EINTR);
+		}
+		else {
+			gettimeofday(&now, NULL);
+			timeval_add_ms(&now, ms_timeout);
+			deadline.tv_sec = now.tv_sec;
+			deadline.tv_nsec = now.tv_usec * 1000;
+
+			while ((ret = sem_timedwait(&q->sem, &deadline)) != 0 && errno == EINTR);
+		}
+
+		if (ret != 0) {
+			return FTL_STATUS_TIMEOUT;
+		}
+	}
 #endif
 
-	if (ftl->status_q.head != NULL) {
-		elmt = ftl->status_q.head;
-		memcpy(stats_msg, &elmt->stats_msg, sizeof(elmt->stats_msg));
-		ftl->status_q.head = elmt->next;
-		free(elmt);
-		ftl->status_q.count--;
-		retval = 0;
+	/*a producer can have claimed the oldest cell without having filled it yet, it won't be long*/
+	while (!_status_queue_take(q, stats_msg)) {
+		sleep_ms(0);
 	}
-	else {
-		FTL_LOG(FTL_LOG_ERROR, "ERROR: dequeue_status_msg had no messages");
+
+	return FTL_SUCCESS;
+}
+
+/*
+ * Push mode: hands everything queued to the status callback, status_callback_batch messages at a time.
+ * Only ever runs on the thread that owns the stream's event loop, or on the disconnecting thread once the
+ * loop is gone, so it is the queue's single consumer.
+ */
+void deliver_status_msgs(ftl_stream_configuration_private_t *ftl) {
+	ftl_status_msg_t msgs[STATUS_QUEUE_SIZE];
+	int count;
+
+	if (ftl->status_callback == NULL) {
+		return;
 	}
 
-#ifdef _WIN32
-	ReleaseMutex(ftl->status_q.mutex);
-#else
-	pthread_mutex_unlock(&ftl->status_q.mutex);
-#endif
+	do {
+		for (count = 0; count < ftl->status_callback_batch && _status_queue_take(&ftl->status_q, &msgs[count]); count++);
 
-	return retval;
+		if (count > 0) {
+			ftl->status_callback(ftl->status_callback_data, msgs, count);
+		}
+	} while (count == ftl->status_callback_batch);
 }
 
 void sleep_ms(int ms)
@@ -277,3 +446,103 @@ void sleep_ms(int ms)
 	usleep(ms * 1000);
 #endif
 }
+
+int64_t ftl_monotonic_ns()
+{
+#ifdef _WIN32
+	static LARGE_INTEGER frequency;
+	LARGE_INTEGER counter;
+
+	if (frequency.QuadPart == 0) {
+		QueryPerformanceFrequency(&frequency);
+	}
+
+	QueryPerformanceCounter(&counter);
+
+	/*split so the multiply can't overflow*/
+	return counter.QuadPart / frequency.QuadPart * NS_PER_SEC + counter.QuadPart % frequency.QuadPart * NS_PER_SEC / frequency.QuadPart;
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (int64_t)ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+#endif
+}
+
+static int64_t _default_clock(void *user_data)
+{
+	(void)user_data;
+	return ftl_monotonic_ns();
+}
+
+void ftl_clock_init(ftl_clock_t *clock, ftl_clock_function_t func, void *user_data)
+{
+	clock->now = func != NULL ? func : _default_clock;
+	clock->user_data = func != NULL ? user_data : NULL;
+}
+
+int ftl_get_cpu_count()
+{
+#ifdef _WIN32
+	SYSTEM_INFO info;
+
+	GetSystemInfo(&info);
+	return (int)info.dwNumberOfProcessors;
+#else
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return count > 0 ? (int)count : 1;
+#endif
+}
+
+static void *_default_alloc(void *user_data, size_t size)
+{
+	(void)user_data;
+	return malloc(size);
+}
+
+static void _default_free(void *user_data, void *ptr)
+{
+	(void)user_data;
+	free(ptr);
+}
+
+void ftl_allocator_init(ftl_allocator_t *allocator, const ftl_allocator_t *user)
+{
+	if (user != NULL && user->alloc != NULL && user->free != NULL) {
+		*allocator = *user;
+	}
+	else {
+		allocator->alloc = _default_alloc;
+		allocator->free = _default_free;
+		allocator->user_data = NULL;
+	}
+}
+
+void *ftl_alloc(const ftl_allocator_t *allocator, size_t size)
+{
+	return allocator->alloc(allocator->user_data, size);
+}
+
+void *ftl_calloc(const ftl_allocator_t *allocator, size_t count, size_t size)
+{
+	void *ptr;
+
+	if (size != 0 && count > (size_t)-1 / size) {
+		return NULL;
+	}
+
+	if ((ptr = allocator->alloc(allocator->user_data, count * size)) != NULL) {
+		memset(ptr, 0, count * size);
+	}
+
+	return ptr;
+}
+
+void ftl_free(const ftl_allocator_t *allocator, void *ptr)
+{
+	if (ptr != NULL) {
+		allocator->free(allocator->user_data, ptr);
+	}
+}
@@ -45,9 +45,12 @@
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <semaphore.h>
+#include <poll.h>
+#include <errno.h>
 #endif
 
 #define MAX_INGEST_COMMAND_LEN 512
+#define MAX_INGEST_METADATA_LEN 1024 /*every line sent between CONNECT and the closing "."*/
 #define INGEST_PORT 8084
 #define MAX_KEY_LEN 100
 #define VIDEO_PTYPE 96
@@ -56,14 +59,53 @@
 #define SOCKET_SEND_TIMEOUT_MS 1000
 #define MAX_PACKET_BUFFER 1500  //Max length of buffer
 #define MAX_MTU 1392
+#define IPV4_UDP_HEADER_LEN 28
+#define IPV6_UDP_HEADER_LEN 48
+#define MIN_MTU 548 //576 byte minimum ipv4 datagram less ip/udp headers
+#define MIN_MTU_IPV6 (1280 - IPV6_UDP_HEADER_LEN)
+#define MAX_PROBE_MTU (MAX_PACKET_BUFFER - IPV4_UDP_HEADER_LEN) //largest rtp packet a nack slot can hold on a 1500 byte link
+#define MAX_PROBE_MTU_IPV6 (MAX_PACKET_BUFFER - IPV6_UDP_HEADER_LEN)
+#define MTU_PROBE_INTERVAL_MS 1000
+#define MTU_PROBE_RAISE_INTERVAL_MS 600000 //how often to look for a larger mtu once the search has converged
+#define MTU_PROBE_GRANULARITY 16
+#define MTU_PROBE_TRIES 3 //unanswered probes before a size is treated as too large
 #define FTL_UDP_MEDIA_PORT 8082   //The port on which to listen for incoming data
 #define RTP_HEADER_BASE_LEN 12
 #define RTP_FUA_HEADER_LEN 2
 #define NACK_RB_SIZE (65536/8) //must be evenly divisible by 2^16
 #define NACK_RTT_AVG_SECONDS 5
-#define MAX_STATUS_MESSAGE_QUEUED 10
+#define STATUS_QUEUE_SIZE 16 //must be a power of 2
+#define STATUS_QUEUE_EVENT_RESERVE 4 //slots only events may take, stats can't crowd out a disconnect
+#define STATUS_COALESCED_TYPES (FTL_STATUS_NETWORK + 1)
+#define LOG_RING_SIZE 256 //must be a power of 2
+#define LOG_MESSAGE_MAX 512 //longer async log messages are truncated
+#define LOG_RATE_LIMIT 20 //async messages per second from one place before the rest are suppressed
+#define LOG_RATE_SITES 64 //must be a power of 2
 #define MAX_FRAME_SIZE_ELEMENTS 64 //must be a minimum of 3
+#define MAX_PARAM_SET_LEN 256 //largest sps or pps kept to resend after a resume
 #define MAX_XMIT_LEVEL_IN_MS 100 //allows a maximum burst size of 100ms at the target bitrate
+#define MAX_INGEST_CANDIDATES 8 //resolved addresses raced when connecting, the rest are ignored
+#define HAPPY_EYEBALLS_DELAY_MS 250 //head start each address gets over the next (rfc 8305)
+#define CONNECT_TIMEOUT_MS 5000 //for the whole race, up to a signed hmac nonce
+#define INGEST_NEGATIVE_CACHE_MS 30000 //an address that failed is tried after the others for this long
+#define MAX_INGEST_PROBES 8 //hostnames ftl_ingest_select can choose between
+#define INGEST_PROBE_PINGS 3 //round trips timed on each ingest after the nonce
+#define INGEST_PROBE_TIMEOUT_MS 2000
+#define MAX_SEND_BATCH 32 //packets handed to the kernel in one sendmmsg
+#define MIN_SOCKET_BUFFER (64 * 1024)
+#define MEDIA_UNREACHABLE_COUNT 3 //icmp unreachable reports within MEDIA_UNREACHABLE_WINDOW_MS before we give up on the ingest
+#define MEDIA_UNREACHABLE_WINDOW_MS 2000
+#define MAX_RECV_BATCH 16 //rtcp packets drained from the media socket per recvmmsg
+#define MAX_POLL_EVENTS 16
+#define STATS_INTERVAL_MS 5000 //how often stats status messages are queued
+#define STATS_SAMPLE_MS 1000 //how often the counters are sampled and the ftl_ingest_get_stats snapshot refreshed
+#define STATS_WINDOW_SAMPLES 5 //rates are averaged over this many sample intervals
+#define HISTOGRAM_SUB_BITS 3 //8 linear buckets per power of 2, values are within 12.5% of what was recorded
+#define HISTOGRAM_BUCKETS ((32 - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+#define TIMER_WHEEL_SLOTS 512 //1ms per slot
+#define CONTEXT_REBALANCE_INTERVAL_MS 1000
+#define CONTEXT_OVERLOAD_PERCENT 70 //a worker busier than this hands a stream to the least loaded worker
+#define TXTIME_HORIZON_MS 20 //how far ahead of its departure time a kernel paced packet is handed to the qdisc
 
 typedef enum {
 	H264_NALU_TYPE_NON_IDR = 1,
@@ -84,27 +126,129 @@ typedef bool BOOL;
 #define SOCKET_ERROR (-1)
 #endif
 
-/*status message queue*/
-typedef struct _status_queue_t {
-	ftl_status_msg_t stats_msg;
-	struct _status_queue_t *next;
-}status_queue_elmt_t;
+/*
+ * Minimal atomics, sequentially consistent on windows and acquire/release elsewhere. Values are longs,
+ * 32 bits on windows, so counters that wrap must be compared by subtracting as unsigned.
+ */
+#ifdef _WIN32
+typedef volatile LONG ftl_atomic_t;
+#define ftl_atomic_load(p) InterlockedCompareExchange((p), 0, 0)
+#define ftl_atomic_store(p, v) InterlockedExchange((p), (v))
+#define ftl_atomic_cas(p, expected, desired) (InterlockedCompareExchange((p), (desired), (expected)) == (expected))
+#define ftl_atomic_add(p, v) InterlockedExchangeAdd((p), (v))
+#define ftl_atomic_add_relaxed(p, v) InterlockedExchangeAdd((p), (v))
+#define ftl_atomic_load_relaxed(p) (*(p))
+#define ftl_atomic_exchange(p, v) InterlockedExchange((p), (v))
+#define ftl_atomic_fence_acquire() MemoryBarrier()
+#define ftl_atomic_fence_release() MemoryBarrier()
+#define ftl_atomic_fence() MemoryBarrier()
+#else
+typedef volatile long ftl_atomic_t;
+#define ftl_atomic_load(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define ftl_atomic_store(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define ftl_atomic_cas(p, expected, desired) __sync_bool_compare_and_swap((p), (expected), (desired))
+#define ftl_atomic_add(p, v) __atomic_fetch_add((p), (v), __ATOMIC_ACQ_REL)
+#define ftl_atomic_add_relaxed(p, v) __atomic_fetch_add((p), (v), __ATOMIC_RELAXED)
+#define ftl_atomic_load_relaxed(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+#define ftl_atomic_exchange(p, v) __atomic_exchange_n((p), (v), __ATOMIC_ACQ_REL)
+#define ftl_atomic_fence_acquire() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define ftl_atomic_fence_release() __atomic_thread_fence(__ATOMIC_RELEASE)
+#define ftl_atomic_fence() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#endif
+
+/*
+ * USDT probes (provider libftl) for bpftrace and perf. Each is a single nop until a tracer attaches, but
+ * the arguments are still evaluated so keep them cheap. See tools/bpftrace for examples.
+ */
+#ifdef FTL_HAVE_USDT
+#include <sys/sdt.h>
+#define FTL_PROBE1(name, a) DTRACE_PROBE1(libftl, name, a)
+#define FTL_PROBE2(name, a, b) DTRACE_PROBE2(libftl, name, a, b)
+#define FTL_PROBE3(name, a, b, c) DTRACE_PROBE3(libftl, name, a, b, c)
+#define FTL_PROBE4(name, a, b, c, d) DTRACE_PROBE4(libftl, name, a, b, c, d)
+#define FTL_PROBE5(name, a, b, c, d, e) DTRACE_PROBE5(libftl, name, a, b, c, d, e)
+#else
+#define FTL_PROBE1(name, a)
+#define FTL_PROBE2(name, a, b)
+#define FTL_PROBE3(name, a, b, c)
+#define FTL_PROBE4(name, a, b, c, d)
+#define FTL_PROBE5(name, a, b, c, d, e)
+#endif
+
+#define RTP_TIMESTAMP(pkt) ntohl(((uint32_t *)(pkt))[1])
+
+/*
+ * Status message queue: a bounded multi producer, single consumer ring (Vyukov) so producers never
+ * allocate or take a lock. When only the event reserve is left, stats messages are coalesced instead:
+ * the newest one of each type waits in its own slot and replaces any older one still waiting there.
+ * A waiting slot takes every newer message of its type and is delivered before anything queued after it.
+ */
+typedef enum {
+	STATUS_SLOT_EMPTY,
+	STATUS_SLOT_WRITING,
+	STATUS_SLOT_READY,
+	STATUS_SLOT_READING
+} status_slot_state_t;
 
 typedef struct {
-	status_queue_elmt_t *head;
-	int count;
+	ftl_atomic_t seq;
+	ftl_status_msg_t msg;
+} status_queue_cell_t;
+
+typedef struct {
+	status_queue_cell_t cells[STATUS_QUEUE_SIZE];
+	ftl_atomic_t enqueue_pos;
+	ftl_atomic_t dequeue_pos; /*only written by the consumer*/
+	ftl_status_msg_t coalesced[STATUS_COALESCED_TYPES];
+	ftl_atomic_t coalesced_state[STATUS_COALESCED_TYPES];
+	ftl_atomic_t coalesced_pos[STATUS_COALESCED_TYPES]; /*enqueue_pos when the slot was filled*/
+	ftl_atomic_t dropped;
+	BOOL push_mode; /*delivered by the event loop through the status callback, the semaphore isn't used*/
 #ifdef _WIN32
-	HANDLE mutex;
 	HANDLE sem;
 #else
-	pthread_mutex_t mutex;
 	sem_t sem;
 #endif
 }status_queue_t;
 
 #ifndef _WIN32
-pthread_mutexattr_t ftl_default_mutexattr;
+extern pthread_mutexattr_t ftl_default_mutexattr; /*set up once by ftl_init, read only after that*/
+#endif
+
+/*
+ * Where a handle's log messages go. The level is checked by FTL_LOG before anything is formatted. In
+ * async mode messages are formatted straight into a lock free ring and a thread of the handle's own calls
+ * func, so the media threads never wait on the application's log handler.
+ */
+struct ftl_log_ring;
+
+typedef struct {
+	ftl_logging_function_t func;
+	ftl_log_callback_t callback; /*takes precedence over func*/
+	void *callback_data;
+	ftl_atomic_t level;
+	ftl_allocator_t allocator;
+	struct ftl_log_ring *ring; /*NULL calls func synchronously on the caller's thread*/
+#ifdef _WIN32
+	HANDLE mutex; /*serializes synchronous calls of this logger only*/
+#else
+	pthread_mutex_t mutex;
 #endif
+} ftl_logger_t;
+
+/*all internal times are int64_t ns read from the handle's (or context's) clock, with integer arithmetic only*/
+#define NS_PER_US 1000LL
+#define NS_PER_MS 1000000LL
+#define NS_PER_SEC 1000000000LL
+
+typedef struct {
+	ftl_clock_function_t now;
+	void *user_data;
+} ftl_clock_t;
+
+#define ftl_clock_now(clock) ((clock)->now((clock)->user_data))
+/*ns to ms for poll and sleep timeouts, rounded up so we don't wake just before a deadline*/
+#define ns_to_timeout_ms(ns) ((ns) > 0 ? (int)(((ns) + NS_PER_MS - 1) / NS_PER_MS) : 0)
 
 /**
  * This configuration structure handles basic information for a struct such
@@ -114,11 +258,12 @@ pthread_mutexattr_t ftl_default_mutexattr;
 typedef struct {
 	uint8_t packet[MAX_PACKET_BUFFER];
 	int len;
-	struct timeval insert_time;
-	struct timeval xmit_time;
+	int64_t insert_time; /*ns on the stream's clock*/
+	int64_t xmit_time;
 	int sn;
 	int first;/*first packet in frame*/
 	int last; /*last packet in frame*/
+	int key; /*first packet of an sps, where a migration may switch ingests*/
 #ifdef _WIN32
 	HANDLE mutex;
 #else
@@ -126,21 +271,67 @@ typedef struct {
 #endif
 }nack_slot_t;
 
+/*
+ * Per component counters. The media path only ever adds to them with relaxed atomics, the stats timer
+ * samples them and works from the differences, so nobody has to reset them under a lock.
+ */
+typedef enum {
+	MEDIA_STAT_FRAMES_QUEUED,
+	MEDIA_STAT_FRAMES_DROPPED,
+	MEDIA_STAT_PACKETS_QUEUED,
+	MEDIA_STAT_BYTES_QUEUED,
+	MEDIA_STAT_FRAMES_SENT,
+	MEDIA_STAT_PACKETS_SENT,
+	MEDIA_STAT_BYTES_SENT,
+	MEDIA_STAT_PACKETS_NACKED,
+	MEDIA_STAT_PACKETS_RESENT,
+	MEDIA_STAT_PACKETS_LATE,
+	MEDIA_STAT_COUNT
+} media_stat_t;
+
+#define media_stat_add(mc, stat, n) ftl_atomic_add_relaxed(&(mc)->stats.counters[(stat)], (n))
+
 typedef struct {
-	int frames_received;
-	int frames_sent;
-	int bytes_queued;
-	int packets_queued;
-	int bytes_sent;
-	int packets_sent;
-	int late_packets;
-	int lost_packets;
-	int nack_requests;
-	int dropped_frames;
-	int test_frame_count;
-	uint32_t old_ts_step;
+	ftl_atomic_t counters[MEDIA_STAT_COUNT];
+	ftl_atomic_t max_frame_size; /*largest frame since the last sample*/
+	int frame_bytes; /*size of the frame being queued, only touched by the thread sending media*/
 }media_stats_t;
 
+typedef struct {
+	int64_t time;
+	unsigned long counters[MEDIA_STAT_COUNT];
+	int max_frame_size;
+}media_stats_sample_t;
+
+/*
+ * Log-linear latency histogram in microseconds: values below 2^HISTOGRAM_SUB_BITS get a bucket each, above
+ * that every power of 2 is split into 2^HISTOGRAM_SUB_BITS buckets. Fixed size, recording is one relaxed
+ * atomic add, so any thread can record into it.
+ */
+typedef struct {
+	ftl_atomic_t counts[HISTOGRAM_BUCKETS];
+	ftl_atomic_t max;
+}ftl_histogram_t;
+
+typedef enum {
+	MEDIA_LATENCY_QUEUE, /*video packet queued until handed to the kernel*/
+	MEDIA_LATENCY_PACER_OVERSHOOT, /*how much later than asked the pacer ran again*/
+	MEDIA_LATENCY_NACK_RESPONSE, /*nack received until the retransmit was handed to the kernel*/
+	MEDIA_LATENCY_FRAME_SPREAD, /*first until last packet of a video frame handed to the kernel*/
+	MEDIA_LATENCY_COUNT
+} media_latency_t;
+
+/*owned by whichever thread runs the media timers*/
+typedef struct {
+	media_stats_sample_t samples[STATS_WINDOW_SAMPLES + 1];
+	int newest;
+	int count;
+	uint64_t totals[MEDIA_STAT_COUNT];
+	uint64_t reported[MEDIA_STAT_COUNT]; /*totals when the last status message was queued*/
+	int reported_max_frame_size; /*largest frame since then*/
+	int64_t reported_time;
+}media_stats_window_t;
+
 typedef struct {
 	uint8_t payload_type;
 	uint32_t ssrc;
@@ -154,14 +345,19 @@ typedef struct {
 	int producer;
 	int consumer;
 	uint16_t xmit_seq_num;
+	ftl_atomic_t bytes_queued; /*of the packets between xmit_seq_num and seq_num, only kept for video*/
 	nack_slot_t *nack_slots[NACK_RB_SIZE];
 #ifdef _WIN32
 	HANDLE pkt_ready;
+	HANDLE slot_freed; /*posted by the pacer when a full queue gets room*/
 #else
 	sem_t pkt_ready;
+	sem_t slot_freed;
 #endif
-	struct timeval stats_tv;
 	media_stats_t stats;
+	media_stats_window_t stats_window;
+	BOOL frame_in_flight; /*the pacer has sent the first packet of a frame but not the last*/
+	int64_t frame_first_xmit;
 }ftl_media_component_common_t;
 
 typedef struct {
@@ -178,11 +374,17 @@ typedef struct {
   float frame_rate;
   uint8_t fua_nalu_type;
   BOOL wait_for_idr_frame;
+  uint8_t sps[MAX_PARAM_SET_LEN]; //last parameter sets queued, 0 length until the encoder sent one
+  int sps_len;
+  uint8_t pps[MAX_PARAM_SET_LEN];
+  int pps_len;
+  BOOL resend_param_sets; //put the cached ones in front of the next frame, set by a resume
   ftl_media_component_common_t media_component;
 } ftl_video_component_t;
 
 typedef struct {
-	struct sockaddr_in server_addr;
+	struct sockaddr_storage server_addr;
+	socklen_t server_addrlen;
 	SOCKET media_socket;
 #ifdef _WIN32
 	HANDLE mutex;
@@ -190,40 +392,188 @@ typedef struct {
 	pthread_mutex_t mutex;
 #endif
 	int assigned_port;
-	BOOL recv_thread_running;
 	BOOL send_thread_running;
 #ifdef _WIN32
-	HANDLE recv_thread_handle;
-	DWORD recv_thread_id;
 	HANDLE send_thread_handle;
 	DWORD send_thread_id;
 #else
-	pthread_t recv_thread;
 	pthread_t send_thread;
 #endif
 	int max_mtu;
+	BOOL pmtud_enabled;
+	int mtu_floor; /*largest size known to reach the ingest*/
+	int mtu_ceiling; /*smallest size known to be too large*/
+	int probe_mtu; /*size of the probe awaiting an echo from the ingest, 0 if none*/
+	int probe_tries;
+	int max_probe_mtu;
+	int64_t next_mtu_probe;
+	int unreachable_count;
+	int64_t first_unreachable;
+	BOOL ingest_unreachable; /*icmp says nobody is listening on the media port any more*/
+	BOOL suspended; /*the control connection was lost, everything is kept for ftl_ingest_connect to resume*/
+	BOOL kernel_pacing; /*packets carry SO_TXTIME departure times and the fq qdisc paces them*/
+	struct ftl_uring *uring; /*NULL unless media goes through io_uring*/
+	int bytes_per_ms;
+	int transmit_level; /*leaky bucket level in bytes*/
+	int64_t pacer_time; /*when the bucket was last filled*/
+	int64_t departure; /*kernel pacing: when the next packet may leave, in ftl_socket_txtime_now ns*/
+	BOOL pacer_started;
+	BOOL pacer_holding; /*the pacer has taken a pkt_ready count it hasn't sent yet*/
+	BOOL pacer_waiting; /*the pacer asked to run again at pacer_wake*/
+	int64_t pacer_wake;
+	int64_t next_stats;
+	int stats_samples; /*counts up to the next stats status message*/
+	ftl_histogram_t latency[MEDIA_LATENCY_COUNT];
 } ftl_media_config_t;
 
+typedef struct ftl_poller ftl_poller_t;
+
+struct _ftl_stream_configuration_private_t;
+
+struct _ftl_context_worker_t;
+
+/*a socket registered with the event loop and what to call when it is readable*/
+typedef struct {
+	SOCKET sock;
+	BOOL (*ready)(struct _ftl_stream_configuration_private_t *ftl);
+	struct _ftl_stream_configuration_private_t *ftl;
+} ftl_io_watch_t;
+
+typedef struct {
+	ftl_poller_t *poller;
+	BOOL running;
+	BOOL started;
+	ftl_io_watch_t control_watch;
+	ftl_io_watch_t media_watch;
+#ifdef _WIN32
+	HANDLE thread_handle;
+	DWORD thread_id;
+#else
+	pthread_t thread;
+#endif
+	/*the rest is only used when the stream runs on a shared context, guarded by the context mutex*/
+	struct _ftl_context_worker_t *worker;
+	BOOL kicked; /*new media is queued*/
+	BOOL detach_pending;
+#ifdef _WIN32
+	HANDLE detached;
+#else
+	sem_t detached;
+#endif
+	struct _ftl_stream_configuration_private_t *next_handle, *prev_handle; /*owned only by the worker from here on*/
+	struct _ftl_stream_configuration_private_t *next_timer, *prev_timer;
+	int64_t timer_due; /*ms, -1 if not on the timer wheel*/
+} ftl_event_loop_t;
+
+typedef struct _ftl_context_worker_t {
+	struct _ftl_context_private_t *context;
+	int index;
+	ftl_poller_t *poller;
+	struct _ftl_stream_configuration_private_t *inbox; /*streams handed to this worker, guarded by the context mutex*/
+	int handle_count; /*including the inbox, guarded by the context mutex*/
+	struct _ftl_stream_configuration_private_t *handles;
+	struct _ftl_stream_configuration_private_t *wheel[TIMER_WHEEL_SLOTS];
+	int64_t wheel_ms;
+	int load; /*percent of the last rebalance interval spent working*/
+	int64_t busy_ns;
+	int64_t load_window_start; /*ns on the os clock*/
+#ifdef _WIN32
+	HANDLE thread_handle;
+	DWORD thread_id;
+#else
+	pthread_t thread;
+#endif
+} ftl_context_worker_t;
+
+typedef struct _ftl_context_private_t {
+	BOOL running;
+	int worker_count;
+	ftl_thread_params_t thread_params;
+	ftl_allocator_t allocator;
+	ftl_logger_t log;
+	ftl_clock_t clock;
+	ftl_context_worker_t *workers;
+#ifdef _WIN32
+	HANDLE mutex;
+#else
+	pthread_mutex_t mutex;
+#endif
+} ftl_context_private_t;
+
+typedef enum {
+	MIGRATION_NONE,
+	MIGRATION_READY, /*the new session is up, media switches to it at the next key frame*/
+	MIGRATION_SWITCHED /*media goes to the new session, the event loop still has to retire the old one*/
+} ftl_migration_state_t;
+
+/*a control connection that has been through CONNECT and the metadata, not yet the stream's*/
 typedef struct {
+	uint32_t channel_id;
+	char key[MAX_KEY_LEN];
+	char hmac[512];
+	SOCKET sock;
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	int assigned_port;
+	ftl_connect_stats_t timings;
+} ftl_ingest_session_t;
+
+/*
+ * Make before break move to another ingest. The caller's thread sets up the new session and media socket
+ * while media keeps flowing, the pacer switches sockets under the media mutex in front of the next key
+ * frame and the event loop then closes the old session. Once switched the fields hold the old sockets.
+ */
+typedef struct {
+	ftl_atomic_t state;
+	ftl_ingest_session_t session;
+	SOCKET media_socket;
+	struct ftl_uring *uring;
+	BOOL pmtud_enabled;
+#ifdef _WIN32
+	HANDLE retired; /*posted once the old session is closed and state is back to none*/
+#else
+	sem_t retired;
+#endif
+} ftl_migration_t;
+
+typedef struct _ftl_stream_configuration_private_t {
   SOCKET ingest_socket;
   int connected;
   int ready_for_media;
-  char ingest_ip[16];//ipv4 only
+  char ingest_ip[INET6_ADDRSTRLEN]; //address we are connected to, for logging
+  struct sockaddr_storage ingest_addr; //control and media both go to this address
+  socklen_t ingest_addrlen;
+  struct sockaddr_storage ingest_candidates[MAX_INGEST_CANDIDATES]; //resolved once so revolving dns cant split control and media
+  socklen_t ingest_candidate_lens[MAX_INGEST_CANDIDATES];
+  int64_t ingest_candidate_failed[MAX_INGEST_CANDIDATES]; //os clock ns the address last failed at, 0 if it hasn't
+  int ingest_candidate_count;
   uint32_t channel_id;
   char *key;
   char hmacBuffer[512];
   int video_kbps;
-#ifdef _WIN32
-  HANDLE connection_thread_handle;
-  DWORD connection_thread_id;
-#else
-  pthread_t connection_thread;
-#endif
+  int socket_send_buf;
+  int socket_recv_buf;
+  BOOL kernel_pacing;
+  BOOL io_uring;
+  ftl_thread_params_t thread_params;
+  ftl_allocator_t allocator;
+  ftl_logger_t log;
+  ftl_clock_t clock; /*the context's when the stream runs on one*/
+  ftl_context_private_t *context; /*NULL when the stream has its own threads*/
+  ftl_event_loop_t event_loop;
   ftl_media_config_t media;
   ftl_audio_component_t audio;
   ftl_video_component_t video;
 
   status_queue_t status_q;
+  ftl_status_callback_t status_callback;
+  void *status_callback_data;
+  int status_callback_batch;
+
+  ftl_connect_stats_t connect_stats; /*of the last connect or migration*/
+  ftl_migration_t migration;
+  ftl_atomic_t stats_seq; /*odd while the snapshot is being written*/
+  ftl_stats_t stats_snapshot;
 
 }  ftl_stream_configuration_private_t;
 
@@ -253,10 +603,27 @@ typedef enum {
  * Logs something to the FTL logs
  */
 
-#define FTL_LOG(log_level, ...) ftl_log_message (log_level, __FILE__, __LINE__, __VA_ARGS__);
-void ftl_logging_init(); /* Sets the callback to 0 disabling it */
-void ftl_register_log_handler(ftl_logging_function_t log_func);
-void ftl_log_message(ftl_log_severity_t log_level, const char * file, int lineno, const char * fmt, ...);
+#define ftl_log_enabled(logger, log_level) ((int)(log_level) <= ((logger) != NULL ? (int)ftl_atomic_load_relaxed(&(logger)->level) : (int)FTL_LOG_DEBUG))
+#define FTL_LOG_TO(logger, log_level, ...) do { \
+    ftl_logger_t *_ftl_logger = (logger); \
+    if (ftl_log_enabled(_ftl_logger, (log_level))) { \
+      ftl_log_message(_ftl_logger, (log_level), __FILE__, __LINE__, __VA_ARGS__); \
+    } \
+  } while (0)
+/* logs to the stream's (or context's) logger, FTL_LOG_TO(NULL, ...) writes to stderr */
+#define FTL_LOG(ftl, log_level, ...) FTL_LOG_TO(&(ftl)->log, log_level, __VA_ARGS__)
+void ftl_log_message(ftl_logger_t *log, ftl_log_severity_t log_level, const char * file, int lineno, const char * fmt, ...);
+ftl_status_t ftl_logger_init(ftl_logger_t *log, ftl_logging_function_t func, ftl_log_callback_t callback, void *callback_data, const ftl_allocator_t *allocator, BOOL async, const ftl_thread_params_t *thread_params);
+void ftl_logger_destroy(ftl_logger_t *log);
+
+/**
+ * Per handle allocation, through the application's allocator if it gave one
+ */
+
+void ftl_allocator_init(ftl_allocator_t *allocator, const ftl_allocator_t *user);
+void *ftl_alloc(const ftl_allocator_t *allocator, size_t size);
+void *ftl_calloc(const ftl_allocator_t *allocator, size_t count, size_t size);
+void ftl_free(const ftl_allocator_t *allocator, void *ptr);
 
 /**
  * Value to string conversion functions
@@ -264,14 +631,18 @@ void ftl_log_message(ftl_log_severity_t log_level, const char * file, int lineno
 
 const char * ftl_audio_codec_to_string(ftl_audio_codec_t codec);
 const char * ftl_video_codec_to_string(ftl_video_codec_t codec);
+const char * ftl_sockaddr_to_string(struct sockaddr_storage *addr, socklen_t addrlen, char *buf, int buflen);
+void ftl_sockaddr_set_port(struct sockaddr_storage *addr, int port);
 
 /**
  * Functions related to the charon prootocol itself
  **/
 
-int recv_all(SOCKET sock, char * buf, int buflen, const char line_terminator);
+int recv_all(ftl_logger_t *log, SOCKET sock, char * buf, int buflen, const char line_terminator);
 
-int ftl_get_hmac(SOCKET sock, char * auth_key, char * dst);
+int ftl_get_hmac(ftl_logger_t *log, SOCKET sock, char * auth_key, char * dst);
+int ftl_sign_nonce(ftl_logger_t *log, const char *buf, int string_len, char * auth_key, char * dst);
+unsigned char decode_hex_char(char c);
 ftl_response_code_t ftl_read_response_code(const char * response_str);
 int ftl_read_media_port(const char *response_str);
 
@@ -279,30 +650,97 @@ int ftl_read_media_port(const char *response_str);
  * Platform abstractions
  **/
 
-// FIXME: make this less global
-extern char error_message[1000];
-
-void ftl_register_log_handler(ftl_logging_function_t log_func);
-
 void ftl_init_sockets();
 int ftl_close_socket(SOCKET sock);
 char * ftl_get_socket_error();
 int ftl_set_socket_recv_timeout(SOCKET socket, int ms_timeout);
 int ftl_set_socket_send_timeout(SOCKET socket, int ms_timeout);
 int ftl_set_socket_enable_keepalive(SOCKET socket);
+int ftl_set_socket_nodelay(SOCKET socket);
 int ftl_set_socket_send_buf(SOCKET socket, int buffer_space);
+int ftl_set_socket_recv_buf(SOCKET socket, int buffer_space);
+int ftl_get_socket_send_buf(SOCKET socket);
+int ftl_get_socket_recv_buf(SOCKET socket);
+int ftl_send_batch(SOCKET socket, uint8_t **bufs, int *lens, int count);
+int ftl_socket_error_is_unreachable();
+int ftl_socket_qdisc_supports_txtime(SOCKET socket);
+int ftl_set_socket_txtime(SOCKET socket);
+int64_t ftl_socket_txtime_now();
+int ftl_send_batch_txtime(SOCKET socket, uint8_t **bufs, int *lens, int64_t *txtimes, int count);
+int ftl_set_socket_dont_fragment(SOCKET socket, int family, int enable);
+int ftl_socket_error_is_msg_too_big();
+int ftl_set_socket_nonblocking(SOCKET socket, int enable);
+int ftl_socket_error_is_in_progress();
+int ftl_socket_error_is_transient();
+int ftl_get_socket_pending_error(SOCKET socket);
+int ftl_poll(struct pollfd *fds, int nfds, int ms_timeout);
+int ftl_recv_batch(SOCKET socket, uint8_t **bufs, int *lens, int count);
+ftl_poller_t *ftl_poller_create(const ftl_allocator_t *allocator);
+void ftl_poller_destroy(ftl_poller_t *poller);
+int ftl_poller_add(ftl_poller_t *poller, SOCKET socket, void *ctx);
+int ftl_poller_remove(ftl_poller_t *poller, SOCKET socket);
+int ftl_poller_wait(ftl_poller_t *poller, void **ready, int max_ready, int ms_timeout);
+void ftl_poller_wake(ftl_poller_t *poller);
+typedef struct ftl_uring ftl_uring_t;
+#ifdef FTL_HAVE_IO_URING
+ftl_uring_t *ftl_uring_create(ftl_logger_t *log, SOCKET sock);
+void ftl_uring_destroy(ftl_uring_t *ring);
+int ftl_uring_send_batch(ftl_uring_t *ring, uint8_t **bufs, int *lens, int64_t *txtimes, int count);
+SOCKET ftl_uring_recv_fd(ftl_uring_t *ring);
+int ftl_uring_recv_batch(ftl_uring_t *ring, uint8_t **bufs, int *lens, int count);
+#endif
+ftl_status_t status_queue_init(status_queue_t *q, BOOL push_mode);
+void status_queue_destroy(status_queue_t *q);
 int dequeue_status_msg(ftl_stream_configuration_private_t *ftl, ftl_status_msg_t *stats_msg, int ms_timeout);
 int enqueue_status_msg(ftl_stream_configuration_private_t *ftl, ftl_status_msg_t *stats_msg);
+void deliver_status_msgs(ftl_stream_configuration_private_t *ftl);
 
 ftl_status_t _ingest_connect(ftl_stream_configuration_private_t *stream_config);
 ftl_status_t _ingest_disconnect(ftl_stream_configuration_private_t *stream_config);
+ftl_status_t _ingest_probe(ftl_stream_configuration_private_t *ftl, const char **hostnames, int count, int *best, struct sockaddr_storage *addr, socklen_t *addrlen);
+BOOL _ingest_control_ready(ftl_stream_configuration_private_t *stream_config);
+ftl_status_t _ingest_migrate(ftl_stream_configuration_private_t *ftl, uint32_t channel_id, const char *key);
+void _ingest_migration_finish(ftl_stream_configuration_private_t *ftl, BOOL disconnect);
+void _ingest_migration_settle(ftl_stream_configuration_private_t *ftl);
+
+ftl_status_t event_loop_start(ftl_stream_configuration_private_t *ftl);
+void event_loop_stop(ftl_stream_configuration_private_t *ftl);
+void event_loop_wake(ftl_stream_configuration_private_t *ftl);
+void event_loop_notify(ftl_stream_configuration_private_t *ftl);
+void event_loop_connection_lost(ftl_stream_configuration_private_t *ftl);
+void event_loop_replace_sockets(ftl_stream_configuration_private_t *ftl, SOCKET control_sock, SOCKET media_sock);
+
+ftl_status_t context_attach(ftl_stream_configuration_private_t *ftl);
+void context_detach(ftl_stream_configuration_private_t *ftl);
+void context_kick(ftl_stream_configuration_private_t *ftl);
 
 ftl_status_t media_init(ftl_stream_configuration_private_t *ftl);
 ftl_status_t media_destroy(ftl_stream_configuration_private_t *ftl);
-int media_send_video(ftl_stream_configuration_private_t *ftl, uint8_t *data, int32_t len, int end_of_frame);
-int media_send_audio(ftl_stream_configuration_private_t *ftl, uint8_t *data, int32_t len);
+ftl_status_t media_resume(ftl_stream_configuration_private_t *ftl);
+ftl_status_t media_migrate_prepare(ftl_stream_configuration_private_t *ftl);
+BOOL media_migrate_switch(ftl_stream_configuration_private_t *ftl);
+BOOL media_migrate_cancel(ftl_stream_configuration_private_t *ftl);
+void media_migrate_release(ftl_stream_configuration_private_t *ftl);
+int media_send_video(ftl_stream_configuration_private_t *ftl, uint8_t *data, int32_t len, int end_of_frame, int ms_timeout, ftl_status_t *drop_reason);
+int media_send_audio(ftl_stream_configuration_private_t *ftl, uint8_t *data, int32_t len, ftl_status_t *drop_reason);
+int media_get_queue_depth_ms(ftl_stream_configuration_private_t *ftl);
+BOOL media_recv(ftl_stream_configuration_private_t *ftl);
+int media_run_timers(ftl_stream_configuration_private_t *ftl, int64_t now);
+int media_pace(ftl_stream_configuration_private_t *ftl, int64_t now);
+SOCKET media_get_recv_socket(ftl_stream_configuration_private_t *ftl);
+
+void stats_reset(ftl_stream_configuration_private_t *ftl);
+void stats_sample(ftl_stream_configuration_private_t *ftl, int64_t now, BOOL report);
+void stats_get_snapshot(ftl_stream_configuration_private_t *ftl, ftl_stats_t *stats);
+void stats_frame_queued(ftl_media_component_common_t *mc, int frame_bytes);
+void stats_connected(ftl_stream_configuration_private_t *ftl);
+void histogram_record(ftl_histogram_t *h, int64_t us);
 
 void sleep_ms(int ms);
+int64_t ftl_monotonic_ns();
+void ftl_clock_init(ftl_clock_t *clock, ftl_clock_function_t func, void *user_data);
+int ftl_get_cpu_count();
+void ftl_thread_setup(ftl_logger_t *log, const char *name, const ftl_thread_params_t *params, BOOL latency_sensitive);
 
 #if defined(_MSC_VER) && _MSC_VER < 1900
 #define snprintf _snprintf
@@ -90,3 +90,18 @@ float timeval_to_ms(struct timeval *tv) {
 
 	return sec * 1000 + usec / 1000;
 }
+
+void timeval_add_ms(struct timeval *tv, int ms) {
+	tv->tv_sec += ms / 1000;
+	tv->tv_usec += (ms % 1000) * 1000;
+
+	if (tv->tv_usec >= 1000000) {
+		tv->tv_sec++;
+		tv->tv_usec -= 1000000;
+	}
+}
+
+/* Return 1 if x is earlier than y. */
+int timeval_before(struct timeval *x, struct timeval *y) {
+	return x->tv_sec < y->tv_sec || (x->tv_sec == y->tv_sec && x->tv_usec < y->tv_usec);
+}
@@ -12,5 +12,7 @@ int gettimeofday(struct timeval * tp, struct timezone * tzp);
 #endif
 int timeval_subtract(struct timeval *result, struct timeval *x, struct timeval *y);
 float timeval_to_ms(struct timeval *tv);
+void timeval_add_ms(struct timeval *tv, int ms);
+int timeval_before(struct timeval *x, struct timeval *y);
 
 #endif // __GETTIMEOFDAY_H
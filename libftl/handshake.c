@@ -28,193 +28,147 @@
 #include <sys/time.h>
 #include <stdarg.h>
 
-#ifdef _WIN32
-DWORD WINAPI connection_status_thread(LPVOID data);
-#else
-static void *connection_status_thread(void *data);
-#endif
-
-static ftl_response_code_t _ftl_send_command(ftl_stream_configuration_private_t *ftl_cfg, BOOL need_response, char *response_buf, int response_len, const char *cmd_fmt, ...);
-ftl_status_t _log_response(int response_code);
-
-ftl_status_t _ingest_connect(ftl_stream_configuration_private_t *stream_config) {
+static SOCKET _ingest_race_connect(ftl_stream_configuration_private_t *ftl, ftl_ingest_session_t *session);
+static ftl_response_code_t _ftl_send_command(ftl_stream_configuration_private_t *ftl_cfg, SOCKET sock, BOOL need_response, char *response_buf, int response_len, const char *cmd_fmt, ...);
+static ftl_response_code_t _ingest_exchange(ftl_stream_configuration_private_t *ftl, SOCKET sock, const char *buf, int len, BOOL need_response, char *response_buf, int response_len);
+static int _ingest_vappend(char *buf, int len, int size, const char *fmt, va_list args);
+static int _ingest_append(char *buf, int len, int size, const char *fmt, ...);
+ftl_status_t _log_response(ftl_stream_configuration_private_t *ftl, int response_code);
+
+/*
+ * Opens a control connection to one of the candidates and takes it through authentication and the
+ * metadata as session->channel_id with session->key. Nothing of the stream's own session is touched, so
+ * a migration can run this while the stream carries on.
+ */
+static ftl_status_t _ingest_handshake(ftl_stream_configuration_private_t *stream_config, ftl_ingest_session_t *session) {
   ftl_response_code_t response_code = FTL_INGEST_RESP_UNKNOWN;
 
-  int err = 0;
   SOCKET sock = 0;
-  struct addrinfo hints;
-  memset(&hints, 0, sizeof(hints));
-
-  hints.ai_family = AF_UNSPEC;
-  hints.ai_socktype = SOCK_STREAM;
-  hints.ai_protocol = 0;
-
-  struct addrinfo* resolved_names = 0;
-  struct addrinfo* p = 0;
-
-  int ingest_port = INGEST_PORT;
-  char ingest_port_str[10];
   char response[MAX_INGEST_COMMAND_LEN];
+  char metadata[MAX_INGEST_METADATA_LEN];
+  ftl_connect_stats_t *timings = &session->timings;
+  int64_t step;
+  int len;
 
-  if (stream_config->connected) {
-	  return FTL_ALREADY_CONNECTED;
-  }
-
-  snprintf(ingest_port_str, 10, "%d", ingest_port);
-  
-  err = getaddrinfo(stream_config->ingest_ip, ingest_port_str, &hints, &resolved_names);
-  if (err != 0) {
-    FTL_LOG(FTL_LOG_ERROR, "getaddrinfo failed to look up ingest address %s.", stream_config->ingest_ip);
-    FTL_LOG(FTL_LOG_ERROR, "gai error was: %s", gai_strerror(err));
-    return FTL_DNS_FAILURE;
-  }
-  
-  /* Open a socket to the control port */
-  for (p = resolved_names; p != NULL; p = p->ai_next) {
-    sock = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
-    if (sock == -1) {
-      /* try the next candidate */
-      FTL_LOG(FTL_LOG_DEBUG, "failed to create socket. error: %s", ftl_get_socket_error());
-      continue;
-    }
-
-    /* Go for broke */
-    if (connect (sock, p->ai_addr, p->ai_addrlen) == -1) {
-      FTL_LOG(FTL_LOG_DEBUG, "failed to connect on candidate, error: %s", ftl_get_socket_error());
-      ftl_close_socket(sock);
-      sock = 0;
-      continue;
-    }
-
-    /* If we got here, we successfully connected */
-	if (ftl_set_socket_enable_keepalive(sock) != 0) {
-		FTL_LOG(FTL_LOG_DEBUG, "failed to enable keep alives.  error: %s", ftl_get_socket_error());
-	}
-
-	if (ftl_set_socket_recv_timeout(sock, SOCKET_RECV_TIMEOUT_MS) != 0) {
-		FTL_LOG(FTL_LOG_DEBUG, "failed to set recv timeout.  error: %s", ftl_get_socket_error());
-	}
-
-	if (ftl_set_socket_send_timeout(sock, SOCKET_SEND_TIMEOUT_MS) != 0) {
-		FTL_LOG(FTL_LOG_DEBUG, "failed to set send timeout.  error: %s", ftl_get_socket_error());
-	}
-
-    break;
-  }
+  memset(timings, 0, sizeof(*timings));
 
-  /* Free the resolved name struct */
-  freeaddrinfo(resolved_names);
-  
-  /* Check to see if we actually connected */
-  if (sock <= 0) {
-    FTL_LOG(FTL_LOG_ERROR, "failed to connect to ingest. Last error was: %s",
-            ftl_get_socket_error());
+  /* Open a socket to the control port, the winner has already had its nonce signed */
+  if ((sock = _ingest_race_connect(stream_config, session)) == INVALID_SOCKET) {
+    FTL_LOG(stream_config, FTL_LOG_ERROR, "failed to connect to ingest");
     return FTL_CONNECT_ERROR;
   }
 
-  stream_config->ingest_socket = sock;
-  
-  if(!ftl_get_hmac(stream_config->ingest_socket, stream_config->key, stream_config->hmacBuffer)) {
-    FTL_LOG(FTL_LOG_ERROR, "could not get a signed HMAC!");
-    response_code = FTL_INTERNAL_ERROR;
-    goto fail;    
+  /* If we got here, we successfully connected */
+  if (ftl_set_socket_enable_keepalive(sock) != 0) {
+	  FTL_LOG(stream_config, FTL_LOG_DEBUG, "failed to enable keep alives.  error: %s", ftl_get_socket_error());
   }
 
-  if ( (response_code = _ftl_send_command(stream_config, TRUE, response, sizeof(response), "CONNECT %d $%s", stream_config->channel_id, stream_config->hmacBuffer)) != FTL_INGEST_RESP_OK) {
-    FTL_LOG(FTL_LOG_ERROR, "ingest did not accept our authkey. Returned response code was %d", response_code);
-    response_code = FTL_STREAM_REJECTED;
-    goto fail;
+  /* every command is a whole request, there is nothing for Nagle to coalesce it with */
+  if (ftl_set_socket_nodelay(sock) != 0) {
+	  FTL_LOG(stream_config, FTL_LOG_DEBUG, "failed to disable nagle.  error: %s", ftl_get_socket_error());
   }
 
-  /* We always send our version component first */
-  if ((response_code = _ftl_send_command(stream_config, FALSE, response, sizeof(response), "ProtocolVersion: %d.%d", FTL_VERSION_MAJOR, FTL_VERSION_MINOR)) != FTL_INGEST_RESP_OK){
-    response_code = FTL_OLD_VERSION;
-    goto fail;
-  }  
-
-  /* Cool. Now ingest wants our stream meta-data, which we send as key-value pairs, followed by a "." */
-  ftl_video_component_t *video = &stream_config->video;
-  /* We're sending video */
-  if ((response_code = _ftl_send_command(stream_config, FALSE, response, sizeof(response), "Video: true")) != FTL_INGEST_RESP_OK){
-    goto fail;
+  if (ftl_set_socket_recv_timeout(sock, SOCKET_RECV_TIMEOUT_MS) != 0) {
+	  FTL_LOG(stream_config, FTL_LOG_DEBUG, "failed to set recv timeout.  error: %s", ftl_get_socket_error());
   }
 
-  if ((response_code = _ftl_send_command(stream_config, FALSE, response, sizeof(response), "VideoCodec: %s", ftl_video_codec_to_string(video->codec))) != FTL_INGEST_RESP_OK){
-    goto fail;
+  if (ftl_set_socket_send_timeout(sock, SOCKET_SEND_TIMEOUT_MS) != 0) {
+	  FTL_LOG(stream_config, FTL_LOG_DEBUG, "failed to set send timeout.  error: %s", ftl_get_socket_error());
   }
 
-  if ((response_code = _ftl_send_command(stream_config, FALSE, response, sizeof(response), "VideoHeight: %d", video->height)) != FTL_INGEST_RESP_OK){
-    goto fail;
-  }
+  step = ftl_monotonic_ns();
 
-  if ((response_code = _ftl_send_command(stream_config, FALSE, response, sizeof(response), "VideoWidth: %d", video->width)) != FTL_INGEST_RESP_OK){
-    goto fail;
-  }
-
-  if ((response_code = _ftl_send_command(stream_config, FALSE, response, sizeof(response), "VideoPayloadType: %d", video->media_component.payload_type)) != FTL_INGEST_RESP_OK){
+  if ( (response_code = _ftl_send_command(stream_config, sock, TRUE, response, sizeof(response), "CONNECT %d $%s", session->channel_id, session->hmac)) != FTL_INGEST_RESP_OK) {
+    FTL_LOG(stream_config, FTL_LOG_ERROR, "ingest did not accept our authkey. Returned response code was %d", response_code);
+    response_code = FTL_STREAM_REJECTED;
     goto fail;
   }
 
-  if ((response_code = _ftl_send_command(stream_config, FALSE, response, sizeof(response), "VideoIngestSSRC: %d", video->media_component.ssrc)) != FTL_INGEST_RESP_OK){
-    goto fail;
-  }
+  timings->auth_us = (int)((ftl_monotonic_ns() - step) / NS_PER_US);
+  step = ftl_monotonic_ns();
 
+  /*
+   * Cool. Now ingest wants our stream meta-data, which we send as key-value pairs, followed by a "."
+   * Only the "." is answered, so the whole block goes out in a single write and costs one round trip.
+   */
+  ftl_video_component_t *video = &stream_config->video;
   ftl_audio_component_t *audio = &stream_config->audio;
 
-  if ((response_code = _ftl_send_command(stream_config, FALSE, response, sizeof(response), "Audio: true")) != FTL_INGEST_RESP_OK){
+  /* We always send our version component first */
+  if ((len = _ingest_append(metadata, 0, sizeof(metadata), "ProtocolVersion: %d.%d", FTL_VERSION_MAJOR, FTL_VERSION_MINOR)) < 0 ||
+    (len = _ingest_append(metadata, len, sizeof(metadata), "Video: true")) < 0 ||
+    (len = _ingest_append(metadata, len, sizeof(metadata), "VideoCodec: %s", ftl_video_codec_to_string(video->codec))) < 0 ||
+    (len = _ingest_append(metadata, len, sizeof(metadata), "VideoHeight: %d", video->height)) < 0 ||
+    (len = _ingest_append(metadata, len, sizeof(metadata), "VideoWidth: %d", video->width)) < 0 ||
+    (len = _ingest_append(metadata, len, sizeof(metadata), "VideoPayloadType: %d", video->media_component.payload_type)) < 0 ||
+    (len = _ingest_append(metadata, len, sizeof(metadata), "VideoIngestSSRC: %d", video->media_component.ssrc)) < 0 ||
+    (len = _ingest_append(metadata, len, sizeof(metadata), "Audio: true")) < 0 ||
+    (len = _ingest_append(metadata, len, sizeof(metadata), "AudioCodec: %s", ftl_audio_codec_to_string(audio->codec))) < 0 ||
+    (len = _ingest_append(metadata, len, sizeof(metadata), "AudioPayloadType: %d", audio->media_component.payload_type)) < 0 ||
+    (len = _ingest_append(metadata, len, sizeof(metadata), "AudioIngestSSRC: %d", audio->media_component.ssrc)) < 0 ||
+    (len = _ingest_append(metadata, len, sizeof(metadata), ".")) < 0) {
+    response_code = FTL_INGEST_RESP_INTERNAL_COMMAND_ERROR;
     goto fail;
   }
 
-  if ((response_code = _ftl_send_command(stream_config, FALSE, response, sizeof(response), "AudioCodec: %s", ftl_audio_codec_to_string(audio->codec))) != FTL_INGEST_RESP_OK){
-    goto fail;
-  }    
-
-  if ((response_code = _ftl_send_command(stream_config, FALSE, response, sizeof(response), "AudioPayloadType: %d", audio->media_component.payload_type)) != FTL_INGEST_RESP_OK){
-    goto fail;
-  }    
-
-  if ((response_code = _ftl_send_command(stream_config, FALSE, response, sizeof(response), "AudioIngestSSRC: %d", audio->media_component.ssrc)) != FTL_INGEST_RESP_OK){
-    goto fail;
-  }                    
-
-  if ( (response_code = _ftl_send_command(stream_config, TRUE, response, sizeof(response), ".")) != FTL_INGEST_RESP_OK){
+  if ((response_code = _ingest_exchange(stream_config, sock, metadata, len, TRUE, response, sizeof(response))) != FTL_INGEST_RESP_OK) {
     goto fail;
   }
 
+  timings->metadata_us = (int)((ftl_monotonic_ns() - step) / NS_PER_US);
+
   /*see if there is a port specified otherwise use default*/
   int port = ftl_read_media_port(response);
 
   if (port < 0) {
-	  stream_config->media.assigned_port = FTL_UDP_MEDIA_PORT; //TODO: receive this from the server
+	  session->assigned_port = FTL_UDP_MEDIA_PORT; //TODO: receive this from the server
   }
   else {
-	  stream_config->media.assigned_port = port;
+	  session->assigned_port = port;
   }
 
-  FTL_LOG(FTL_LOG_INFO, "Successfully connected to ingest.  Media will be sent to port %d", stream_config->media.assigned_port);
-
-  stream_config->connected = 1;
-  
-#ifdef _WIN32
-  if ((stream_config->connection_thread_handle = CreateThread(NULL, 0, connection_status_thread, stream_config, 0, &stream_config->connection_thread_id)) == NULL) {
-#else
-  if ((pthread_create(&stream_config->connection_thread, NULL, connection_status_thread, stream_config)) != 0) {
-#endif
-	  return FTL_MALLOC_FAILURE;
-  }
+  session->sock = sock;
 
   return FTL_SUCCESS;
 
 fail:
-  if (stream_config->ingest_socket <= 0) {
-    ftl_close_socket(stream_config->ingest_socket);
-  }
+  ftl_close_socket(sock);
 
-  response_code = _log_response(response_code);
+  response_code = _log_response(stream_config, response_code);
 
   return response_code;
 }
 
+ftl_status_t _ingest_connect(ftl_stream_configuration_private_t *stream_config) {
+  ftl_ingest_session_t session;
+  ftl_status_t status;
+
+  if (stream_config->connected) {
+	  return FTL_ALREADY_CONNECTED;
+  }
+
+  session.channel_id = stream_config->channel_id;
+  strcpy(session.key, stream_config->key);
+
+  if ((status = _ingest_handshake(stream_config, &session)) != FTL_SUCCESS) {
+    return status;
+  }
+
+  stream_config->ingest_socket = session.sock;
+  stream_config->media.assigned_port = session.assigned_port;
+  memcpy(&stream_config->ingest_addr, &session.addr, sizeof(stream_config->ingest_addr));
+  stream_config->ingest_addrlen = session.addrlen;
+  ftl_sockaddr_to_string(&stream_config->ingest_addr, stream_config->ingest_addrlen, stream_config->ingest_ip, sizeof(stream_config->ingest_ip));
+  strcpy(stream_config->hmacBuffer, session.hmac);
+
+  FTL_LOG(stream_config, FTL_LOG_INFO, "Successfully connected to ingest.  Media will be sent to port %d", stream_config->media.assigned_port);
+
+  stream_config->connected = 1;
+  stream_config->connect_stats = session.timings;
+
+  return FTL_SUCCESS;
+}
+
 ftl_status_t _ingest_disconnect(ftl_stream_configuration_private_t *stream_config) {
 
 	ftl_response_code_t response_code = FTL_INGEST_RESP_UNKNOWN;
@@ -225,166 +179,766 @@ ftl_status_t _ingest_disconnect(ftl_stream_configuration_private_t *stream_confi
 
 		//TODO: once light saber releases this legancy disconnect can go away
 		if (stream_config->media.assigned_port == FTL_UDP_MEDIA_PORT) {
-			FTL_LOG(FTL_LOG_INFO, "Legacy disconnect\n");
+			FTL_LOG(stream_config, FTL_LOG_INFO, "Legacy disconnect\n");
 			/*TODO: we dont need a key to disconnect from a tcp connection*/
-			if (!ftl_get_hmac(stream_config->ingest_socket, stream_config->key, stream_config->hmacBuffer)) {
-				FTL_LOG(FTL_LOG_ERROR, "could not get a signed HMAC!");
+			if (!ftl_get_hmac(&stream_config->log, stream_config->ingest_socket, stream_config->key, stream_config->hmacBuffer)) {
+				FTL_LOG(stream_config, FTL_LOG_ERROR, "could not get a signed HMAC!");
 				response_code = FTL_INTERNAL_ERROR;
 			}
 
-			if ((response_code = _ftl_send_command(stream_config, TRUE, response, sizeof(response), "DISCONNECT %d $%s", stream_config->channel_id, stream_config->hmacBuffer)) != FTL_INGEST_RESP_OK) {
-				FTL_LOG(FTL_LOG_ERROR, "ingest did not accept our authkey. Returned response code was %d\n", response_code);
+			if ((response_code = _ftl_send_command(stream_config, stream_config->ingest_socket, TRUE, response, sizeof(response), "DISCONNECT %d $%s", stream_config->channel_id, stream_config->hmacBuffer)) != FTL_INGEST_RESP_OK) {
+				FTL_LOG(stream_config, FTL_LOG_ERROR, "ingest did not accept our authkey. Returned response code was %d\n", response_code);
 				response_code = response_code;
 			}
 		}
 		else {
-			FTL_LOG(FTL_LOG_INFO, "light-saber disconnect\n");
-			if ((response_code = _ftl_send_command(stream_config, TRUE, response, sizeof(response), "DISCONNECT %d", stream_config->channel_id)) != FTL_INGEST_RESP_OK) {
-				FTL_LOG(FTL_LOG_ERROR, "Ingest Disconnect failed with %d\n", response_code);
+			FTL_LOG(stream_config, FTL_LOG_INFO, "light-saber disconnect\n");
+			if ((response_code = _ftl_send_command(stream_config, stream_config->ingest_socket, TRUE, response, sizeof(response), "DISCONNECT %d", stream_config->channel_id)) != FTL_INGEST_RESP_OK) {
+				FTL_LOG(stream_config, FTL_LOG_ERROR, "Ingest Disconnect failed with %d\n", response_code);
 				response_code = response_code;
 			}
 		}
 	}
 
-	if (stream_config->ingest_socket > 0) {
+	if (stream_config->ingest_socket != INVALID_SOCKET) {
 		ftl_close_socket(stream_config->ingest_socket);
+		stream_config->ingest_socket = INVALID_SOCKET;
 	}
 
 	return FTL_SUCCESS;
 }
 
-static ftl_response_code_t _ftl_send_command(ftl_stream_configuration_private_t *ftl_cfg, BOOL need_response, char *response_buf, int response_len, const char *cmd_fmt, ...){
-  int resp_code = FTL_INGEST_RESP_OK;
-  va_list valist;
-  double sum = 0.0;
-  char *buf = NULL;
+/*
+ * Moves a live stream to the ingest the candidates now point at, authenticating as channel_id with key.
+ * The handshake runs here on the caller's thread while the old session carries on; once it is up the
+ * pacer switches media over in front of the next key frame and the event loop closes the old session.
+ */
+ftl_status_t _ingest_migrate(ftl_stream_configuration_private_t *ftl, uint32_t channel_id, const char *key) {
+  ftl_migration_t *mig = &ftl->migration;
+  ftl_ingest_session_t *session = &mig->session;
+  ftl_status_t status;
+  int64_t start, media_start;
+  char addr_str[INET6_ADDRSTRLEN];
+
+  /*a newer migration replaces one still waiting for its key frame*/
+  if (media_migrate_cancel(ftl)) {
+    FTL_LOG(ftl, FTL_LOG_INFO, "Dropping the migration still waiting for a key frame\n");
+    ftl_close_socket(session->sock);
+    session->sock = INVALID_SOCKET;
+  }
+
+  /*
+   * One that has switched only waits for the event loop to close the old session. That always happens,
+   * a loop that stops or loses the connection first settles the migration on its way out.
+   */
+  while (ftl_atomic_load(&mig->state) != MIGRATION_NONE) {
+#ifdef _WIN32
+    WaitForSingleObject(mig->retired, INFINITE);
+#else
+    while (sem_wait(&mig->retired) != 0 && errno == EINTR);
+#endif
+  }
+
+  if (!ftl->connected) {
+    return FTL_NOT_CONNECTED;
+  }
+
+  /*real time even with a virtual clock, this waits on the network*/
+  start = ftl_monotonic_ns();
+
+  session->channel_id = channel_id;
+  strcpy(session->key, key);
+
+  if ((status = _ingest_handshake(ftl, session)) != FTL_SUCCESS) {
+    return status;
+  }
+
+  media_start = ftl_monotonic_ns();
+
+  if ((status = media_migrate_prepare(ftl)) != FTL_SUCCESS) {
+    ftl_close_socket(session->sock);
+    session->sock = INVALID_SOCKET;
+    return status;
+  }
+
+  session->timings.media_setup_us = (int)((ftl_monotonic_ns() - media_start) / NS_PER_US);
+  session->timings.total_us = (int)((ftl_monotonic_ns() - start) / NS_PER_US);
+
+  FTL_LOG(ftl, FTL_LOG_INFO, "Ready to move to %s in %d us (tcp %d, hmac %d, auth %d, metadata %d, media %d), switching at the next key frame\n",
+    ftl_sockaddr_to_string(&session->addr, session->addrlen, addr_str, sizeof(addr_str)), session->timings.total_us, session->timings.tcp_connect_us,
+    session->timings.hmac_us, session->timings.auth_us, session->timings.metadata_us, session->timings.media_setup_us);
+
+  ftl_atomic_store(&mig->state, MIGRATION_READY);
+
+  return FTL_SUCCESS;
+}
+
+/*
+ * Retires the old session once media has switched, on the event loop or after it has stopped. Closing
+ * the control connection ends the session on the ingest; the DISCONNECT, sent unless the connection is
+ * already gone, only lets it tell a move from a failure.
+ */
+void _ingest_migration_finish(ftl_stream_configuration_private_t *ftl, BOOL disconnect) {
+  ftl_migration_t *mig = &ftl->migration;
+  ftl_status_msg_t status;
+  char old_ip[INET6_ADDRSTRLEN];
+
+  event_loop_replace_sockets(ftl, mig->session.sock, media_get_recv_socket(ftl));
+
+  if (disconnect) {
+    _ftl_send_command(ftl, ftl->ingest_socket, FALSE, NULL, 0, "DISCONNECT %d", ftl->channel_id);
+  }
+  ftl_close_socket(ftl->ingest_socket);
+  media_migrate_release(ftl);
+
+  strcpy(old_ip, ftl->ingest_ip);
+
+  ftl->ingest_socket = mig->session.sock;
+  memcpy(&ftl->ingest_addr, &mig->session.addr, sizeof(ftl->ingest_addr));
+  ftl->ingest_addrlen = mig->session.addrlen;
+  ftl_sockaddr_to_string(&ftl->ingest_addr, ftl->ingest_addrlen, ftl->ingest_ip, sizeof(ftl->ingest_ip));
+  ftl->channel_id = mig->session.channel_id;
+  strcpy(ftl->key, mig->session.key);
+  strcpy(ftl->hmacBuffer, mig->session.hmac);
+  ftl->connect_stats = mig->session.timings;
+  stats_connected(ftl);
+
+  mig->session.sock = INVALID_SOCKET;
+  ftl_atomic_store(&mig->state, MIGRATION_NONE);
+#ifdef _WIN32
+  ReleaseSemaphore(mig->retired, 1, NULL);
+#else
+  sem_post(&mig->retired);
+#endif
+
+  FTL_LOG(ftl, FTL_LOG_INFO, "Moved the stream from %s to %s\n", old_ip, ftl->ingest_ip);
+
+  status.type = FTL_STATUS_EVENT;
+  status.msg.event.reason = FTL_STATUS_EVENT_REASON_API_REQUEST;
+  status.msg.event.type = FTL_STATUS_EVENT_TYPE_MIGRATED;
+
+  enqueue_status_msg(ftl, &status);
+}
+
+/*for when nothing can switch media any more, the event loop has stopped or is tearing the stream down*/
+void _ingest_migration_settle(ftl_stream_configuration_private_t *ftl) {
+  if (media_migrate_cancel(ftl)) {
+    ftl_close_socket(ftl->migration.session.sock);
+    ftl->migration.session.sock = INVALID_SOCKET;
+  }
+  else if (ftl_atomic_load(&ftl->migration.state) == MIGRATION_SWITCHED) {
+    _ingest_migration_finish(ftl, TRUE);
+  }
+}
+
+static SOCKET _ingest_start_connect(ftl_stream_configuration_private_t *ftl, struct sockaddr_storage *addr, socklen_t addrlen) {
+  SOCKET sock;
+
+  if ((sock = socket(addr->ss_family, SOCK_STREAM, IPPROTO_TCP)) == INVALID_SOCKET) {
+    FTL_LOG(ftl, FTL_LOG_DEBUG, "failed to create socket. error: %s", ftl_get_socket_error());
+    return INVALID_SOCKET;
+  }
+
+  if (ftl_set_socket_nonblocking(sock, TRUE) != 0) {
+    FTL_LOG(ftl, FTL_LOG_DEBUG, "failed to make socket non blocking. error: %s", ftl_get_socket_error());
+    ftl_close_socket(sock);
+    return INVALID_SOCKET;
+  }
+
+  if (connect(sock, (struct sockaddr *)addr, addrlen) == SOCKET_ERROR && !ftl_socket_error_is_in_progress()) {
+    FTL_LOG(ftl, FTL_LOG_DEBUG, "failed to connect on candidate, error: %s", ftl_get_socket_error());
+    ftl_close_socket(sock);
+    return INVALID_SOCKET;
+  }
+
+  return sock;
+}
+
+/*one connection in the race, it asks for the nonce as soon as it is up*/
+typedef struct {
+  SOCKET sock;
+  int candidate;
+  BOOL connected;
+  int64_t connect_time;
+  char buf[MAX_INGEST_COMMAND_LEN];
   int len;
-  int buflen = MAX_INGEST_COMMAND_LEN * sizeof(char);
-  char *format = NULL;
+} ingest_attempt_t;
 
+static BOOL _ingest_failed_recently(ftl_stream_configuration_private_t *ftl, int candidate, int64_t now) {
+  return ftl->ingest_candidate_failed[candidate] != 0 && now - ftl->ingest_candidate_failed[candidate] < (int64_t)INGEST_NEGATIVE_CACHE_MS * NS_PER_MS;
+}
+
+/*moves an attempt along when its socket is ready, returns 1 once it has a signed nonce and -1 if it failed*/
+static int _ingest_attempt_step(ftl_stream_configuration_private_t *ftl, ftl_ingest_session_t *session, ingest_attempt_t *a, short revents) {
+  char addr_str[INET6_ADDRSTRLEN];
+  int err, n;
+
+  ftl_sockaddr_to_string(&ftl->ingest_candidates[a->candidate], ftl->ingest_candidate_lens[a->candidate], addr_str, sizeof(addr_str));
+
+  if (!a->connected) {
+    if ((err = ftl_get_socket_pending_error(a->sock)) != 0 || !(revents & POLLOUT)) {
+      FTL_LOG(ftl, FTL_LOG_DEBUG, "failed to connect to %s, error %d", addr_str, err);
+      return -1;
+    }
 
-  if( (buf = (char*)malloc(buflen)) == NULL){
-    resp_code = FTL_INGEST_RESP_INTERNAL_MEMORY_ERROR;
-	goto cleanup;
+    a->connect_time = ftl_monotonic_ns();
+    a->connected = TRUE;
+
+    /*a fresh socket always has room for this*/
+    if (send(a->sock, "HMAC\r\n\r\n", 8, 0) != 8) {
+      FTL_LOG(ftl, FTL_LOG_DEBUG, "failed to ask %s for a nonce, error: %s", addr_str, ftl_get_socket_error());
+      return -1;
+    }
+
+    return 0;
   }
 
-  if( (format = (char*)malloc(strlen(cmd_fmt) + 5)) == NULL){
-    resp_code = FTL_INGEST_RESP_INTERNAL_MEMORY_ERROR;
-	goto cleanup;
+  if ((n = recv(a->sock, a->buf + a->len, sizeof(a->buf) - 1 - a->len, 0)) <= 0) {
+    FTL_LOG(ftl, FTL_LOG_DEBUG, "%s closed the connection before sending a nonce", addr_str);
+    return -1;
   }
 
-  sprintf(format, "%s\r\n\r\n", cmd_fmt);
+  a->len += n;
+  a->buf[a->len] = '\0';
 
-  va_start(valist, cmd_fmt);
+  if (a->buf[a->len - 1] != '\n') {
+    if (a->len == sizeof(a->buf) - 1) {
+      FTL_LOG(ftl, FTL_LOG_DEBUG, "nonce from %s is too long", addr_str);
+      return -1;
+    }
+    return 0;
+  }
+
+  if (!ftl_sign_nonce(&ftl->log, a->buf, a->len, session->key, session->hmac)) {
+    FTL_LOG(ftl, FTL_LOG_DEBUG, "could not sign the nonce from %s", addr_str);
+    return -1;
+  }
+
+  return 1;
+}
+
+/*
+ * Happy Eyeballs (RFC 8305) over every resolved address, carried through to the HMAC nonce. Each address
+ * gets a head start of HAPPY_EYEBALLS_DELAY_MS before the next one is tried in parallel (or immediately,
+ * if every attempt so far has failed). The first connection with a signed nonce wins, so a node that
+ * accepts connections but doesn't answer loses to one that does, and its address is used for the media
+ * channel as well. Addresses that failed in the last INGEST_NEGATIVE_CACHE_MS are tried after the rest.
+ */
+static SOCKET _ingest_race_connect(ftl_stream_configuration_private_t *ftl, ftl_ingest_session_t *session) {
+  ingest_attempt_t attempts[MAX_INGEST_CANDIDATES];
+  struct pollfd fds[MAX_INGEST_CANDIDATES];
+  int fd_idx[MAX_INGEST_CANDIDATES];
+  int order[MAX_INGEST_CANDIDATES];
+  ingest_attempt_t *a;
+  int64_t start, now;
+  int count = ftl->ingest_candidate_count, started = 0, pending = 0, winner = -1;
+  int elapsed_ms, wait_ms, nfds, i, n, result;
+  char addr_str[INET6_ADDRSTRLEN];
+
+  /*real time even with a virtual clock, this waits on the network*/
+  start = ftl_monotonic_ns();
+
+  /*fresh addresses first, recent failures last, each in resolver order*/
+  for (i = 0, n = 0; i < count; i++) {
+    if (!_ingest_failed_recently(ftl, i, start)) {
+      order[n++] = i;
+    }
+  }
+  for (i = 0; i < count; i++) {
+    if (_ingest_failed_recently(ftl, i, start)) {
+      FTL_LOG(ftl, FTL_LOG_DEBUG, "%s failed %d s ago, trying it last", ftl_sockaddr_to_string(&ftl->ingest_candidates[i], ftl->ingest_candidate_lens[i], addr_str, sizeof(addr_str)),
+        (int)((start - ftl->ingest_candidate_failed[i]) / NS_PER_MS / 1000));
+      order[n++] = i;
+    }
+  }
+
+  while (winner < 0) {
+    now = ftl_monotonic_ns();
+    elapsed_ms = (int)((now - start) / NS_PER_MS);
+
+    if (elapsed_ms >= CONNECT_TIMEOUT_MS) {
+      FTL_LOG(ftl, FTL_LOG_ERROR, "timed out connecting to ingest");
+      break;
+    }
+
+    if (started < count && (pending == 0 || elapsed_ms >= started * HAPPY_EYEBALLS_DELAY_MS)) {
+      a = &attempts[started++];
+      a->candidate = order[started - 1];
+      a->connected = FALSE;
+      a->len = 0;
+
+      FTL_LOG(ftl, FTL_LOG_DEBUG, "connecting to %s", ftl_sockaddr_to_string(&ftl->ingest_candidates[a->candidate], ftl->ingest_candidate_lens[a->candidate], addr_str, sizeof(addr_str)));
+      ftl_sockaddr_set_port(&ftl->ingest_candidates[a->candidate], INGEST_PORT);
+
+      if ((a->sock = _ingest_start_connect(ftl, &ftl->ingest_candidates[a->candidate], ftl->ingest_candidate_lens[a->candidate])) != INVALID_SOCKET) {
+        pending++;
+      }
+      else {
+        ftl->ingest_candidate_failed[a->candidate] = now;
+      }
+      continue;
+    }
+
+    if (pending == 0) {
+      break;
+    }
+
+    wait_ms = CONNECT_TIMEOUT_MS - elapsed_ms;
+    if (started < count && started * HAPPY_EYEBALLS_DELAY_MS - elapsed_ms < wait_ms) {
+      wait_ms = started * HAPPY_EYEBALLS_DELAY_MS - elapsed_ms;
+    }
+
+    for (i = 0, nfds = 0; i < started; i++) {
+      if (attempts[i].sock != INVALID_SOCKET) {
+        fds[nfds].fd = attempts[i].sock;
+        fds[nfds].events = attempts[i].connected ? POLLIN : POLLOUT;
+        fds[nfds].revents = 0;
+        fd_idx[nfds++] = i;
+      }
+    }
+
+    if (ftl_poll(fds, nfds, wait_ms) <= 0) {
+      continue;
+    }
 
-  memset(buf, 0, buflen);
+    for (i = 0; i < nfds; i++) {
+      if (fds[i].revents == 0) {
+        continue;
+      }
 
-  len = vsnprintf(buf, buflen, format, valist);
+      a = &attempts[fd_idx[i]];
 
-  va_end(valist);   
+      if ((result = _ingest_attempt_step(ftl, session, a, fds[i].revents)) > 0) {
+        winner = fd_idx[i];
+        break;
+      }
 
-  if ( len < 0 || len >= buflen){
-    resp_code = FTL_INGEST_RESP_INTERNAL_COMMAND_ERROR; 
-    goto cleanup;
+      if (result < 0) {
+        ftl->ingest_candidate_failed[a->candidate] = ftl_monotonic_ns();
+        ftl_close_socket(a->sock);
+        a->sock = INVALID_SOCKET;
+        pending--;
+      }
+    }
   }
 
-  send(ftl_cfg->ingest_socket, buf, len, 0);
+  /*the losers of a won race were only slower, the ones still pending after a timeout failed*/
+  now = ftl_monotonic_ns();
+  for (i = 0; i < started; i++) {
+    if (i != winner && attempts[i].sock != INVALID_SOCKET) {
+      if (winner < 0) {
+        ftl->ingest_candidate_failed[attempts[i].candidate] = now;
+      }
+      ftl_close_socket(attempts[i].sock);
+    }
+  }
+
+  if (winner < 0) {
+    return INVALID_SOCKET;
+  }
+
+  a = &attempts[winner];
+  ftl->ingest_candidate_failed[a->candidate] = 0;
+  session->timings.tcp_connect_us = (int)((a->connect_time - start) / NS_PER_US);
+  session->timings.hmac_us = (int)((now - a->connect_time) / NS_PER_US);
+
+  ftl_set_socket_nonblocking(a->sock, FALSE);
+
+  memcpy(&session->addr, &ftl->ingest_candidates[a->candidate], sizeof(session->addr));
+  session->addrlen = ftl->ingest_candidate_lens[a->candidate];
+
+  FTL_LOG(ftl, FTL_LOG_INFO, "connected to ingest at %s", ftl_sockaddr_to_string(&session->addr, session->addrlen, addr_str, sizeof(addr_str)));
 
-  if (need_response) {
-    memset(response_buf, 0, response_len);
-    len = recv_all(ftl_cfg->ingest_socket, response_buf, response_len, '\n');
+  return a->sock;
+}
+
+typedef enum {
+  INGEST_PROBE_CONNECTING,
+  INGEST_PROBE_NONCE,
+  INGEST_PROBE_PING,
+  INGEST_PROBE_DONE
+} ingest_probe_state_t;
+
+/*one hostname being measured by _ingest_probe*/
+typedef struct {
+  SOCKET sock;
+  ingest_probe_state_t state;
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+  int64_t sent; /*when the connect or the outstanding request went out*/
+  int pings;
+  int rtt_max_us;
+  char buf[MAX_INGEST_COMMAND_LEN];
+  int len;
+  ftl_ingest_probe_msg_t result;
+} ingest_probe_t;
+
+static BOOL _ingest_probe_resolve(ftl_stream_configuration_private_t *ftl, const char *hostname, ingest_probe_t *p) {
+  struct addrinfo hints;
+  struct addrinfo *resolved_names = NULL, *ai;
+  int err;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
 
-    if (len < 0) {
-      FTL_LOG(FTL_LOG_ERROR, "ingest returned invalid response of %d\n", len);
-      return FTL_INTERNAL_ERROR;
+  if ((err = getaddrinfo(hostname, NULL, &hints, &resolved_names)) != 0) {
+    FTL_LOG(ftl, FTL_LOG_WARN, "failed to look up ingest %s: %s", hostname, gai_strerror(err));
+    return FALSE;
+  }
+
+  /*the address the resolver prefers, the connect will try it first too*/
+  for (ai = resolved_names; ai != NULL; ai = ai->ai_next) {
+    if (ai->ai_family == AF_INET || ai->ai_family == AF_INET6) {
+      memcpy(&p->addr, ai->ai_addr, ai->ai_addrlen);
+      p->addrlen = (socklen_t)ai->ai_addrlen;
+      break;
     }
+  }
+
+  freeaddrinfo(resolved_names);
+
+  return ai != NULL;
+}
+
+static void _ingest_probe_sample(ingest_probe_t *p, int64_t now) {
+  int rtt_us = (int)((now - p->sent) / NS_PER_US);
 
-    resp_code = ftl_read_response_code(response_buf);
+  if (p->result.rtt_us == 0 || rtt_us < p->result.rtt_us) {
+    p->result.rtt_us = rtt_us;
   }
-  
-cleanup:
-  if(buf != NULL){
-    free(buf);
+
+  if (rtt_us > p->rtt_max_us) {
+    p->rtt_max_us = rtt_us;
   }
 
-  if(format != NULL){
-      free(format);
+  p->result.jitter_us = p->rtt_max_us - p->result.rtt_us;
+}
+
+static BOOL _ingest_probe_send(ftl_stream_configuration_private_t *ftl, ingest_probe_t *p, const char *cmd_fmt, ...) {
+  char buf[MAX_INGEST_COMMAND_LEN];
+  va_list args;
+  int len;
+
+  va_start(args, cmd_fmt);
+  len = _ingest_vappend(buf, 0, sizeof(buf), cmd_fmt, args);
+  va_end(args);
+
+  p->sent = ftl_monotonic_ns();
+
+  /*one short request at a time, the socket always has room for it*/
+  if (len < 0 || send(p->sock, buf, len, 0) != len) {
+    p->result.status = FTL_CONNECT_ERROR;
+    return FALSE;
   }
 
-  return resp_code;
+  return TRUE;
 }
 
-#ifdef _WIN32
-DWORD WINAPI connection_status_thread(LPVOID data)
-#else
-static void *connection_status_thread(void *data)
-#endif
-{
-	ftl_stream_configuration_private_t *ftl = (ftl_stream_configuration_private_t *)data;
-	char buf;
+/*moves a probe along when its socket is ready, returns FALSE once it is done or has failed*/
+static BOOL _ingest_probe_step(ftl_stream_configuration_private_t *ftl, ingest_probe_t *p, short revents) {
+  int64_t now = ftl_monotonic_ns();
+  int n;
 
-	while (ftl->connected) {
+  if (p->state == INGEST_PROBE_CONNECTING) {
+    if (ftl_get_socket_pending_error(p->sock) != 0 || !(revents & POLLOUT)) {
+      p->result.status = FTL_CONNECT_ERROR;
+      return FALSE;
+    }
 
-		sleep_ms(500);
+    p->result.connect_us = (int)((now - p->sent) / NS_PER_US);
+    p->state = INGEST_PROBE_NONCE;
 
-		int err = recv(ftl->ingest_socket, &buf, sizeof(buf), MSG_PEEK);
+    return _ingest_probe_send(ftl, p, "HMAC");
+  }
 
-		if (err == 0 && ftl->connected) {
-			ftl_status_t status_code;
+  if ((n = recv(p->sock, p->buf + p->len, sizeof(p->buf) - 1 - p->len, 0)) <= 0) {
+    p->result.status = p->state == INGEST_PROBE_NONCE ? FTL_CONNECT_ERROR : FTL_SUCCESS;
+    return FALSE;
+  }
 
-			ftl->connected = 0;
-			ftl->ready_for_media = 0;
+  p->len += n;
+  p->buf[p->len] = '\0';
 
-			if ((status_code = _ingest_disconnect(ftl)) != FTL_SUCCESS) {
-				FTL_LOG(FTL_LOG_ERROR, "Disconnect failed with error %d\n", status_code);
-			}
+  if (p->buf[p->len - 1] != '\n') {
+    if (p->len == sizeof(p->buf) - 1) {
+      p->result.status = p->state == INGEST_PROBE_NONCE ? FTL_BAD_REQUEST : FTL_SUCCESS;
+      return FALSE;
+    }
+    return TRUE;
+  }
 
-			if ((status_code = media_destroy(ftl)) != FTL_SUCCESS) {
-				FTL_LOG(FTL_LOG_ERROR, "failed to clean up media channel with error %d\n", status_code);
-			}
+  _ingest_probe_sample(p, now);
+  p->len = 0;
+
+  /*an ingest handing out nonces is up and taking streams, pings only refine the round trip*/
+  if (p->state == INGEST_PROBE_NONCE) {
+    if (ftl_read_response_code(p->buf) != FTL_INGEST_RESP_OK) {
+      p->result.status = FTL_BAD_REQUEST;
+      return FALSE;
+    }
 
-			ftl_status_msg_t status;
+    p->result.status = FTL_SUCCESS;
+    p->state = INGEST_PROBE_PING;
+  }
+  else if (p->buf[0] != '2' || ++p->pings == INGEST_PROBE_PINGS) {
+    return FALSE;
+  }
 
-			status.type = FTL_STATUS_EVENT;
-			status.msg.event.reason = FTL_STATUS_EVENT_REASON_UNKNOWN;
-			status.msg.event.type = FTL_STATUS_EVENT_TYPE_DISCONNECTED;
+  return _ingest_probe_send(ftl, p, "PING %d", ftl->channel_id);
+}
 
-			enqueue_status_msg(ftl, &status);
-			break;
-		}
+/*
+ * Measures every hostname at once over a control connection of its own, which is closed again afterwards.
+ * An ingest doesn't answer on udp before a stream is set up, so round trips are timed on the control
+ * channel: the nonce request (which also shows the ingest is taking streams) and a few pings, each of
+ * them answered by the ingest itself rather than the kernel as the tcp connect is. The one with the lowest
+ * round trip plus jitter wins, jitter being what a busy ingest or a congested path adds. Queues an FTL_STATUS_INGEST_PROBE message per hostname.
+ */
+ftl_status_t _ingest_probe(ftl_stream_configuration_private_t *ftl, const char **hostnames, int count, int *best, struct sockaddr_storage *addr, socklen_t *addrlen) {
+  ingest_probe_t probes[MAX_INGEST_PROBES];
+  struct pollfd fds[MAX_INGEST_PROBES];
+  int fd_idx[MAX_INGEST_PROBES];
+  ftl_status_msg_t status;
+  ingest_probe_t *p;
+  int64_t start;
+  int pending = 0, elapsed_ms, nfds, i;
+  char addr_str[INET6_ADDRSTRLEN];
+
+  *best = -1;
+
+  /*real time even with a virtual clock, this waits on the network*/
+  start = ftl_monotonic_ns();
+
+  for (i = 0; i < count; i++) {
+    p = &probes[i];
+    memset(&p->result, 0, sizeof(p->result));
+    p->result.index = i;
+    p->result.status = FTL_DNS_FAILURE;
+    p->state = INGEST_PROBE_DONE;
+    p->sock = INVALID_SOCKET;
+    p->rtt_max_us = 0;
+    p->pings = 0;
+    p->len = 0;
+
+    if (!_ingest_probe_resolve(ftl, hostnames[i], p)) {
+      continue;
+    }
 
+    ftl_sockaddr_set_port(&p->addr, INGEST_PORT);
+    p->result.status = FTL_CONNECT_ERROR;
+    p->sent = ftl_monotonic_ns();
+
+    if ((p->sock = _ingest_start_connect(ftl, &p->addr, p->addrlen)) != INVALID_SOCKET) {
+      p->state = INGEST_PROBE_CONNECTING;
+      pending++;
+    }
+  }
+
+  while (pending > 0) {
+    elapsed_ms = (int)((ftl_monotonic_ns() - start) / NS_PER_MS);
+
+    if (elapsed_ms >= INGEST_PROBE_TIMEOUT_MS) {
+      break;
+    }
+
+    for (i = 0, nfds = 0; i < count; i++) {
+      if (probes[i].state != INGEST_PROBE_DONE) {
+        fds[nfds].fd = probes[i].sock;
+        fds[nfds].events = probes[i].state == INGEST_PROBE_CONNECTING ? POLLOUT : POLLIN;
+        fds[nfds].revents = 0;
+        fd_idx[nfds++] = i;
+      }
+    }
+
+    if (ftl_poll(fds, nfds, INGEST_PROBE_TIMEOUT_MS - elapsed_ms) <= 0) {
+      continue;
+    }
+
+    for (i = 0; i < nfds; i++) {
+      if (fds[i].revents != 0 && !_ingest_probe_step(ftl, &probes[fd_idx[i]], fds[i].revents)) {
+        probes[fd_idx[i]].state = INGEST_PROBE_DONE;
+        pending--;
+      }
+    }
+  }
+
+  for (i = 0; i < count; i++) {
+    p = &probes[i];
+
+    if (p->sock != INVALID_SOCKET) {
+      ftl_close_socket(p->sock);
+    }
+
+    /*still waiting on the nonce, an ingest that slow isn't one to stream to*/
+    if (p->state == INGEST_PROBE_CONNECTING || p->state == INGEST_PROBE_NONCE) {
+      p->result.status = FTL_STATUS_TIMEOUT;
+    }
+
+    if (p->result.status == FTL_SUCCESS && (*best < 0 || p->result.rtt_us + p->result.jitter_us < probes[*best].result.rtt_us + probes[*best].result.jitter_us)) {
+      *best = i;
+    }
+  }
+
+  if (*best >= 0) {
+    probes[*best].result.selected = 1;
+    memcpy(addr, &probes[*best].addr, sizeof(*addr));
+    *addrlen = probes[*best].addrlen;
+  }
+
+  for (i = 0; i < count; i++) {
+    p = &probes[i];
+
+    if (p->result.status == FTL_SUCCESS) {
+      FTL_LOG(ftl, FTL_LOG_INFO, "ingest %s (%s): rtt %d us, jitter %d us, connect %d us%s", hostnames[i], ftl_sockaddr_to_string(&p->addr, p->addrlen, addr_str, sizeof(addr_str)),
+        p->result.rtt_us, p->result.jitter_us, p->result.connect_us, p->result.selected ? ", selected" : "");
+    }
+    else {
+      FTL_LOG(ftl, FTL_LOG_INFO, "ingest %s: unusable, status %d", hostnames[i], p->result.status);
+    }
+
+    status.type = FTL_STATUS_INGEST_PROBE;
+    status.msg.ingest_probe = p->result;
+    enqueue_status_msg(ftl, &status);
+  }
+
+  return *best >= 0 ? FTL_SUCCESS : FTL_CONNECT_ERROR;
+}
+
+static ftl_response_code_t _ftl_send_command(ftl_stream_configuration_private_t *ftl_cfg, SOCKET sock, BOOL need_response, char *response_buf, int response_len, const char *cmd_fmt, ...){
+  char buf[MAX_INGEST_COMMAND_LEN];
+  va_list valist;
+  int len;
+
+  va_start(valist, cmd_fmt);
+  len = _ingest_vappend(buf, 0, sizeof(buf), cmd_fmt, valist);
+  va_end(valist);
+
+  if (len < 0) {
+    return FTL_INGEST_RESP_INTERNAL_COMMAND_ERROR;
+  }
+
+  return _ingest_exchange(ftl_cfg, sock, buf, len, need_response, response_buf, response_len);
+}
+
+/*sends one or more complete commands and reads the response to the last one if it has one*/
+static ftl_response_code_t _ingest_exchange(ftl_stream_configuration_private_t *ftl, SOCKET sock, const char *buf, int len, BOOL need_response, char *response_buf, int response_len) {
+  int sent;
+
+  while (len > 0) {
+    if ((sent = send(sock, buf, len, 0)) <= 0) {
+      FTL_LOG(ftl, FTL_LOG_ERROR, "failed to send to ingest: %s\n", ftl_get_socket_error());
+      return FTL_INGEST_RESP_UNKNOWN;
+    }
+
+    buf += sent;
+    len -= sent;
+  }
+
+  if (!need_response) {
+    return FTL_INGEST_RESP_OK;
+  }
+
+  memset(response_buf, 0, response_len);
+  len = recv_all(&ftl->log, sock, response_buf, response_len, '\n');
+
+  if (len < 0) {
+    FTL_LOG(ftl, FTL_LOG_ERROR, "ingest returned invalid response of %d\n", len);
+    return FTL_INTERNAL_ERROR;
+  }
+
+  return ftl_read_response_code(response_buf);
+}
+
+/*formats a command onto the end of buf, returns the new length or -1 if it doesn't fit*/
+static int _ingest_vappend(char *buf, int len, int size, const char *fmt, va_list args) {
+  int n;
+
+  n = vsnprintf(buf + len, size - len, fmt, args);
+
+  if (n < 0 || len + n + 4 >= size) {
+    return -1;
+  }
+
+  len += n;
+  memcpy(buf + len, "\r\n\r\n", 4);
+
+  return len + 4;
+}
+
+static int _ingest_append(char *buf, int len, int size, const char *fmt, ...) {
+  va_list args;
+
+  va_start(args, fmt);
+  len = _ingest_vappend(buf, len, size, fmt, args);
+  va_end(args);
+
+  return len;
+}
+
+/*
+ * Called by the event loop when the control connection is readable. The ingest doesn't send anything
+ * unsolicited while streaming, so this is either the connection closing or data we can discard (reading
+ * it keeps a level triggered poller from spinning).
+ */
+BOOL _ingest_control_ready(ftl_stream_configuration_private_t *ftl) {
+	char buf[MAX_INGEST_COMMAND_LEN];
+	int ret;
+
+	ret = recv(ftl->ingest_socket, buf, sizeof(buf), 0);
+
+	if (ret > 0) {
+		FTL_LOG(ftl, FTL_LOG_DEBUG, "Ignoring %d unexpected bytes from ingest\n", ret);
+		return TRUE;
+	}
+
+	/*a signal or a spurious wakeup, the connection is still fine*/
+	if (ret < 0 && ftl_socket_error_is_transient()) {
+		return TRUE;
 	}
 
-	FTL_LOG(FTL_LOG_INFO, "Exited connection_status_thread\n");
+	if (ret == 0) {
+		FTL_LOG(ftl, FTL_LOG_ERROR, "Ingest closed the control connection\n");
+	}
+	else {
+		FTL_LOG(ftl, FTL_LOG_ERROR, "Control connection failed: %s\n", ftl_get_socket_error());
+	}
+
+	/*the old ingest went before the key frame, carry on with the new one rather than drop the stream*/
+	if (media_migrate_switch(ftl) || ftl_atomic_load(&ftl->migration.state) == MIGRATION_SWITCHED) {
+		FTL_LOG(ftl, FTL_LOG_WARN, "Switching to the new ingest early\n");
+		_ingest_migration_finish(ftl, FALSE);
+		return TRUE;
+	}
 
-	return 0;
+	return FALSE;
 }
 
-ftl_status_t _log_response(int response_code){
+ftl_status_t _log_response(ftl_stream_configuration_private_t *ftl, int response_code){
     switch (response_code) {
     case FTL_INGEST_RESP_OK:
-      FTL_LOG(FTL_LOG_DEBUG, "ingest accepted our paramteres");
+      FTL_LOG(ftl, FTL_LOG_DEBUG, "ingest accepted our paramteres");
       break;
     case FTL_INGEST_RESP_BAD_REQUEST:
-      FTL_LOG(FTL_LOG_ERROR, "ingest responded bad request. Possible charon bug?");
+      FTL_LOG(ftl, FTL_LOG_ERROR, "ingest responded bad request. Possible charon bug?");
       return FTL_BAD_REQUEST;
     case FTL_INGEST_RESP_UNAUTHORIZED:
-      FTL_LOG(FTL_LOG_ERROR, "channel is not authorized for FTL");
+      FTL_LOG(ftl, FTL_LOG_ERROR, "channel is not authorized for FTL");
       return FTL_UNAUTHORIZED;
     case FTL_INGEST_RESP_OLD_VERSION:
-      FTL_LOG(FTL_LOG_ERROR, "charon protocol mismatch. Please update to latest charon/libftl");
+      FTL_LOG(ftl, FTL_LOG_ERROR, "charon protocol mismatch. Please update to latest charon/libftl");
       return FTL_OLD_VERSION;
     case FTL_INGEST_RESP_AUDIO_SSRC_COLLISION:
-      FTL_LOG(FTL_LOG_ERROR, "audio SSRC collision from this IP address. Please change your audio SSRC to an unused value");
+      FTL_LOG(ftl, FTL_LOG_ERROR, "audio SSRC collision from this IP address. Please change your audio SSRC to an unused value");
       return FTL_INGEST_RESP_AUDIO_SSRC_COLLISION;
     case FTL_INGEST_RESP_VIDEO_SSRC_COLLISION:
-      FTL_LOG(FTL_LOG_ERROR, "video SSRC collision from this IP address. Please change your audio SSRC to an unused value");
+      FTL_LOG(ftl, FTL_LOG_ERROR, "video SSRC collision from this IP address. Please change your audio SSRC to an unused value");
       return FTL_INGEST_RESP_VIDEO_SSRC_COLLISION;
     case FTL_INGEST_RESP_INTERNAL_SERVER_ERROR:
-      FTL_LOG(FTL_LOG_ERROR, "parameters accepted, but ingest couldn't start FTL. Please contact support!");
+      FTL_LOG(ftl, FTL_LOG_ERROR, "parameters accepted, but ingest couldn't start FTL. Please contact support!");
       return FTL_INGEST_RESP_INTERNAL_SERVER_ERROR;
     case FTL_INGEST_RESP_INVALID_STREAM_KEY:
-      FTL_LOG(FTL_LOG_ERROR, "invalid stream key or channel id");
+      FTL_LOG(ftl, FTL_LOG_ERROR, "invalid stream key or channel id");
       return FTL_STREAM_REJECTED;
   }
 
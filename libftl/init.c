@@ -25,7 +25,6 @@
 #define __FTL_INTERNAL
 #include "ftl.h"
 
-char error_message[1000];
 FTL_API const int FTL_VERSION_MAJOR = 0;
 FTL_API const int FTL_VERSION_MINOR = 2;
 FTL_API const int FTL_VERSION_MAINTENANCE = 3;
@@ -33,6 +32,5 @@ FTL_API const int FTL_VERSION_MAINTENANCE = 3;
 // Initializes all sublibraries used by FTL
 ftl_status_t ftl_init() {
   ftl_init_sockets();
-  ftl_logging_init();
   return FTL_SUCCESS;
 }
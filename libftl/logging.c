@@ -26,49 +26,319 @@
 #include "ftl.h"
 #include "ftl_private.h"
 
-static ftl_logging_function_t ftl_log_cb;
+typedef struct {
+  ftl_atomic_t seq;
+  ftl_log_severity_t level;
+  const char *file;
+  int lineno;
+  char message[LOG_MESSAGE_MAX];
+} log_cell_t;
 
-#ifndef _WIN32
-pthread_mutex_t lock;
+/*per call site (hashed, so sites can share) message count for the current second*/
+typedef struct {
+  const char *file;
+  int lineno;
+  ftl_atomic_t second;
+  ftl_atomic_t count;
+  ftl_atomic_t suppressed;
+} log_site_t;
+
+/*multi producer, single consumer ring like the status queue, the log thread is the consumer*/
+struct ftl_log_ring {
+  log_cell_t cells[LOG_RING_SIZE];
+  ftl_atomic_t enqueue_pos;
+  ftl_atomic_t dequeue_pos;
+  ftl_atomic_t dropped;
+  log_site_t sites[LOG_RATE_SITES];
+  ftl_thread_params_t thread_params;
+  volatile BOOL running;
+#ifdef _WIN32
+  HANDLE sem;
+  HANDLE thread_handle;
+#else
+  sem_t sem;
+  pthread_t thread;
+#endif
+};
+
+#ifdef _WIN32
+static DWORD WINAPI _log_thread(LPVOID data);
+#else
+static void *_log_thread(void *data);
 #endif
 
-void ftl_logging_init() {
-  ftl_log_cb = 0;
+ftl_status_t ftl_logger_init(ftl_logger_t *log, ftl_logging_function_t func, ftl_log_callback_t callback, void *callback_data, const ftl_allocator_t *allocator, BOOL async, const ftl_thread_params_t *thread_params) {
+  struct ftl_log_ring *ring;
+  int i;
 
-#ifndef _WIN32
-  if (pthread_mutex_init(&lock, NULL) != 0) {
-    printf("logging mutex init failed\n");
+  log->func = func;
+  log->callback = callback;
+  log->callback_data = callback_data;
+  log->level = FTL_LOG_DEBUG;
+  log->allocator = *allocator;
+  log->ring = NULL;
+
+  if (!async) {
+#ifdef _WIN32
+    if ((log->mutex = CreateMutex(NULL, FALSE, NULL)) == NULL) {
+#else
+    if (pthread_mutex_init(&log->mutex, &ftl_default_mutexattr) != 0) {
+#endif
+      return FTL_MALLOC_FAILURE;
+    }
+
+    return FTL_SUCCESS;
+  }
+
+  if ((ring = (struct ftl_log_ring *)ftl_calloc(allocator, 1, sizeof(struct ftl_log_ring))) == NULL) {
+    return FTL_MALLOC_FAILURE;
   }
+
+  for (i = 0; i < LOG_RING_SIZE; i++) {
+    ring->cells[i].seq = i;
+  }
+
+  /*calloc left the os defaults*/
+  if (thread_params != NULL) {
+    ring->thread_params = *thread_params;
+  }
+
+#ifdef _WIN32
+  if ((ring->sem = CreateSemaphore(NULL, 0, LOG_RING_SIZE, NULL)) == NULL) {
+#else
+  if (sem_init(&ring->sem, 0 /* pshared */, 0 /* value */)) {
 #endif
+    ftl_free(allocator, ring);
+    return FTL_MALLOC_FAILURE;
+  }
+
+  log->ring = ring;
+  ring->running = TRUE;
+
+#ifdef _WIN32
+  if ((ring->thread_handle = CreateThread(NULL, 0, _log_thread, log, 0, NULL)) == NULL) {
+    CloseHandle(ring->sem);
+#else
+  if (pthread_create(&ring->thread, NULL, _log_thread, log) != 0) {
+    sem_destroy(&ring->sem);
+#endif
+    log->ring = NULL;
+    ftl_free(allocator, ring);
+    return FTL_MALLOC_FAILURE;
+  }
 
+  return FTL_SUCCESS;
 }
 
-void ftl_register_log_handler(ftl_logging_function_t log_func) {
-  ftl_log_cb = log_func;
+/*stops the log thread once it has delivered everything already queued*/
+void ftl_logger_destroy(ftl_logger_t *log) {
+  struct ftl_log_ring *ring = log->ring;
+
+  if (ring == NULL) {
+#ifdef _WIN32
+    CloseHandle(log->mutex);
+#else
+    pthread_mutex_destroy(&log->mutex);
+#endif
+    return;
+  }
+
+  ring->running = FALSE;
+
+#ifdef _WIN32
+  ReleaseSemaphore(ring->sem, 1, NULL);
+  WaitForSingleObject(ring->thread_handle, INFINITE);
+  CloseHandle(ring->thread_handle);
+  CloseHandle(ring->sem);
+#else
+  sem_post(&ring->sem);
+  pthread_join(ring->thread, NULL);
+  sem_destroy(&ring->sem);
+#endif
+
+  log->ring = NULL;
+  ftl_free(&log->allocator, ring);
 }
 
-// Convert compiler macro to actual printf call to stderr
-void ftl_log_message(ftl_log_severity_t log_level, const char * file, int lineno, const char * fmt, ...) {
+static void _log_deliver(ftl_logger_t *log, ftl_log_severity_t log_level, const char *file, int lineno, const char *message) {
+  if (log != NULL && log->callback != NULL) {
+    log->callback(log->callback_data, log_level, message);
+  } else if (log != NULL && log->func != NULL) {
+    log->func(log_level, message);
+  } else {
+    fprintf(stderr, "[%s]:%d %s\n", file, lineno, message);
+  }
+}
+
+/*more than LOG_RATE_LIMIT messages a second from one place are counted instead of queued*/
+static BOOL _log_ring_allow(struct ftl_log_ring *ring, const char *file, int lineno) {
+  log_site_t *site = &ring->sites[(((uintptr_t)file >> 3) + (uintptr_t)lineno * 31) & (LOG_RATE_SITES - 1)];
+  long now = (long)(ftl_monotonic_ns() / NS_PER_SEC);
+  long second = ftl_atomic_load_relaxed(&site->second);
+
+  if (second != now && ftl_atomic_cas(&site->second, second, now)) {
+    site->file = file;
+    site->lineno = lineno;
+    ftl_atomic_store(&site->count, 0);
+  }
+
+  if (ftl_atomic_add_relaxed(&site->count, 1) < LOG_RATE_LIMIT) {
+    return TRUE;
+  }
+
+  ftl_atomic_add_relaxed(&site->suppressed, 1);
+  return FALSE;
+}
+
+/*never blocks: formats into a free cell, or counts the message as dropped if the ring is full*/
+static void _log_ring_enqueue(struct ftl_log_ring *ring, ftl_log_severity_t log_level, const char *file, int lineno, const char *fmt, va_list args) {
+  log_cell_t *cell;
+  unsigned long pos;
+  long diff;
+
+  if (!_log_ring_allow(ring, file, lineno)) {
+    return;
+  }
 
+  pos = (unsigned long)ftl_atomic_load(&ring->enqueue_pos);
+
+  for (;;) {
+    cell = &ring->cells[pos & (LOG_RING_SIZE - 1)];
+    diff = (long)((unsigned long)ftl_atomic_load(&cell->seq) - pos);
+
+    if (diff == 0) {
+      if (ftl_atomic_cas(&ring->enqueue_pos, (long)pos, (long)(pos + 1))) {
+        break;
+      }
+      pos = (unsigned long)ftl_atomic_load(&ring->enqueue_pos);
+    }
+    else if (diff < 0) {
+      ftl_atomic_add(&ring->dropped, 1);
+      return;
+    }
+    else {
+      pos = (unsigned long)ftl_atomic_load(&ring->enqueue_pos);
+    }
+  }
+
+  cell->level = log_level;
+  cell->file = file;
+  cell->lineno = lineno;
+  vsnprintf(cell->message, sizeof(cell->message), fmt, args);
+  ftl_atomic_store(&cell->seq, (long)(pos + 1));
+
+#ifdef _WIN32
+  ReleaseSemaphore(ring->sem, 1, NULL);
+#else
+  sem_post(&ring->sem);
+#endif
+}
+
+/*hands everything queued to the log handler, then reports what was suppressed or dropped*/
+static void _log_ring_drain(ftl_logger_t *log) {
+  struct ftl_log_ring *ring = log->ring;
+  char message[128];
+  unsigned long pos;
+  log_cell_t *cell;
+  long count;
+  int i;
+
+  for (;;) {
+    pos = (unsigned long)ring->dequeue_pos;
+    cell = &ring->cells[pos & (LOG_RING_SIZE - 1)];
+
+    /*a producer may have claimed the cell but not filled it yet, it gets picked up on the next wake*/
+    if ((long)((unsigned long)ftl_atomic_load(&cell->seq) - (pos + 1)) != 0) {
+      break;
+    }
+
+    _log_deliver(log, cell->level, cell->file, cell->lineno, cell->message);
+    ftl_atomic_store(&cell->seq, (long)(pos + LOG_RING_SIZE));
+    ftl_atomic_store(&ring->dequeue_pos, (long)(pos + 1));
+  }
+
+  for (i = 0; i < LOG_RATE_SITES; i++) {
+    if ((count = ftl_atomic_exchange(&ring->sites[i].suppressed, 0)) > 0) {
+      snprintf(message, sizeof(message), "Suppressed %ld repeated messages from %s:%d", count, ring->sites[i].file, ring->sites[i].lineno);
+      _log_deliver(log, FTL_LOG_WARN, __FILE__, __LINE__, message);
+    }
+  }
+
+  if ((count = ftl_atomic_exchange(&ring->dropped, 0)) > 0) {
+    snprintf(message, sizeof(message), "Log ring full, dropped %ld messages", count);
+    _log_deliver(log, FTL_LOG_WARN, __FILE__, __LINE__, message);
+  }
+}
+
+#ifdef _WIN32
+static DWORD WINAPI _log_thread(LPVOID data)
+#else
+static void *_log_thread(void *data)
+#endif
+{
+  ftl_logger_t *log = (ftl_logger_t *)data;
+  struct ftl_log_ring *ring = log->ring;
 #ifndef _WIN32
-  pthread_mutex_lock(&lock);
+  struct timespec deadline;
+  struct timeval now;
+#endif
+
+  ftl_thread_setup(log, "ftl-log", &ring->thread_params, FALSE);
+
+  while (ring->running) {
+    /*wake at least once a second to report suppressed messages*/
+#ifdef _WIN32
+    WaitForSingleObject(ring->sem, 1000);
+#else
+    gettimeofday(&now, NULL);
+    timeval_add_ms(&now, 1000);
+    deadline.tv_sec = now.tv_sec;
+    deadline.tv_nsec = now.tv_usec * 1000;
+    sem_timedwait(&ring->sem, &deadline);
 #endif
 
+    _log_ring_drain(log);
+  }
+
+  _log_ring_drain(log);
+
+  return 0;
+}
+
+// Convert compiler macro to actual printf call to stderr
+void ftl_log_message(ftl_logger_t *log, ftl_log_severity_t log_level, const char * file, int lineno, const char * fmt, ...) {
     va_list args;
     char message[2048];
+
+    if (log != NULL && log->ring != NULL) {
+      va_start(args, fmt);
+      _log_ring_enqueue(log->ring, log_level, file, lineno, fmt, args);
+      va_end(args);
+      return;
+    }
+
     va_start(args, fmt);
     vsnprintf(message, 2048, fmt, args);
     va_end(args);
 
-    // and now spit it out
-    if (ftl_log_cb != 0) {
-      (*ftl_log_cb)(log_level, message);
-    } else {
-      fprintf(stderr, "[%s]:%d %s\n", file, lineno, message);
+    if (log == NULL) {
+      _log_deliver(log, log_level, file, lineno, message);
+      return;
     }
 
-#ifndef _WIN32
-  pthread_mutex_unlock(&lock);
+    // and now spit it out, one message at a time for this logger only
+#ifdef _WIN32
+  WaitForSingleObject(log->mutex, INFINITE);
+#else
+  pthread_mutex_lock(&log->mutex);
+#endif
+
+    _log_deliver(log, log_level, file, lineno, message);
+
+#ifdef _WIN32
+  ReleaseMutex(log->mutex);
+#else
+  pthread_mutex_unlock(&log->mutex);
 #endif
 
 }
@@ -3,37 +3,47 @@
 #include "ftl_private.h"
 
 #ifdef _WIN32
-static DWORD WINAPI recv_thread(LPVOID data);
 static DWORD WINAPI send_thread(LPVOID data);
 #else
-static void *recv_thread(void *data);
 static void *send_thread(void *data);
 #endif
-static int _nack_init(ftl_media_component_common_t *media);
-static int _nack_destroy(ftl_media_component_common_t *media);
+static int _nack_init(ftl_stream_configuration_private_t *ftl, ftl_media_component_common_t *media);
+static int _nack_destroy(ftl_stream_configuration_private_t *ftl, ftl_media_component_common_t *media);
+static nack_slot_t *_nack_lock_slot(ftl_stream_configuration_private_t *ftl, ftl_media_component_common_t *mc, uint16_t sn);
+static int _nack_resend_slots(ftl_stream_configuration_private_t *ftl, ftl_media_component_common_t *mc, nack_slot_t **slots, int count, int64_t nack_time);
 static ftl_media_component_common_t *_media_lookup(ftl_stream_configuration_private_t *ftl, uint32_t ssrc);
 static int _media_make_video_rtp_packet(ftl_stream_configuration_private_t *ftl, uint8_t *in, int in_len, uint8_t *out, int *out_len, int first_pkt);
 static int _media_make_audio_rtp_packet(ftl_stream_configuration_private_t *ftl, uint8_t *in, int in_len, uint8_t *out, int *out_len);
 static int _media_set_marker_bit(ftl_media_component_common_t *mc, uint8_t *in);
 static int _media_send_packet(ftl_stream_configuration_private_t *ftl, ftl_media_component_common_t *mc);
+static int _media_send_packets(ftl_stream_configuration_private_t *ftl, ftl_media_component_common_t *mc, int max_bytes, int64_t *departure, int bytes_per_ms);
+static int _media_send_batch(ftl_stream_configuration_private_t *ftl, uint8_t **bufs, int *lens, int64_t *txtimes, int count);
+static void _media_pacer_init(ftl_stream_configuration_private_t *ftl);
+static BOOL _media_take_packet(ftl_media_component_common_t *mc);
+static void _media_check_unreachable(ftl_stream_configuration_private_t *ftl);
+static void _media_set_socket_buffers(ftl_stream_configuration_private_t *ftl, SOCKET sock);
 static int _media_send_slot(ftl_stream_configuration_private_t *ftl, nack_slot_t *slot);
 static nack_slot_t* _media_get_empty_slot(ftl_stream_configuration_private_t *ftl, uint32_t ssrc, uint16_t sn);
-static float _media_get_queue_fullness(ftl_stream_configuration_private_t *ftl, uint32_t ssrc);
+static nack_slot_t* _media_wait_for_empty_slot(ftl_stream_configuration_private_t *ftl, uint32_t ssrc, uint16_t sn, int64_t deadline);
+static int _media_probe_path_mtu(ftl_stream_configuration_private_t *ftl, int64_t now);
+static void _media_path_mtu_exceeded(ftl_stream_configuration_private_t *ftl, int pkt_len);
+static void _media_set_mtu(ftl_stream_configuration_private_t *ftl, int mtu);
+static void _media_mtu_probe_echoed(ftl_stream_configuration_private_t *ftl, uint8_t *buf, int recv_len);
+static void _media_handle_rtcp(ftl_stream_configuration_private_t *ftl, uint8_t *buf, int recv_len);
 
 #ifdef _WIN32
 #define LOCK_MUTEX(mutex) WaitForSingleObject((mutex), INFINITE)
+#define TRYLOCK_MUTEX(mutex) (WaitForSingleObject((mutex), 0) == WAIT_OBJECT_0)
 #define UNLOCK_MUTEX(mutex) ReleaseMutex(mutex)
 #else
 #define LOCK_MUTEX(mutex) pthread_mutex_lock(&(mutex))
+#define TRYLOCK_MUTEX(mutex) (pthread_mutex_trylock(&(mutex)) == 0)
 #define UNLOCK_MUTEX(mutex) pthread_mutex_unlock(&(mutex))
 #endif
 
-void clear_stats(media_stats_t *stats);
-
 ftl_status_t media_init(ftl_stream_configuration_private_t *ftl) {
 
 	ftl_media_config_t *media = &ftl->media;
-	struct hostent *server = NULL;
 	ftl_status_t status = FTL_SUCCESS;
 	unsigned long idx;
 
@@ -45,24 +55,71 @@ ftl_status_t media_init(ftl_stream_configuration_private_t *ftl) {
 		return FTL_MALLOC_FAILURE;
 	}
 
+	//media goes to the same address (and so the same family) the control connection won with
+	memcpy(&media->server_addr, &ftl->ingest_addr, sizeof(media->server_addr));
+	media->server_addrlen = ftl->ingest_addrlen;
+	ftl_sockaddr_set_port(&media->server_addr, media->assigned_port);
+
 	//Create a socket
-	if ((media->media_socket = socket(AF_INET, SOCK_DGRAM, 0)) == INVALID_SOCKET)
+	if ((media->media_socket = socket(media->server_addr.ss_family, SOCK_DGRAM, 0)) == INVALID_SOCKET)
 	{
-		FTL_LOG(FTL_LOG_ERROR, "Could not create socket : %s", ftl_get_socket_error());
+		FTL_LOG(ftl, FTL_LOG_ERROR, "Could not create socket : %s", ftl_get_socket_error());
+		return FTL_INTERNAL_ERROR;
 	}
-	FTL_LOG(FTL_LOG_INFO, "Socket created");
+	FTL_LOG(ftl, FTL_LOG_INFO, "Socket created");
 
-	if ((server = gethostbyname(ftl->ingest_ip)) == NULL) {
-		FTL_LOG(FTL_LOG_ERROR, "No such host as %s\n", ftl->ingest_ip);
-		return FTL_DNS_FAILURE;
+	//a connected socket saves the kernel a route lookup per packet and lets icmp errors reach us
+	if (connect(media->media_socket, (struct sockaddr *)&media->server_addr, media->server_addrlen) == SOCKET_ERROR) {
+		FTL_LOG(ftl, FTL_LOG_ERROR, "Could not connect media socket : %s", ftl_get_socket_error());
+		ftl_close_socket(media->media_socket);
+		return FTL_CONNECT_ERROR;
 	}
 
-	//Prepare the sockaddr_in structure
-	media->server_addr.sin_family = AF_INET;
-	memcpy((char *)&media->server_addr.sin_addr.s_addr, (char *)server->h_addr, server->h_length);
-	media->server_addr.sin_port = htons(media->assigned_port);
+	media->unreachable_count = 0;
+	media->ingest_unreachable = FALSE;
+
+	_media_set_socket_buffers(ftl, media->media_socket);
 
 	media->max_mtu = MAX_MTU;
+	media->mtu_floor = media->server_addr.ss_family == AF_INET6 ? MIN_MTU_IPV6 : MIN_MTU;
+	media->max_probe_mtu = media->server_addr.ss_family == AF_INET6 ? MAX_PROBE_MTU_IPV6 : MAX_PROBE_MTU;
+	media->mtu_ceiling = media->max_probe_mtu + 1;
+	media->probe_mtu = 0;
+	media->next_mtu_probe = ftl_clock_now(&ftl->clock);
+	media->next_stats = media->next_mtu_probe + STATS_SAMPLE_MS * NS_PER_MS;
+
+	/*with DF set oversized packets fail locally instead of being fragmented, which is what lets us probe*/
+	if ((media->pmtud_enabled = (ftl_set_socket_dont_fragment(media->media_socket, media->server_addr.ss_family, TRUE) == 0)) == FALSE) {
+		FTL_LOG(ftl, FTL_LOG_WARN, "Unable to set don't fragment on media socket, path mtu discovery disabled: %s\n", ftl_get_socket_error());
+	}
+
+	media->kernel_pacing = FALSE;
+	if (ftl->kernel_pacing && ftl->video_kbps > 0) {
+		if (!ftl_socket_qdisc_supports_txtime(media->media_socket)) {
+			FTL_LOG(ftl, FTL_LOG_WARN, "Egress interface does not use the fq qdisc, falling back to software pacing\n");
+		}
+		else if (ftl_set_socket_txtime(media->media_socket) != 0) {
+			FTL_LOG(ftl, FTL_LOG_WARN, "Failed to enable SO_TXTIME, falling back to software pacing: %s\n", ftl_get_socket_error());
+		}
+		else {
+			FTL_LOG(ftl, FTL_LOG_INFO, "Media packets are paced by the kernel\n");
+			media->kernel_pacing = TRUE;
+		}
+	}
+
+	media->uring = NULL;
+	if (ftl->io_uring) {
+#ifdef FTL_HAVE_IO_URING
+		if ((media->uring = ftl_uring_create(&ftl->log, media->media_socket)) == NULL) {
+			FTL_LOG(ftl, FTL_LOG_WARN, "Failed to set up io_uring, falling back to sendmmsg: %s\n", ftl_get_socket_error());
+		}
+		else {
+			FTL_LOG(ftl, FTL_LOG_INFO, "Media is sent through io_uring\n");
+		}
+#else
+		FTL_LOG(ftl, FTL_LOG_WARN, "libftl was built without io_uring support, falling back to sendmmsg\n");
+#endif
+	}
 
 	ftl_media_component_common_t *media_comp[] = { &ftl->video.media_component, &ftl->audio.media_component };
 	ftl_media_component_common_t *comp;
@@ -73,41 +130,46 @@ ftl_status_t media_init(ftl_stream_configuration_private_t *ftl) {
 
 		comp->nack_slots_initalized = FALSE;
 
-		if ((status = _nack_init(comp)) != FTL_SUCCESS) {
+		if ((status = _nack_init(ftl, comp)) != FTL_SUCCESS) {
 			return status;
 		}
 
 		comp->timestamp = 0; //TODO: should start at a random value
-		gettimeofday(&comp->stats_tv, NULL);
 		comp->producer = 0;
 		comp->consumer = 0;
-
-		clear_stats(&comp->stats);
 	}
 
+	stats_reset(ftl);
+
 	ftl->video.media_component.timestamp_step = (uint32_t)(90000.f / ftl->video.frame_rate);
 	ftl->video.wait_for_idr_frame = TRUE;
 	ftl->audio.media_component.timestamp_step = 48000 / 50; //TODO: dont assume the step size for audio
 
-	media->recv_thread_running = TRUE;
+	comp = &ftl->video.media_component;
+
 #ifdef _WIN32
-	if ((media->recv_thread_handle = CreateThread(NULL, 0, recv_thread, ftl, 0, &media->recv_thread_id)) == NULL) {
+	if ((comp->pkt_ready = CreateSemaphore(NULL, 0, 1000000, NULL)) == NULL) {
 #else
-	if ((pthread_create(&media->recv_thread, NULL, recv_thread, ftl)) != 0) {
+	if (sem_init(&comp->pkt_ready, 0 /* pshared */, 0 /* value */)) {
 #endif
 		return FTL_MALLOC_FAILURE;
 	}
 
-	comp = &ftl->video.media_component;
-
 #ifdef _WIN32
-	if ((comp->pkt_ready = CreateSemaphore(NULL, 0, 1000000, NULL)) == NULL) {
+	if ((comp->slot_freed = CreateSemaphore(NULL, 0, 1000000, NULL)) == NULL) {
 #else
-	if (sem_init(&comp->pkt_ready, 0 /* pshared */, 0 /* value */)) {
+	if (sem_init(&comp->slot_freed, 0 /* pshared */, 0 /* value */)) {
 #endif
 		return FTL_MALLOC_FAILURE;
 	}
 
+	_media_pacer_init(ftl);
+
+	/*streams on a shared context are paced by its workers*/
+	if (ftl->context != NULL) {
+		return status;
+	}
+
 	media->send_thread_running = TRUE;
 #ifdef _WIN32
 	if ((media->send_thread_handle = CreateThread(NULL, 0, send_thread, ftl, 0, &media->send_thread_id)) == NULL) {
@@ -125,40 +187,49 @@ ftl_status_t media_destroy(ftl_stream_configuration_private_t *ftl) {
 	struct hostent *server = NULL;
 	ftl_status_t status = FTL_SUCCESS;
 
-	ftl_close_socket(media->media_socket);
-
-	media->recv_thread_running = FALSE;
+	if (ftl->context == NULL) {
+		media->send_thread_running = FALSE;
 #ifdef _WIN32
-	WaitForSingleObject(media->recv_thread_handle, INFINITE);
-	CloseHandle(media->recv_thread_handle);
+		ReleaseSemaphore(ftl->video.media_component.pkt_ready, 1, NULL); 
+		ReleaseSemaphore(ftl->video.media_component.slot_freed, 1, NULL);
+		WaitForSingleObject(media->send_thread_handle, INFINITE);
+		CloseHandle(media->send_thread_handle);
 #else
-	pthread_join(media->recv_thread, NULL);
+		sem_post(&ftl->video.media_component.pkt_ready);
+		sem_post(&ftl->video.media_component.slot_freed);
+		pthread_join(media->send_thread, NULL);
 #endif
+	}
 
-	media->send_thread_running = FALSE;
 #ifdef _WIN32
-	ReleaseSemaphore(ftl->video.media_component.pkt_ready, 1, NULL); 
-	WaitForSingleObject(media->send_thread_handle, INFINITE);
-	CloseHandle(media->send_thread_handle);
 	CloseHandle(ftl->video.media_component.pkt_ready);
+	CloseHandle(ftl->video.media_component.slot_freed);
 #else
-	sem_post(&ftl->video.media_component.pkt_ready);
-	pthread_join(media->send_thread, NULL);
 	sem_destroy(&ftl->video.media_component.pkt_ready);
+	sem_destroy(&ftl->video.media_component.slot_freed);
+#endif
+
+#ifdef FTL_HAVE_IO_URING
+	ftl_uring_destroy(media->uring);
 #endif
+	media->uring = NULL;
+
+	ftl_close_socket(media->media_socket);
 
 	media->max_mtu = 0;
+	media->ingest_unreachable = FALSE;
+	media->suspended = FALSE;
 
 	ftl_media_component_common_t *video_comp = &ftl->video.media_component;
 
-	_nack_destroy(video_comp);
+	_nack_destroy(ftl, video_comp);
 
 	video_comp->timestamp = 0; //TODO: should start at a random value
 	video_comp->timestamp_step = 0;
 
 	ftl_media_component_common_t *audio_comp = &ftl->audio.media_component;
 
-	_nack_destroy(audio_comp);
+	_nack_destroy(ftl, audio_comp);
 
 	audio_comp->timestamp = 0;
 	audio_comp->timestamp_step = 0;
@@ -166,19 +237,227 @@ ftl_status_t media_destroy(ftl_stream_configuration_private_t *ftl) {
 	return status;
 }
 
-void clear_stats(media_stats_t *stats) {
-	stats->frames_received = 0;
-	stats->frames_sent = 0;
-	stats->bytes_sent = 0;
-	stats->packets_sent = 0;
-	stats->late_packets = 0;
-	stats->lost_packets = 0;
-	stats->nack_requests = 0;
-	stats->dropped_frames = 0;
-	stats->bytes_queued = 0;
+/*
+ * Picks a suspended stream up again on the session _ingest_connect just set up. The nack slots, sequence
+ * numbers, timestamps, pacer and send thread all carry on, only where the packets go changes. Fails if
+ * the ingest is now reached over the other address family, the caller then sets media up from scratch.
+ */
+ftl_status_t media_resume(ftl_stream_configuration_private_t *ftl) {
+	ftl_media_config_t *media = &ftl->media;
+	ftl_status_t status = FTL_SUCCESS;
+
+	if (ftl->ingest_addr.ss_family != media->server_addr.ss_family) {
+		return FTL_CONNECT_ERROR;
+	}
+
+	LOCK_MUTEX(media->mutex);
+
+	memcpy(&media->server_addr, &ftl->ingest_addr, sizeof(media->server_addr));
+	media->server_addrlen = ftl->ingest_addrlen;
+	ftl_sockaddr_set_port(&media->server_addr, media->assigned_port);
+
+	/*connecting a udp socket again just changes its destination*/
+	if (connect(media->media_socket, (struct sockaddr *)&media->server_addr, media->server_addrlen) == SOCKET_ERROR) {
+		FTL_LOG(ftl, FTL_LOG_ERROR, "Could not reconnect media socket : %s", ftl_get_socket_error());
+		status = FTL_CONNECT_ERROR;
+	}
+	else {
+		media->unreachable_count = 0;
+		media->ingest_unreachable = FALSE;
+
+		/*it may be another node on another path, search for its mtu again starting from the current one*/
+		media->probe_mtu = 0;
+		media->mtu_ceiling = media->max_probe_mtu + 1;
+		media->next_mtu_probe = ftl_clock_now(&ftl->clock);
+
+		/*a new session can only start decoding at a key frame, and encoders often only send parameter sets once*/
+		ftl->video.wait_for_idr_frame = TRUE;
+		ftl->video.resend_param_sets = ftl->video.sps_len > 0 && ftl->video.pps_len > 0;
+		media->suspended = FALSE;
+	}
+
+	UNLOCK_MUTEX(media->mutex);
+
+	return status;
+}
+
+/*
+ * Sets up the media socket of the session _ingest_migrate just opened the way media_init set up the current
+ * one, so switching is only a swap. Nothing else looks at the migration until it is marked ready.
+ */
+ftl_status_t media_migrate_prepare(ftl_stream_configuration_private_t *ftl) {
+	ftl_media_config_t *media = &ftl->media;
+	ftl_migration_t *mig = &ftl->migration;
+	struct sockaddr_storage addr;
+	SOCKET sock;
+
+	memcpy(&addr, &mig->session.addr, sizeof(addr));
+	ftl_sockaddr_set_port(&addr, mig->session.assigned_port);
+
+	if ((sock = socket(addr.ss_family, SOCK_DGRAM, 0)) == INVALID_SOCKET) {
+		FTL_LOG(ftl, FTL_LOG_ERROR, "Could not create socket : %s", ftl_get_socket_error());
+		return FTL_INTERNAL_ERROR;
+	}
+
+	if (connect(sock, (struct sockaddr *)&addr, mig->session.addrlen) == SOCKET_ERROR) {
+		FTL_LOG(ftl, FTL_LOG_ERROR, "Could not connect media socket : %s", ftl_get_socket_error());
+		ftl_close_socket(sock);
+		return FTL_CONNECT_ERROR;
+	}
+
+	_media_set_socket_buffers(ftl, sock);
+
+	if ((mig->pmtud_enabled = (ftl_set_socket_dont_fragment(sock, addr.ss_family, TRUE) == 0)) == FALSE) {
+		FTL_LOG(ftl, FTL_LOG_WARN, "Unable to set don't fragment on media socket, path mtu discovery disabled: %s\n", ftl_get_socket_error());
+	}
+
+	/*the pacer keeps stamping departure times, the new socket has to take them*/
+	if (media->kernel_pacing && (!ftl_socket_qdisc_supports_txtime(sock) || ftl_set_socket_txtime(sock) != 0)) {
+		FTL_LOG(ftl, FTL_LOG_ERROR, "The path to the new ingest can't be paced by the kernel\n");
+		ftl_close_socket(sock);
+		return FTL_INTERNAL_ERROR;
+	}
+
+	/*without a ring of its own the new socket is sent to with sendmmsg, which works just as well*/
+	mig->uring = NULL;
+#ifdef FTL_HAVE_IO_URING
+	if (media->uring != NULL && (mig->uring = ftl_uring_create(&ftl->log, sock)) == NULL) {
+		FTL_LOG(ftl, FTL_LOG_WARN, "Failed to set up io_uring for the new ingest, falling back to sendmmsg: %s\n", ftl_get_socket_error());
+	}
+#endif
+
+	mig->media_socket = sock;
+
+	return FTL_SUCCESS;
+}
+
+/*
+ * Points media at the migration's session, normally called by the pacer right in front of a key frame.
+ * Holding the media mutex keeps every send (nack resends and mtu probes included) on one side of the
+ * swap. The old socket is kept in the migration until the event loop has stopped watching it. Returns
+ * FALSE if no migration was ready.
+ */
+BOOL media_migrate_switch(ftl_stream_configuration_private_t *ftl) {
+	ftl_media_config_t *media = &ftl->media;
+	ftl_migration_t *mig = &ftl->migration;
+	struct ftl_uring *uring;
+	SOCKET sock;
+	BOOL switched = FALSE;
+
+	LOCK_MUTEX(media->mutex);
+
+	if (ftl_atomic_load(&mig->state) == MIGRATION_READY) {
+		sock = media->media_socket;
+		media->media_socket = mig->media_socket;
+		mig->media_socket = sock;
+
+		uring = media->uring;
+		media->uring = mig->uring;
+		mig->uring = uring;
+
+		memcpy(&media->server_addr, &mig->session.addr, sizeof(media->server_addr));
+		media->server_addrlen = mig->session.addrlen;
+		media->assigned_port = mig->session.assigned_port;
+		ftl_sockaddr_set_port(&media->server_addr, media->assigned_port);
+
+		media->unreachable_count = 0;
+		media->ingest_unreachable = FALSE;
+
+		/*another node and maybe another family, search for its mtu from the bottom*/
+		media->pmtud_enabled = mig->pmtud_enabled;
+		media->mtu_floor = media->server_addr.ss_family == AF_INET6 ? MIN_MTU_IPV6 : MIN_MTU;
+		media->max_probe_mtu = media->server_addr.ss_family == AF_INET6 ? MAX_PROBE_MTU_IPV6 : MAX_PROBE_MTU;
+		if (media->max_mtu > media->max_probe_mtu) {
+			media->max_mtu = media->max_probe_mtu;
+		}
+		media->mtu_ceiling = media->max_probe_mtu + 1;
+		media->probe_mtu = 0;
+		media->next_mtu_probe = ftl_clock_now(&ftl->clock);
+
+		ftl_atomic_store(&mig->state, MIGRATION_SWITCHED);
+		switched = TRUE;
+	}
+
+	UNLOCK_MUTEX(media->mutex);
+
+	/*the event loop retires the old session*/
+	if (switched) {
+		event_loop_wake(ftl);
+	}
+
+	return switched;
 }
 
-int media_send_audio(ftl_stream_configuration_private_t *ftl, uint8_t *data, int32_t len) {
+/*drops a migration still waiting for its key frame, returns FALSE if there was none*/
+BOOL media_migrate_cancel(ftl_stream_configuration_private_t *ftl) {
+	ftl_migration_t *mig = &ftl->migration;
+	BOOL cancelled = FALSE;
+
+	LOCK_MUTEX(ftl->media.mutex);
+
+	if (ftl_atomic_load(&mig->state) == MIGRATION_READY) {
+		media_migrate_release(ftl);
+		ftl_atomic_store(&mig->state, MIGRATION_NONE);
+		cancelled = TRUE;
+	}
+
+	UNLOCK_MUTEX(ftl->media.mutex);
+
+	return cancelled;
+}
+
+/*closes the media socket the migration holds, the new one if it never switched and the old one once it has*/
+void media_migrate_release(ftl_stream_configuration_private_t *ftl) {
+	ftl_migration_t *mig = &ftl->migration;
+
+#ifdef FTL_HAVE_IO_URING
+	ftl_uring_destroy(mig->uring);
+#endif
+	mig->uring = NULL;
+
+	ftl_close_socket(mig->media_socket);
+	mig->media_socket = INVALID_SOCKET;
+}
+
+/*
+ * The send buffer has to absorb the largest burst the pacer allows (MAX_XMIT_LEVEL_IN_MS at the target
+ * bitrate) plus a full sendmmsg batch, otherwise bursts are dropped in the kernel. The receive side only
+ * carries rtcp, size it for a loss burst worth of nacks.
+ */
+static void _media_set_socket_buffers(ftl_stream_configuration_private_t *ftl, SOCKET sock) {
+	int burst_bytes = (int)((int64_t)ftl->video_kbps * 1000 / 8 * MAX_XMIT_LEVEL_IN_MS / 1000 * 11 / 10);
+	int send_buf = ftl->socket_send_buf;
+	int recv_buf = ftl->socket_recv_buf;
+
+	if (send_buf <= 0) {
+		send_buf = burst_bytes * 2 + MAX_SEND_BATCH * MAX_PACKET_BUFFER;
+
+		if (send_buf < MIN_SOCKET_BUFFER) {
+			send_buf = MIN_SOCKET_BUFFER;
+		}
+	}
+
+	if (recv_buf <= 0) {
+		recv_buf = burst_bytes / 4;
+
+		if (recv_buf < MIN_SOCKET_BUFFER) {
+			recv_buf = MIN_SOCKET_BUFFER;
+		}
+	}
+
+	if (ftl_set_socket_send_buf(sock, send_buf) != 0) {
+		FTL_LOG(ftl, FTL_LOG_WARN, "Failed to set media socket send buffer to %d bytes: %s\n", send_buf, ftl_get_socket_error());
+	}
+
+	if (ftl_set_socket_recv_buf(sock, recv_buf) != 0) {
+		FTL_LOG(ftl, FTL_LOG_WARN, "Failed to set media socket receive buffer to %d bytes: %s\n", recv_buf, ftl_get_socket_error());
+	}
+
+	FTL_LOG(ftl, FTL_LOG_INFO, "Media socket buffers: send %d bytes (requested %d), receive %d bytes (requested %d)\n",
+		ftl_get_socket_send_buf(sock), send_buf, ftl_get_socket_recv_buf(sock), recv_buf);
+}
+
+int media_send_audio(ftl_stream_configuration_private_t *ftl, uint8_t *data, int32_t len, ftl_status_t *drop_reason) {
 	ftl_media_component_common_t *mc = &ftl->audio.media_component;
 	uint8_t nalu_type = 0;
 	int bytes_sent = 0;
@@ -189,6 +468,7 @@ int media_send_audio(ftl_stream_configuration_private_t *ftl, uint8_t *data, int
 	nack_slot_t *slot;
 	int remaining = len;
 	int retries = 0;
+	int packets_queued = 0;
 
 	while (remaining > 0) {
 		uint16_t sn = mc->seq_num;
@@ -196,6 +476,9 @@ int media_send_audio(ftl_stream_configuration_private_t *ftl, uint8_t *data, int
 		uint8_t *pkt_buf;
 		
 		if ((slot = _media_get_empty_slot(ftl, ssrc, sn)) == NULL) {
+			*drop_reason = FTL_STATUS_MEDIA_QUEUE_FULL;
+			media_stat_add(mc, MEDIA_STAT_FRAMES_DROPPED, 1);
+			FTL_PROBE3(drop, ssrc, FTL_STATUS_MEDIA_QUEUE_FULL, remaining);
 			return 0;
 		}
 
@@ -213,17 +496,25 @@ int media_send_audio(ftl_stream_configuration_private_t *ftl, uint8_t *data, int
 
 		slot->len = pkt_len;
 		slot->sn = sn;
-		gettimeofday(&slot->insert_time, NULL);
+		slot->first = consumed == payload_size;
+		slot->last = remaining <= 0;
+		slot->key = 0;
+		slot->insert_time = ftl_clock_now(&ftl->clock);
+		packets_queued++;
 
 		_media_send_packet(ftl, mc);
 
 		UNLOCK_MUTEX(slot->mutex);
 	}
 
+	media_stat_add(mc, MEDIA_STAT_PACKETS_QUEUED, packets_queued);
+	media_stat_add(mc, MEDIA_STAT_BYTES_QUEUED, bytes_sent);
+	stats_frame_queued(mc, len);
+
 	return bytes_sent;
 }
 
-int media_send_video(ftl_stream_configuration_private_t *ftl, uint8_t *data, int32_t len, int end_of_frame) {
+int media_send_video(ftl_stream_configuration_private_t *ftl, uint8_t *data, int32_t len, int end_of_frame, int ms_timeout, ftl_status_t *drop_reason) {
 	ftl_media_component_common_t *mc = &ftl->video.media_component;
 	uint8_t nalu_type = 0;
 	uint8_t nri;
@@ -235,35 +526,78 @@ int media_send_video(ftl_stream_configuration_private_t *ftl, uint8_t *data, int
 	nack_slot_t *slot;
 	int remaining = len;
 	int first_fu = 1;
+	int packets_queued = 0;
+	int64_t deadline = 0;
 
 	nalu_type = data[0] & 0x1F;
 	nri = (data[0] >> 5) & 0x3;
 
+	FTL_PROBE4(nalu_submit, mc->ssrc, nalu_type, len, end_of_frame);
+
+	/*kept for a resume, memmove as the resend below passes the cached copy back in*/
+	if (nalu_type == H264_NALU_TYPE_SPS && len <= MAX_PARAM_SET_LEN) {
+		memmove(ftl->video.sps, data, len);
+		ftl->video.sps_len = len;
+		ftl->video.resend_param_sets = FALSE;
+	}
+	else if (nalu_type == H264_NALU_TYPE_PPS && len <= MAX_PARAM_SET_LEN) {
+		memmove(ftl->video.pps, data, len);
+		ftl->video.pps_len = len;
+	}
+
 	if (ftl->video.wait_for_idr_frame) {
-		if (nalu_type == H264_NALU_TYPE_SPS) {
-			FTL_LOG(FTL_LOG_INFO, "Got key frame, continuing (dropped %d frames)\n", mc->stats.dropped_frames);
+		/*an idr without parameter sets will do when the cached ones are about to be sent ahead of it*/
+		if (nalu_type == H264_NALU_TYPE_SPS || (nalu_type == H264_NALU_TYPE_IDR && ftl->video.resend_param_sets)) {
+			FTL_LOG(ftl, FTL_LOG_INFO, "Got key frame, continuing (dropped %ld frames so far)\n", (long)ftl_atomic_load_relaxed(&mc->stats.counters[MEDIA_STAT_FRAMES_DROPPED]));
 			ftl->video.wait_for_idr_frame = FALSE;
 		}
 		else {
+			mc->stats.frame_bytes = 0;
 			if (end_of_frame) {
-				mc->stats.dropped_frames++;
+				media_stat_add(mc, MEDIA_STAT_FRAMES_DROPPED, 1);
 				mc->timestamp += mc->timestamp_step;
 			}
+			*drop_reason = FTL_STATUS_WAITING_FOR_KEY_FRAME;
+			FTL_PROBE3(drop, mc->ssrc, FTL_STATUS_WAITING_FOR_KEY_FRAME, len);
 			return bytes_queued;
 		}
 	}
 
+	/*a key frame that brings its own parameter sets cleared this when its sps was cached above*/
+	if (ftl->video.resend_param_sets && mc->stats.frame_bytes == 0) {
+		ftl->video.resend_param_sets = FALSE;
+		media_send_video(ftl, ftl->video.sps, ftl->video.sps_len, 0, ms_timeout, drop_reason);
+		media_send_video(ftl, ftl->video.pps, ftl->video.pps_len, 0, ms_timeout, drop_reason);
+	}
+
+	if (ms_timeout > 0) {
+		/*a timeout is real time, a virtual clock may never get there*/
+		deadline = ftl_monotonic_ns() + ms_timeout * NS_PER_MS;
+	}
+
 	while (remaining > 0) {
 		uint16_t sn = mc->seq_num;
 		uint32_t ssrc = mc->ssrc;
 		uint8_t *pkt_buf;
 
-		if ((slot = _media_get_empty_slot(ftl, ssrc, sn)) == NULL) {
+		slot = _media_get_empty_slot(ftl, ssrc, sn);
+
+		if (slot == NULL && ms_timeout > 0) {
+			/*slots only free up once the worker sends what is already queued*/
+			if (ftl->context != NULL && bytes_queued > 0) {
+				context_kick(ftl);
+			}
+			slot = _media_wait_for_empty_slot(ftl, ssrc, sn, deadline);
+		}
+
+		if (slot == NULL) {
+			*drop_reason = FTL_STATUS_MEDIA_QUEUE_FULL;
+			FTL_PROBE3(drop, ssrc, FTL_STATUS_MEDIA_QUEUE_FULL, remaining);
 			if (nri) {
-				FTL_LOG(FTL_LOG_INFO, "Video queue full, dropping packets until next key frame\n");
+				FTL_LOG(ftl, FTL_LOG_INFO, "Video queue full, dropping packets until next key frame\n");
 				ftl->video.wait_for_idr_frame = TRUE;
 			}
-			return bytes_queued;
+			break;
 		}
 
 		LOCK_MUTEX(slot->mutex);
@@ -271,10 +605,13 @@ int media_send_video(ftl_stream_configuration_private_t *ftl, uint8_t *data, int
 		pkt_buf = slot->packet;
 		pkt_len = sizeof(slot->packet);
 		
-		slot->first = 0;
+		slot->first = mc->stats.frame_bytes == 0 && bytes_queued == 0;
 		slot->last = 0;
+		/*the same key frame test as wait_for_idr_frame, a new ingest can decode from here on*/
+		slot->key = first_fu && nalu_type == H264_NALU_TYPE_SPS;
 
 		payload_size = _media_make_video_rtp_packet(ftl, data, remaining, pkt_buf, &pkt_len, first_fu);
+		FTL_PROBE4(packetize, ssrc, sn, payload_size, pkt_len);
 
 		first_fu = 0;
 		remaining -= payload_size;
@@ -290,59 +627,48 @@ int media_send_video(ftl_stream_configuration_private_t *ftl, uint8_t *data, int
 
 		slot->len = pkt_len;
 		slot->sn = sn;
-		gettimeofday(&slot->insert_time, NULL);
+		slot->insert_time = ftl_clock_now(&ftl->clock);
 
 		UNLOCK_MUTEX(slot->mutex);
 
+		ftl_atomic_add_relaxed(&mc->bytes_queued, pkt_len);
+
 #ifdef _WIN32
 		ReleaseSemaphore(mc->pkt_ready, 1, NULL);
 #else
 		sem_post(&mc->pkt_ready);
 #endif
-		mc->stats.packets_queued++;
-		mc->stats.bytes_queued += pkt_len;
-	}
-
-	if (end_of_frame) {
-		mc->stats.frames_received++;
+		FTL_PROBE5(enqueue, ssrc, sn, RTP_TIMESTAMP(pkt_buf), slot->first, slot->last);
+		packets_queued++;
 	}
 
-	struct timeval now, delta;
-	gettimeofday(&now, NULL);
-	timeval_subtract(&delta, &now, &mc->stats_tv);
-	float stats_interval = timeval_to_ms(&delta);
+	media_stat_add(mc, MEDIA_STAT_PACKETS_QUEUED, packets_queued);
+	media_stat_add(mc, MEDIA_STAT_BYTES_QUEUED, bytes_queued);
+	mc->stats.frame_bytes += bytes_queued;
 
-	if (stats_interval > 5000) {
-		ftl_status_msg_t status;
-
-		mc->stats_tv = now;
-
-		status.msg.video_stats.average_fps = 60;
-		status.msg.video_stats.bytes_sent = 1234;
-		status.msg.video_stats.frames_sent = 600;
-
-		status.type = FTL_STATUS_VIDEO;
-
-		enqueue_status_msg(ftl, &status);
-
-		FTL_LOG(FTL_LOG_INFO, "Queue an average of %3.2f fps (%3.1f kbps), sent an average of %3.2f fps (%3.1f kbps), queue fullness %3.1f\n", 
-			(float)mc->stats.frames_received * 1000.f / stats_interval, 
-			(float)mc->stats.bytes_queued / stats_interval * 8,
-			(float)mc->stats.frames_sent * 1000.f / stats_interval,
-			(float)mc->stats.bytes_sent / stats_interval * 8,
-			_media_get_queue_fullness(ftl, mc->ssrc) * 100.f);
+	/*the shared workers only pace a stream when told there is something to send*/
+	if (ftl->context != NULL && bytes_queued > 0) {
+		context_kick(ftl);
+	}
 
-		clear_stats(&mc->stats);
+	if (end_of_frame) {
+		if (remaining <= 0) {
+			stats_frame_queued(mc, mc->stats.frame_bytes);
+		}
+		else {
+			media_stat_add(mc, MEDIA_STAT_FRAMES_DROPPED, 1);
+		}
+		mc->stats.frame_bytes = 0;
 	}
 
 	return bytes_queued;
 }
 
-static int _nack_init(ftl_media_component_common_t *media) {
+static int _nack_init(ftl_stream_configuration_private_t *ftl, ftl_media_component_common_t *media) {
 
 	for (int i = 0; i < NACK_RB_SIZE; i++) {
-		if ((media->nack_slots[i] = (nack_slot_t *)malloc(sizeof(nack_slot_t))) == NULL) {
-			FTL_LOG(FTL_LOG_ERROR, "Failed to allocate memory for nack buffer\n");
+		if ((media->nack_slots[i] = (nack_slot_t *)ftl_alloc(&ftl->allocator, sizeof(nack_slot_t))) == NULL) {
+			FTL_LOG(ftl, FTL_LOG_ERROR, "Failed to allocate memory for nack buffer\n");
 			return FTL_MALLOC_FAILURE;
 		}
 
@@ -353,7 +679,7 @@ static int _nack_init(ftl_media_component_common_t *media) {
 #else
 		if (pthread_mutex_init(&slot->mutex, &ftl_default_mutexattr) != 0) {
 #endif
-			FTL_LOG(FTL_LOG_ERROR, "Failed to allocate memory for nack buffer\n");
+			FTL_LOG(ftl, FTL_LOG_ERROR, "Failed to allocate memory for nack buffer\n");
 			return FTL_MALLOC_FAILURE;
 		}
 
@@ -364,11 +690,12 @@ static int _nack_init(ftl_media_component_common_t *media) {
 
 	media->nack_slots_initalized = TRUE;
 	media->seq_num = media->xmit_seq_num = 0; //TODO: should start at a random value
+	media->bytes_queued = 0;
 
 	return FTL_SUCCESS;
 }
 
-static int _nack_destroy(ftl_media_component_common_t *media) {
+static int _nack_destroy(ftl_stream_configuration_private_t *ftl, ftl_media_component_common_t *media) {
 
 	for (int i = 0; i < NACK_RB_SIZE; i++) {
 		if (media->nack_slots[i] != NULL) {
@@ -377,7 +704,7 @@ static int _nack_destroy(ftl_media_component_common_t *media) {
 #else
 			pthread_mutex_destroy(&media->nack_slots[i]->mutex);
 #endif
-			free(media->nack_slots[i]);
+			ftl_free(&ftl->allocator, media->nack_slots[i]);
 			media->nack_slots[i] = NULL;
 		}
 	}
@@ -407,7 +734,7 @@ static nack_slot_t* _media_get_empty_slot(ftl_stream_configuration_private_t *ft
 	ftl_media_component_common_t *mc;
 
 	if ((mc = _media_lookup(ftl, ssrc)) == NULL) {
-		FTL_LOG(FTL_LOG_ERROR, "Unable to find ssrc %d\n", ssrc);
+		FTL_LOG(ftl, FTL_LOG_ERROR, "Unable to find ssrc %d\n", ssrc);
 		return NULL;
 	}
 
@@ -418,39 +745,239 @@ static nack_slot_t* _media_get_empty_slot(ftl_stream_configuration_private_t *ft
 	return mc->nack_slots[sn % NACK_RB_SIZE];
 }
 
-static float _media_get_queue_fullness(ftl_stream_configuration_private_t *ftl, uint32_t ssrc) {
-	ftl_media_component_common_t *mc;
+/*
+ * Blocks until the pacer frees a slot or the deadline passes. The pacer posts slot_freed whenever it sends
+ * from a full queue; both sides fence between updating their end of the ring and reading the other's, so
+ * either the check here sees the room or the pacer sees the queue was full and posts.
+ */
+static nack_slot_t* _media_wait_for_empty_slot(ftl_stream_configuration_private_t *ftl, uint32_t ssrc, uint16_t sn, int64_t deadline) {
+	ftl_media_component_common_t *mc = &ftl->video.media_component;
+	nack_slot_t *slot;
+	int64_t wait_ms;
+#ifndef _WIN32
+	struct timespec ts;
+	struct timeval now;
+#endif
 
-	if ((mc = _media_lookup(ftl, ssrc)) == NULL) {
-		FTL_LOG(FTL_LOG_ERROR, "Unable to find ssrc %d\n", ssrc);
-		return -1;
-	}
+	/*counts left from times the queue filled up with nobody waiting*/
+#ifdef _WIN32
+	while (WaitForSingleObject(mc->slot_freed, 0) == WAIT_OBJECT_0);
+#else
+	while (sem_trywait(&mc->slot_freed) == 0);
+#endif
 
-	int packets_queued;
+	ftl_atomic_fence();
 
-	if (mc->seq_num >= mc->xmit_seq_num) {
-		packets_queued = mc->seq_num - mc->xmit_seq_num;
+	while ((slot = _media_get_empty_slot(ftl, ssrc, sn)) == NULL) {
+		if (ftl->context == NULL && !ftl->media.send_thread_running) {
+			break;
+		}
+
+		if ((wait_ms = (deadline - ftl_monotonic_ns() + NS_PER_MS - 1) / NS_PER_MS) <= 0) {
+			break;
+		}
+
+#ifdef _WIN32
+		WaitForSingleObject(mc->slot_freed, (DWORD)wait_ms);
+#else
+		gettimeofday(&now, NULL);
+		timeval_add_ms(&now, (int)wait_ms);
+		ts.tv_sec = now.tv_sec;
+		ts.tv_nsec = now.tv_usec * 1000;
+		sem_timedwait(&mc->slot_freed, &ts);
+#endif
 	}
-	else {
-		packets_queued = 65535 - mc->xmit_seq_num + mc->seq_num + 1;
+
+	return slot;
+}
+
+/*audio is sent synchronously so only video ever sits in the queue*/
+int media_get_queue_depth_ms(ftl_stream_configuration_private_t *ftl) {
+	int64_t bytes_queued = ftl_atomic_load_relaxed(&ftl->video.media_component.bytes_queued);
+
+	if (ftl->video_kbps <= 0 || bytes_queued <= 0) {
+		return 0;
 	}
 
-	return (float)packets_queued / (float)NACK_RB_SIZE;
+	return (int)(bytes_queued * 8 / ftl->video_kbps);
 }
 
 static int _media_send_slot(ftl_stream_configuration_private_t *ftl, nack_slot_t *slot) {
 	int tx_len;
 	
 	LOCK_MUTEX(ftl->media.mutex);
-	if ((tx_len = sendto(ftl->media.media_socket, slot->packet, slot->len, 0, (struct sockaddr*) &ftl->media.server_addr, sizeof(struct sockaddr_in))) == SOCKET_ERROR)
+	tx_len = send(ftl->media.media_socket, slot->packet, slot->len, 0);
+
+	if (tx_len == SOCKET_ERROR && ftl->media.pmtud_enabled && ftl_socket_error_is_msg_too_big()) {
+		_media_path_mtu_exceeded(ftl, slot->len);
+
+		/*this packet was built for the old mtu, let it fragment rather than lose it*/
+		ftl_set_socket_dont_fragment(ftl->media.media_socket, ftl->media.server_addr.ss_family, FALSE);
+		tx_len = send(ftl->media.media_socket, slot->packet, slot->len, 0);
+		ftl_set_socket_dont_fragment(ftl->media.media_socket, ftl->media.server_addr.ss_family, TRUE);
+	}
+
+	if (tx_len == SOCKET_ERROR)
 	{
-		FTL_LOG(FTL_LOG_ERROR, "sendto() failed with error: %s", ftl_get_socket_error());
+		if (ftl_socket_error_is_unreachable()) {
+			_media_check_unreachable(ftl);
+			event_loop_wake(ftl);
+		}
+		else {
+			FTL_LOG(ftl, FTL_LOG_ERROR, "send() failed with error: %s", ftl_get_socket_error());
+		}
 	}
 	UNLOCK_MUTEX(ftl->media.mutex);
 
 	return tx_len;
 }
 
+/*
+ * Packetization layer path mtu discovery (RFC 4821). Probes are RTCP APP packets, which an RTP receiver
+ * ignores, and the search is a bisection above the current mtu. A size is only confirmed when the ingest
+ * echoes the probe back at full length; a local send succeeding proves nothing on a path that drops ICMP.
+ * An ingest that doesn't echo probes leaves the mtu at MAX_MTU, which can still be lowered on EMSGSIZE.
+ */
+static int _media_send_mtu_probe(ftl_stream_configuration_private_t *ftl, int size) {
+	uint8_t probe[MAX_PACKET_BUFFER];
+	uint32_t *hdr = (uint32_t *)probe;
+	int tx_len;
+
+	memset(probe, 0, size);
+
+	hdr[0] = htonl((2 << 30) | (204 << 16) | (size / 4 - 1));
+	hdr[1] = htonl(ftl->video.media_component.ssrc);
+	memcpy(&hdr[2], "FTLP", 4);
+
+	if ((tx_len = send(ftl->media.media_socket, probe, size, 0)) == SOCKET_ERROR) {
+		return ftl_socket_error_is_msg_too_big() ? 0 : -1;
+	}
+
+	return tx_len;
+}
+
+static int _media_probe_path_mtu(ftl_stream_configuration_private_t *ftl, int64_t now) {
+	ftl_media_config_t *media = &ftl->media;
+	int bytes_sent = 0;
+	int candidate;
+	int ret;
+
+	if (!media->pmtud_enabled || now < media->next_mtu_probe) {
+		return 0;
+	}
+
+	LOCK_MUTEX(media->mutex);
+
+	media->next_mtu_probe = now;
+
+	/*no echo yet, the probe or its echo may just have been lost so try the same size again*/
+	if (media->probe_mtu && ++media->probe_tries < MTU_PROBE_TRIES) {
+		if ((ret = _media_send_mtu_probe(ftl, media->probe_mtu)) > 0) {
+			bytes_sent += ret;
+		}
+		else if (ret == 0) {
+			media->mtu_ceiling = media->probe_mtu;
+			media->probe_mtu = 0;
+		}
+
+		media->next_mtu_probe += MTU_PROBE_INTERVAL_MS * NS_PER_MS;
+
+		UNLOCK_MUTEX(media->mutex);
+
+		return bytes_sent;
+	}
+
+	if (media->probe_mtu) {
+		media->mtu_ceiling = media->probe_mtu;
+		media->probe_mtu = 0;
+	}
+
+	/*sizes up to the current mtu are already in use, only larger ones need probing*/
+	if (media->mtu_floor < media->max_mtu) {
+		media->mtu_floor = media->max_mtu;
+	}
+
+	if (media->mtu_ceiling - media->mtu_floor <= MTU_PROBE_GRANULARITY) {
+		/*search has converged, check back later in case the path now allows larger packets*/
+		media->mtu_ceiling = media->max_probe_mtu + 1;
+		media->next_mtu_probe += MTU_PROBE_RAISE_INTERVAL_MS * NS_PER_MS;
+	}
+	else {
+		/*rtcp lengths are in 32 bit words*/
+		candidate = ((media->mtu_floor + media->mtu_ceiling) / 2) & ~3;
+
+		if ((ret = _media_send_mtu_probe(ftl, candidate)) > 0) {
+			bytes_sent += ret;
+			media->probe_mtu = candidate;
+			media->probe_tries = 0;
+		}
+		else if (ret == 0) {
+			media->mtu_ceiling = candidate;
+		}
+
+		media->next_mtu_probe += MTU_PROBE_INTERVAL_MS * NS_PER_MS;
+	}
+
+	UNLOCK_MUTEX(media->mutex);
+
+	return bytes_sent;
+}
+
+/*the ingest sent a probe back, so packets of that size make it there and back*/
+static void _media_mtu_probe_echoed(ftl_stream_configuration_private_t *ftl, uint8_t *buf, int recv_len) {
+	ftl_media_config_t *media = &ftl->media;
+
+	LOCK_MUTEX(media->mutex);
+
+	/*only the outstanding probe counts, a late echo of an older one may predate an mtu drop*/
+	if (media->probe_mtu != 0 && recv_len == media->probe_mtu &&
+		ntohl(*(uint32_t *)(buf + 4)) == ftl->video.media_component.ssrc) {
+		media->mtu_floor = media->probe_mtu;
+
+		if (media->probe_mtu > media->max_mtu) {
+			_media_set_mtu(ftl, media->probe_mtu);
+		}
+
+		media->probe_mtu = 0;
+		media->next_mtu_probe = ftl_clock_now(&ftl->clock);
+	}
+
+	UNLOCK_MUTEX(media->mutex);
+}
+
+/*the path got smaller (route change, new tunnel), fall back to the last confirmed size and search again*/
+static void _media_path_mtu_exceeded(ftl_stream_configuration_private_t *ftl, int pkt_len) {
+	ftl_media_config_t *media = &ftl->media;
+
+	if (pkt_len < media->mtu_ceiling) {
+		media->mtu_ceiling = pkt_len;
+	}
+
+	if (media->mtu_floor >= media->mtu_ceiling) {
+		media->mtu_floor = media->server_addr.ss_family == AF_INET6 ? MIN_MTU_IPV6 : MIN_MTU;
+	}
+
+	media->probe_mtu = 0;
+	media->next_mtu_probe = ftl_clock_now(&ftl->clock);
+
+	if (media->max_mtu >= pkt_len) {
+		_media_set_mtu(ftl, media->mtu_floor);
+	}
+}
+
+static void _media_set_mtu(ftl_stream_configuration_private_t *ftl, int mtu) {
+	ftl_status_msg_t status;
+
+	ftl->media.max_mtu = mtu;
+
+	FTL_LOG(ftl, FTL_LOG_INFO, "Media mtu is now %d bytes\n", mtu);
+
+	status.type = FTL_STATUS_NETWORK;
+	status.msg.network.mtu = mtu;
+
+	enqueue_status_msg(ftl, &status);
+}
+
 static int _media_send_packet(ftl_stream_configuration_private_t *ftl, ftl_media_component_common_t *mc) {
 
 	int tx_len;
@@ -458,74 +985,239 @@ static int _media_send_packet(ftl_stream_configuration_private_t *ftl, ftl_media
 	nack_slot_t *slot = mc->nack_slots[mc->xmit_seq_num % NACK_RB_SIZE];
 
 	if (mc->xmit_seq_num == mc->seq_num) {
-		FTL_LOG(FTL_LOG_INFO, "ERROR: No packets in ring buffer (%d == %d)", mc->xmit_seq_num, mc->seq_num);
+		FTL_LOG(ftl, FTL_LOG_INFO, "ERROR: No packets in ring buffer (%d == %d)", mc->xmit_seq_num, mc->seq_num);
 	}
 
 	LOCK_MUTEX(slot->mutex);
 
 	tx_len = _media_send_slot(ftl, slot);
+	FTL_PROBE5(send, mc->ssrc, slot->sn, RTP_TIMESTAMP(slot->packet), tx_len, slot->last);
 
-	gettimeofday(&slot->xmit_time, NULL);
+	slot->xmit_time = ftl_clock_now(&ftl->clock);
 
 	mc->xmit_seq_num++;
 
 	if (slot->last) {
-		mc->stats.frames_sent++;
+		media_stat_add(mc, MEDIA_STAT_FRAMES_SENT, 1);
+	}
+	media_stat_add(mc, MEDIA_STAT_PACKETS_SENT, 1);
+	if (tx_len > 0) {
+		media_stat_add(mc, MEDIA_STAT_BYTES_SENT, tx_len);
 	}
-	mc->stats.packets_sent++;
-	mc->stats.bytes_sent += tx_len;
+
+	UNLOCK_MUTEX(slot->mutex);
+	
+	return tx_len;
+}
 
 /*
-	timeval_subtract(&profile_delta, &slot->xmit_time, &slot->insert_time);
+ * Sends up to max_bytes of queued packets with a single syscall (sendmmsg where available). The caller has
+ * already taken one pkt_ready count, every additional packet in the batch must take its own count so we
+ * never pick up a slot the producer has not finished writing.
+ * With kernel pacing each packet is stamped with *departure, which then advances by the packet's time on
+ * the wire at bytes_per_ms. Pass NULL to send immediately.
+ */
+static int _media_send_packets(ftl_stream_configuration_private_t *ftl, ftl_media_component_common_t *mc, int max_bytes, int64_t *departure, int bytes_per_ms) {
+	nack_slot_t *slots[MAX_SEND_BATCH];
+	uint8_t *bufs[MAX_SEND_BATCH];
+	int lens[MAX_SEND_BATCH];
+	int64_t txtimes[MAX_SEND_BATCH];
+	int count = 0, split, sent, bytes_sent = 0, frames_sent = 0, tx_len, i;
+	uint16_t sn = mc->xmit_seq_num;
+	int64_t now;
+
+	do {
+		if (count > 0 && !_media_take_packet(mc)) {
+			break;
+		}
 
-	xmit_delay_delta = timeval_to_ms(&profile_delta);
+		slots[count] = mc->nack_slots[sn % NACK_RB_SIZE];
+		LOCK_MUTEX(slots[count]->mutex);
+		FTL_PROBE2(dequeue, mc->ssrc, sn);
+		bufs[count] = slots[count]->packet;
+		lens[count] = slots[count]->len;
+		max_bytes -= lens[count];
 
-	if (xmit_delay_delta > pkt_xmit_delay_max) {
-		pkt_xmit_delay_max = xmit_delay_delta;
+		if (departure != NULL) {
+			txtimes[count] = *departure;
+			*departure += (int64_t)lens[count] * 1000000 / bytes_per_ms;
+		}
+
+		count++;
+		sn++;
+	} while (count < MAX_SEND_BATCH && max_bytes > 0);
+
+	/*a migration waiting for a key frame switches sockets right in front of it*/
+	split = count;
+	if (ftl_atomic_load(&ftl->migration.state) == MIGRATION_READY) {
+		for (split = 0; split < count && !slots[split]->key; split++) {
+		}
 	}
-	else if (xmit_delay_delta < pkt_xmit_delay_min) {
-		pkt_xmit_delay_min = xmit_delay_delta;
+
+	LOCK_MUTEX(ftl->media.mutex);
+	sent = split > 0 ? _media_send_batch(ftl, bufs, lens, departure != NULL ? txtimes : NULL, split) : 0;
+
+	if (split < count && sent == split && media_migrate_switch(ftl)) {
+		sent += _media_send_batch(ftl, bufs + split, lens + split, departure != NULL ? txtimes + split : NULL, count - split);
 	}
+	UNLOCK_MUTEX(ftl->media.mutex);
 
-	xmit_delay_total += xmit_delay_delta;
-	xmit_delay_samples++;
-*/
-	UNLOCK_MUTEX(slot->mutex);
-	
-	return tx_len;
+	now = ftl_clock_now(&ftl->clock);
+
+	for (i = 0; i < count; i++) {
+		/*anything the batch didn't take goes out on its own so errors (mtu, unreachable) get handled*/
+		tx_len = i < sent ? lens[i] : _media_send_slot(ftl, slots[i]);
+		FTL_PROBE5(send, mc->ssrc, slots[i]->sn, RTP_TIMESTAMP(slots[i]->packet), tx_len, slots[i]->last);
+
+		slots[i]->xmit_time = now;
+		mc->xmit_seq_num++;
+		ftl_atomic_add_relaxed(&mc->bytes_queued, -lens[i]);
+
+		histogram_record(&ftl->media.latency[MEDIA_LATENCY_QUEUE], (now - slots[i]->insert_time) / NS_PER_US);
+
+		if (slots[i]->first) {
+			mc->frame_first_xmit = now;
+			mc->frame_in_flight = TRUE;
+		}
+
+		if (slots[i]->last) {
+			frames_sent++;
+
+			if (mc->frame_in_flight) {
+				histogram_record(&ftl->media.latency[MEDIA_LATENCY_FRAME_SPREAD], (now - mc->frame_first_xmit) / NS_PER_US);
+				mc->frame_in_flight = FALSE;
+			}
+		}
+
+		if (tx_len > 0) {
+			bytes_sent += tx_len;
+		}
+
+		UNLOCK_MUTEX(slots[i]->mutex);
+	}
+
+	/*a producer blocked on a full queue can go on, see _media_wait_for_empty_slot*/
+	ftl_atomic_fence();
+	if (((mc->seq_num + 1) % NACK_RB_SIZE) == ((uint16_t)(sn - count) % NACK_RB_SIZE)) {
+#ifdef _WIN32
+		ReleaseSemaphore(mc->slot_freed, 1, NULL);
+#else
+		sem_post(&mc->slot_freed);
+#endif
+	}
+
+	media_stat_add(mc, MEDIA_STAT_FRAMES_SENT, frames_sent);
+	media_stat_add(mc, MEDIA_STAT_PACKETS_SENT, count);
+	media_stat_add(mc, MEDIA_STAT_BYTES_SENT, bytes_sent);
+
+	return bytes_sent;
 }
 
-static int _nack_resend_packet(ftl_stream_configuration_private_t *ftl, uint32_t ssrc, uint16_t sn) {
-	ftl_media_component_common_t *mc;
-	int tx_len;
+/*
+ * One syscall for the whole batch, through io_uring when it is set up. Returns how many packets went out,
+ * the caller retries the rest one at a time to handle the error. Called with the media mutex held.
+ */
+static int _media_send_batch(ftl_stream_configuration_private_t *ftl, uint8_t **bufs, int *lens, int64_t *txtimes, int count) {
+	int sent;
+
+#ifdef FTL_HAVE_IO_URING
+	if (ftl->media.uring != NULL) {
+		sent = ftl_uring_send_batch(ftl->media.uring, bufs, lens, txtimes, count);
+	}
+	else
+#endif
+	if (txtimes != NULL) {
+		sent = ftl_send_batch_txtime(ftl->media.media_socket, bufs, lens, txtimes, count);
+	}
+	else {
+		sent = ftl_send_batch(ftl->media.media_socket, bufs, lens, count);
+	}
 
-	if ((mc = _media_lookup(ftl, ssrc)) == NULL) {
-		FTL_LOG(FTL_LOG_ERROR, "Unable to find ssrc %d\n", ssrc);
-		return -1;
+	return sent < 0 ? 0 : sent;
+}
+
+/*connected udp sockets turn icmp unreachable into socket errors, a few of those in a row mean the ingest is gone*/
+static void _media_check_unreachable(ftl_stream_configuration_private_t *ftl) {
+	ftl_media_config_t *media = &ftl->media;
+	int64_t now = ftl_clock_now(&ftl->clock);
+
+	if (media->unreachable_count == 0 || now - media->first_unreachable >= MEDIA_UNREACHABLE_WINDOW_MS * NS_PER_MS) {
+		media->unreachable_count = 0;
+		media->first_unreachable = now;
 	}
 
-	/*map sequence number to slot*/
+	if (++media->unreachable_count >= MEDIA_UNREACHABLE_COUNT && !media->ingest_unreachable) {
+		/*the new session is up, move to it now instead of losing the stream while waiting for a key frame*/
+		if (media_migrate_switch(ftl)) {
+			FTL_LOG(ftl, FTL_LOG_WARN, "Ingest media port is unreachable, switching to the new ingest early\n");
+			return;
+		}
+
+		FTL_LOG(ftl, FTL_LOG_ERROR, "Ingest media port is unreachable\n");
+		media->ingest_unreachable = TRUE;
+	}
+}
+
+/*
+ * Returns the slot holding sn locked, or NULL if it has been overwritten. Only tries the lock: a slot the
+ * producer or pacer is busy with hasn't been sent yet so there is nothing to retransmit, and waiting on it
+ * while holding other slots of the batch could deadlock against the pacer.
+ */
+static nack_slot_t *_nack_lock_slot(ftl_stream_configuration_private_t *ftl, ftl_media_component_common_t *mc, uint16_t sn) {
 	nack_slot_t *slot = mc->nack_slots[sn % NACK_RB_SIZE];
-	LOCK_MUTEX(slot->mutex);
+
+	if (!TRYLOCK_MUTEX(slot->mutex)) {
+		return NULL;
+	}
 
 	if (slot->sn != sn) {
-		FTL_LOG(FTL_LOG_WARN, "[%d] expected sn %d in slot but found %d...discarding retransmit request\n", ssrc, sn, slot->sn);
+		FTL_LOG(ftl, FTL_LOG_WARN, "[%d] expected sn %d in slot but found %d...discarding retransmit request\n", mc->ssrc, sn, slot->sn);
+		media_stat_add(mc, MEDIA_STAT_PACKETS_LATE, 1);
 		UNLOCK_MUTEX(slot->mutex);
-		return 0;
+		return NULL;
 	}
 
-	int req_delay = 0;
-	struct timeval delta, now;
-	gettimeofday(&now, NULL);
-	timeval_subtract(&delta, &now, &slot->xmit_time);
-	req_delay = (int)timeval_to_ms(&delta);
+	return slot;
+}
+
+/*retransmits a batch of locked slots with one syscall and unlocks them*/
+static int _nack_resend_slots(ftl_stream_configuration_private_t *ftl, ftl_media_component_common_t *mc, nack_slot_t **slots, int count, int64_t nack_time) {
+	uint8_t *bufs[MAX_SEND_BATCH];
+	int lens[MAX_SEND_BATCH];
+	int sent, bytes_sent = 0, resent = 0, tx_len, delay_ms, i;
+	int64_t now;
 
-	tx_len = _media_send_slot(ftl, slot);
-	FTL_LOG(FTL_LOG_INFO, "[%d] resent sn %d, request delay was %d ms\n", ssrc, sn, req_delay);
+	for (i = 0; i < count; i++) {
+		bufs[i] = slots[i]->packet;
+		lens[i] = slots[i]->len;
+	}
 
-	UNLOCK_MUTEX(slot->mutex);
+	LOCK_MUTEX(ftl->media.mutex);
+	sent = _media_send_batch(ftl, bufs, lens, NULL, count);
+	UNLOCK_MUTEX(ftl->media.mutex);
 
-	return tx_len;
+	now = ftl_clock_now(&ftl->clock);
+
+	for (i = 0; i < count; i++) {
+		tx_len = i < sent ? lens[i] : _media_send_slot(ftl, slots[i]);
+
+		if (tx_len > 0) {
+			bytes_sent += tx_len;
+			resent++;
+		}
+
+		histogram_record(&ftl->media.latency[MEDIA_LATENCY_NACK_RESPONSE], (now - nack_time) / NS_PER_US);
+
+		delay_ms = (int)((now - slots[i]->xmit_time) / NS_PER_MS);
+		FTL_PROBE4(retransmit, mc->ssrc, slots[i]->sn, tx_len, delay_ms);
+		FTL_LOG(ftl, FTL_LOG_DEBUG, "[%d] resent sn %d, request delay was %d ms\n", mc->ssrc, slots[i]->sn, delay_ms);
+
+		UNLOCK_MUTEX(slots[i]->mutex);
+	}
+
+	media_stat_add(mc, MEDIA_STAT_PACKETS_RESENT, resent);
+
+	return bytes_sent;
 }
 
 static int _media_make_video_rtp_packet(ftl_stream_configuration_private_t *ftl, uint8_t *in, int in_len, uint8_t *out, int *out_len, int first_pkt) {
@@ -533,9 +1225,10 @@ static int _media_make_video_rtp_packet(ftl_stream_configuration_private_t *ftl,
 	int frag_len;
 	ftl_video_component_t *video = &ftl->video;
 	ftl_media_component_common_t *mc = &video->media_component;
+	int mtu = ftl->media.max_mtu; /*can be changed by path mtu discovery while we packetize*/
 
 	sbit = first_pkt ? 1 : 0;
-	ebit = (in_len + RTP_HEADER_BASE_LEN + RTP_FUA_HEADER_LEN) <= ftl->media.max_mtu;
+	ebit = (in_len + RTP_HEADER_BASE_LEN + RTP_FUA_HEADER_LEN) <= mtu;
 
 	uint32_t rtp_header;
 	uint32_t *out_header = (uint32_t *)out;
@@ -570,7 +1263,7 @@ static int _media_make_video_rtp_packet(ftl_stream_configuration_private_t *ftl,
 
 		out += 2;
 
-		frag_len = ftl->media.max_mtu - RTP_HEADER_BASE_LEN - RTP_FUA_HEADER_LEN;
+		frag_len = mtu - RTP_HEADER_BASE_LEN - RTP_FUA_HEADER_LEN;
 
 		if (frag_len > in_len) {
 			frag_len = in_len;
@@ -625,98 +1318,157 @@ static int _media_set_marker_bit(ftl_media_component_common_t *mc, uint8_t *in)
 }
 
 
-/*handles rtcp packets from ingest including lost packet retransmission requests (nack)*/
-#ifdef _WIN32
-static DWORD WINAPI recv_thread(LPVOID data)
-#else
-static void *recv_thread(void *data)
-#endif
-{
-	ftl_stream_configuration_private_t *ftl = (ftl_stream_configuration_private_t *)data;
-	ftl_media_config_t *media = &ftl->media;
-	int ret;
-	unsigned char *buf;
-
-#ifdef _WIN32
-	if (!SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL)) {
-		FTL_LOG(FTL_LOG_WARN, "Failed to set recv_thread priority to THREAD_PRIORITY_TIME_CRITICAL\n");
+/*what the event loop watches for rtcp, the io_uring completion queue when receives go through it*/
+SOCKET media_get_recv_socket(ftl_stream_configuration_private_t *ftl) {
+#ifdef FTL_HAVE_IO_URING
+	if (ftl->media.uring != NULL && ftl_uring_recv_fd(ftl->media.uring) != INVALID_SOCKET) {
+		return ftl_uring_recv_fd(ftl->media.uring);
 	}
 #endif
 
-	if ((buf = (unsigned char*)malloc(MAX_PACKET_BUFFER)) == NULL) {
-		FTL_LOG(FTL_LOG_ERROR, "Failed to allocate recv buffer\n");
-		return (void*)-1;
-	}
+	return ftl->media.media_socket;
+}
 
-#if 0
-	if (ret >= 0 && recv_size > 0) {
-		if (!discard_recv_data(stream, (size_t)recv_size))
-			return -1;
+/*called by the event loop whenever the media socket is readable, drains everything that has arrived*/
+BOOL media_recv(ftl_stream_configuration_private_t *ftl) {
+	uint8_t bufs[MAX_RECV_BATCH][MAX_PACKET_BUFFER];
+	uint8_t *buf_ptrs[MAX_RECV_BATCH];
+	int lens[MAX_RECV_BATCH];
+	int count, i;
+
+	for (i = 0; i < MAX_RECV_BATCH; i++) {
+		buf_ptrs[i] = bufs[i];
 	}
-#endif
 
-	while (media->recv_thread_running) {
+	do {
+		for (i = 0; i < MAX_RECV_BATCH; i++) {
+			lens[i] = MAX_PACKET_BUFFER;
+		}
 
-#ifdef _WIN32
-		ret = recv(media->media_socket, buf, MAX_PACKET_BUFFER, 0);
-#else
-		ret = recv(media->media_socket, buf, MAX_PACKET_BUFFER, 0);
+#ifdef FTL_HAVE_IO_URING
+		if (ftl->media.uring != NULL && ftl_uring_recv_fd(ftl->media.uring) != INVALID_SOCKET) {
+			count = ftl_uring_recv_batch(ftl->media.uring, buf_ptrs, lens, MAX_RECV_BATCH);
+
+			/*the kernel turned down the multishot recv, watch the socket from now on*/
+			if (ftl_uring_recv_fd(ftl->media.uring) == INVALID_SOCKET) {
+				event_loop_replace_sockets(ftl, ftl->event_loop.control_watch.sock, ftl->media.media_socket);
+			}
+		}
+		else
 #endif
-		if (ret <= 0) {
-			continue;
+		count = ftl_recv_batch(ftl->media.media_socket, buf_ptrs, lens, MAX_RECV_BATCH);
+
+		if (count < 0) {
+			if (ftl_socket_error_is_unreachable()) {
+				_media_check_unreachable(ftl);
+			}
+			break;
 		}
 
-		int version, padding, feedbackType, ptype, length, ssrcSender, ssrcMedia;
-		uint16_t snBase, blp, sn;
-		int recv_len = ret;
+		for (i = 0; i < count; i++) {
+			_media_handle_rtcp(ftl, bufs[i], lens[i]);
+		}
+	} while (count == MAX_RECV_BATCH);
+
+	return !ftl->media.ingest_unreachable;
+}
+
+/*handles rtcp packets from ingest including lost packet retransmission requests (nack)*/
+static void _media_handle_rtcp(ftl_stream_configuration_private_t *ftl, uint8_t *buf, int recv_len) {
+	int version, padding, feedbackType, ptype, length, ssrcSender, ssrcMedia;
+	uint16_t snBase, blp, sn;
+	int64_t received = ftl_clock_now(&ftl->clock);
+
+	if (recv_len < 2) {
+		FTL_LOG(ftl, FTL_LOG_WARN, "recv packet too small to parse, discarding\n");
+		return;
+	}
+
+	/*extract rtp header*/
+	version = (buf[0] >> 6) & 0x3;
+	padding = (buf[0] >> 5) & 0x1;
+	feedbackType = buf[0] & 0x1F;
+	ptype = buf[1];
 
-		if (recv_len < 2) {
-			FTL_LOG(FTL_LOG_WARN, "recv packet too small to parse, discarding\n");
-			continue;
+	if (feedbackType == 1 && ptype == 205) {
+
+		length = ntohs(*((uint16_t*)(buf + 2)));
+
+		if (recv_len < ((length + 1) * 4)) {
+			FTL_LOG(ftl, FTL_LOG_WARN, "reported len was %d but packet is only %d...discarding\n", recv_len, ((length + 1) * 4));
+			return;
 		}
 
-		/*extract rtp header*/
-		version = (buf[0] >> 6) & 0x3;
-		padding = (buf[0] >> 5) & 0x1;
-		feedbackType = buf[0] & 0x1F;
-		ptype = buf[1];
+		ssrcSender = ntohl(*((uint32_t*)(buf + 4)));
+		ssrcMedia = ntohl(*((uint32_t*)(buf + 8)));
 
-		if (feedbackType == 1 && ptype == 205) {
+		uint16_t *p = (uint16_t *)(buf + 12);
+		ftl_media_component_common_t *mc;
+		nack_slot_t *slots[MAX_SEND_BATCH];
+		int count = 0;
 
-			length = ntohs(*((uint16_t*)(buf + 2)));
+		if ((mc = _media_lookup(ftl, ssrcMedia)) == NULL) {
+			FTL_LOG(ftl, FTL_LOG_ERROR, "Unable to find ssrc %d\n", ssrcMedia);
+			return;
+		}
 
-			if (recv_len < ((length + 1) * 4)) {
-				FTL_LOG(FTL_LOG_WARN, "reported len was %d but packet is only %d...discarding\n", recv_len, ((length + 1) * 4));
-				continue;
-			}
+		/*every packet the nack asks for goes out in as few batches as possible*/
+		for (int fci = 0; fci < (length - 2); fci++) {
+			//request the first sequence number
+			snBase = ntohs(*p++);
+			blp = ntohs(*p++);
+
+			for (int i = -1; i < 16; i++) {
+				if (i >= 0 && (blp & (1 << i)) == 0) {
+					continue;
+				}
+
+				sn = snBase + i + 1;
+				media_stat_add(mc, MEDIA_STAT_PACKETS_NACKED, 1);
+				FTL_PROBE2(nack, mc->ssrc, sn);
 
-			ssrcSender = ntohl(*((uint32_t*)(buf + 4)));
-			ssrcMedia = ntohl(*((uint32_t*)(buf + 8)));
-
-			uint16_t *p = (uint16_t *)(buf + 12);
-
-			for (int fci = 0; fci < (length - 2); fci++) {
-				//request the first sequence number
-				snBase = ntohs(*p++);
-				_nack_resend_packet(ftl, ssrcMedia, snBase);
-				blp = ntohs(*p++);
-				if (blp) {
-					for (int i = 0; i < 16; i++) {
-						if ((blp & (1 << i)) != 0) {
-							sn = snBase + i + 1;
-							_nack_resend_packet(ftl, ssrcMedia, sn);
-						}
-					}
+				if ((slots[count] = _nack_lock_slot(ftl, mc, sn)) != NULL && ++count == MAX_SEND_BATCH) {
+					_nack_resend_slots(ftl, mc, slots, count, received);
+					count = 0;
 				}
 			}
 		}
+
+		if (count > 0) {
+			_nack_resend_slots(ftl, mc, slots, count, received);
+		}
 	}
+	else if (ptype == 204 && recv_len >= 12 && memcmp(buf + 8, "FTLP", 4) == 0) {
+		_media_mtu_probe_echoed(ftl, buf, recv_len);
+	}
+}
 
-	free(buf);
+/*runs whatever media housekeeping is due and returns how long the event loop may sleep*/
+int media_run_timers(ftl_stream_configuration_private_t *ftl, int64_t now) {
+	ftl_media_config_t *media = &ftl->media;
+	int64_t next;
 
-	FTL_LOG(FTL_LOG_INFO, "Exited Recv Thread\n");
+	/*media has moved to the new ingest, the old session can go*/
+	if (ftl_atomic_load(&ftl->migration.state) == MIGRATION_SWITCHED) {
+		_ingest_migration_finish(ftl, TRUE);
+	}
 
-	return 0;
+	if (now >= media->next_stats) {
+		media->stats_samples = (media->stats_samples + 1) % (STATS_INTERVAL_MS / STATS_SAMPLE_MS);
+		stats_sample(ftl, now, media->stats_samples == 0);
+
+		media->next_stats = now + STATS_SAMPLE_MS * NS_PER_MS;
+	}
+
+	_media_probe_path_mtu(ftl, now);
+
+	next = media->next_stats;
+
+	if (media->pmtud_enabled && media->next_mtu_probe < next) {
+		next = media->next_mtu_probe;
+	}
+
+	return ns_to_timeout_ms(next - now);
 }
 
 #ifdef _WIN32
@@ -728,29 +1480,9 @@ static void *send_thread(void *data)
 	ftl_stream_configuration_private_t *ftl = (ftl_stream_configuration_private_t *)data;
 	ftl_media_config_t *media = &ftl->media;
 	ftl_media_component_common_t *video = &ftl->video.media_component;
-//	int ret;
-//	nack_slot_t *slot;
+	int wait_ms;
 
-	int first_packet = 1;
-	int bytes_per_ms;
-	int pkt_sent;
-
-	int transmit_level;
-	struct timeval start_tv, stop_tv, delta_tv;
-//	struct timeval profile_start, profile_stop, profile_delta;
-//	int pkt_xmit_delay_min = 1000, pkt_xmit_delay_max = 0, xmit_delay_delta;
-//	int xmit_delay_avg, xmit_delay_total = 0, xmit_delay_samples = 0;
-
-#ifdef _WIN32
-	if (!SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL)) {
-		FTL_LOG(FTL_LOG_WARN, "Failed to set recv_thread priority to THREAD_PRIORITY_TIME_CRITICAL\n");
-	}
-#endif
-
-	//TODO: need to decide if 10% overhead makes sense (im leaning towards no) but if this is to restrictive it will introduce delay
-	bytes_per_ms = (int)(((float)(ftl->video_kbps * 1000 / 8)) * 1.1) / 1000;
-
-	transmit_level = 5 * bytes_per_ms; /*small initial level to prevent bursting at the same of a stream*/
+	ftl_thread_setup(&ftl->log, "ftl-send", &ftl->thread_params, TRUE);
 
 	while (1) {
 
@@ -764,36 +1496,147 @@ static void *send_thread(void *data)
 			break;
 		}
 
-		pkt_sent = 0;
-		while(!pkt_sent && media->send_thread_running) {
+		media->pacer_holding = TRUE;
 
-			if (transmit_level <= 0) {
-				sleep_ms(1500 / bytes_per_ms + 1);
+		do {
+			if ((wait_ms = media_pace(ftl, ftl_clock_now(&ftl->clock))) > 0) {
+				sleep_ms(wait_ms);
 			}
+		} while (wait_ms >= 0 && media->send_thread_running);
+	}
 
-			gettimeofday(&stop_tv, NULL);
-			if (!first_packet) {
-				timeval_subtract(&delta_tv, &stop_tv, &start_tv);
-				transmit_level += (int)timeval_to_ms(&delta_tv) * bytes_per_ms;
+	FTL_LOG(ftl, FTL_LOG_INFO, "Exited Send Thread\n");
+	return 0;
+}
 
-				if (transmit_level > (MAX_XMIT_LEVEL_IN_MS * bytes_per_ms)) {
-					transmit_level = MAX_XMIT_LEVEL_IN_MS * bytes_per_ms;
-				}
+static void _media_pacer_init(ftl_stream_configuration_private_t *ftl) {
+	ftl_media_config_t *media = &ftl->media;
+
+	//TODO: need to decide if 10% overhead makes sense (im leaning towards no) but if this is to restrictive it will introduce delay
+	media->bytes_per_ms = (int)(((float)(ftl->video_kbps * 1000 / 8)) * 1.1) / 1000;
+
+	media->transmit_level = 5 * media->bytes_per_ms; /*small initial level to prevent bursting at the same of a stream*/
+	media->pacer_started = FALSE;
+	media->pacer_holding = FALSE;
+	media->pacer_waiting = FALSE;
+}
+
+/*
+ * Leaky bucket pacer step, run by the send thread or by a context worker. Sends as much of the video queue
+ * as the bucket allows and returns how many ms until it can send again, 0 to be called again right away,
+ * or -1 once the queue is empty.
+ *
+ * With kernel pacing the bucket becomes a departure time: each packet is stamped with the time the bucket
+ * would have released it and is handed to the fq qdisc up to TXTIME_HORIZON_MS early, so we wake once per
+ * horizon instead of once per packet. A full bucket is simply a departure time MAX_XMIT_LEVEL_IN_MS in the
+ * past, so the burst allowance and the 5ms start up level carry over unchanged. NACK retransmits and mtu
+ * probes go out from the event loop unstamped and leave immediately.
+ */
+int media_pace(ftl_stream_configuration_private_t *ftl, int64_t now) {
+	ftl_media_config_t *media = &ftl->media;
+	ftl_media_component_common_t *video = &ftl->video.media_component;
+	int64_t now_ns = 0, budget, late_us, elapsed_ms;
+	int64_t *departure = NULL;
+	int sent, wait_ms;
+
+	/*an early call (more video arrived) isn't a miss, only waking up late is*/
+	if (media->pacer_waiting) {
+		late_us = 0;
+		if (now >= media->pacer_wake) {
+			late_us = (now - media->pacer_wake) / NS_PER_US;
+			histogram_record(&media->latency[MEDIA_LATENCY_PACER_OVERSHOOT], late_us);
+		}
+		FTL_PROBE1(pacer_wake, late_us);
+		media->pacer_waiting = FALSE;
+	}
+
+	if (!media->pacer_holding && !_media_take_packet(video)) {
+		return -1;
+	}
+
+	media->pacer_holding = TRUE;
+
+	if (!media->pacer_started) {
+		/*the time before the first packet isn't credited, start from the initial level*/
+		media->pacer_time = now;
+		media->departure = ftl_socket_txtime_now() - 5 * 1000000;
+		media->pacer_started = TRUE;
+	}
+
+	if (media->bytes_per_ms <= 0) {
+		/*no bitrate configured, don't pace*/
+		budget = MAX_SEND_BATCH * MAX_PACKET_BUFFER;
+	}
+	else if (media->kernel_pacing) {
+		now_ns = ftl_socket_txtime_now();
+
+		if (media->departure < now_ns - (int64_t)MAX_XMIT_LEVEL_IN_MS * 1000000) {
+			media->departure = now_ns - (int64_t)MAX_XMIT_LEVEL_IN_MS * 1000000;
+		}
+
+		budget = (now_ns + (int64_t)TXTIME_HORIZON_MS * 1000000 - media->departure) * media->bytes_per_ms / 1000000;
+		departure = &media->departure;
+	}
+	else {
+		/*only whole ms are credited, the remainder carries over to the next step*/
+		if ((elapsed_ms = (now - media->pacer_time) / NS_PER_MS) > 0) {
+			media->pacer_time += elapsed_ms * NS_PER_MS;
+
+			if (elapsed_ms >= MAX_XMIT_LEVEL_IN_MS || media->transmit_level + elapsed_ms * media->bytes_per_ms > MAX_XMIT_LEVEL_IN_MS * media->bytes_per_ms) {
+				media->transmit_level = MAX_XMIT_LEVEL_IN_MS * media->bytes_per_ms;
+				media->pacer_time = now;
 			}
 			else {
-				first_packet = 0;
+				media->transmit_level += (int)elapsed_ms * media->bytes_per_ms;
 			}
+		}
 
-			start_tv = stop_tv;
+		budget = media->transmit_level;
+	}
 
-			if (transmit_level > 0 ) {
-				transmit_level -= _media_send_packet(ftl, video);
-				pkt_sent = 1;
+	while (budget > 0) {
+		media->pacer_holding = FALSE;
 
-			}
+		sent = _media_send_packets(ftl, video, (int)budget, departure, media->bytes_per_ms);
+		budget -= sent;
+
+		if (media->bytes_per_ms <= 0) {
+			return 0;
+		}
+
+		if (departure == NULL) {
+			media->transmit_level -= sent;
+		}
+
+		if (!_media_take_packet(video)) {
+			return -1;
 		}
+
+		media->pacer_holding = TRUE;
 	}
 
-	FTL_LOG(FTL_LOG_INFO, "Exited Send Thread\n");
-	return 0;
+	if (departure != NULL) {
+		/*everything up to the horizon is already queued in the qdisc*/
+		wait_ms = (int)((media->departure - now_ns) / 1000000) - TXTIME_HORIZON_MS + 1;
+	}
+	else {
+		wait_ms = -media->transmit_level / media->bytes_per_ms + 1;
+	}
+
+	if (wait_ms > 0) {
+		media->pacer_wake = now + wait_ms * NS_PER_MS;
+		media->pacer_waiting = TRUE;
+		FTL_PROBE1(pacer_sleep, wait_ms);
+	}
+
+	return wait_ms;
+}
+
+/*takes a pkt_ready count without blocking*/
+static BOOL _media_take_packet(ftl_media_component_common_t *mc) {
+#ifdef _WIN32
+	return WaitForSingleObject(mc->pkt_ready, 0) == WAIT_OBJECT_0;
+#else
+	return sem_trywait(&mc->pkt_ready) == 0;
+#endif
 }
@@ -22,13 +22,36 @@
 * SOFTWARE.
 **/
 
+#define _GNU_SOURCE
 #define __FTL_INTERNAL
 #include "ftl.h"
+#include "ftl_private.h"
 
 #include <unistd.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
 #include <string.h>
+#include <time.h>
+#include <stdlib.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
+#if defined(__linux__) && defined(SO_TXTIME)
+#define FTL_HAVE_TXTIME
+#include <ifaddrs.h>
+#include <net/if.h>
+#include <linux/net_tstamp.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#endif
 
 void ftl_init_sockets() {
   //BSD sockets are smarter and don't need silly init
@@ -71,5 +94,511 @@ int ftl_set_socket_enable_keepalive(int socket){
   return setsockopt(socket, SOL_SOCKET, SO_KEEPALIVE, (char*)&keep_alive, sizeof(keep_alive));
 }
 
+int ftl_set_socket_nodelay(int socket){
+  int no_delay = 1;
+  return setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, (char*)&no_delay, sizeof(no_delay));
+}
+
+int ftl_set_socket_send_buf(int socket, int buffer_space) {
+  return setsockopt(socket, SOL_SOCKET, SO_SNDBUF, (char*)&buffer_space, sizeof(buffer_space));
+}
+
+int ftl_set_socket_recv_buf(int socket, int buffer_space) {
+  return setsockopt(socket, SOL_SOCKET, SO_RCVBUF, (char*)&buffer_space, sizeof(buffer_space));
+}
+
+int ftl_get_socket_send_buf(int socket) {
+  int buffer_space = 0;
+  socklen_t len = sizeof(buffer_space);
+
+  if (getsockopt(socket, SOL_SOCKET, SO_SNDBUF, (char*)&buffer_space, &len) != 0) {
+    return -1;
+  }
+
+  return buffer_space;
+}
+
+int ftl_get_socket_recv_buf(int socket) {
+  int buffer_space = 0;
+  socklen_t len = sizeof(buffer_space);
+
+  if (getsockopt(socket, SOL_SOCKET, SO_RCVBUF, (char*)&buffer_space, &len) != 0) {
+    return -1;
+  }
+
+  return buffer_space;
+}
+
+int ftl_set_socket_dont_fragment(int socket, int family, int enable) {
+  if (family == AF_INET6) {
+#if defined(IPV6_MTU_DISCOVER)
+    int val = enable ? IPV6_PMTUDISC_DO : IPV6_PMTUDISC_DONT;
+    return setsockopt(socket, IPPROTO_IPV6, IPV6_MTU_DISCOVER, (char*)&val, sizeof(val));
+#elif defined(IPV6_DONTFRAG)
+    int val = enable ? 1 : 0;
+    return setsockopt(socket, IPPROTO_IPV6, IPV6_DONTFRAG, (char*)&val, sizeof(val));
+#endif
+  }
+  else {
+#if defined(IP_MTU_DISCOVER)
+    int val = enable ? IP_PMTUDISC_DO : IP_PMTUDISC_DONT;
+    return setsockopt(socket, IPPROTO_IP, IP_MTU_DISCOVER, (char*)&val, sizeof(val));
+#elif defined(IP_DONTFRAG)
+    int val = enable ? 1 : 0;
+    return setsockopt(socket, IPPROTO_IP, IP_DONTFRAG, (char*)&val, sizeof(val));
+#endif
+  }
+
+  errno = ENOPROTOOPT;
+  return -1;
+}
+
+int ftl_socket_error_is_msg_too_big() {
+  return errno == EMSGSIZE;
+}
+
+int ftl_set_socket_nonblocking(int socket, int enable) {
+  int flags;
+
+  if ((flags = fcntl(socket, F_GETFL, 0)) < 0) {
+    return -1;
+  }
+
+  flags = enable ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+
+  return fcntl(socket, F_SETFL, flags);
+}
+
+int ftl_socket_error_is_in_progress() {
+  return errno == EINPROGRESS || errno == EWOULDBLOCK;
+}
+
+/*interrupted or nothing there after all, try again the next time the socket is ready*/
+int ftl_socket_error_is_transient() {
+  return errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK;
+}
+
+int ftl_get_socket_pending_error(int socket) {
+  int err = 0;
+  socklen_t len = sizeof(err);
+
+  if (getsockopt(socket, SOL_SOCKET, SO_ERROR, (char*)&err, &len) != 0) {
+    return errno;
+  }
+
+  return err;
+}
+
+int ftl_poll(struct pollfd *fds, int nfds, int ms_timeout) {
+  return poll(fds, nfds, ms_timeout);
+}
+
+/*sends count datagrams on a connected socket, returns how many were sent or -1 if the first one failed*/
+int ftl_send_batch(int socket, uint8_t **bufs, int *lens, int count) {
+#if defined(__linux__)
+  struct mmsghdr msgs[count];
+  struct iovec iovs[count];
+  int i;
+
+  memset(msgs, 0, sizeof(msgs));
+
+  for (i = 0; i < count; i++) {
+    iovs[i].iov_base = bufs[i];
+    iovs[i].iov_len = lens[i];
+    msgs[i].msg_hdr.msg_iov = &iovs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  return sendmmsg(socket, msgs, count, 0);
+#else
+  int i;
+
+  for (i = 0; i < count; i++) {
+    if (send(socket, bufs[i], lens[i], 0) < 0) {
+      return i > 0 ? i : -1;
+    }
+  }
+
+  return count;
+#endif
+}
+
+/*non blocking, returns how many datagrams were read into bufs with their sizes in lens*/
+int ftl_recv_batch(int socket, uint8_t **bufs, int *lens, int count) {
+#if defined(__linux__)
+  struct mmsghdr msgs[count];
+  struct iovec iovs[count];
+  int i, ret;
+
+  memset(msgs, 0, sizeof(msgs));
+
+  for (i = 0; i < count; i++) {
+    iovs[i].iov_base = bufs[i];
+    iovs[i].iov_len = lens[i];
+    msgs[i].msg_hdr.msg_iov = &iovs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  if ((ret = recvmmsg(socket, msgs, count, MSG_DONTWAIT, NULL)) > 0) {
+    for (i = 0; i < ret; i++) {
+      lens[i] = msgs[i].msg_len;
+    }
+  }
+
+  return ret;
+#else
+  int i, ret;
+
+  for (i = 0; i < count; i++) {
+    if ((ret = recv(socket, bufs[i], lens[i], MSG_DONTWAIT)) < 0) {
+      return i > 0 ? i : -1;
+    }
+    lens[i] = ret;
+  }
+
+  return count;
+#endif
+}
+
+int ftl_socket_error_is_unreachable() {
+  return errno == ECONNREFUSED || errno == EHOSTUNREACH || errno == ENETUNREACH;
+}
+
+#ifdef FTL_HAVE_TXTIME
+/*the interface that owns the local address of a connected socket is where its packets leave*/
+static int _get_egress_ifindex(int socket) {
+  struct sockaddr_storage local;
+  socklen_t local_len = sizeof(local);
+  struct ifaddrs *ifas, *ifa;
+  int ifindex = 0;
+
+  if (getsockname(socket, (struct sockaddr *)&local, &local_len) != 0 || getifaddrs(&ifas) != 0) {
+    return 0;
+  }
+
+  for (ifa = ifas; ifa != NULL && ifindex == 0; ifa = ifa->ifa_next) {
+    if (ifa->ifa_addr == NULL || ifa->ifa_addr->sa_family != local.ss_family) {
+      continue;
+    }
+
+    if (local.ss_family == AF_INET &&
+        ((struct sockaddr_in *)ifa->ifa_addr)->sin_addr.s_addr == ((struct sockaddr_in *)&local)->sin_addr.s_addr) {
+      ifindex = if_nametoindex(ifa->ifa_name);
+    }
+    else if (local.ss_family == AF_INET6 &&
+        memcmp(&((struct sockaddr_in6 *)ifa->ifa_addr)->sin6_addr, &((struct sockaddr_in6 *)&local)->sin6_addr, sizeof(struct in6_addr)) == 0) {
+      ifindex = if_nametoindex(ifa->ifa_name);
+    }
+  }
+
+  freeifaddrs(ifas);
+
+  return ifindex;
+}
+#endif
+
+/*
+ * SO_TXTIME departure times are only honored by the fq qdisc, anything else (fq_codel, pfifo_fast,
+ * noqueue) sends the packet immediately so the whole batch would leave as one burst. Dump the qdiscs
+ * over rtnetlink and look for fq on the egress interface, either as the root or under mq.
+ */
+int ftl_socket_qdisc_supports_txtime(int sock) {
+#ifdef FTL_HAVE_TXTIME
+  struct {
+    struct nlmsghdr nh;
+    struct tcmsg tc;
+  } req;
+  char buf[8192];
+  struct nlmsghdr *nh;
+  struct tcmsg *tc;
+  struct rtattr *rta;
+  int nl, ifindex, len, rta_len, done = 0, found = 0;
+
+  if ((ifindex = _get_egress_ifindex(sock)) <= 0) {
+    return 0;
+  }
+
+  if ((nl = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE)) < 0) {
+    return 0;
+  }
+
+  memset(&req, 0, sizeof(req));
+  req.nh.nlmsg_len = NLMSG_LENGTH(sizeof(struct tcmsg));
+  req.nh.nlmsg_type = RTM_GETQDISC;
+  req.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+  req.tc.tcm_family = AF_UNSPEC;
+  req.tc.tcm_ifindex = ifindex;
+
+  if (send(nl, &req, req.nh.nlmsg_len, 0) < 0) {
+    close(nl);
+    return 0;
+  }
+
+  while (!done && (len = recv(nl, buf, sizeof(buf), 0)) > 0) {
+    for (nh = (struct nlmsghdr *)buf; NLMSG_OK(nh, len); nh = NLMSG_NEXT(nh, len)) {
+      if (nh->nlmsg_type == NLMSG_DONE || nh->nlmsg_type == NLMSG_ERROR) {
+        done = 1;
+        break;
+      }
+
+      if (nh->nlmsg_type != RTM_NEWQDISC) {
+        continue;
+      }
+
+      tc = (struct tcmsg *)NLMSG_DATA(nh);
+
+      if (tc->tcm_ifindex != ifindex) {
+        continue;
+      }
+
+      rta_len = nh->nlmsg_len - NLMSG_LENGTH(sizeof(*tc));
+      for (rta = (struct rtattr *)((char *)tc + NLMSG_ALIGN(sizeof(*tc))); RTA_OK(rta, rta_len); rta = RTA_NEXT(rta, rta_len)) {
+        if (rta->rta_type == TCA_KIND && strcmp((char *)RTA_DATA(rta), "fq") == 0) {
+          found = 1;
+        }
+      }
+    }
+  }
+
+  close(nl);
+
+  return found;
+#else
+  return 0;
+#endif
+}
+
+/*fq compares departure times against CLOCK_MONOTONIC*/
+int ftl_set_socket_txtime(int socket) {
+#ifdef FTL_HAVE_TXTIME
+  struct sock_txtime txtime;
+
+  txtime.clockid = CLOCK_MONOTONIC;
+  txtime.flags = 0;
+
+  return setsockopt(socket, SOL_SOCKET, SO_TXTIME, &txtime, sizeof(txtime));
+#else
+  errno = ENOPROTOOPT;
+  return -1;
+#endif
+}
+
+int64_t ftl_socket_txtime_now() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*like ftl_send_batch but every packet carries the time (ftl_socket_txtime_now based, in ns) it may leave*/
+int ftl_send_batch_txtime(int socket, uint8_t **bufs, int *lens, int64_t *txtimes, int count) {
+#ifdef FTL_HAVE_TXTIME
+  struct mmsghdr msgs[count];
+  struct iovec iovs[count];
+  char control[count][CMSG_SPACE(sizeof(uint64_t))];
+  struct cmsghdr *cm;
+  uint64_t txtime;
+  int i;
+
+  memset(msgs, 0, sizeof(msgs));
+  memset(control, 0, sizeof(control));
+
+  for (i = 0; i < count; i++) {
+    iovs[i].iov_base = bufs[i];
+    iovs[i].iov_len = lens[i];
+    msgs[i].msg_hdr.msg_iov = &iovs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+    msgs[i].msg_hdr.msg_control = control[i];
+    msgs[i].msg_hdr.msg_controllen = sizeof(control[i]);
+
+    txtime = (uint64_t)txtimes[i];
+    cm = CMSG_FIRSTHDR(&msgs[i].msg_hdr);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_TXTIME;
+    cm->cmsg_len = CMSG_LEN(sizeof(txtime));
+    memcpy(CMSG_DATA(cm), &txtime, sizeof(txtime));
+  }
+
+  return sendmmsg(socket, msgs, count, 0);
+#else
+  return ftl_send_batch(socket, bufs, lens, count);
+#endif
+}
+
+/*
+ * Readiness notification for the event loop, epoll where we have it and poll everywhere else. Every
+ * registered socket is watched for input, errors and hangups are always reported. ftl_poller_wake makes
+ * a blocked ftl_poller_wait return early.
+ */
+#define FTL_POLLER_MAX_FDS 256
+
+struct ftl_poller {
+  ftl_allocator_t allocator;
+#ifdef __linux__
+  int epfd;
+  int wake_fd;
+#else
+  int wake_fds[2];
+  int nfds;
+  struct pollfd fds[FTL_POLLER_MAX_FDS];
+  void *ctxs[FTL_POLLER_MAX_FDS];
+#endif
+};
+
+struct ftl_poller *ftl_poller_create(const ftl_allocator_t *allocator) {
+  struct ftl_poller *poller;
+
+  if ((poller = (struct ftl_poller *)ftl_alloc(allocator, sizeof(*poller))) == NULL) {
+    return NULL;
+  }
+
+  poller->allocator = *allocator;
+
+#ifdef __linux__
+  struct epoll_event ev;
+
+  if ((poller->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+    ftl_free(allocator, poller);
+    return NULL;
+  }
+
+  if ((poller->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+    close(poller->epfd);
+    ftl_free(allocator, poller);
+    return NULL;
+  }
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL;
+
+  if (epoll_ctl(poller->epfd, EPOLL_CTL_ADD, poller->wake_fd, &ev) != 0) {
+    close(poller->wake_fd);
+    close(poller->epfd);
+    ftl_free(allocator, poller);
+    return NULL;
+  }
+#else
+  if (pipe(poller->wake_fds) != 0) {
+    ftl_free(allocator, poller);
+    return NULL;
+  }
+
+  fcntl(poller->wake_fds[0], F_SETFL, O_NONBLOCK);
+  fcntl(poller->wake_fds[1], F_SETFL, O_NONBLOCK);
+
+  poller->fds[0].fd = poller->wake_fds[0];
+  poller->fds[0].events = POLLIN;
+  poller->ctxs[0] = NULL;
+  poller->nfds = 1;
+#endif
+
+  return poller;
+}
+
+void ftl_poller_destroy(struct ftl_poller *poller) {
+#ifdef __linux__
+  close(poller->wake_fd);
+  close(poller->epfd);
+#else
+  close(poller->wake_fds[0]);
+  close(poller->wake_fds[1]);
+#endif
+  ftl_free(&poller->allocator, poller);
+}
+
+int ftl_poller_add(struct ftl_poller *poller, int socket, void *ctx) {
+#ifdef __linux__
+  struct epoll_event ev;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN | EPOLLRDHUP;
+  ev.data.ptr = ctx;
+
+  return epoll_ctl(poller->epfd, EPOLL_CTL_ADD, socket, &ev);
+#else
+  if (poller->nfds == FTL_POLLER_MAX_FDS) {
+    errno = ENOSPC;
+    return -1;
+  }
+
+  poller->fds[poller->nfds].fd = socket;
+  poller->fds[poller->nfds].events = POLLIN;
+  poller->ctxs[poller->nfds] = ctx;
+  poller->nfds++;
+
+  return 0;
+#endif
+}
+
+int ftl_poller_remove(struct ftl_poller *poller, int socket) {
+#ifdef __linux__
+  struct epoll_event ev;
 
+  return epoll_ctl(poller->epfd, EPOLL_CTL_DEL, socket, &ev);
+#else
+  int i;
 
+  for (i = 1; i < poller->nfds; i++) {
+    if (poller->fds[i].fd == socket) {
+      poller->nfds--;
+      poller->fds[i] = poller->fds[poller->nfds];
+      poller->ctxs[i] = poller->ctxs[poller->nfds];
+      return 0;
+    }
+  }
+
+  errno = ENOENT;
+  return -1;
+#endif
+}
+
+/*returns the number of ready contexts stored in ready, 0 on timeout or wake up*/
+int ftl_poller_wait(struct ftl_poller *poller, void **ready, int max_ready, int ms_timeout) {
+  uint64_t drain;
+  int i, ret, count = 0;
+
+#ifdef __linux__
+  struct epoll_event events[max_ready];
+
+  if ((ret = epoll_wait(poller->epfd, events, max_ready, ms_timeout)) < 0) {
+    return errno == EINTR ? 0 : -1;
+  }
+
+  for (i = 0; i < ret; i++) {
+    if (events[i].data.ptr == NULL) {
+      while (read(poller->wake_fd, &drain, sizeof(drain)) > 0);
+    }
+    else {
+      ready[count++] = events[i].data.ptr;
+    }
+  }
+#else
+  if ((ret = poll(poller->fds, poller->nfds, ms_timeout)) < 0) {
+    return errno == EINTR ? 0 : -1;
+  }
+
+  if (poller->fds[0].revents) {
+    while (read(poller->wake_fds[0], &drain, sizeof(drain)) > 0);
+  }
+
+  for (i = 1; i < poller->nfds && count < max_ready; i++) {
+    if (poller->fds[i].revents) {
+      ready[count++] = poller->ctxs[i];
+    }
+  }
+#endif
+
+  return count;
+}
+
+void ftl_poller_wake(struct ftl_poller *poller) {
+  uint64_t one = 1;
+
+#ifdef __linux__
+  write(poller->wake_fd, &one, sizeof(one));
+#else
+  write(poller->wake_fds[1], &one, 1);
+#endif
+}
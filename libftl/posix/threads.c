@@ -0,0 +1,95 @@
+/**
+* \file threads.c - Thread placement for POSIX
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+**/
+
+#define _GNU_SOURCE
+#define __FTL_INTERNAL
+#include "ftl.h"
+#include "ftl_private.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <errno.h>
+#include <string.h>
+
+/*
+ * Called by every thread libftl starts, on itself. Nothing here is fatal: a setting the os refuses is
+ * logged and the thread carries on with what it has. Only latency sensitive threads get the real-time
+ * policy, the others just share the cpu affinity.
+ */
+void ftl_thread_setup(ftl_logger_t *log, const char *name, const ftl_thread_params_t *params, BOOL latency_sensitive) {
+  struct sched_param sp;
+  int policy, err;
+
+#if defined(__APPLE__)
+  pthread_setname_np(name);
+#elif defined(__linux__)
+  /*names are cut off at 15 characters*/
+  char short_name[16];
+
+  snprintf(short_name, sizeof(short_name), "%s", name);
+  pthread_setname_np(pthread_self(), short_name);
+#endif
+
+  if (params->cpu_affinity != 0) {
+#ifdef __linux__
+    cpu_set_t cpus;
+    int cpu;
+
+    CPU_ZERO(&cpus);
+    for (cpu = 0; cpu < 64 && cpu < CPU_SETSIZE; cpu++) {
+      if (params->cpu_affinity & ((uint64_t)1 << cpu)) {
+        CPU_SET(cpu, &cpus);
+      }
+    }
+
+    if ((err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus)) != 0) {
+      FTL_LOG_TO(log, FTL_LOG_WARN, "Failed to set cpu affinity of %s to 0x%llx: %s\n", name, (unsigned long long)params->cpu_affinity, strerror(err));
+    }
+#else
+    FTL_LOG_TO(log, FTL_LOG_WARN, "cpu affinity is not supported on this platform, %s is not pinned\n", name);
+#endif
+  }
+
+  if (!latency_sensitive || params->sched_policy == FTL_THREAD_SCHED_DEFAULT) {
+    return;
+  }
+
+  policy = params->sched_policy == FTL_THREAD_SCHED_FIFO ? SCHED_FIFO : SCHED_RR;
+
+  memset(&sp, 0, sizeof(sp));
+  sp.sched_priority = params->sched_priority;
+
+  if (sp.sched_priority < sched_get_priority_min(policy)) {
+    sp.sched_priority = sched_get_priority_min(policy);
+  }
+  else if (sp.sched_priority > sched_get_priority_max(policy)) {
+    sp.sched_priority = sched_get_priority_max(policy);
+  }
+
+  if ((err = pthread_setschedparam(pthread_self(), policy, &sp)) != 0) {
+    FTL_LOG_TO(log, FTL_LOG_WARN, "Failed to set %s to %s priority %d, keeping the default policy: %s\n", name,
+      policy == SCHED_FIFO ? "SCHED_FIFO" : "SCHED_RR", sp.sched_priority, strerror(err));
+  }
+  else {
+    FTL_LOG_TO(log, FTL_LOG_DEBUG, "%s runs with %s priority %d\n", name, policy == SCHED_FIFO ? "SCHED_FIFO" : "SCHED_RR", sp.sched_priority);
+  }
+}
@@ -0,0 +1,467 @@
+/**
+* \file uring.c - io_uring media transport
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+**/
+
+#define _GNU_SOURCE
+#define __FTL_INTERNAL
+#include "ftl.h"
+#include "ftl_private.h"
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <linux/io_uring.h>
+
+/*
+ * Talks to the kernel directly rather than through liburing, there are only a handful of calls. Each
+ * media socket gets two rings:
+ *  - the send ring takes a whole batch of datagrams (media or nack retransmits) and waits for all of
+ *    them in a single io_uring_enter. Callers serialize on the media mutex so it has one submitter.
+ *  - the recv ring keeps a multishot recv armed on the socket with buffers the kernel picks from a
+ *    provided buffer ring. Its fd is what the event loop polls, and rtcp is read straight out of the
+ *    completion queue without a syscall.
+ * Kernels without multishot recv or buffer rings (before 6.0) still get the send ring, rtcp is then
+ * read from the socket as before. 5.19 takes the multishot recv and only fails it once it completes,
+ * the recv ring is torn down then and the event loop goes back to the socket.
+ */
+
+#define URING_SEND_ENTRIES MAX_SEND_BATCH
+#define URING_RECV_ENTRIES 16
+#define URING_RECV_BUFFERS 32 //must be a power of 2
+#define URING_RECV_GROUP 0
+
+typedef struct {
+  int fd;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_ring, *cq_ring;
+  size_t sq_ring_size, cq_ring_size, sqes_size;
+} uring_queue_t;
+
+struct ftl_uring {
+  ftl_logger_t *log; /*the stream's, for its allocator too*/
+  int sock;
+  uring_queue_t send;
+  uring_queue_t recv; /*fd is -1 when rtcp is read from the socket*/
+  struct io_uring_buf_ring *buf_ring;
+  uint8_t *buffers;
+  unsigned short buf_tail;
+  int recv_armed;
+};
+
+static int _uring_queue_init(uring_queue_t *q, unsigned entries) {
+  struct io_uring_params p;
+
+  memset(q, 0, sizeof(*q));
+  memset(&p, 0, sizeof(p));
+  p.flags = IORING_SETUP_COOP_TASKRUN;
+
+  if ((q->fd = (int)syscall(__NR_io_uring_setup, entries, &p)) < 0 && errno == EINVAL) {
+    /*older kernels don't know the flag*/
+    memset(&p, 0, sizeof(p));
+    q->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+  }
+
+  if (q->fd < 0) {
+    return -1;
+  }
+
+  q->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  q->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (q->cq_ring_size > q->sq_ring_size) {
+      q->sq_ring_size = q->cq_ring_size;
+    }
+    q->cq_ring_size = q->sq_ring_size;
+  }
+
+  q->sq_ring = mmap(NULL, q->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, q->fd, IORING_OFF_SQ_RING);
+  if (q->sq_ring == MAP_FAILED) {
+    close(q->fd);
+    q->fd = -1;
+    return -1;
+  }
+
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    q->cq_ring = q->sq_ring;
+  }
+  else if ((q->cq_ring = mmap(NULL, q->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, q->fd, IORING_OFF_CQ_RING)) == MAP_FAILED) {
+    munmap(q->sq_ring, q->sq_ring_size);
+    close(q->fd);
+    q->fd = -1;
+    return -1;
+  }
+
+  q->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  if ((q->sqes = mmap(NULL, q->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, q->fd, IORING_OFF_SQES)) == MAP_FAILED) {
+    if (q->cq_ring != q->sq_ring) {
+      munmap(q->cq_ring, q->cq_ring_size);
+    }
+    munmap(q->sq_ring, q->sq_ring_size);
+    close(q->fd);
+    q->fd = -1;
+    return -1;
+  }
+
+  q->sq_head = (unsigned *)((char *)q->sq_ring + p.sq_off.head);
+  q->sq_tail = (unsigned *)((char *)q->sq_ring + p.sq_off.tail);
+  q->sq_mask = (unsigned *)((char *)q->sq_ring + p.sq_off.ring_mask);
+  q->sq_array = (unsigned *)((char *)q->sq_ring + p.sq_off.array);
+  q->cq_head = (unsigned *)((char *)q->cq_ring + p.cq_off.head);
+  q->cq_tail = (unsigned *)((char *)q->cq_ring + p.cq_off.tail);
+  q->cq_mask = (unsigned *)((char *)q->cq_ring + p.cq_off.ring_mask);
+  q->cqes = (struct io_uring_cqe *)((char *)q->cq_ring + p.cq_off.cqes);
+
+  return 0;
+}
+
+static void _uring_queue_destroy(uring_queue_t *q) {
+  if (q->fd < 0) {
+    return;
+  }
+
+  munmap(q->sqes, q->sqes_size);
+  if (q->cq_ring != q->sq_ring) {
+    munmap(q->cq_ring, q->cq_ring_size);
+  }
+  munmap(q->sq_ring, q->sq_ring_size);
+  close(q->fd);
+  q->fd = -1;
+}
+
+/*the caller never queues more than the ring holds, so this can't run out*/
+static struct io_uring_sqe *_uring_get_sqe(uring_queue_t *q) {
+  unsigned tail = *q->sq_tail;
+  unsigned idx = tail & *q->sq_mask;
+  struct io_uring_sqe *sqe = &q->sqes[idx];
+
+  memset(sqe, 0, sizeof(*sqe));
+  q->sq_array[idx] = idx;
+  __atomic_store_n(q->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+  return sqe;
+}
+
+static int _uring_enter(uring_queue_t *q, unsigned to_submit, unsigned min_complete) {
+  return (int)syscall(__NR_io_uring_enter, q->fd, to_submit, min_complete, min_complete > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+static struct io_uring_cqe *_uring_peek_cqe(uring_queue_t *q) {
+  unsigned head = *q->cq_head;
+
+  if (head == __atomic_load_n(q->cq_tail, __ATOMIC_ACQUIRE)) {
+    return NULL;
+  }
+
+  return &q->cqes[head & *q->cq_mask];
+}
+
+static void _uring_cqe_seen(uring_queue_t *q) {
+  __atomic_store_n(q->cq_head, *q->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/*queues a buffer for the kernel, it sees it once the tail is published*/
+static void _uring_recycle_buffer(struct ftl_uring *ring, unsigned short bid) {
+  struct io_uring_buf *buf = &ring->buf_ring->bufs[ring->buf_tail & (URING_RECV_BUFFERS - 1)];
+
+  buf->addr = (uint64_t)(uintptr_t)(ring->buffers + bid * MAX_PACKET_BUFFER);
+  buf->len = MAX_PACKET_BUFFER;
+  buf->bid = bid;
+  ring->buf_tail++;
+}
+
+static int _uring_arm_recv(struct ftl_uring *ring) {
+  struct io_uring_sqe *sqe = _uring_get_sqe(&ring->recv);
+
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = ring->sock;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_RECV_GROUP;
+
+  if (_uring_enter(&ring->recv, 1, 0) != 1) {
+    return -1;
+  }
+
+  ring->recv_armed = 1;
+
+  return 0;
+}
+
+static int _uring_recv_init(struct ftl_uring *ring) {
+  struct io_uring_buf_reg reg;
+  unsigned short bid;
+
+  if (_uring_queue_init(&ring->recv, URING_RECV_ENTRIES) != 0) {
+    return -1;
+  }
+
+  /*the buffer ring has to be page aligned*/
+  ring->buf_ring = (struct io_uring_buf_ring *)mmap(NULL, URING_RECV_BUFFERS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ring->buf_ring == MAP_FAILED) {
+    ring->buf_ring = NULL;
+    return -1;
+  }
+
+  if ((ring->buffers = (uint8_t *)ftl_alloc(&ring->log->allocator, URING_RECV_BUFFERS * MAX_PACKET_BUFFER)) == NULL) {
+    return -1;
+  }
+
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t)(uintptr_t)ring->buf_ring;
+  reg.ring_entries = URING_RECV_BUFFERS;
+  reg.bgid = URING_RECV_GROUP;
+
+  if (syscall(__NR_io_uring_register, ring->recv.fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+    return -1;
+  }
+
+  ring->buf_tail = 0;
+  for (bid = 0; bid < URING_RECV_BUFFERS; bid++) {
+    _uring_recycle_buffer(ring, bid);
+  }
+  __atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+
+  return _uring_arm_recv(ring);
+}
+
+static void _uring_recv_destroy(struct ftl_uring *ring) {
+  _uring_queue_destroy(&ring->recv);
+
+  if (ring->buf_ring != NULL) {
+    munmap(ring->buf_ring, URING_RECV_BUFFERS * sizeof(struct io_uring_buf));
+    ring->buf_ring = NULL;
+  }
+
+  ftl_free(&ring->log->allocator, ring->buffers);
+  ring->buffers = NULL;
+}
+
+ftl_uring_t *ftl_uring_create(ftl_logger_t *log, SOCKET sock) {
+  struct ftl_uring *ring;
+
+  if ((ring = (struct ftl_uring *)ftl_calloc(&log->allocator, 1, sizeof(*ring))) == NULL) {
+    return NULL;
+  }
+
+  ring->log = log;
+  ring->sock = sock;
+  ring->recv.fd = -1;
+
+  if (_uring_queue_init(&ring->send, URING_SEND_ENTRIES) != 0) {
+    ftl_free(&log->allocator, ring);
+    return NULL;
+  }
+
+  if (_uring_recv_init(ring) != 0) {
+    FTL_LOG_TO(ring->log, FTL_LOG_WARN, "Kernel has no multishot recv, rtcp will be read from the socket: %s\n", strerror(errno));
+    _uring_recv_destroy(ring);
+  }
+
+  return ring;
+}
+
+void ftl_uring_destroy(ftl_uring_t *ring) {
+  if (ring == NULL) {
+    return;
+  }
+
+  _uring_recv_destroy(ring);
+  _uring_queue_destroy(&ring->send);
+  ftl_free(&ring->log->allocator, ring);
+}
+
+/*
+ * Same contract as ftl_send_batch: returns how many datagrams were sent, or -1 with errno set if the
+ * first one failed. The sends are linked so the first failure cancels the rest, like sendmmsg stopping
+ * at an error. txtimes may be NULL, otherwise every packet carries its SO_TXTIME departure time.
+ */
+int ftl_uring_send_batch(ftl_uring_t *ring, uint8_t **bufs, int *lens, int64_t *txtimes, int count) {
+  struct msghdr msgs[URING_SEND_ENTRIES];
+  struct iovec iovs[URING_SEND_ENTRIES];
+  char control[URING_SEND_ENTRIES][CMSG_SPACE(sizeof(uint64_t))];
+  int results[URING_SEND_ENTRIES];
+  struct io_uring_sqe *sqe;
+  struct io_uring_cqe *cqe;
+  struct cmsghdr *cm;
+  uint64_t txtime;
+  int queued, submitted = 0, reaped = 0, error, ret, i;
+
+  if (count > URING_SEND_ENTRIES) {
+    count = URING_SEND_ENTRIES;
+  }
+
+  for (i = 0; i < count; i++) {
+    sqe = _uring_get_sqe(&ring->send);
+    sqe->fd = ring->sock;
+    sqe->user_data = i;
+
+    if (txtimes == NULL) {
+      sqe->opcode = IORING_OP_SEND;
+      sqe->addr = (uint64_t)(uintptr_t)bufs[i];
+      sqe->len = lens[i];
+    }
+    else {
+      memset(&msgs[i], 0, sizeof(msgs[i]));
+      memset(control[i], 0, sizeof(control[i]));
+      iovs[i].iov_base = bufs[i];
+      iovs[i].iov_len = lens[i];
+      msgs[i].msg_iov = &iovs[i];
+      msgs[i].msg_iovlen = 1;
+      msgs[i].msg_control = control[i];
+      msgs[i].msg_controllen = sizeof(control[i]);
+
+      txtime = (uint64_t)txtimes[i];
+      cm = CMSG_FIRSTHDR(&msgs[i]);
+      cm->cmsg_level = SOL_SOCKET;
+      cm->cmsg_type = SCM_TXTIME;
+      cm->cmsg_len = CMSG_LEN(sizeof(txtime));
+      memcpy(CMSG_DATA(cm), &txtime, sizeof(txtime));
+
+      sqe->opcode = IORING_OP_SENDMSG;
+      sqe->addr = (uint64_t)(uintptr_t)&msgs[i];
+      sqe->len = 1;
+    }
+
+    if (i < count - 1) {
+      sqe->flags = IOSQE_IO_LINK;
+    }
+
+    results[i] = -ECANCELED;
+  }
+
+  /*the packets live in the nack slots the caller has locked, so wait for every completion before returning*/
+  queued = count;
+  while (reaped < queued) {
+    if ((ret = _uring_enter(&ring->send, queued - submitted, queued - reaped)) < 0) {
+      if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+        continue;
+      }
+
+      if (submitted < queued) {
+        error = errno;
+        FTL_LOG_TO(ring->log, FTL_LOG_ERROR, "io_uring_enter failed: %s\n", strerror(error));
+
+        /*the kernel never took the rest, pull them back out of the ring so the next batch doesn't send them*/
+        __atomic_store_n(ring->send.sq_tail, *ring->send.sq_tail - (unsigned)(queued - submitted), __ATOMIC_RELEASE);
+        for (i = submitted; i < queued; i++) {
+          results[i] = -error;
+        }
+        queued = submitted;
+        continue;
+      }
+
+      /*can't wait in the kernel either, the completions still show up each time this thread enters it*/
+      sleep_ms(1);
+      ret = 0;
+    }
+
+    submitted += ret;
+
+    while ((cqe = _uring_peek_cqe(&ring->send)) != NULL) {
+      if (cqe->user_data < (uint64_t)count) {
+        results[cqe->user_data] = cqe->res;
+      }
+      _uring_cqe_seen(&ring->send);
+      reaped++;
+    }
+  }
+
+  for (i = 0; i < count && results[i] >= 0; i++);
+
+  if (i == 0) {
+    errno = -results[0];
+    return -1;
+  }
+
+  return i;
+}
+
+/*the fd the event loop should poll for rtcp, INVALID_SOCKET when it has to poll the media socket itself*/
+SOCKET ftl_uring_recv_fd(ftl_uring_t *ring) {
+  return ring->recv.fd >= 0 ? ring->recv.fd : INVALID_SOCKET;
+}
+
+/*
+ * Same contract as ftl_recv_batch, but the datagrams are already sitting in the completion queue. A
+ * socket error (icmp unreachable) ends the multishot recv, it is reported once and the recv re-armed.
+ * If the kernel rejects the multishot recv itself the recv ring is torn down, ftl_uring_recv_fd then
+ * returns INVALID_SOCKET and rtcp has to be read from the socket.
+ */
+int ftl_uring_recv_batch(ftl_uring_t *ring, uint8_t **bufs, int *lens, int count) {
+  struct io_uring_cqe *cqe;
+  unsigned short bid;
+  int n = 0, error = 0, len;
+
+  while (n < count && (cqe = _uring_peek_cqe(&ring->recv)) != NULL) {
+    if (cqe->res == -EINVAL && !(cqe->flags & IORING_CQE_F_MORE)) {
+      /*re-arming would only fail the same way on every call*/
+      FTL_LOG_TO(ring->log, FTL_LOG_WARN, "Kernel has no multishot recv, rtcp will be read from the socket\n");
+      _uring_recv_destroy(ring);
+      return n;
+    }
+
+    if (cqe->res < 0 && cqe->res != -ENOBUFS) {
+      /*hand over what we have first, the error is reported on the next call*/
+      if (n > 0) {
+        break;
+      }
+      error = -cqe->res;
+    }
+    else if (cqe->res >= 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+      bid = (unsigned short)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+      len = cqe->res < lens[n] ? cqe->res : lens[n];
+      memcpy(bufs[n], ring->buffers + bid * MAX_PACKET_BUFFER, len);
+      lens[n++] = len;
+      _uring_recycle_buffer(ring, bid);
+    }
+
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+      ring->recv_armed = 0;
+    }
+
+    _uring_cqe_seen(&ring->recv);
+
+    if (error != 0) {
+      break;
+    }
+  }
+
+  __atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+
+  if (!ring->recv_armed && _uring_arm_recv(ring) != 0) {
+    FTL_LOG_TO(ring->log, FTL_LOG_ERROR, "Failed to re-arm rtcp receive: %s\n", strerror(errno));
+  }
+
+  if (n == 0 && error != 0) {
+    errno = error;
+    return -1;
+  }
+
+  return n;
+}
@@ -0,0 +1,323 @@
+/**
+ * stats.c - Per stream media statistics
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ **/
+
+#define __FTL_INTERNAL
+#include "ftl.h"
+#include "ftl_private.h"
+
+/*
+ * The media path bumps counters and nothing else. Every STATS_SAMPLE_MS the thread running the media
+ * timers samples them into a small ring per component, turns the differences into 64 bit totals and
+ * rates over the last STATS_WINDOW_SAMPLES samples, and publishes the result under a sequence lock so
+ * ftl_ingest_get_stats can copy it from any thread without waiting on anyone.
+ */
+
+static void _stats_sample_component(ftl_media_component_common_t *mc, int64_t now);
+static void _stats_fill_component(ftl_media_component_common_t *mc, ftl_component_stats_t *stats, int *window_ms);
+static void _stats_report_component(ftl_stream_configuration_private_t *ftl, ftl_media_component_common_t *mc, ftl_status_types_t pkt_type, int64_t now);
+static void _stats_publish(ftl_stream_configuration_private_t *ftl);
+static void _histogram_percentiles(ftl_histogram_t *h, ftl_latency_stats_t *stats);
+
+/*starts counting from zero, called before the media threads are started*/
+void stats_reset(ftl_stream_configuration_private_t *ftl) {
+	ftl_media_component_common_t *media_comp[] = { &ftl->video.media_component, &ftl->audio.media_component };
+	media_stats_window_t *window;
+	int64_t now = ftl_clock_now(&ftl->clock);
+	size_t i;
+
+	for (i = 0; i < sizeof(media_comp) / sizeof(media_comp[0]); i++) {
+		memset(&media_comp[i]->stats, 0, sizeof(media_comp[i]->stats));
+
+		/*the first sample is the all zero starting point*/
+		window = &media_comp[i]->stats_window;
+		memset(window, 0, sizeof(*window));
+		window->samples[0].time = now;
+		window->count = 1;
+		window->reported_time = now;
+	}
+
+	ftl->media.stats_samples = 0;
+	memset(ftl->media.latency, 0, sizeof(ftl->media.latency));
+
+	_stats_publish(ftl);
+}
+
+/*called by the thread queueing media once a frame is complete*/
+void stats_frame_queued(ftl_media_component_common_t *mc, int frame_bytes) {
+	long max;
+
+	media_stat_add(mc, MEDIA_STAT_FRAMES_QUEUED, 1);
+
+	do {
+		max = ftl_atomic_load_relaxed(&mc->stats.max_frame_size);
+	} while (frame_bytes > max && !ftl_atomic_cas(&mc->stats.max_frame_size, max, frame_bytes));
+}
+
+/*makes ftl->connect_stats visible right away, called before the event loop starts publishing*/
+void stats_connected(ftl_stream_configuration_private_t *ftl) {
+	_stats_publish(ftl);
+}
+
+void stats_sample(ftl_stream_configuration_private_t *ftl, int64_t now, BOOL report) {
+	_stats_sample_component(&ftl->video.media_component, now);
+	_stats_sample_component(&ftl->audio.media_component, now);
+
+	_stats_publish(ftl);
+
+	if (report) {
+		_stats_report_component(ftl, &ftl->video.media_component, FTL_STATUS_VIDEO_PACKETS, now);
+		_stats_report_component(ftl, &ftl->audio.media_component, FTL_STATUS_AUDIO_PACKETS, now);
+	}
+}
+
+void stats_get_snapshot(ftl_stream_configuration_private_t *ftl, ftl_stats_t *stats) {
+	long seq;
+
+	do {
+		/*odd means the timer thread is in the middle of writing it, which takes no time at all*/
+		while ((seq = ftl_atomic_load(&ftl->stats_seq)) & 1) {
+		}
+
+		*stats = ftl->stats_snapshot;
+		ftl_atomic_fence_acquire();
+	} while (ftl_atomic_load_relaxed(&ftl->stats_seq) != seq);
+}
+
+static void _stats_sample_component(ftl_media_component_common_t *mc, int64_t now) {
+	media_stats_window_t *window = &mc->stats_window;
+	media_stats_sample_t *prev = &window->samples[window->newest];
+	media_stats_sample_t *sample;
+	int i;
+
+	window->newest = (window->newest + 1) % (STATS_WINDOW_SAMPLES + 1);
+	sample = &window->samples[window->newest];
+
+	sample->time = now;
+
+	/*counters are longs and wrap (at 32 bits on windows), differences taken as unsigned are still right*/
+	for (i = 0; i < MEDIA_STAT_COUNT; i++) {
+		sample->counters[i] = (unsigned long)ftl_atomic_load_relaxed(&mc->stats.counters[i]);
+		window->totals[i] += sample->counters[i] - prev->counters[i];
+	}
+
+	sample->max_frame_size = (int)ftl_atomic_exchange(&mc->stats.max_frame_size, 0);
+
+	if (sample->max_frame_size > window->reported_max_frame_size) {
+		window->reported_max_frame_size = sample->max_frame_size;
+	}
+
+	if (window->count < STATS_WINDOW_SAMPLES + 1) {
+		window->count++;
+	}
+}
+
+static void _stats_fill_component(ftl_media_component_common_t *mc, ftl_component_stats_t *stats, int *window_ms) {
+	media_stats_window_t *window = &mc->stats_window;
+	media_stats_sample_t *newest = &window->samples[window->newest];
+	media_stats_sample_t *oldest = &window->samples[(window->newest + STATS_WINDOW_SAMPLES + 2 - window->count) % (STATS_WINDOW_SAMPLES + 1)];
+	float ms;
+	int i;
+
+	stats->frames_queued = window->totals[MEDIA_STAT_FRAMES_QUEUED];
+	stats->frames_dropped = window->totals[MEDIA_STAT_FRAMES_DROPPED];
+	stats->frames_sent = window->totals[MEDIA_STAT_FRAMES_SENT];
+	stats->packets_sent = window->totals[MEDIA_STAT_PACKETS_SENT];
+	stats->bytes_sent = window->totals[MEDIA_STAT_BYTES_SENT];
+	stats->packets_nacked = window->totals[MEDIA_STAT_PACKETS_NACKED];
+	stats->packets_resent = window->totals[MEDIA_STAT_PACKETS_RESENT];
+	stats->packets_late = window->totals[MEDIA_STAT_PACKETS_LATE];
+
+	ms = (float)((newest->time - oldest->time) / NS_PER_US) / 1000.f;
+
+	stats->frame_rate = 0;
+	stats->packet_rate = 0;
+	stats->kbps = 0;
+	stats->max_frame_size = 0;
+	*window_ms = 0;
+
+	if (ms <= 0) {
+		return;
+	}
+
+	*window_ms = (int)ms;
+	stats->frame_rate = (float)(newest->counters[MEDIA_STAT_FRAMES_SENT] - oldest->counters[MEDIA_STAT_FRAMES_SENT]) * 1000.f / ms;
+	stats->packet_rate = (float)(newest->counters[MEDIA_STAT_PACKETS_SENT] - oldest->counters[MEDIA_STAT_PACKETS_SENT]) * 1000.f / ms;
+	stats->kbps = (int)((float)(newest->counters[MEDIA_STAT_BYTES_SENT] - oldest->counters[MEDIA_STAT_BYTES_SENT]) * 8.f / ms);
+
+	/*each sample holds the largest frame of the interval ending with it, the oldest one is outside the window*/
+	for (i = 0; i < window->count - 1; i++) {
+		media_stats_sample_t *sample = &window->samples[(window->newest + STATS_WINDOW_SAMPLES + 1 - i) % (STATS_WINDOW_SAMPLES + 1)];
+
+		if (sample->max_frame_size > stats->max_frame_size) {
+			stats->max_frame_size = sample->max_frame_size;
+		}
+	}
+}
+
+static void _stats_publish(ftl_stream_configuration_private_t *ftl) {
+	ftl_stats_t *snapshot = &ftl->stats_snapshot;
+	long seq = ftl_atomic_load_relaxed(&ftl->stats_seq);
+	int video_ms, audio_ms;
+
+	ftl_atomic_store(&ftl->stats_seq, seq + 1);
+	ftl_atomic_fence_release();
+
+	_stats_fill_component(&ftl->video.media_component, &snapshot->video, &video_ms);
+	_stats_fill_component(&ftl->audio.media_component, &snapshot->audio, &audio_ms);
+	snapshot->window_ms = video_ms;
+	snapshot->queue_depth_ms = media_get_queue_depth_ms(ftl);
+	snapshot->mtu = ftl->media.max_mtu;
+	_histogram_percentiles(&ftl->media.latency[MEDIA_LATENCY_QUEUE], &snapshot->queue_delay);
+	_histogram_percentiles(&ftl->media.latency[MEDIA_LATENCY_PACER_OVERSHOOT], &snapshot->pacer_overshoot);
+	_histogram_percentiles(&ftl->media.latency[MEDIA_LATENCY_NACK_RESPONSE], &snapshot->nack_response);
+	_histogram_percentiles(&ftl->media.latency[MEDIA_LATENCY_FRAME_SPREAD], &snapshot->frame_spread);
+	snapshot->connect = ftl->connect_stats;
+
+	ftl_atomic_store(&ftl->stats_seq, seq + 2);
+}
+
+/*queues the status messages covering everything since the previous report*/
+static void _stats_report_component(ftl_stream_configuration_private_t *ftl, ftl_media_component_common_t *mc, ftl_status_types_t pkt_type, int64_t now) {
+	media_stats_window_t *window = &mc->stats_window;
+	uint64_t delta[MEDIA_STAT_COUNT];
+	ftl_status_msg_t status;
+	float ms;
+	int i;
+
+	for (i = 0; i < MEDIA_STAT_COUNT; i++) {
+		delta[i] = window->totals[i] - window->reported[i];
+		window->reported[i] = window->totals[i];
+	}
+
+	ms = (float)((now - window->reported_time) / NS_PER_US) / 1000.f;
+	window->reported_time = now;
+
+	if (ms <= 0) {
+		ms = 1;
+	}
+
+	status.type = pkt_type;
+	status.msg.pkt_stats.lost = (int)delta[MEDIA_STAT_PACKETS_NACKED];
+	status.msg.pkt_stats.received = delta[MEDIA_STAT_PACKETS_SENT] > delta[MEDIA_STAT_PACKETS_NACKED] ? (int)(delta[MEDIA_STAT_PACKETS_SENT] - delta[MEDIA_STAT_PACKETS_NACKED]) : 0;
+	status.msg.pkt_stats.recovered = (int)delta[MEDIA_STAT_PACKETS_RESENT];
+	status.msg.pkt_stats.late = (int)delta[MEDIA_STAT_PACKETS_LATE];
+	status.msg.pkt_stats.average_pps = (int)((float)delta[MEDIA_STAT_PACKETS_SENT] * 1000.f / ms);
+
+	enqueue_status_msg(ftl, &status);
+
+	if (pkt_type == FTL_STATUS_VIDEO_PACKETS) {
+		status.type = FTL_STATUS_VIDEO;
+		status.msg.video_stats.frames_sent = (int)delta[MEDIA_STAT_FRAMES_SENT];
+		status.msg.video_stats.bytes_sent = (int)delta[MEDIA_STAT_BYTES_SENT];
+		status.msg.video_stats.average_fps = (int)((float)delta[MEDIA_STAT_FRAMES_SENT] * 1000.f / ms + 0.5f);
+		status.msg.video_stats.max_frame_size = window->reported_max_frame_size;
+
+		enqueue_status_msg(ftl, &status);
+
+		FTL_LOG(ftl, FTL_LOG_INFO, "Queued an average of %3.2f fps (%3.1f kbps), sent an average of %3.2f fps (%3.1f kbps), %d lost, %d resent, queue depth %d ms\n",
+			(float)delta[MEDIA_STAT_FRAMES_QUEUED] * 1000.f / ms,
+			(float)delta[MEDIA_STAT_BYTES_QUEUED] * 8.f / ms,
+			(float)delta[MEDIA_STAT_FRAMES_SENT] * 1000.f / ms,
+			(float)delta[MEDIA_STAT_BYTES_SENT] * 8.f / ms,
+			(int)delta[MEDIA_STAT_PACKETS_NACKED], (int)delta[MEDIA_STAT_PACKETS_RESENT],
+			ftl->stats_snapshot.queue_depth_ms);
+	}
+
+	window->reported_max_frame_size = 0;
+}
+
+void histogram_record(ftl_histogram_t *h, int64_t us) {
+	unsigned long v, e, bucket;
+	long max;
+
+	if (us < 0) {
+		us = 0;
+	}
+	else if (us > 0x7FFFFFFF) {
+		us = 0x7FFFFFFF;
+	}
+
+	v = (unsigned long)us;
+
+	if (v < (1 << HISTOGRAM_SUB_BITS)) {
+		bucket = v;
+	}
+	else {
+		/*e is the highest set bit, the next HISTOGRAM_SUB_BITS bits pick the bucket within that power of 2*/
+#ifdef _WIN32
+		_BitScanReverse(&e, v);
+#else
+		e = 31 - __builtin_clz((unsigned int)v);
+#endif
+		bucket = ((e - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS) + ((v >> (e - HISTOGRAM_SUB_BITS)) & ((1 << HISTOGRAM_SUB_BITS) - 1));
+	}
+
+	ftl_atomic_add_relaxed(&h->counts[bucket], 1);
+
+	do {
+		max = ftl_atomic_load_relaxed(&h->max);
+	} while ((long)v > max && !ftl_atomic_cas(&h->max, max, (long)v));
+}
+
+/*largest value that lands in the bucket*/
+static int _histogram_bucket_value(int bucket) {
+	int group = bucket >> HISTOGRAM_SUB_BITS;
+	int64_t lower;
+
+	if (group == 0) {
+		return bucket;
+	}
+
+	lower = (int64_t)((1 << HISTOGRAM_SUB_BITS) + (bucket & ((1 << HISTOGRAM_SUB_BITS) - 1))) << (group - 1);
+
+	return (int)(lower + ((int64_t)1 << (group - 1)) - 1);
+}
+
+static void _histogram_percentiles(ftl_histogram_t *h, ftl_latency_stats_t *stats) {
+	unsigned long counts[HISTOGRAM_BUCKETS];
+	const int percents[] = { 50, 90, 99 };
+	int *values[] = { &stats->p50_us, &stats->p90_us, &stats->p99_us };
+	uint64_t total = 0, seen = 0;
+	int bucket, p = 0;
+
+	for (bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+		counts[bucket] = (unsigned long)ftl_atomic_load_relaxed(&h->counts[bucket]);
+		total += counts[bucket];
+	}
+
+	stats->count = total;
+	stats->max_us = (int)ftl_atomic_load_relaxed(&h->max);
+	stats->p50_us = stats->p90_us = stats->p99_us = 0;
+
+	for (bucket = 0; bucket < HISTOGRAM_BUCKETS && p < 3 && total > 0; bucket++) {
+		seen += counts[bucket];
+
+		while (p < 3 && seen * 100 >= total * percents[p]) {
+			/*a sample recorded after max was read can't push a percentile past it*/
+			*values[p] = _histogram_bucket_value(bucket);
+			if (*values[p] > stats->max_us) {
+				*values[p] = stats->max_us;
+			}
+			p++;
+		}
+	}
+}
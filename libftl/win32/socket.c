@@ -36,6 +36,7 @@ int ftl_close_socket(SOCKET sock) {
 }
 
 char * ftl_get_socket_error() {
+  static __declspec(thread) char error_message[1000]; /*one per thread, streams on other threads can't overwrite it*/
   int error_code = WSAGetLastError();
 
   if (FormatMessage(FORMAT_MESSAGE_FROM_SYSTEM,
@@ -65,7 +66,244 @@ int ftl_set_socket_enable_keepalive(SOCKET socket){
   return setsockopt(socket, SOL_SOCKET, SO_KEEPALIVE, (char*)&keep_alive, sizeof(keep_alive));
 }
 
+int ftl_set_socket_nodelay(SOCKET socket){
+  BOOL no_delay = TRUE;
+  return setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, (char*)&no_delay, sizeof(no_delay));
+}
+
 int ftl_set_socket_send_buf(SOCKET socket, int buffer_space) {
-	int keep_alive = 1;
 	return setsockopt(socket, SOL_SOCKET, SO_SNDBUF, (char*)&buffer_space, sizeof(buffer_space));
 }
+
+int ftl_set_socket_recv_buf(SOCKET socket, int buffer_space) {
+	return setsockopt(socket, SOL_SOCKET, SO_RCVBUF, (char*)&buffer_space, sizeof(buffer_space));
+}
+
+int ftl_get_socket_send_buf(SOCKET socket) {
+	int buffer_space = 0;
+	int len = sizeof(buffer_space);
+
+	if (getsockopt(socket, SOL_SOCKET, SO_SNDBUF, (char*)&buffer_space, &len) != 0) {
+		return -1;
+	}
+
+	return buffer_space;
+}
+
+int ftl_get_socket_recv_buf(SOCKET socket) {
+	int buffer_space = 0;
+	int len = sizeof(buffer_space);
+
+	if (getsockopt(socket, SOL_SOCKET, SO_RCVBUF, (char*)&buffer_space, &len) != 0) {
+		return -1;
+	}
+
+	return buffer_space;
+}
+
+int ftl_set_socket_dont_fragment(SOCKET socket, int family, int enable) {
+	DWORD val = enable ? 1 : 0;
+
+	if (family == AF_INET6) {
+		return setsockopt(socket, IPPROTO_IPV6, IPV6_DONTFRAG, (char*)&val, sizeof(val));
+	}
+
+	return setsockopt(socket, IPPROTO_IP, IP_DONTFRAGMENT, (char*)&val, sizeof(val));
+}
+
+int ftl_socket_error_is_msg_too_big() {
+	return WSAGetLastError() == WSAEMSGSIZE;
+}
+
+int ftl_set_socket_nonblocking(SOCKET socket, int enable) {
+	u_long mode = enable ? 1 : 0;
+	return ioctlsocket(socket, FIONBIO, &mode);
+}
+
+int ftl_socket_error_is_in_progress() {
+	return WSAGetLastError() == WSAEWOULDBLOCK;
+}
+
+int ftl_socket_error_is_transient() {
+	return WSAGetLastError() == WSAEINTR || WSAGetLastError() == WSAEWOULDBLOCK;
+}
+
+int ftl_get_socket_pending_error(SOCKET socket) {
+	int err = 0;
+	int len = sizeof(err);
+
+	if (getsockopt(socket, SOL_SOCKET, SO_ERROR, (char*)&err, &len) != 0) {
+		return WSAGetLastError();
+	}
+
+	return err;
+}
+
+int ftl_poll(struct pollfd *fds, int nfds, int ms_timeout) {
+	return WSAPoll(fds, nfds, ms_timeout);
+}
+
+/*winsock has no sendmmsg, send the batch one datagram at a time*/
+int ftl_send_batch(SOCKET socket, uint8_t **bufs, int *lens, int count) {
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (send(socket, (char*)bufs[i], lens[i], 0) == SOCKET_ERROR) {
+			return i > 0 ? i : -1;
+		}
+	}
+
+	return count;
+}
+
+/*windows has no earliest departure time scheduling, the send thread paces in software*/
+int ftl_socket_qdisc_supports_txtime(SOCKET socket) {
+	return 0;
+}
+
+int ftl_set_socket_txtime(SOCKET socket) {
+	WSASetLastError(WSAENOPROTOOPT);
+	return -1;
+}
+
+int64_t ftl_socket_txtime_now() {
+	return 0;
+}
+
+int ftl_send_batch_txtime(SOCKET socket, uint8_t **bufs, int *lens, int64_t *txtimes, int count) {
+	return ftl_send_batch(socket, bufs, lens, count);
+}
+
+/*only called once the socket is readable so a single blocking recv never waits*/
+int ftl_recv_batch(SOCKET socket, uint8_t **bufs, int *lens, int count) {
+	int ret;
+
+	if ((ret = recv(socket, (char*)bufs[0], lens[0], 0)) == SOCKET_ERROR) {
+		return -1;
+	}
+
+	lens[0] = ret;
+
+	return 1;
+}
+
+/*a connected udp socket reports icmp port unreachable as WSAECONNRESET*/
+int ftl_socket_error_is_unreachable() {
+	int err = WSAGetLastError();
+	return err == WSAECONNRESET || err == WSAEHOSTUNREACH || err == WSAENETUNREACH;
+}
+
+/*
+ * WSAPoll based poller. Winsock has no eventfd or pipe that WSAPoll accepts, so wake ups are a datagram
+ * sent to a loopback socket connected to itself.
+ */
+#define FTL_POLLER_MAX_FDS 256
+
+struct ftl_poller {
+	ftl_allocator_t allocator;
+	SOCKET wake_socket;
+	int nfds;
+	WSAPOLLFD fds[FTL_POLLER_MAX_FDS];
+	void *ctxs[FTL_POLLER_MAX_FDS];
+};
+
+ftl_poller_t *ftl_poller_create(const ftl_allocator_t *allocator) {
+	ftl_poller_t *poller;
+	struct sockaddr_in addr;
+	int addrlen = sizeof(addr);
+	u_long nonblocking = 1;
+
+	if ((poller = (ftl_poller_t *)ftl_alloc(allocator, sizeof(*poller))) == NULL) {
+		return NULL;
+	}
+
+	poller->allocator = *allocator;
+
+	if ((poller->wake_socket = socket(AF_INET, SOCK_DGRAM, 0)) == INVALID_SOCKET) {
+		ftl_free(allocator, poller);
+		return NULL;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if (bind(poller->wake_socket, (struct sockaddr *)&addr, sizeof(addr)) == SOCKET_ERROR ||
+		getsockname(poller->wake_socket, (struct sockaddr *)&addr, &addrlen) == SOCKET_ERROR ||
+		connect(poller->wake_socket, (struct sockaddr *)&addr, addrlen) == SOCKET_ERROR) {
+		closesocket(poller->wake_socket);
+		ftl_free(allocator, poller);
+		return NULL;
+	}
+
+	ioctlsocket(poller->wake_socket, FIONBIO, &nonblocking);
+
+	poller->fds[0].fd = poller->wake_socket;
+	poller->fds[0].events = POLLRDNORM;
+	poller->ctxs[0] = NULL;
+	poller->nfds = 1;
+
+	return poller;
+}
+
+void ftl_poller_destroy(ftl_poller_t *poller) {
+	closesocket(poller->wake_socket);
+	ftl_free(&poller->allocator, poller);
+}
+
+int ftl_poller_add(ftl_poller_t *poller, SOCKET socket, void *ctx) {
+	if (poller->nfds == FTL_POLLER_MAX_FDS) {
+		WSASetLastError(WSAENOBUFS);
+		return -1;
+	}
+
+	poller->fds[poller->nfds].fd = socket;
+	poller->fds[poller->nfds].events = POLLRDNORM;
+	poller->ctxs[poller->nfds] = ctx;
+	poller->nfds++;
+
+	return 0;
+}
+
+int ftl_poller_remove(ftl_poller_t *poller, SOCKET socket) {
+	int i;
+
+	for (i = 1; i < poller->nfds; i++) {
+		if (poller->fds[i].fd == socket) {
+			poller->nfds--;
+			poller->fds[i] = poller->fds[poller->nfds];
+			poller->ctxs[i] = poller->ctxs[poller->nfds];
+			return 0;
+		}
+	}
+
+	WSASetLastError(WSAENOTSOCK);
+	return -1;
+}
+
+int ftl_poller_wait(ftl_poller_t *poller, void **ready, int max_ready, int ms_timeout) {
+	char drain[16];
+	int i, count = 0;
+
+	if (WSAPoll(poller->fds, poller->nfds, ms_timeout) == SOCKET_ERROR) {
+		return -1;
+	}
+
+	if (poller->fds[0].revents) {
+		while (recv(poller->wake_socket, drain, sizeof(drain), 0) > 0);
+	}
+
+	for (i = 1; i < poller->nfds && count < max_ready; i++) {
+		if (poller->fds[i].revents) {
+			ready[count++] = poller->ctxs[i];
+		}
+	}
+
+	return count;
+}
+
+void ftl_poller_wake(ftl_poller_t *poller) {
+	char one = 1;
+
+	send(poller->wake_socket, &one, sizeof(one), 0);
+}
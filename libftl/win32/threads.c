@@ -0,0 +1,58 @@
+/**
+* \file threads.c - Thread placement for Windows
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+**/
+
+#define __FTL_INTERNAL
+#include "ftl.h"
+#include "ftl_private.h"
+
+typedef HRESULT (WINAPI *set_thread_description_t)(HANDLE thread, PCWSTR description);
+
+/*
+ * Called by every thread libftl starts, on itself. SetThreadDescription only exists from Windows 10 1607
+ * so it is looked up at runtime.
+ */
+void ftl_thread_setup(ftl_logger_t *log, const char *name, const ftl_thread_params_t *params, BOOL latency_sensitive) {
+	set_thread_description_t set_thread_description;
+	wchar_t wide_name[64];
+	HMODULE kernel32;
+	int priority = THREAD_PRIORITY_NORMAL;
+
+	if ((kernel32 = GetModuleHandleA("kernel32.dll")) != NULL &&
+		(set_thread_description = (set_thread_description_t)GetProcAddress(kernel32, "SetThreadDescription")) != NULL &&
+		MultiByteToWideChar(CP_UTF8, 0, name, -1, wide_name, sizeof(wide_name) / sizeof(wide_name[0])) > 0) {
+		set_thread_description(GetCurrentThread(), wide_name);
+	}
+
+	if (params->cpu_affinity != 0) {
+		if (SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)params->cpu_affinity) == 0) {
+			FTL_LOG_TO(log, FTL_LOG_WARN, "Failed to set cpu affinity of %s to 0x%llx: %d\n", name, (unsigned long long)params->cpu_affinity, GetLastError());
+		}
+	}
+
+	if (latency_sensitive) {
+		priority = THREAD_PRIORITY_TIME_CRITICAL;
+	}
+
+	if (priority != THREAD_PRIORITY_NORMAL && !SetThreadPriority(GetCurrentThread(), priority)) {
+		FTL_LOG_TO(log, FTL_LOG_WARN, "Failed to set %s priority to THREAD_PRIORITY_TIME_CRITICAL\n", name);
+	}
+}
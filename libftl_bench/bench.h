@@ -0,0 +1,58 @@
+/**
+ * bench.h - Microbenchmark harness for libftl
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ **/
+
+#ifndef __BENCH_H
+#define __BENCH_H
+
+#include <stdint.h>
+#include "ftl.h"
+
+/*
+ * A benchmark runs b->iterations operations and may count the packets and bytes they produced. The
+ * harness picks the iteration count, growing it until one run takes at least the minimum time, and
+ * reports that last run. Setup done before bench_reset_timer isn't timed.
+ */
+typedef struct {
+	const char *name;
+	uint64_t iterations;
+	uint64_t packets;
+	uint64_t bytes;
+	int64_t start;
+	int64_t elapsed;
+	int timing;
+	int failed;
+} bench_t;
+
+typedef void (*bench_func_t)(bench_t *b, void *arg);
+
+void bench_run(const char *name, bench_func_t func, void *arg);
+void bench_reset_timer(bench_t *b);
+void bench_stop_timer(bench_t *b);
+void bench_fail(bench_t *b, const char *reason);
+
+/*a stream that logs nowhere, so nothing but results reaches stdout*/
+void bench_ingest_params(ftl_ingest_params_t *params);
+
+/*benchmarks built into the same translation unit as media.c so they can reach its statics*/
+void bench_media_all(void);
+
+#endif // __BENCH_H
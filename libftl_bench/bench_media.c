@@ -0,0 +1,346 @@
+/**
+ * bench_media.c - Benchmarks for the media send path: packetization, the slot ring and nack handling
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ **/
+
+/*the hot paths are static to media.c, so this file is media.c plus the benchmarks and the build leaves media.c out*/
+#include "media.c"
+#include "bench.h"
+
+#define RING_BATCH MAX_SEND_BATCH
+#define RING_PACKET_LEN 1000
+#define NACK_HISTORY 1024 /*packets sent before nacks are asked for*/
+
+typedef struct {
+	ftl_handle_t handle;
+	ftl_stream_configuration_private_t *ftl;
+	SOCKET sink;
+} media_fixture_t;
+
+/*
+ * What media_init sets up, minus the send thread so the benchmark decides when packets are taken off the
+ * ring. Media goes to a local socket that is never read, the kernel drops what doesn't fit.
+ */
+static int _fixture_init(media_fixture_t *fx) {
+	ftl_ingest_params_t params;
+	ftl_stream_configuration_private_t *ftl;
+	ftl_media_config_t *media;
+	struct sockaddr_in *addr;
+
+	memset(fx, 0, sizeof(*fx));
+	fx->sink = INVALID_SOCKET;
+	bench_ingest_params(&params);
+
+	if (ftl_ingest_create(&fx->handle, &params) != FTL_SUCCESS) {
+		return -1;
+	}
+
+	ftl_ingest_set_log_level(&fx->handle, FTL_LOG_ERROR);
+
+	ftl = fx->ftl = (ftl_stream_configuration_private_t *)fx->handle.priv;
+	media = &ftl->media;
+	media->media_socket = INVALID_SOCKET;
+
+	addr = (struct sockaddr_in *)&media->server_addr;
+	memset(&media->server_addr, 0, sizeof(media->server_addr));
+	addr->sin_family = AF_INET;
+	addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	media->server_addrlen = sizeof(*addr);
+
+	if ((fx->sink = socket(AF_INET, SOCK_DGRAM, 0)) == INVALID_SOCKET ||
+		bind(fx->sink, (struct sockaddr *)addr, sizeof(*addr)) != 0 ||
+		getsockname(fx->sink, (struct sockaddr *)addr, &media->server_addrlen) != 0) {
+		return -1;
+	}
+
+	if ((media->media_socket = socket(AF_INET, SOCK_DGRAM, 0)) == INVALID_SOCKET ||
+		connect(media->media_socket, (struct sockaddr *)addr, media->server_addrlen) != 0) {
+		return -1;
+	}
+
+	if (pthread_mutex_init(&media->mutex, &ftl_default_mutexattr) != 0 ||
+		_nack_init(ftl, &ftl->video.media_component) != FTL_SUCCESS ||
+		_nack_init(ftl, &ftl->audio.media_component) != FTL_SUCCESS ||
+		sem_init(&ftl->video.media_component.pkt_ready, 0, 0) != 0) {
+		return -1;
+	}
+
+	media->max_mtu = MAX_MTU;
+	media->pmtud_enabled = FALSE;
+	media->uring = NULL;
+
+	stats_reset(ftl);
+
+	ftl->video.media_component.timestamp_step = (uint32_t)(90000.f / ftl->video.frame_rate);
+	ftl->video.wait_for_idr_frame = FALSE;
+
+	_media_pacer_init(ftl);
+
+	return 0;
+}
+
+static void _fixture_destroy(media_fixture_t *fx) {
+	ftl_stream_configuration_private_t *ftl = fx->ftl;
+
+	if (ftl != NULL) {
+		_nack_destroy(ftl, &ftl->video.media_component);
+		_nack_destroy(ftl, &ftl->audio.media_component);
+		sem_destroy(&ftl->video.media_component.pkt_ready);
+		pthread_mutex_destroy(&ftl->media.mutex);
+		if (ftl->media.media_socket != INVALID_SOCKET) {
+			ftl_close_socket(ftl->media.media_socket);
+		}
+		ftl_ingest_destroy(&fx->handle);
+	}
+
+	if (fx->sink != INVALID_SOCKET) {
+		ftl_close_socket(fx->sink);
+	}
+}
+
+/*takes everything queued off the ring the way the pacer does, without sending it*/
+static void _ring_drain(ftl_media_component_common_t *mc, int64_t now) {
+	nack_slot_t *slot;
+
+	while (_media_take_packet(mc)) {
+		slot = mc->nack_slots[mc->xmit_seq_num % NACK_RB_SIZE];
+		LOCK_MUTEX(slot->mutex);
+		slot->xmit_time = now;
+		mc->xmit_seq_num++;
+		UNLOCK_MUTEX(slot->mutex);
+	}
+}
+
+/*one nalu of the given size per op, cut into rtp packets*/
+static void _bench_packetize(bench_t *b, void *arg) {
+	int size = *(int *)arg;
+	media_fixture_t fx;
+	uint8_t out[MAX_PACKET_BUFFER];
+	uint8_t *nalu, *data;
+	int remaining, consumed, out_len, first;
+	uint64_t i;
+
+	nalu = (uint8_t *)malloc(size);
+
+	if (nalu == NULL || _fixture_init(&fx) != 0) {
+		bench_fail(b, "setup failed");
+		_fixture_destroy(&fx);
+		free(nalu);
+		return;
+	}
+
+	memset(nalu, 0x55, size);
+	nalu[0] = 0x41;
+
+	bench_reset_timer(b);
+
+	for (i = 0; i < b->iterations; i++) {
+		data = nalu;
+		remaining = size;
+		first = 1;
+
+		while (remaining > 0) {
+			out_len = sizeof(out);
+			consumed = _media_make_video_rtp_packet(fx.ftl, data, remaining, out, &out_len, first);
+			first = 0;
+			data += consumed;
+			remaining -= consumed;
+			b->packets++;
+			b->bytes += out_len;
+		}
+	}
+
+	bench_stop_timer(b);
+
+	_fixture_destroy(&fx);
+	free(nalu);
+}
+
+/*one packet per op through media_send_video onto the ring, taken off again a send batch at a time*/
+static void _bench_ring(bench_t *b, void *arg) {
+	uint8_t nalu[RING_PACKET_LEN];
+	media_fixture_t fx;
+	ftl_media_component_common_t *mc;
+	ftl_status_t drop_reason;
+	uint64_t i;
+
+	if (_fixture_init(&fx) != 0) {
+		bench_fail(b, "setup failed");
+		_fixture_destroy(&fx);
+		return;
+	}
+
+	mc = &fx.ftl->video.media_component;
+	memset(nalu, 0x55, sizeof(nalu));
+	nalu[0] = 0x41;
+
+	bench_reset_timer(b);
+
+	for (i = 0; i < b->iterations; i++) {
+		b->bytes += media_send_video(fx.ftl, nalu, sizeof(nalu), 1, 0, &drop_reason);
+		b->packets++;
+
+		if ((i + 1) % RING_BATCH == 0) {
+			_ring_drain(mc, 0);
+		}
+	}
+
+	_ring_drain(mc, 0);
+
+	bench_stop_timer(b);
+
+	_fixture_destroy(&fx);
+}
+
+/*the pacer with no bitrate set: every queued packet goes out in sendmmsg batches*/
+static void _bench_send(bench_t *b, void *arg) {
+	uint8_t nalu[RING_PACKET_LEN];
+	media_fixture_t fx;
+	ftl_status_t drop_reason;
+	int64_t now;
+	uint64_t i;
+
+	if (_fixture_init(&fx) != 0) {
+		bench_fail(b, "setup failed");
+		_fixture_destroy(&fx);
+		return;
+	}
+
+	memset(nalu, 0x55, sizeof(nalu));
+	nalu[0] = 0x41;
+	now = ftl_clock_now(&fx.ftl->clock);
+
+	bench_reset_timer(b);
+
+	for (i = 0; i < b->iterations; i++) {
+		media_send_video(fx.ftl, nalu, sizeof(nalu), 1, 0, &drop_reason);
+
+		if ((i + 1) % RING_BATCH == 0 || i + 1 == b->iterations) {
+			while (media_pace(fx.ftl, now) >= 0);
+		}
+	}
+
+	bench_stop_timer(b);
+
+	b->packets = (uint64_t)ftl_atomic_load(&fx.ftl->video.media_component.stats.counters[MEDIA_STAT_PACKETS_SENT]);
+	b->bytes = (uint64_t)ftl_atomic_load(&fx.ftl->video.media_component.stats.counters[MEDIA_STAT_BYTES_SENT]);
+
+	_fixture_destroy(&fx);
+}
+
+static int _fill_history(media_fixture_t *fx) {
+	uint8_t nalu[RING_PACKET_LEN];
+	ftl_status_t drop_reason;
+	int i;
+
+	memset(nalu, 0x55, sizeof(nalu));
+	nalu[0] = 0x41;
+
+	for (i = 0; i < NACK_HISTORY; i++) {
+		if (media_send_video(fx->ftl, nalu, sizeof(nalu), 1, 0, &drop_reason) <= 0) {
+			return -1;
+		}
+
+		_ring_drain(&fx->ftl->video.media_component, 0);
+	}
+
+	return 0;
+}
+
+/*finding and locking the slot a nack asks for*/
+static void _bench_nack_lookup(bench_t *b, void *arg) {
+	media_fixture_t fx;
+	ftl_media_component_common_t *mc;
+	nack_slot_t *slot;
+	uint64_t i;
+
+	if (_fixture_init(&fx) != 0 || _fill_history(&fx) != 0) {
+		bench_fail(b, "setup failed");
+		_fixture_destroy(&fx);
+		return;
+	}
+
+	mc = &fx.ftl->video.media_component;
+
+	bench_reset_timer(b);
+
+	for (i = 0; i < b->iterations; i++) {
+		if ((slot = _nack_lock_slot(fx.ftl, mc, (uint16_t)(i % NACK_HISTORY))) == NULL) {
+			bench_fail(b, "slot not found");
+			break;
+		}
+
+		UNLOCK_MUTEX(slot->mutex);
+	}
+
+	bench_stop_timer(b);
+
+	_fixture_destroy(&fx);
+}
+
+/*a whole nack as it arrives from ingest: parse, look up 17 packets and resend them in one batch*/
+static void _bench_nack_resend(bench_t *b, void *arg) {
+	media_fixture_t fx;
+	uint8_t nack[16];
+	uint32_t *hdr = (uint32_t *)nack;
+	uint16_t *fci = (uint16_t *)(nack + 12);
+	uint64_t i;
+
+	if (_fixture_init(&fx) != 0 || _fill_history(&fx) != 0) {
+		bench_fail(b, "setup failed");
+		_fixture_destroy(&fx);
+		return;
+	}
+
+	hdr[0] = htonl((2 << 30) | (1 << 24) | (205 << 16) | 3);
+	hdr[1] = htonl(0);
+	hdr[2] = htonl(fx.ftl->video.media_component.ssrc);
+	fci[1] = htons(0xFFFF);
+
+	bench_reset_timer(b);
+
+	for (i = 0; i < b->iterations; i++) {
+		fci[0] = htons((uint16_t)((i * 17) % (NACK_HISTORY - 17)));
+		_media_handle_rtcp(fx.ftl, nack, sizeof(nack));
+	}
+
+	bench_stop_timer(b);
+
+	b->packets = (uint64_t)ftl_atomic_load(&fx.ftl->video.media_component.stats.counters[MEDIA_STAT_PACKETS_RESENT]);
+	b->bytes = b->packets * (RING_PACKET_LEN + RTP_HEADER_BASE_LEN);
+
+	_fixture_destroy(&fx);
+}
+
+void bench_media_all(void) {
+	static int sizes[] = { 100, 1000, 10000, 100000, 1000000 };
+	char name[64];
+	int i;
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		snprintf(name, sizeof(name), "packetize.%d", sizes[i]);
+		bench_run(name, _bench_packetize, &sizes[i]);
+	}
+
+	bench_run("ring.enqueue_dequeue", _bench_ring, NULL);
+	bench_run("send.batch", _bench_send, NULL);
+	bench_run("nack.lookup", _bench_nack_lookup, NULL);
+	bench_run("nack.resend", _bench_nack_resend, NULL);
+}
@@ -0,0 +1,441 @@
+/**
+ * main.c - Microbenchmarks for libftl hot paths
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ **/
+
+#define __FTL_INTERNAL
+#include "ftl.h"
+#include "ftl_private.h"
+#include "hmac/hmac.h"
+#include "bench.h"
+
+#include <unistd.h>
+#include <poll.h>
+
+#define E2E_FRAME_LEN 20000
+#define E2E_DRAIN_MS 100
+
+static double min_time = 0.5;
+static const char *filter = NULL;
+static int json = 0;
+
+static void usage(void) {
+	printf("Usage: libftl_bench [-t seconds] [-f filter] [-j]\n");
+	printf("Times libftl's hot paths, one line per benchmark\n");
+	printf("\t-t\t\tminimum time per benchmark, default 0.5\n");
+	printf("\t-f\t\tonly run benchmarks whose name contains this\n");
+	printf("\t-j\t\tjson lines instead of a table, for comparing runs\n");
+	printf("\t-?\t\tthis help message\n");
+	exit(0);
+}
+
+void bench_reset_timer(bench_t *b) {
+	b->packets = 0;
+	b->bytes = 0;
+	b->elapsed = 0;
+	b->timing = 1;
+	b->start = ftl_monotonic_ns();
+}
+
+void bench_stop_timer(bench_t *b) {
+	if (b->timing) {
+		b->elapsed += ftl_monotonic_ns() - b->start;
+		b->timing = 0;
+	}
+}
+
+static void _log_nothing(ftl_log_severity_t log_level, const char *msg) {
+}
+
+void bench_ingest_params(ftl_ingest_params_t *params) {
+	memset(params, 0, sizeof(*params));
+	params->stream_key = "1-bench";
+	params->ingest_hostname = "127.0.0.1";
+	params->video_codec = FTL_VIDEO_H264;
+	params->audio_codec = FTL_AUDIO_OPUS;
+	params->video_frame_rate = 30;
+	params->log_func = _log_nothing;
+}
+
+void bench_fail(bench_t *b, const char *reason) {
+	fprintf(stderr, "%s: %s\n", b->name, reason);
+	b->failed = 1;
+}
+
+static void _report(bench_t *b) {
+	double secs = b->elapsed / (double)NS_PER_SEC;
+	double ns_per_op = b->elapsed / (double)b->iterations;
+
+	if (json) {
+		printf("{\"name\":\"%s\",\"iterations\":%llu,\"ns_per_op\":%.2f,\"ops_per_sec\":%.1f,\"packets_per_sec\":%.1f,\"bytes_per_sec\":%.1f}\n",
+			b->name, (unsigned long long)b->iterations, ns_per_op, b->iterations / secs, b->packets / secs, b->bytes / secs);
+	}
+	else {
+		printf("%-24s %12llu %14.1f %14.0f %14.0f %14.0f\n", b->name, (unsigned long long)b->iterations, ns_per_op,
+			b->iterations / secs, b->packets / secs, b->bytes / secs);
+	}
+
+	fflush(stdout);
+}
+
+void bench_run(const char *name, bench_func_t func, void *arg) {
+	bench_t b;
+	uint64_t n = 1, next;
+
+	if (filter != NULL && strstr(name, filter) == NULL) {
+		return;
+	}
+
+	for (;;) {
+		memset(&b, 0, sizeof(b));
+		b.name = name;
+		b.iterations = n;
+		bench_reset_timer(&b);
+
+		func(&b, arg);
+		bench_stop_timer(&b);
+
+		if (b.failed) {
+			return;
+		}
+
+		if (b.elapsed >= min_time * NS_PER_SEC || n >= (1ULL << 40)) {
+			break;
+		}
+
+		/*aim 20% past the minimum from the rate so far, but grow at most 100x per step*/
+		next = b.elapsed > 0 ? (uint64_t)(min_time * NS_PER_SEC * 1.2 / b.elapsed * n) : n * 100;
+		n = next > n * 100 ? n * 100 : next > n ? next : n + 1;
+	}
+
+	_report(&b);
+}
+
+/*what ftl_get_hmac does once the nonce is in: decode the hex and sign it with the stream key*/
+static void _bench_hmac(bench_t *b, void *arg) {
+	char nonce_hex[129], result[129];
+	unsigned char nonce[64];
+	uint64_t i;
+	int j;
+
+	for (j = 0; j < 64; j++) {
+		sprintf(nonce_hex + j * 2, "%02x", (j * 37 + 11) & 0xFF);
+	}
+
+	bench_reset_timer(b);
+
+	for (i = 0; i < b->iterations; i++) {
+		for (j = 0; j < 64; j++) {
+			nonce[j] = (decode_hex_char(nonce_hex[j * 2]) << 4) + decode_hex_char(nonce_hex[j * 2 + 1]);
+		}
+
+		hmacsha512("bench-stream-key-0123456789abcdef", nonce, sizeof(nonce), result);
+	}
+
+	bench_stop_timer(b);
+}
+
+/*one status message in and out of the queue per op, stats coalescing never kicks in*/
+static void _bench_status_queue(bench_t *b, void *arg) {
+	ftl_stream_configuration_private_t *ftl;
+	ftl_ingest_params_t params;
+	ftl_status_msg_t msg;
+	ftl_handle_t handle;
+	uint64_t i;
+
+	bench_ingest_params(&params);
+
+	if (ftl_ingest_create(&handle, &params) != FTL_SUCCESS) {
+		bench_fail(b, "setup failed");
+		return;
+	}
+
+	ftl = (ftl_stream_configuration_private_t *)handle.priv;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.type = FTL_STATUS_EVENT;
+	msg.msg.event.type = FTL_STATUS_EVENT_TYPE_CONNECTED;
+
+	bench_reset_timer(b);
+
+	for (i = 0; i < b->iterations; i++) {
+		if (enqueue_status_msg(ftl, &msg) != 0 || dequeue_status_msg(ftl, &msg, 0) != FTL_SUCCESS) {
+			bench_fail(b, "queue failed");
+			break;
+		}
+	}
+
+	bench_stop_timer(b);
+
+	ftl_ingest_destroy(&handle);
+}
+
+/*
+ * Just enough of an ingest on loopback for libftl to connect and stream to: answers the control protocol
+ * and counts what arrives on the media port.
+ */
+typedef struct {
+	SOCKET listen_sock;
+	SOCKET media_sock;
+	int media_port;
+	volatile int running;
+	pthread_t thread;
+	ftl_atomic_t packets;
+	ftl_atomic_t bytes;
+} fake_ingest_t;
+
+static void _fake_ingest_command(fake_ingest_t *ingest, SOCKET sock, const char *cmd) {
+	char reply[256];
+	int i;
+
+	if (strcmp(cmd, "HMAC") == 0) {
+		strcpy(reply, "200 ");
+		for (i = 0; i < 64; i++) {
+			sprintf(reply + 4 + i * 2, "%02x", i);
+		}
+		strcat(reply, "\n");
+	}
+	else if (strncmp(cmd, "CONNECT", 7) == 0 || strncmp(cmd, "DISCONNECT", 10) == 0) {
+		strcpy(reply, "200\n");
+	}
+	else if (strcmp(cmd, ".") == 0) {
+		sprintf(reply, "200 hi. Use UDP port %d\n", ingest->media_port);
+	}
+	else {
+		return;
+	}
+
+	send(sock, reply, (int)strlen(reply), 0);
+}
+
+static void *_fake_ingest_thread(void *data) {
+	fake_ingest_t *ingest = (fake_ingest_t *)data;
+	struct pollfd fds[3];
+	SOCKET control = INVALID_SOCKET;
+	char buf[4096], *end;
+	uint8_t pkt[MAX_PACKET_BUFFER];
+	int len = 0, ret, nfds;
+
+	while (ingest->running) {
+		fds[0].fd = ingest->listen_sock;
+		fds[0].events = POLLIN;
+		fds[1].fd = ingest->media_sock;
+		fds[1].events = POLLIN;
+		fds[2].fd = control;
+		fds[2].events = POLLIN;
+		nfds = control != INVALID_SOCKET ? 3 : 2;
+
+		if (poll(fds, nfds, 50) <= 0) {
+			continue;
+		}
+
+		if (fds[1].revents & POLLIN) {
+			while ((ret = recv(ingest->media_sock, pkt, sizeof(pkt), MSG_DONTWAIT)) > 0) {
+				ftl_atomic_add(&ingest->packets, 1);
+				ftl_atomic_add(&ingest->bytes, ret);
+			}
+		}
+
+		if ((fds[0].revents & POLLIN) && control == INVALID_SOCKET) {
+			control = accept(ingest->listen_sock, NULL, NULL);
+			len = 0;
+			continue;
+		}
+
+		if (nfds == 3 && (fds[2].revents & (POLLIN | POLLHUP))) {
+			if ((ret = recv(control, buf + len, sizeof(buf) - 1 - len, 0)) <= 0) {
+				ftl_close_socket(control);
+				control = INVALID_SOCKET;
+				continue;
+			}
+
+			len += ret;
+			buf[len] = '\0';
+
+			while ((end = strstr(buf, "\r\n\r\n")) != NULL) {
+				*end = '\0';
+				_fake_ingest_command(ingest, control, buf);
+				len -= (int)(end + 4 - buf);
+				memmove(buf, end + 4, len + 1);
+			}
+		}
+	}
+
+	if (control != INVALID_SOCKET) {
+		ftl_close_socket(control);
+	}
+
+	return NULL;
+}
+
+static int _fake_ingest_start(fake_ingest_t *ingest) {
+	struct sockaddr_in addr;
+	socklen_t addr_len = sizeof(addr);
+	int one = 1, buf_size = 8 * 1024 * 1024;
+
+	memset(ingest, 0, sizeof(*ingest));
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(INGEST_PORT);
+
+	if ((ingest->listen_sock = socket(AF_INET, SOCK_STREAM, 0)) == INVALID_SOCKET) {
+		return -1;
+	}
+
+	setsockopt(ingest->listen_sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	if (bind(ingest->listen_sock, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(ingest->listen_sock, 1) != 0) {
+		ftl_close_socket(ingest->listen_sock);
+		return -1;
+	}
+
+	addr.sin_port = 0;
+
+	if ((ingest->media_sock = socket(AF_INET, SOCK_DGRAM, 0)) == INVALID_SOCKET ||
+		bind(ingest->media_sock, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+		getsockname(ingest->media_sock, (struct sockaddr *)&addr, &addr_len) != 0) {
+		ftl_close_socket(ingest->listen_sock);
+		return -1;
+	}
+
+	setsockopt(ingest->media_sock, SOL_SOCKET, SO_RCVBUF, &buf_size, sizeof(buf_size));
+	ingest->media_port = ntohs(addr.sin_port);
+	ingest->running = 1;
+
+	if (pthread_create(&ingest->thread, NULL, _fake_ingest_thread, ingest) != 0) {
+		ftl_close_socket(ingest->media_sock);
+		ftl_close_socket(ingest->listen_sock);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void _fake_ingest_stop(fake_ingest_t *ingest) {
+	ingest->running = 0;
+	pthread_join(ingest->thread, NULL);
+	ftl_close_socket(ingest->media_sock);
+	ftl_close_socket(ingest->listen_sock);
+}
+
+/*
+ * Whole frames per op through the public api to an ingest on loopback, unpaced. Timing stops once the
+ * send thread has put the last packet on the wire; packets and bytes are what the ingest received.
+ */
+static void _bench_e2e(bench_t *b, void *arg) {
+	static uint8_t frame[E2E_FRAME_LEN];
+	ftl_stream_configuration_private_t *ftl;
+	ftl_media_component_common_t *mc;
+	ftl_media_send_result_t result;
+	ftl_ingest_params_t params;
+	fake_ingest_t ingest;
+	ftl_handle_t handle;
+	uint8_t sps[20];
+	uint64_t i;
+
+	if (_fake_ingest_start(&ingest) != 0) {
+		bench_fail(b, "can't listen on the ingest port");
+		return;
+	}
+
+	bench_ingest_params(&params);
+
+	if (ftl_ingest_create(&handle, &params) != FTL_SUCCESS) {
+		bench_fail(b, "setup failed");
+		_fake_ingest_stop(&ingest);
+		return;
+	}
+
+	ftl_ingest_set_log_level(&handle, FTL_LOG_ERROR);
+
+	if (ftl_ingest_connect(&handle) != FTL_SUCCESS) {
+		bench_fail(b, "connect failed");
+		ftl_ingest_destroy(&handle);
+		_fake_ingest_stop(&ingest);
+		return;
+	}
+
+	ftl = (ftl_stream_configuration_private_t *)handle.priv;
+	mc = &ftl->video.media_component;
+
+	memset(sps, 0, sizeof(sps));
+	sps[0] = H264_NALU_TYPE_SPS;
+	memset(frame, 0x55, sizeof(frame));
+	frame[0] = 0x65;
+
+	ftl_ingest_send_media_ex(&handle, FTL_VIDEO_DATA, sps, sizeof(sps), 0, 0, &result);
+
+	bench_reset_timer(b);
+
+	for (i = 0; i < b->iterations; i++) {
+		ftl_ingest_send_media_ex(&handle, FTL_VIDEO_DATA, frame, sizeof(frame), 1, 1000, &result);
+		frame[0] = 0x41;
+	}
+
+	while (ftl_atomic_load(&mc->stats.counters[MEDIA_STAT_PACKETS_SENT]) < ftl_atomic_load(&mc->stats.counters[MEDIA_STAT_PACKETS_QUEUED])) {
+		usleep(100);
+	}
+
+	bench_stop_timer(b);
+
+	sleep_ms(E2E_DRAIN_MS);
+	b->packets = (uint64_t)ftl_atomic_load(&ingest.packets);
+	b->bytes = (uint64_t)ftl_atomic_load(&ingest.bytes);
+
+	ftl_ingest_disconnect(&handle);
+	ftl_ingest_destroy(&handle);
+	_fake_ingest_stop(&ingest);
+}
+
+int main(int argc, char **argv) {
+	int c;
+
+	while ((c = getopt(argc, argv, "t:f:j?")) != -1) {
+		switch (c) {
+		case 't':
+			min_time = atof(optarg);
+			break;
+		case 'f':
+			filter = optarg;
+			break;
+		case 'j':
+			json = 1;
+			break;
+		default:
+			usage();
+			break;
+		}
+	}
+
+	ftl_init();
+
+	if (!json) {
+		printf("libftl %d.%d.%d\n", FTL_VERSION_MAJOR, FTL_VERSION_MINOR, FTL_VERSION_MAINTENANCE);
+		printf("%-24s %12s %14s %14s %14s %14s\n", "benchmark", "iterations", "ns/op", "ops/s", "packets/s", "bytes/s");
+	}
+
+	bench_media_all();
+	bench_run("status.queue", _bench_status_queue, NULL);
+	bench_run("hmac.sha512", _bench_hmac, NULL);
+	bench_run("e2e.loopback", _bench_e2e, NULL);
+
+	return 0;
+}